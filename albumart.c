@@ -38,34 +38,47 @@
 #include "utils.h"
 #include "image_utils.h"
 #include "log.h"
+#include "metrics.h"
 
+/* Album art lives in a store keyed by a hash of the source image's bytes:
+ * each distinct image is decoded and resized once, into
+ * art_cache/store/<2 hex digits>/<hash>.jpg, and the ALBUM_ART rows of all the
+ * files sharing it point to the same entry, found through IDX_ALBUM_ART_HASH.
+ * Entries are shared across directories, so they are only dropped by
+ * art_cache_sweep() once no file refers to them any more. */
+#define ART_MAX_SIZE	(16 * 1024 * 1024)
+
+/* Write to a private name first and move it into place, so an interrupted
+ * write never leaves a truncated image under the name the store serves. */
 static int
-art_cache_exists(const char *orig_path, char **cache_file)
+save_album_art(const uint8_t *image_data, int image_size, const char *cache_file)
 {
-	if( xasprintf(cache_file, "%s/art_cache%s", db_path, orig_path) < 0 )
-		return 0;
+	char tmp[MAXPATHLEN];
+	FILE *dstfile;
+	size_t nwritten;
 
-	strcpy(strchr(*cache_file, '\0')-4, ".jpg");
+	snprintf(tmp, sizeof(tmp), "%s.%d.tmp", cache_file, (int)getpid());
+	dstfile = fopen(tmp, "w");
+	if( !dstfile )
+		return -1;
+	nwritten = fwrite(image_data, 1, image_size, dstfile);
+	if( fclose(dstfile) != 0 || nwritten != image_size || rename(tmp, cache_file) != 0 )
+	{
+		DPRINTF(E_WARN, L_METADATA, "Album art error: wrote %lu/%d bytes\n",
+			(unsigned long)nwritten, image_size);
+		unlink(tmp);
+		return -1;
+	}
 
-	return (!access(*cache_file, F_OK));
+	return 0;
 }
 
-static char *
-save_resized_album_art(image_s *imsrc, const char *path)
+static int
+save_resized_album_art(image_s *imsrc, const char *cache_file)
 {
-	int dstw, dsth;
+	int dstw, dsth, size, ret;
 	image_s *imdst;
-	char *cache_file;
-	char cache_dir[MAXPATHLEN];
-
-	if( !imsrc )
-		return NULL;
-
-	if( art_cache_exists(path, &cache_file) )
-		return cache_file;
-
-	strncpyt(cache_dir, cache_file, sizeof(cache_dir));
-	make_dir(dirname(cache_dir), S_IRWXU|S_IRGRP|S_IXGRP|S_IROTH|S_IXOTH);
+	unsigned char *data;
 
 	if( imsrc->width > imsrc->height )
 	{
@@ -79,15 +92,167 @@ save_resized_album_art(image_s *imsrc, const char *path)
 	}
 	imdst = image_resize(imsrc, dstw, dsth);
 	if( !imdst )
+		return -1;
+	data = image_save_to_jpeg_buf(imdst, &size);
+	image_free(imdst);
+	if( !data )
+		return -1;
+	ret = save_album_art(data, size, cache_file);
+	free(data);
+
+	return ret;
+}
+
+/* look the image up in the store, adding it if it is new or its file has
+ * gone missing; source is the file it was found in, for messages
+ * returns: its ALBUM_ART id, or 0 if it is not a usable JPEG */
+static int64_t
+art_store(const uint8_t *image_data, int image_size, const char *source)
+{
+	char hash[33];
+	char art_dir[MAXPATHLEN];
+	char *art_path;
+	uint64_t h[2];
+	image_s *imsrc;
+	int64_t ret;
+	int err;
+
+	hash128(image_data, image_size, h);
+	snprintf(hash, sizeof(hash), "%016llx%016llx", (unsigned long long)h[0], (unsigned long long)h[1]);
+	if( xasprintf(&art_path, "%s/art_cache/store/%.2s/%s.jpg", db_path, hash, hash) < 0 )
+		return 0;
+	ret = sql_get_int64_field(db, "SELECT ID from ALBUM_ART where HASH = '%s'", hash);
+	if( ret > 0 && access(art_path, F_OK) == 0 )
 	{
-		free(cache_file);
-		return NULL;
+		metrics_add(M_ART_HIT, 1);
+		free(art_path);
+		return ret;
 	}
+	metrics_add(M_ART_MISS, 1);
 
-	cache_file = image_save_to_jpeg_file(imdst, cache_file);
-	image_free(imdst);
-	
-	return cache_file;
+	imsrc = image_new_from_jpeg(NULL, 0, image_data, image_size, 1, ROTATE_NONE);
+	if( !imsrc )
+	{
+		DPRINTF(E_WARN, L_METADATA, "Invalid album art in %s\n", source);
+		free(art_path);
+		return 0;
+	}
+	strncpyt(art_dir, art_path, sizeof(art_dir));
+	make_dir(dirname(art_dir), S_IRWXU|S_IRGRP|S_IXGRP|S_IROTH|S_IXOTH);
+	if( imsrc->width > 160 || imsrc->height > 160 )
+		err = save_resized_album_art(imsrc, art_path);
+	else if( imsrc->width > 0 && imsrc->height > 0 )
+		err = save_album_art(image_data, image_size, art_path);
+	else
+		err = -1;
+	image_free(imsrc);
+	if( err )
+	{
+		DPRINTF(E_WARN, L_METADATA, "Unable to store the album art in %s\n", source);
+		free(art_path);
+		return 0;
+	}
+
+	if( ret > 0 )
+	{
+		/* keep the id the DETAILS rows already point to */
+		DPRINTF(E_DEBUG, L_METADATA, "Restored missing album art from %s\n", source);
+		sql_exec(db, "UPDATE ALBUM_ART set PATH = '%q' where ID = %lld", art_path, (long long)ret);
+	}
+	else
+	{
+		DPRINTF(E_DEBUG, L_METADATA, "Found new album art in %s\n", source);
+		ret = 0;
+		if( sql_exec(db, "INSERT into ALBUM_ART (PATH, HASH) VALUES ('%q', '%s')", art_path, hash) == SQLITE_OK )
+			ret = sqlite3_last_insert_rowid(db);
+	}
+	free(art_path);
+
+	return ret;
+}
+
+/* Consecutive files mostly share a cover file, so the last one is remembered
+ * rather than read and hashed again for each of them. */
+static struct {
+	char path[PATH_MAX];
+	time_t mtime;
+	off_t size;
+	int64_t id;
+} last_art_file;
+
+static int64_t
+art_store_from_file(const char *file)
+{
+	struct stat st;
+	uint8_t *data;
+	int64_t ret = 0;
+	FILE *f;
+
+	if( stat(file, &st) != 0 || st.st_size <= 0 || st.st_size > ART_MAX_SIZE )
+		return 0;
+	if( last_art_file.id && st.st_mtime == last_art_file.mtime &&
+	    st.st_size == last_art_file.size && strcmp(file, last_art_file.path) == 0 )
+		return last_art_file.id;
+
+	data = malloc(st.st_size);
+	f = fopen(file, "r");
+	if( data && f && fread(data, 1, st.st_size, f) == st.st_size )
+		ret = art_store(data, st.st_size, file);
+	if( f )
+		fclose(f);
+	free(data);
+
+	if( ret )
+	{
+		strncpyt(last_art_file.path, file, sizeof(last_art_file.path));
+		last_art_file.mtime = st.st_mtime;
+		last_art_file.size = st.st_size;
+		last_art_file.id = ret;
+	}
+
+	return ret;
+}
+
+/* Set when a DETAILS row went away or changed its art, so the monitor only
+ * looks for unreferenced entries when there can be some. */
+static int art_unref;
+
+void
+art_cache_unref(void)
+{
+	art_unref = 1;
+}
+
+void
+art_cache_sweep(int all)
+{
+	char cache_dir[MAXPATHLEN];
+	char **result;
+	int rows, i;
+	size_t len;
+
+	if( !all && !art_unref )
+		return;
+	art_unref = 0;
+	if( sql_get_table(db, "SELECT ID, PATH from ALBUM_ART where ID not in"
+	                      " (SELECT ALBUM_ART from DETAILS where ALBUM_ART is not NULL)",
+	                  &result, &rows, NULL) != SQLITE_OK )
+		return;
+	/* Rows from before the store may name a cover next to the media itself,
+	 * so only files in our own cache are unlinked. */
+	len = snprintf(cache_dir, sizeof(cache_dir), "%s/art_cache/", db_path);
+	for( i = 1; i <= rows; i++ )
+	{
+		if( result[2*i+1] && strncmp(result[2*i+1], cache_dir, len) == 0 )
+			unlink(result[2*i+1]);
+		sql_exec(db, "DELETE from ALBUM_ART where ID = %s", result[2*i]);
+	}
+	sqlite3_free_table(result);
+	if( rows )
+	{
+		DPRINTF(E_DEBUG, L_METADATA, "Removed %d unused album art entries\n", rows);
+		last_art_file.id = 0;
+	}
 }
 
 /* And our main album art functions */
@@ -153,127 +318,27 @@ update_if_album_art(const char *path)
 			ret = sql_exec(db, "UPDATE DETAILS set ALBUM_ART = %lld where PATH = '%q'", (long long)art_id, file);
 			if( ret != SQLITE_OK )
 				DPRINTF(E_WARN, L_METADATA, "Error setting %s as cover art for %s\n", match, dp->d_name);
+			else
+				art_cache_unref();
 		}
 	}
 	closedir(dh);
 }
 
-char *
-check_embedded_art(const char *path, uint8_t *image_data, int image_size)
-{
-	int width = 0, height = 0;
-	char *art_path = NULL;
-	char *cache_dir;
-	FILE *dstfile;
-	image_s *imsrc;
-	static char last_path[PATH_MAX];
-	static unsigned int last_hash = 0;
-	static int last_success = 0;
-	unsigned int hash;
-
-	if( !image_data || !image_size || !path )
-	{
-		return NULL;
-	}
-	/* If the embedded image matches the embedded image from the last file we
-	 * checked, just make a hard link.  Better than storing it on the disk twice. */
-	hash = DJBHash(image_data, image_size);
-	if( hash == last_hash )
-	{
-		if( !last_success )
-			return NULL;
-		art_cache_exists(path, &art_path);
-		if( link(last_path, art_path) == 0 )
-		{
-			return(art_path);
-		}
-		else
-		{
-			if( errno == ENOENT )
-			{
-				cache_dir = strdup(art_path);
-				make_dir(dirname(cache_dir), S_IRWXU|S_IRGRP|S_IXGRP|S_IROTH|S_IXOTH);
-				free(cache_dir);
-				if( link(last_path, art_path) == 0 )
-					return(art_path);
-			}
-			DPRINTF(E_WARN, L_METADATA, "Linking %s to %s failed [%s]\n", art_path, last_path, strerror(errno));
-			free(art_path);
-			art_path = NULL;
-		}
-	}
-	last_hash = hash;
-
-	imsrc = image_new_from_jpeg(NULL, 0, image_data, image_size, 1, ROTATE_NONE);
-	if( !imsrc )
-	{
-		last_success = 0;
-		return NULL;
-	}
-	width = imsrc->width;
-	height = imsrc->height;
-
-	if( width > 160 || height > 160 )
-	{
-		art_path = save_resized_album_art(imsrc, path);
-	}
-	else if( width > 0 && height > 0 )
-	{
-		size_t nwritten;
-		if( art_cache_exists(path, &art_path) )
-			goto end_art;
-		cache_dir = strdup(art_path);
-		make_dir(dirname(cache_dir), S_IRWXU|S_IRGRP|S_IXGRP|S_IROTH|S_IXOTH);
-		free(cache_dir);
-		dstfile = fopen(art_path, "w");
-		if( !dstfile )
-		{
-			free(art_path);
-			art_path = NULL;
-			goto end_art;
-		}
-		nwritten = fwrite((void *)image_data, 1, image_size, dstfile);
-		fclose(dstfile);
-		if( nwritten != image_size )
-		{
-			DPRINTF(E_WARN, L_METADATA, "Embedded art error: wrote %lu/%d bytes\n",
-				(unsigned long)nwritten, image_size);
-			remove(art_path);
-			free(art_path);
-			art_path = NULL;
-			goto end_art;
-		}
-	}
-end_art:
-	image_free(imsrc);
-	if( !art_path )
-	{
-		DPRINTF(E_WARN, L_METADATA, "Invalid embedded album art in %s\n", basename((char *)path));
-		last_success = 0;
-		return NULL;
-	}
-	DPRINTF(E_DEBUG, L_METADATA, "Found new embedded album art in %s\n", basename((char *)path));
-	last_success = 1;
-	strcpy(last_path, art_path);
-
-	return(art_path);
-}
-
-static char *
+static int64_t
 check_for_album_file(const char *path)
 {
 	char file[MAXPATHLEN];
 	char mypath[MAXPATHLEN];
 	struct album_art_name_s *album_art_name;
-	image_s *imsrc = NULL;
-	int width=0, height=0;
-	char *art_file, *p;
 	const char *dir;
+	char *p;
 	struct stat st;
+	int64_t art_id;
 	int ret;
 
 	if( stat(path, &st) != 0 )
-		return NULL;
+		return 0;
 
 	if( S_ISDIR(st.st_mode) )
 	{
@@ -308,12 +373,9 @@ check_for_album_file(const char *path)
 	}
 	if( ret == 0 )
 	{
-		if( art_cache_exists(file, &art_file) )
-			goto existing_file;
-		free(art_file);
-		imsrc = image_new_from_jpeg(file, 1, NULL, 0, 1, ROTATE_NONE);
-		if( imsrc )
-			goto found_file;
+		art_id = art_store_from_file(file);
+		if( art_id )
+			return art_id;
 	}
 check_dir:
 	/* Then fall back to possible generic cover art file names */
@@ -322,46 +384,23 @@ check_dir:
 		snprintf(file, sizeof(file), "%s/%s", dir, album_art_name->name);
 		if( access(file, R_OK) == 0 )
 		{
-			if( art_cache_exists(file, &art_file) )
-			{
-existing_file:
-				return art_file;
-			}
-			free(art_file);
-			imsrc = image_new_from_jpeg(file, 1, NULL, 0, 1, ROTATE_NONE);
-			if( !imsrc )
-				continue;
-found_file:
-			width = imsrc->width;
-			height = imsrc->height;
-			if( width > 160 || height > 160 )
-				art_file = save_resized_album_art(imsrc, file);
-			else
-				art_file = strdup(file);
-			image_free(imsrc);
-			return(art_file);
+			art_id = art_store_from_file(file);
+			if( art_id )
+				return art_id;
 		}
 	}
-	return NULL;
+	return 0;
 }
 
 int64_t
 find_album_art(const char *path, uint8_t *image_data, int image_size)
 {
-	char *album_art = NULL;
 	int64_t ret = 0;
 
-	if( (image_size && (album_art = check_embedded_art(path, image_data, image_size))) ||
-	    (album_art = check_for_album_file(path)) )
-	{
-		ret = sql_get_int_field(db, "SELECT ID from ALBUM_ART where PATH = '%q'", album_art);
-		if( !ret )
-		{
-			if( sql_exec(db, "INSERT into ALBUM_ART (PATH) VALUES ('%q')", album_art) == SQLITE_OK )
-				ret = sqlite3_last_insert_rowid(db);
-		}
-	}
-	free(album_art);
+	if( image_data && image_size && path )
+		ret = art_store(image_data, image_size, path);
+	if( !ret )
+		ret = check_for_album_file(path);
 
 	return ret;
 }
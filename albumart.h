@@ -26,5 +26,10 @@
 
 void update_if_album_art(const char *path);
 int64_t find_album_art(const char *path, uint8_t *image_data, int image_size);
+/* Note that an ALBUM_ART entry may have lost its last reference */
+void art_cache_unref(void);
+/* Drop unreferenced ALBUM_ART entries and their cached images; unless all is
+ * set, only when art_cache_unref() was called since the last sweep */
+void art_cache_sweep(int all);
 
 #endif
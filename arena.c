@@ -0,0 +1,186 @@
+/* Per-request bump allocator
+ *
+ * MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+
+#include "arena.h"
+#include "log.h"
+
+#define ARENA_ALIGN	16
+#define ALIGN_UP(n)	(((n) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+/* The first chunk in the list is the one small allocations are made from;
+ * chunks holding a single large allocation are kept behind it. */
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t size;		/* usable bytes in data */
+	size_t used;
+	char data[] __attribute__((aligned(ARENA_ALIGN)));
+};
+
+static struct arena_chunk *
+new_chunk(size_t size)
+{
+	struct arena_chunk *c;
+
+	c = malloc(sizeof(*c) + size);
+	if (!c)
+	{
+		DPRINTF(E_ERROR, L_HTTP, "arena: allocation of %lu bytes failed\n",
+			(unsigned long)size);
+		return NULL;
+	}
+	c->size = size;
+	c->used = 0;
+	return c;
+}
+
+void *
+arena_alloc(struct arena *a, size_t size)
+{
+	struct arena_chunk *c = a->chunks;
+
+	size = ALIGN_UP(size ? size : 1);
+	if (size > ARENA_CHUNK_SIZE / 4)
+	{
+		c = new_chunk(size);
+		if (!c)
+			return NULL;
+		c->used = size;
+		if (a->chunks)
+		{
+			c->next = a->chunks->next;
+			a->chunks->next = c;
+		}
+		else
+		{
+			/* nothing to carve from yet; mark it full */
+			c->next = NULL;
+			a->chunks = c;
+		}
+		return c->data;
+	}
+	if (!c || c->size - c->used < size)
+	{
+		c = new_chunk(ARENA_CHUNK_SIZE);
+		if (!c)
+			return NULL;
+		c->next = a->chunks;
+		a->chunks = c;
+	}
+	c->used += size;
+	return c->data + c->used - size;
+}
+
+void *
+arena_realloc(struct arena *a, void *ptr, size_t oldsize, size_t size)
+{
+	struct arena_chunk *c, **prev;
+	void *p;
+
+	if (!ptr)
+		return arena_alloc(a, size);
+	if (size <= oldsize)
+		return ptr;
+
+	oldsize = ALIGN_UP(oldsize ? oldsize : 1);
+	size = ALIGN_UP(size);
+	for (prev = &a->chunks; (c = *prev); prev = &c->next)
+	{
+		if ((char *)ptr < c->data || (char *)ptr >= c->data + c->size)
+			continue;
+		/* the last thing carved out of the current chunk */
+		if ((char *)ptr + oldsize == c->data + c->used &&
+		    c->size - c->used >= size - oldsize)
+		{
+			c->used += size - oldsize;
+			return ptr;
+		}
+		/* a large allocation with a chunk of its own */
+		if (ptr == c->data && c->used == oldsize && size > ARENA_CHUNK_SIZE / 4)
+		{
+			c = realloc(c, sizeof(*c) + size);
+			if (!c)
+				return NULL;
+			c->size = c->used = size;
+			*prev = c;
+			return c->data;
+		}
+		break;
+	}
+
+	p = arena_alloc(a, size);
+	if (p)
+		memcpy(p, ptr, oldsize);
+	return p;
+}
+
+char *
+arena_strdup(struct arena *a, const char *s)
+{
+	size_t len = strlen(s) + 1;
+	char *p;
+
+	p = arena_alloc(a, len);
+	if (p)
+		memcpy(p, s, len);
+	return p;
+}
+
+int
+arena_printf(struct arena *a, char **strp, const char *fmt, ...)
+{
+	va_list args;
+	char buf[256];
+	int len;
+
+	va_start(args, fmt);
+	len = vsnprintf(buf, sizeof(buf), fmt, args);
+	va_end(args);
+	if (len < 0 || !(*strp = arena_alloc(a, len + 1)))
+	{
+		*strp = NULL;
+		return -1;
+	}
+	if (len < sizeof(buf))
+		memcpy(*strp, buf, len + 1);
+	else
+	{
+		va_start(args, fmt);
+		vsnprintf(*strp, len + 1, fmt, args);
+		va_end(args);
+	}
+
+	return len;
+}
+
+void
+arena_release(struct arena *a)
+{
+	struct arena_chunk *c;
+
+	while ((c = a->chunks))
+	{
+		a->chunks = c->next;
+		free(c);
+	}
+}
@@ -0,0 +1,74 @@
+/* Per-request bump allocator
+ *
+ * MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <stddef.h>
+
+/* Small allocations are carved out of chunks of this size; anything larger
+ * gets a chunk of its own. */
+#define ARENA_CHUNK_SIZE	16384
+
+struct arena_chunk;
+
+/* An all-zero arena is empty and ready to use. */
+struct arena {
+	struct arena_chunk *chunks;
+};
+
+/**
+ * Allocate memory that lives until the arena is released.
+ * @param a The arena.
+ * @param size Number of bytes wanted.
+ * @return Suitably aligned memory, or NULL if out of memory.
+ */
+void *arena_alloc(struct arena *a, size_t size);
+
+/**
+ * Grow an allocation, in place if it is the last one made or has a chunk
+ * of its own.
+ * @param a The arena.
+ * @param ptr Memory returned by arena_alloc()/arena_realloc(), or NULL.
+ * @param oldsize Size ptr was allocated with.
+ * @param size New size.
+ * @return The (possibly moved) allocation, or NULL if out of memory, in
+ *         which case ptr is left untouched.
+ */
+void *arena_realloc(struct arena *a, void *ptr, size_t oldsize, size_t size);
+
+/**
+ * Copy a string into the arena.
+ * @return The copy, or NULL if out of memory.
+ */
+char *arena_strdup(struct arena *a, const char *s);
+
+/**
+ * Format a string into the arena, like asprintf().
+ * @param strp Set to the new string, or NULL on failure.
+ * @return The length of the string, or -1 on failure.
+ */
+int arena_printf(struct arena *a, char **strp, const char *fmt, ...)
+	__attribute__((__format__ (__printf__, 3, 4)));
+
+/**
+ * Free everything allocated from the arena at once.
+ */
+void arena_release(struct arena *a);
+
+#endif
@@ -0,0 +1,320 @@
+/* Shared helpers for the loopback benchmarks
+ *
+ * MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "benchutil.h"
+
+double
+bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void
+bench_append(struct bench_buf *buf, const void *data, size_t len)
+{
+	if (buf->len + len + 1 > buf->size)
+	{
+		buf->size = (buf->len + len + 1) * 2;
+		buf->data = realloc(buf->data, buf->size);
+		if (!buf->data)
+		{
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+	}
+	memcpy(buf->data + buf->len, data, len);
+	buf->len += len;
+	buf->data[buf->len] = '\0';
+}
+
+int
+bench_connect(int port)
+{
+	struct sockaddr_in addr;
+	int s, one = 1;
+
+	s = socket(PF_INET, SOCK_STREAM, 0);
+	if (s < 0)
+		return -1;
+	setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (connect(s, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+	{
+		close(s);
+		return -1;
+	}
+
+	return s;
+}
+
+int
+bench_http(int port, const char *req, size_t reqlen, struct bench_buf *resp)
+{
+	char buf[16384];
+	ssize_t n;
+	size_t off = 0;
+	int s, status = -1;
+
+	resp->len = 0;
+	s = bench_connect(port);
+	if (s < 0)
+		return -1;
+	while (off < reqlen)
+	{
+		n = send(s, req + off, reqlen - off, MSG_NOSIGNAL);
+		if (n <= 0)
+		{
+			if (n < 0 && errno == EINTR)
+				continue;
+			close(s);
+			return -1;
+		}
+		off += n;
+	}
+	for (;;)
+	{
+		n = recv(s, buf, sizeof(buf), 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		bench_append(resp, buf, n);
+	}
+	close(s);
+	if (resp->len && sscanf(resp->data, "HTTP/%*d.%*d %d", &status) != 1)
+		status = -1;
+
+	return status;
+}
+
+int
+bench_soap(int port, const char *user_agent, const char *method, const char *args,
+           struct bench_buf *resp)
+{
+	char body[2048], req[3072];
+	int blen, rlen;
+
+	blen = snprintf(body, sizeof(body),
+		"<?xml version=\"1.0\" encoding=\"utf-8\"?>\r\n"
+		"<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\""
+		" s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\"><s:Body>"
+		"<u:%s xmlns:u=\"urn:schemas-upnp-org:service:ContentDirectory:1\">%s</u:%s>"
+		"</s:Body></s:Envelope>\r\n", method, args, method);
+	rlen = snprintf(req, sizeof(req),
+		"POST /ctl/ContentDir HTTP/1.1\r\n"
+		"Host: 127.0.0.1:%d\r\n"
+		"User-Agent: %s\r\n"
+		"Content-Type: text/xml; charset=\"utf-8\"\r\n"
+		"SOAPACTION: \"urn:schemas-upnp-org:service:ContentDirectory:1#%s\"\r\n"
+		"Content-Length: %d\r\n"
+		"Connection: close\r\n"
+		"\r\n%s", port, user_agent, method, blen, body);
+	if (blen >= (int)sizeof(body) || rlen >= (int)sizeof(req))
+		return -1;
+
+	return bench_http(port, req, rlen, resp);
+}
+
+int
+bench_metric(int port, const char *series, double *value)
+{
+	static const char req[] = "GET /metrics HTTP/1.0\r\n\r\n";
+	struct bench_buf resp = { NULL, 0, 0 };
+	size_t len = strlen(series);
+	char *p;
+	int ret = -1;
+
+	if (bench_http(port, req, sizeof(req) - 1, &resp) != 200)
+		goto done;
+	for (p = resp.data; p && *p; p = strchr(p, '\n'), p = p ? p + 1 : NULL)
+	{
+		if (strncmp(p, series, len) == 0 && p[len] == ' ')
+		{
+			*value = strtod(p + len + 1, NULL);
+			ret = 0;
+			break;
+		}
+	}
+done:
+	free(resp.data);
+	return ret;
+}
+
+pid_t
+bench_start_daemon(const char *bin, const char *conf, const char *pidfile, int rebuild)
+{
+	pid_t pid;
+
+	pid = fork();
+	if (pid != 0)
+		return pid;
+	/* -S keeps it in the foreground without the debug log level of -d */
+	if (rebuild)
+		execl(bin, bin, "-f", conf, "-P", pidfile, "-S", "-R", (char *)NULL);
+	else
+		execl(bin, bin, "-f", conf, "-P", pidfile, "-S", (char *)NULL);
+	fprintf(stderr, "Unable to run %s: %s\n", bin, strerror(errno));
+	_exit(127);
+}
+
+void
+bench_stop_daemon(pid_t pid)
+{
+	int i;
+
+	if (pid <= 0)
+		return;
+	kill(pid, SIGTERM);
+	for (i = 0; i < 100; i++)
+	{
+		if (waitpid(pid, NULL, WNOHANG) == pid)
+			return;
+		usleep(100000);
+	}
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+}
+
+int
+bench_wait_http(int port, int timeout)
+{
+	double end = bench_now() + timeout;
+	int s;
+
+	while (bench_now() < end)
+	{
+		s = bench_connect(port);
+		if (s >= 0)
+		{
+			close(s);
+			return 0;
+		}
+		usleep(50000);
+	}
+
+	return -1;
+}
+
+int
+bench_wait_scan(int port)
+{
+	double in_progress, files;
+	int seen_scan = 0;
+
+	for (;;)
+	{
+		if (bench_metric(port, "minidlna_scan_in_progress", &in_progress) != 0)
+			return -1;
+		if (in_progress > 0)
+			seen_scan = 1;
+		/* A very small library may be done before we first look */
+		else if (seen_scan ||
+		         (bench_metric(port, "minidlna_scan_files_total", &files) == 0 && files > 0))
+			return 0;
+		usleep(100000);
+	}
+}
+
+int
+bench_write_conf(const char *conf, const char *dir, const char *media_dir, int port,
+                 const char *extra)
+{
+	FILE *fp;
+
+	fp = fopen(conf, "w");
+	if (!fp)
+		return -1;
+	fprintf(fp, "port=%d\n"
+	            "media_dir=%s\n"
+	            "db_dir=%s/db\n"
+	            "log_dir=%s\n"
+	            "friendly_name=minidlna bench\n"
+	            "inotify=no\n"
+	            "%s\n",
+	        port, media_dir, dir, dir, extra ? extra : "");
+
+	return fclose(fp) == 0 ? 0 : -1;
+}
+
+void
+bench_add_sample(struct bench_samples *s, double v)
+{
+	if (s->n == s->size)
+	{
+		s->size = s->size ? s->size * 2 : 1024;
+		s->v = realloc(s->v, s->size * sizeof(double));
+		if (!s->v)
+		{
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+	}
+	s->v[s->n++] = v;
+}
+
+void
+bench_merge_samples(struct bench_samples *dst, const struct bench_samples *src)
+{
+	int i;
+
+	for (i = 0; i < src->n; i++)
+		bench_add_sample(dst, src->v[i]);
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+double
+bench_percentile(struct bench_samples *s, double p)
+{
+	int i;
+
+	if (!s->n)
+		return 0;
+	qsort(s->v, s->n, sizeof(double), cmp_double);
+	i = (int)(p / 100 * s->n);
+	if (i >= s->n)
+		i = s->n - 1;
+
+	return s->v[i];
+}
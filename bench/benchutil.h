@@ -0,0 +1,102 @@
+/* Shared helpers for the loopback benchmarks
+ *
+ * MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __BENCHUTIL_H__
+#define __BENCHUTIL_H__
+
+#include <stddef.h>
+#include <sys/types.h>
+
+struct bench_buf {
+	char *data;
+	size_t len;
+	size_t size;
+};
+
+/* A growable set of samples, for percentiles */
+struct bench_samples {
+	double *v;
+	int n;
+	int size;
+};
+
+/* bench_now()
+ * monotonic time in seconds */
+double bench_now(void);
+
+/* bench_append()
+ * append len bytes to buf, growing it as needed */
+void bench_append(struct bench_buf *buf, const void *data, size_t len);
+
+/* bench_connect()
+ * open a TCP connection to the daemon on 127.0.0.1
+ * returns: a socket, or -1 on failure */
+int bench_connect(int port);
+
+/* bench_http()
+ * send a complete request and read the response until the server closes
+ * the connection
+ * returns: the HTTP status code, or -1 on failure */
+int bench_http(int port, const char *req, size_t reqlen, struct bench_buf *resp);
+
+/* bench_soap()
+ * POST one ContentDirectory action, args being its argument elements
+ * returns: the HTTP status code, or -1 on failure */
+int bench_soap(int port, const char *user_agent, const char *method, const char *args,
+               struct bench_buf *resp);
+
+/* bench_metric()
+ * fetch /metrics and look up one sample; series is the metric name plus
+ * any labels exactly as exported, e.g. "minidlna_scan_stage_seconds{stage=\"files\"}"
+ * returns: 0 on success, -1 if it couldn't be found */
+int bench_metric(int port, const char *series, double *value);
+
+/* bench_start_daemon()
+ * run minidlnad in the foreground against a generated config file
+ * returns: the child pid, or -1 on failure */
+pid_t bench_start_daemon(const char *bin, const char *conf, const char *pidfile, int rebuild);
+
+/* bench_stop_daemon()
+ * stop the daemon and wait for it to exit */
+void bench_stop_daemon(pid_t pid);
+
+/* bench_wait_http()
+ * wait until the daemon accepts connections on port
+ * returns: 0 once it does, -1 after timeout seconds */
+int bench_wait_http(int port, int timeout);
+
+/* bench_wait_scan()
+ * wait for the daemon's initial scan to finish, going by /metrics
+ * returns: 0 once it has, -1 if /metrics is unavailable */
+int bench_wait_scan(int port);
+
+/* bench_write_conf()
+ * write a minidlna.conf serving media_dir from dir, with its database and
+ * log under dir as well
+ * returns: 0 on success, -1 on failure */
+int bench_write_conf(const char *conf, const char *dir, const char *media_dir, int port,
+                     const char *extra);
+
+void bench_add_sample(struct bench_samples *s, double v);
+void bench_merge_samples(struct bench_samples *dst, const struct bench_samples *src);
+
+/* bench_percentile()
+ * the p'th percentile (0-100) of the samples, which get sorted */
+double bench_percentile(struct bench_samples *s, double p);
+
+#endif
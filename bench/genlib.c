@@ -0,0 +1,567 @@
+/* Synthetic media library generator for the benchmarks
+ *
+ * MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* The files are tiny but well formed, so the scanner takes the same code
+ * paths as for a real library: ID3 tags and MPEG audio frames for libid3tag
+ * and libavformat, EXIF for libexif, and an AVI container for the video
+ * probe.  Tags are spread over artists, albums and genres in realistic
+ * proportions, so the Music/Artist/Album/Genre views have sensible sizes. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <jpeglib.h>
+
+#include "genlib.h"
+
+#define TRACKS_PER_ALBUM	12
+#define ALBUMS_PER_ARTIST	3
+
+static const char *genres[] = {
+	"Rock", "Pop", "Jazz", "Classical", "Electronic", "Hip-Hop",
+	"Blues", "Country", "Reggae", "Metal", "Folk", "Soundtrack"
+};
+
+static const char *models[] = {
+	"Canon EOS 5D", "NIKON D750", "iPhone 6", "DMC-GX7", "SM-G900F"
+};
+
+/* MPEG-1 Layer III, 128kbit/s, 44.1kHz, joint stereo, no CRC */
+static const unsigned char mp3_header[4] = { 0xFF, 0xFB, 0x90, 0x40 };
+#define MP3_FRAME_SIZE		417	/* 144 * 128000 / 44100 */
+#define MP3_FRAMES_PER_SEC	38
+
+static void
+put_be32(unsigned char *p, unsigned int v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static void
+put_le16(unsigned char *p, unsigned int v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void
+put_le32(unsigned char *p, unsigned int v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static size_t
+id3_text_frame(unsigned char *p, const char *id, const char *text)
+{
+	size_t len = strlen(text) + 1;	/* encoding byte */
+
+	memcpy(p, id, 4);
+	put_be32(p + 4, len);
+	p[8] = p[9] = 0;
+	p[10] = 0;			/* ISO-8859-1 */
+	memcpy(p + 11, text, len - 1);
+
+	return 10 + len;
+}
+
+long
+genlib_mp3(const char *path, const struct genlib_tags *tags, int seconds)
+{
+	unsigned char tag[2048], frame[MP3_FRAME_SIZE];
+	char num[16];
+	size_t off = 10, size;
+	long total;
+	int i, frames;
+	FILE *fp;
+
+	if (tags->title)
+		off += id3_text_frame(tag + off, "TIT2", tags->title);
+	if (tags->artist)
+		off += id3_text_frame(tag + off, "TPE1", tags->artist);
+	if (tags->album)
+		off += id3_text_frame(tag + off, "TALB", tags->album);
+	if (tags->genre)
+		off += id3_text_frame(tag + off, "TCON", tags->genre);
+	if (tags->track)
+	{
+		snprintf(num, sizeof(num), "%d", tags->track);
+		off += id3_text_frame(tag + off, "TRCK", num);
+	}
+	if (tags->year)
+	{
+		snprintf(num, sizeof(num), "%d", tags->year);
+		off += id3_text_frame(tag + off, "TYER", num);
+	}
+	memcpy(tag, "ID3\x03\x00\x00", 6);
+	size = off - 10;
+	/* syncsafe size */
+	tag[6] = (size >> 21) & 0x7f;
+	tag[7] = (size >> 14) & 0x7f;
+	tag[8] = (size >> 7) & 0x7f;
+	tag[9] = size & 0x7f;
+
+	fp = fopen(path, "wb");
+	if (!fp)
+		return -1;
+	fwrite(tag, 1, off, fp);
+	/* An all-zero side info block decodes as silence */
+	memset(frame, 0, sizeof(frame));
+	memcpy(frame, mp3_header, sizeof(mp3_header));
+	frames = seconds * MP3_FRAMES_PER_SEC;
+	if (frames < 1)
+		frames = 1;
+	for (i = 0; i < frames; i++)
+		fwrite(frame, 1, sizeof(frame), fp);
+	total = off + (long)frames * sizeof(frame);
+	if (fclose(fp) != 0)
+		return -1;
+
+	return total;
+}
+
+/* libjpeg destination that collects the output in memory */
+struct mem_dst {
+	struct jpeg_destination_mgr jdst;
+	unsigned char *data;
+	size_t size;
+	size_t len;
+};
+
+static void
+mem_init(j_compress_ptr cinfo)
+{
+	struct mem_dst *dst = (struct mem_dst *)cinfo->dest;
+
+	dst->jdst.next_output_byte = dst->data;
+	dst->jdst.free_in_buffer = dst->size;
+}
+
+static boolean
+mem_empty(j_compress_ptr cinfo)
+{
+	struct mem_dst *dst = (struct mem_dst *)cinfo->dest;
+	size_t used = dst->size;
+
+	dst->size *= 2;
+	dst->data = realloc(dst->data, dst->size);
+	if (!dst->data)
+	{
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	dst->jdst.next_output_byte = dst->data + used;
+	dst->jdst.free_in_buffer = dst->size - used;
+
+	return TRUE;
+}
+
+static void
+mem_term(j_compress_ptr cinfo)
+{
+	struct mem_dst *dst = (struct mem_dst *)cinfo->dest;
+
+	dst->len = dst->size - dst->jdst.free_in_buffer;
+}
+
+/* Append an IFD entry; strings that don't fit in the entry go to data */
+static void
+exif_ascii(unsigned char *tiff, unsigned char **entry, size_t *data, int tag, const char *str)
+{
+	size_t len = strlen(str) + 1;
+	unsigned char *e = *entry;
+
+	put_le16(e, tag);
+	put_le16(e + 2, 2);		/* ASCII */
+	put_le32(e + 4, len);
+	if (len <= 4)
+		memcpy(e + 8, str, len);
+	else
+	{
+		put_le32(e + 8, *data);
+		memcpy(tiff + *data, str, len);
+		*data += (len + 1) & ~1;
+	}
+	*entry += 12;
+}
+
+static size_t
+build_exif(unsigned char *buf, const char *model, time_t taken)
+{
+	unsigned char *tiff = buf + 6, *e;
+	size_t data, exif_ifd;
+	char date[20];
+	struct tm tm;
+
+	memcpy(buf, "Exif\0\0", 6);
+	memcpy(tiff, "II\x2a\x00\x08\x00\x00\x00", 8);
+
+	/* IFD0: Make, Model, ExifIFDPointer */
+	put_le16(tiff + 8, 3);
+	e = tiff + 10;
+	exif_ifd = 10 + 3 * 12 + 4;
+	data = exif_ifd + 2 + 12 + 4;
+	exif_ascii(tiff, &e, &data, 0x010f, "minidlna");
+	exif_ascii(tiff, &e, &data, 0x0110, model);
+	put_le16(e, 0x8769);
+	put_le16(e + 2, 4);		/* LONG */
+	put_le32(e + 4, 1);
+	put_le32(e + 8, exif_ifd);
+	put_le32(e + 12, 0);		/* no IFD1 */
+
+	/* Exif IFD: DateTimeOriginal */
+	gmtime_r(&taken, &tm);
+	strftime(date, sizeof(date), "%Y:%m:%d %H:%M:%S", &tm);
+	put_le16(tiff + exif_ifd, 1);
+	e = tiff + exif_ifd + 2;
+	exif_ascii(tiff, &e, &data, 0x9003, date);
+	put_le32(e, 0);
+
+	return 6 + data;
+}
+
+/* Encode a gradient image; pad adds that many bytes of JPEG comments */
+static unsigned char *
+encode_jpeg(int width, int height, unsigned int seed, const unsigned char *app1,
+            size_t app1_len, size_t pad, size_t *len)
+{
+	struct jpeg_compress_struct cinfo;
+	struct jpeg_error_mgr jerr;
+	struct mem_dst dst;
+	unsigned char *row, comment[65533];
+	JSAMPROW rows[1];
+	size_t chunk;
+	int x, y;
+
+	cinfo.err = jpeg_std_error(&jerr);
+	jpeg_create_compress(&cinfo);
+	memset(&dst, 0, sizeof(dst));
+	dst.size = 16384 + pad;
+	dst.data = malloc(dst.size);
+	if (!dst.data)
+		return NULL;
+	dst.jdst.init_destination = mem_init;
+	dst.jdst.empty_output_buffer = mem_empty;
+	dst.jdst.term_destination = mem_term;
+	cinfo.dest = &dst.jdst;
+	cinfo.image_width = width;
+	cinfo.image_height = height;
+	cinfo.input_components = 3;
+	cinfo.in_color_space = JCS_RGB;
+	jpeg_set_defaults(&cinfo);
+	jpeg_set_quality(&cinfo, 80, TRUE);
+	jpeg_start_compress(&cinfo, TRUE);
+	if (app1)
+		jpeg_write_marker(&cinfo, JPEG_APP0 + 1, app1, app1_len);
+	memset(comment, ' ', sizeof(comment));
+	while (pad > 4)
+	{
+		/* each marker costs 4 bytes of header */
+		chunk = pad - 4;
+		if (chunk > sizeof(comment))
+			chunk = sizeof(comment);
+		jpeg_write_marker(&cinfo, JPEG_COM, comment, chunk);
+		pad -= chunk + 4;
+	}
+
+	row = malloc(width * 3);
+	rows[0] = row;
+	for (y = 0; y < height; y++)
+	{
+		for (x = 0; x < width; x++)
+		{
+			row[x * 3] = (x * 255 / width + seed) & 0xff;
+			row[x * 3 + 1] = (y * 255 / height + seed * 7) & 0xff;
+			row[x * 3 + 2] = ((x + y) + seed * 13) & 0xff;
+		}
+		jpeg_write_scanlines(&cinfo, rows, 1);
+	}
+	jpeg_finish_compress(&cinfo);
+	jpeg_destroy_compress(&cinfo);
+	free(row);
+	*len = dst.len;
+
+	return dst.data;
+}
+
+long
+genlib_jpeg(const char *path, int width, int height, unsigned int seed,
+            const char *model, time_t taken)
+{
+	unsigned char exif[512], *data;
+	size_t exif_len, len;
+	FILE *fp;
+	int ok;
+
+	exif_len = build_exif(exif, model, taken);
+	data = encode_jpeg(width, height, seed, exif, exif_len, 0, &len);
+	if (!data)
+		return -1;
+	fp = fopen(path, "wb");
+	if (!fp)
+	{
+		free(data);
+		return -1;
+	}
+	ok = (fwrite(data, 1, len, fp) == len);
+	if (fclose(fp) != 0)
+		ok = 0;
+	free(data);
+
+	return ok ? (long)len : -1;
+}
+
+#define AVI_DISTINCT_FRAMES	8
+
+static void
+write_chunk_header(FILE *fp, const char *id, unsigned int size)
+{
+	unsigned char b[4];
+
+	fwrite(id, 1, 4, fp);
+	put_le32(b, size);
+	fwrite(b, 1, 4, fp);
+}
+
+long long
+genlib_avi(const char *path, int width, int height, int frames, int fps, int frame_bytes)
+{
+	unsigned char *jpeg[AVI_DISTINCT_FRAMES];
+	size_t jlen[AVI_DISTINCT_FRAMES], len;
+	unsigned char hdr[56], strf[40], idx[16];
+	unsigned long long movi_size = 4, total;
+	unsigned int max_frame = 0, offset;
+	int distinct, i;
+	FILE *fp;
+
+	distinct = frames < AVI_DISTINCT_FRAMES ? frames : AVI_DISTINCT_FRAMES;
+	for (i = 0; i < distinct; i++)
+	{
+		jpeg[i] = encode_jpeg(width, height, i * 31, NULL, 0, 0, &len);
+		if (jpeg[i] && frame_bytes > (int)len)
+		{
+			/* Re-encode with enough comment padding to hit the target */
+			free(jpeg[i]);
+			jpeg[i] = encode_jpeg(width, height, i * 31, NULL, 0, frame_bytes - len, &len);
+		}
+		if (!jpeg[i])
+			return -1;
+		jlen[i] = len;
+		if (len > max_frame)
+			max_frame = len;
+	}
+	for (i = 0; i < frames; i++)
+		movi_size += 8 + ((jlen[i % distinct] + 1) & ~1);
+	/* RIFF header + hdrl list (4 + avih + strl) + movi list + idx1 */
+	total = 12 + (12 + 8 + 56 + 12 + 8 + 56 + 8 + 40) + (8 + movi_size) + 8 + 16ULL * frames;
+	if (total - 8 > 0xffffffffULL)
+		return -1;
+
+	fp = fopen(path, "wb");
+	if (!fp)
+		return -1;
+	write_chunk_header(fp, "RIFF", total - 8);
+	fwrite("AVI ", 1, 4, fp);
+	write_chunk_header(fp, "LIST", 4 + 8 + 56 + 12 + 8 + 56 + 8 + 40);
+	fwrite("hdrl", 1, 4, fp);
+
+	memset(hdr, 0, sizeof(hdr));
+	put_le32(hdr, 1000000 / fps);			/* dwMicroSecPerFrame */
+	put_le32(hdr + 4, max_frame * fps);		/* dwMaxBytesPerSec */
+	put_le32(hdr + 12, 0x10);			/* AVIF_HASINDEX */
+	put_le32(hdr + 16, frames);			/* dwTotalFrames */
+	put_le32(hdr + 24, 1);				/* dwStreams */
+	put_le32(hdr + 28, max_frame + 8);		/* dwSuggestedBufferSize */
+	put_le32(hdr + 32, width);
+	put_le32(hdr + 36, height);
+	write_chunk_header(fp, "avih", 56);
+	fwrite(hdr, 1, 56, fp);
+
+	write_chunk_header(fp, "LIST", 4 + 8 + 56 + 8 + 40);
+	fwrite("strl", 1, 4, fp);
+	memset(hdr, 0, sizeof(hdr));
+	memcpy(hdr, "vidsMJPG", 8);
+	put_le32(hdr + 20, 1);				/* dwScale */
+	put_le32(hdr + 24, fps);			/* dwRate */
+	put_le32(hdr + 32, frames);			/* dwLength */
+	put_le32(hdr + 36, max_frame + 8);
+	put_le32(hdr + 40, 0xffffffff);			/* dwQuality */
+	put_le16(hdr + 52, width);
+	put_le16(hdr + 54, height);
+	write_chunk_header(fp, "strh", 56);
+	fwrite(hdr, 1, 56, fp);
+
+	memset(strf, 0, sizeof(strf));
+	put_le32(strf, 40);
+	put_le32(strf + 4, width);
+	put_le32(strf + 8, height);
+	put_le16(strf + 12, 1);
+	put_le16(strf + 14, 24);
+	memcpy(strf + 16, "MJPG", 4);
+	put_le32(strf + 20, width * height * 3);
+	write_chunk_header(fp, "strf", 40);
+	fwrite(strf, 1, 40, fp);
+
+	write_chunk_header(fp, "LIST", movi_size);
+	fwrite("movi", 1, 4, fp);
+	for (i = 0; i < frames; i++)
+	{
+		len = jlen[i % distinct];
+		write_chunk_header(fp, "00dc", len);
+		fwrite(jpeg[i % distinct], 1, len, fp);
+		if (len & 1)
+			fputc(0, fp);
+	}
+
+	write_chunk_header(fp, "idx1", 16 * frames);
+	offset = 4;
+	for (i = 0; i < frames; i++)
+	{
+		len = jlen[i % distinct];
+		memcpy(idx, "00dc", 4);
+		put_le32(idx + 4, 0x10);		/* AVIIF_KEYFRAME */
+		put_le32(idx + 8, offset);
+		put_le32(idx + 12, len);
+		fwrite(idx, 1, 16, fp);
+		offset += 8 + ((len + 1) & ~1);
+	}
+	for (i = 0; i < distinct; i++)
+		free(jpeg[i]);
+	if (fclose(fp) != 0)
+		return -1;
+
+	return total;
+}
+
+static int
+make_dir(const char *path, struct genlib_stats *stats)
+{
+	if (mkdir(path, 0755) != 0 && errno != EEXIST)
+	{
+		fprintf(stderr, "Unable to create %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	stats->dirs++;
+
+	return 0;
+}
+
+/* Create the directory tree, and return the leaf directories */
+static int
+make_tree(const char *dir, int depth, int fanout, char ***leaves, int *nleaves,
+          struct genlib_stats *stats)
+{
+	char path[PATH_MAX];
+	int i;
+
+	if (make_dir(dir, stats) != 0)
+		return -1;
+	if (depth == 0)
+	{
+		*leaves = realloc(*leaves, (*nleaves + 1) * sizeof(char *));
+		(*leaves)[(*nleaves)++] = strdup(dir);
+		return 0;
+	}
+	for (i = 0; i < fanout; i++)
+	{
+		snprintf(path, sizeof(path), "%s/Folder %02d", dir, i + 1);
+		if (make_tree(path, depth - 1, fanout, leaves, nleaves, stats) != 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+int
+genlib_create(const struct genlib_opts *opts, struct genlib_stats *stats)
+{
+	struct genlib_tags tags;
+	char path[PATH_MAX], title[64], artist[64], album[64];
+	char **leaves = NULL;
+	int nleaves = 0, weight, i, n, album_no, ret = 0;
+	long long size;
+	time_t taken = 1262304000;	/* 2010-01-01 */
+
+	memset(stats, 0, sizeof(*stats));
+	weight = opts->audio + opts->video + opts->image;
+	if (weight <= 0 || opts->files <= 0)
+		return -1;
+	if (make_tree(opts->root, opts->depth, opts->fanout, &leaves, &nleaves, stats) != 0)
+		return -1;
+	srand(opts->seed);
+
+	for (i = 0; i < opts->files; i++)
+	{
+		const char *dir = leaves[i % nleaves];
+
+		/* Interleave the types so every directory gets a mix */
+		n = (int)(((long long)i * 7919) % weight);
+		if (n < opts->audio)
+		{
+			n = stats->audio++;
+			album_no = n / TRACKS_PER_ALBUM;
+			snprintf(title, sizeof(title), "Track %d", n % TRACKS_PER_ALBUM + 1);
+			snprintf(artist, sizeof(artist), "Artist %d", album_no / ALBUMS_PER_ARTIST + 1);
+			snprintf(album, sizeof(album), "Album %d", album_no + 1);
+			tags.title = title;
+			tags.artist = artist;
+			tags.album = album;
+			tags.genre = genres[(album_no / ALBUMS_PER_ARTIST) % (sizeof(genres) / sizeof(genres[0]))];
+			tags.track = n % TRACKS_PER_ALBUM + 1;
+			tags.year = 1960 + album_no % 60;
+			snprintf(path, sizeof(path), "%s/%s - %s - %02d.mp3", dir, artist, album, tags.track);
+			size = genlib_mp3(path, &tags, 1 + rand() % 3);
+		}
+		else if (n < opts->audio + opts->video)
+		{
+			n = stats->video++;
+			snprintf(path, sizeof(path), "%s/Clip %05d.avi", dir, n + 1);
+			size = genlib_avi(path, 160, 120, 10, 5, 0);
+		}
+		else
+		{
+			n = stats->image++;
+			snprintf(path, sizeof(path), "%s/IMG_%05d.jpg", dir, n + 1);
+			size = genlib_jpeg(path, 320, 240, n,
+			                   models[n % (sizeof(models) / sizeof(models[0]))],
+			                   taken + (time_t)n * 3600);
+		}
+		if (size < 0)
+		{
+			fprintf(stderr, "Unable to write %s: %s\n", path, strerror(errno));
+			ret = -1;
+			break;
+		}
+		stats->bytes += size;
+	}
+
+	for (i = 0; i < nleaves; i++)
+		free(leaves[i]);
+	free(leaves);
+
+	return ret;
+}
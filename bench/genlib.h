@@ -0,0 +1,78 @@
+/* Synthetic media library generator for the benchmarks
+ *
+ * MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __GENLIB_H__
+#define __GENLIB_H__
+
+#include <time.h>
+
+struct genlib_opts {
+	const char *root;	/* directory to create the library in */
+	int files;		/* total number of media files */
+	int depth;		/* levels of directories below root */
+	int fanout;		/* subdirectories per directory */
+	int audio;		/* relative share of audio files */
+	int video;		/* relative share of video files */
+	int image;		/* relative share of image files */
+	unsigned int seed;
+};
+
+struct genlib_stats {
+	int dirs;
+	int audio;
+	int video;
+	int image;
+	long long bytes;
+};
+
+struct genlib_tags {
+	const char *title;
+	const char *artist;
+	const char *album;
+	const char *genre;
+	int track;
+	int year;
+};
+
+/* genlib_mp3()
+ * write an MP3 with an ID3v2.3 tag and the given number of seconds of
+ * silent 128kbit/s frames
+ * returns: bytes written, or -1 on failure */
+long genlib_mp3(const char *path, const struct genlib_tags *tags, int seconds);
+
+/* genlib_jpeg()
+ * write a gradient JPEG with an EXIF block naming the camera model and the
+ * time it was taken
+ * returns: bytes written, or -1 on failure */
+long genlib_jpeg(const char *path, int width, int height, unsigned int seed,
+                 const char *model, time_t taken);
+
+/* genlib_avi()
+ * write a Motion JPEG AVI of frames frames at fps frames per second; each
+ * frame is padded to frame_bytes (if larger than the encoded image) so the
+ * file can have a chosen bitrate
+ * returns: bytes written, or -1 on failure */
+long long genlib_avi(const char *path, int width, int height, int frames, int fps,
+                     int frame_bytes);
+
+/* genlib_create()
+ * build a whole library tree according to opts
+ * returns: 0 on success, -1 on failure */
+int genlib_create(const struct genlib_opts *opts, struct genlib_stats *stats);
+
+#endif
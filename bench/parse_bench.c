@@ -0,0 +1,572 @@
+/* Request parsing and SQL translation micro-benchmarks
+ *
+ * MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Times the code that runs on every control request, in isolation:
+ * header parsing, the SOAP argument parser, Filter, SortCriteria and
+ * SearchCriteria translation, tag escaping and the DIDL-Lite callback.
+ * The inputs are requests as sent by real clients, so the numbers follow
+ * the paths those clients actually exercise.  Each case reports ns/op and
+ * heap allocations per op.
+ *
+ * Most of these functions are static, so upnphttp.c and upnpsoap.c are
+ * compiled as part of this file rather than linked in.
+ *
+ * usage: parse_bench [-t milliseconds per case] [case name substring] */
+#include "upnphttp.c"
+#include "upnpsoap.c"
+
+#include <time.h>
+
+extern char create_objectTable_sqlite[];
+extern char create_detailTable_sqlite[];
+extern char create_captionTable_sqlite[];
+extern char create_bookmarkTable_sqlite[];
+
+/* Count heap allocations by wrapping glibc's allocator */
+static unsigned long allocs;
+
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+void *
+malloc(size_t size)
+{
+	allocs++;
+	return __libc_malloc(size);
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+	allocs++;
+	return __libc_calloc(nmemb, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+	allocs++;
+	return __libc_realloc(ptr, size);
+}
+
+void
+free(void *ptr)
+{
+	__libc_free(ptr);
+}
+#define COUNTS_ALLOCS 1
+#else
+#define COUNTS_ALLOCS 0
+#endif
+
+#define SOAP_ENVELOPE(body) \
+	"<?xml version=\"1.0\" encoding=\"utf-8\"?>\r\n" \
+	"<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" " \
+	"s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\"><s:Body>" \
+	body "</s:Body></s:Envelope>\r\n"
+#define CDS "xmlns:u=\"urn:schemas-upnp-org:service:ContentDirectory:1\""
+
+/* Requests as captured from each client; Content-Length is filled in */
+static const struct {
+	const char *name;
+	const char *headers;
+	const char *body;
+} recorded[] = {
+	{ "samsung-browse",
+	  "POST /ctl/ContentDir HTTP/1.0\r\n"
+	  "HOST: 192.168.1.10:8200\r\n"
+	  "CONTENT-LENGTH: %d\r\n"
+	  "CONTENT-TYPE: text/xml;charset=\"utf-8\"\r\n"
+	  "USER-AGENT: DLNADOC/1.50 SEC_HHP_[TV]UE40D7000/1.0\r\n"
+	  "SOAPACTION: \"urn:schemas-upnp-org:service:ContentDirectory:1#Browse\"\r\n"
+	  "\r\n",
+	  SOAP_ENVELOPE("<u:Browse " CDS "><ObjectID>1$4</ObjectID>"
+	  "<BrowseFlag>BrowseDirectChildren</BrowseFlag>"
+	  "<Filter>dc:title,dc:date,upnp:class,res,res@duration,res@size,res@resolution,"
+	  "upnp:albumArtURI,upnp:artist,upnp:album,upnp:genre,sec:CaptionInfoEx,sec:dcmInfo</Filter>"
+	  "<StartingIndex>0</StartingIndex><RequestedCount>30</RequestedCount>"
+	  "<SortCriteria>+dc:title</SortCriteria></u:Browse>") },
+	{ "samsung-stream",
+	  "GET /MediaItems/2481.mkv HTTP/1.1\r\n"
+	  "Host: 192.168.1.10:8200\r\n"
+	  "User-Agent: SEC_HHP_[TV]UE40D7000/1.0 DLNADOC/1.50\r\n"
+	  "Accept: */*\r\n"
+	  "Range: bytes=0-\r\n"
+	  "transferMode.dlna.org: Streaming\r\n"
+	  "getcontentFeatures.dlna.org: 1\r\n"
+	  "getCaptionInfo.sec: 1\r\n"
+	  "Connection: close\r\n"
+	  "\r\n",
+	  NULL },
+	{ "lg-browse",
+	  "POST /ctl/ContentDir HTTP/1.1\r\n"
+	  "Host: 192.168.1.10:8200\r\n"
+	  "Content-Length: %d\r\n"
+	  "Content-Type: text/xml; charset=\"utf-8\"\r\n"
+	  "SOAPACTION: \"urn:schemas-upnp-org:service:ContentDirectory:1#Browse\"\r\n"
+	  "User-Agent: Linux/2.6.31-1.0 UPnP/1.0 DLNADOC/1.50 INTEL_NMPR/2.0 LGE_DLNA_SDK/1.5.0\r\n"
+	  "\r\n",
+	  SOAP_ENVELOPE("<u:Browse " CDS "><ObjectID>64$3$1</ObjectID>"
+	  "<BrowseFlag>BrowseDirectChildren</BrowseFlag>"
+	  "<Filter>@id,@parentID,@childCount,dc:title,upnp:class,res,upnp:album,upnp:artist,"
+	  "upnp:albumArtURI,res@duration,res@size,upnp:originalTrackNumber</Filter>"
+	  "<StartingIndex>0</StartingIndex><RequestedCount>50</RequestedCount>"
+	  "<SortCriteria></SortCriteria></u:Browse>") },
+	{ "xbox-search",
+	  "POST /ctl/ContentDir HTTP/1.1\r\n"
+	  "Cache-Control: no-cache\r\n"
+	  "Connection: Keep-Alive\r\n"
+	  "Pragma: no-cache\r\n"
+	  "Content-Type: text/xml; charset=\"utf-8\"\r\n"
+	  "User-Agent: Xbox/2.0.4548.0 UPnP/1.0 Xbox/2.0.4548.0\r\n"
+	  "SOAPACTION: \"urn:schemas-upnp-org:service:ContentDirectory:1#Search\"\r\n"
+	  "Content-Length: %d\r\n"
+	  "Host: 192.168.1.10:8200\r\n"
+	  "\r\n",
+	  SOAP_ENVELOPE("<u:Search " CDS "><ContainerID>7</ContainerID>"
+	  "<SearchCriteria>(upnp:class = &quot;object.container.album.musicAlbum&quot;)</SearchCriteria>"
+	  "<Filter>dc:title,upnp:artist</Filter><StartingIndex>0</StartingIndex>"
+	  "<RequestedCount>1000</RequestedCount><SortCriteria>+dc:title</SortCriteria></u:Search>") },
+	{ "wmp-search",
+	  "POST /ctl/ContentDir HTTP/1.1\r\n"
+	  "Cache-Control: no-cache\r\n"
+	  "Connection: Close\r\n"
+	  "Pragma: no-cache\r\n"
+	  "Content-Type: text/xml; charset=\"utf-8\"\r\n"
+	  "User-Agent: Microsoft-Windows/6.1 UPnP/1.0 Windows-Media-Player-DMS/12.0.7601.17514 DLNADOC/1.50\r\n"
+	  "FriendlyName.DLNA.ORG: DESKTOP\r\n"
+	  "SOAPAction: \"urn:schemas-upnp-org:service:ContentDirectory:1#Search\"\r\n"
+	  "Content-Length: %d\r\n"
+	  "Host: 192.168.1.10:8200\r\n"
+	  "\r\n",
+	  SOAP_ENVELOPE("<u:Search " CDS "><ContainerID>0</ContainerID>"
+	  "<SearchCriteria>upnp:class derivedfrom &quot;object.item.audioItem&quot; and @refID exists false</SearchCriteria>"
+	  "<Filter>dc:title,dc:creator,upnp:artist,upnp:album,upnp:genre,upnp:originalTrackNumber,"
+	  "res@duration,res@size,res@bitrate,res@sampleFrequency,res@nrAudioChannels,upnp:albumArtURI</Filter>"
+	  "<StartingIndex>0</StartingIndex><RequestedCount>200</RequestedCount>"
+	  "<SortCriteria>+upnp:artist,+upnp:album,+upnp:originalTrackNumber,+dc:title</SortCriteria></u:Search>") },
+	{ "kodi-browse",
+	  "POST /ctl/ContentDir HTTP/1.1\r\n"
+	  "Host: 192.168.1.10:8200\r\n"
+	  "Accept-Encoding: gzip, deflate\r\n"
+	  "Content-Length: %d\r\n"
+	  "Content-Type: text/xml; charset=\"utf-8\"\r\n"
+	  "SOAPAction: \"urn:schemas-upnp-org:service:ContentDirectory:1#Browse\"\r\n"
+	  "User-Agent: Kodi/19.4 (Linux; Android 9.0) UPnP/1.0 DLNADOC/1.50 Platinum/1.0.5.13\r\n"
+	  "Accept-Language: en\r\n"
+	  "Connection: close\r\n"
+	  "\r\n",
+	  SOAP_ENVELOPE("<u:Browse " CDS "><ObjectID>2$8</ObjectID>"
+	  "<BrowseFlag>BrowseDirectChildren</BrowseFlag><Filter>*</Filter>"
+	  "<StartingIndex>0</StartingIndex><RequestedCount>200</RequestedCount>"
+	  "<SortCriteria>+upnp:class,+dc:title</SortCriteria></u:Browse>") },
+	{ "bubbleupnp-search",
+	  "POST /ctl/ContentDir HTTP/1.1\r\n"
+	  "Content-Type: text/xml; charset=\"utf-8\"\r\n"
+	  "SOAPAction: \"urn:schemas-upnp-org:service:ContentDirectory:1#Search\"\r\n"
+	  "User-Agent: BubbleUPnP UPnP/1.1\r\n"
+	  "Content-Length: %d\r\n"
+	  "Host: 192.168.1.10:8200\r\n"
+	  "Connection: Keep-Alive\r\n"
+	  "\r\n",
+	  SOAP_ENVELOPE("<u:Search " CDS "><ContainerID>0</ContainerID>"
+	  "<SearchCriteria>(upnp:class derivedfrom &quot;object.item.audioItem&quot; and "
+	  "(dc:title contains &quot;love&quot; or upnp:artist contains &quot;love&quot; or "
+	  "upnp:album contains &quot;love&quot;))</SearchCriteria>"
+	  "<Filter>*</Filter><StartingIndex>0</StartingIndex><RequestedCount>16</RequestedCount>"
+	  "<SortCriteria>-dc:date,+dc:title</SortCriteria></u:Search>") },
+	{ "sony-stream",
+	  "GET /MediaItems/1377.mp4 HTTP/1.1\r\n"
+	  "Host: 192.168.1.10:8200\r\n"
+	  "transferMode.dlna.org: Streaming\r\n"
+	  "getcontentFeatures.dlna.org: 1\r\n"
+	  "X-AV-Physical-Unit-Info: pa=\"BRAVIA KDL-40EX720\";\r\n"
+	  "X-AV-Client-Info: av=5.0; cn=\"Sony Corporation\"; mn=\"BRAVIA KDL-40EX720\"; mv=\"1.7\";\r\n"
+	  "Range: bytes=1048576-2097151\r\n"
+	  "\r\n",
+	  NULL },
+};
+#define NRECORDED	(int)(sizeof(recorded) / sizeof(recorded[0]))
+
+/* A recorded request, ready to parse, and the arguments pulled out of it */
+struct request {
+	const char *name;
+	char *buf;
+	int buflen;
+	int contentoff;
+	struct upnphttp h;
+	char *body;
+	int bodylen;
+	char *filter;
+	char *sort;
+	char *search;
+};
+
+static struct request requests[NRECORDED];
+
+/* Rows as the Browse/Search SELECT returns them, in COLUMNS order */
+static const struct {
+	const char *name;
+	const char *argv[25];
+} rows[] = {
+	{ "audio", { "1$4$3$1$5", "1$4$3$1", NULL, "5", "item.audioItem.musicTrack", "7340032",
+	  "Bohemian Rhapsody", "0:05:55.000", "40000", "44100", "Queen", "A Night at the Opera",
+	  "Rock", NULL, "2", "11", "1975-10-31", NULL, "0", "Queen", "MP3", "audio/mpeg", "17", NULL, "1" } },
+	{ "video", { "64$2$3", "64$2", NULL, "2481", "item.videoItem", "1468006400",
+	  "Big Buck Bunny", "0:09:56.458", "2463000", "48000", NULL, NULL,
+	  NULL, NULL, "2", NULL, "2008-05-20", "1920x1080", "0", NULL, "AVC_MP4_HP_HD_AAC", "video/mp4", "0", NULL, NULL } },
+	{ "image", { "3$12$7", "3$12", NULL, "912", "item.imageItem.photo", "4194304",
+	  "IMG_0042", NULL, NULL, NULL, NULL, NULL,
+	  NULL, NULL, NULL, NULL, "2019-07-14T17:32:08", "4032x3024", "1", "Apple iPhone X", "JPEG_LRG", "image/jpeg", "0", "0", NULL } },
+	{ "folder", { "64$2", "64", NULL, NULL, "container.storageFolder", NULL,
+	  "Movies & Shows", NULL, NULL, NULL, NULL, NULL,
+	  NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, "0", NULL, NULL } },
+	{ "album", { "1$7$2A", "1$7", NULL, "14", "container.album.musicAlbum", NULL,
+	  "A Night at the Opera", NULL, NULL, NULL, "Queen", NULL,
+	  "Rock", NULL, NULL, NULL, NULL, NULL, NULL, "Queen", NULL, NULL, "17", NULL, NULL } },
+};
+#define NROWS		(int)(sizeof(rows) / sizeof(rows[0]))
+
+/* Titles as they come out of tags, and what they look like escaped */
+static const char *tags[] = {
+	"Bohemian Rhapsody",
+	"Simon & Garfunkel - Bridge over Troubled Water",
+	"<Live> \"Unplugged\" & Acoustic & More",
+};
+
+static double
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static const char *only;
+static double target_ns = 200e6;
+
+/* Run fn until it has taken target_ns in total and print the average */
+static void
+run(const char *name, const char *input, void (*fn)(void *), void *arg)
+{
+	char label[128];
+	unsigned long n, iters = 1, a0;
+	double t0, elapsed;
+
+	snprintf(label, sizeof(label), "%s/%s", name, input);
+	if (only && !strstr(label, only))
+		return;
+	/* Warm up and calibrate */
+	for (;;)
+	{
+		t0 = now_ns();
+		for (n = 0; n < iters; n++)
+			fn(arg);
+		elapsed = now_ns() - t0;
+		if (elapsed > target_ns / 10)
+			break;
+		iters *= 2;
+	}
+	iters = iters * (target_ns / elapsed) + 1;
+	a0 = allocs;
+	t0 = now_ns();
+	for (n = 0; n < iters; n++)
+		fn(arg);
+	elapsed = now_ns() - t0;
+	if (COUNTS_ALLOCS)
+		printf("%-44s %12.1f ns/op %8.2f allocs/op\n", label,
+		       elapsed / iters, (double)(allocs - a0) / iters);
+	else
+		printf("%-44s %12.1f ns/op\n", label, elapsed / iters);
+}
+
+/* Receive a recorded request into a fresh connection and parse it */
+static void
+parse_request(struct upnphttp *h, const struct request *r)
+{
+	struct in_addr addr = r->h.clientaddr;
+
+	memset(h, 0, offsetof(struct upnphttp, req_fixed));
+	h->clientaddr = addr;
+	h->req_buf = h->req_fixed;
+	h->req_bufsize = sizeof(h->req_fixed);
+	h->req_contentlen = -1;
+	memcpy(h->req_buf, r->buf, r->buflen + 1);
+	h->req_buflen = r->buflen;
+	ParseHttpRequest(h);
+}
+
+static void
+op_headers(void *arg)
+{
+	struct request *r = arg;
+	struct upnphttp h;
+
+	parse_request(&h, r);
+}
+
+static void
+op_namevalue(void *arg)
+{
+	struct request *r = arg;
+	struct NameValueParserData data;
+
+	ParseNameValue(r->body, r->bodylen, &data, 0);
+	ClearNameValueList(&data);
+}
+
+/* The way the SOAP handlers parse their arguments, into the request arena */
+static void
+op_namevalue_arena(void *arg)
+{
+	struct request *r = arg;
+	struct NameValueParserData data;
+	struct arena arena = { NULL };
+
+	ParseNameValueArena(r->body, r->bodylen, &data, 0, &arena);
+	ClearNameValueList(&data);
+	arena_release(&arena);
+}
+
+static void
+op_filter(void *arg)
+{
+	struct request *r = arg;
+
+	/* set_filter_flags() puts the commas back when it's done */
+	set_filter_flags(r->filter, &r->h);
+}
+
+static void
+op_sort(void *arg)
+{
+	struct request *r = arg;
+	struct arena arena = { NULL };
+	char buf[512];
+	int error;
+
+	/* parse_sort_criteria() tokenizes in place */
+	strcpy(buf, r->sort);
+	parse_sort_criteria(&arena, buf, &error);
+	arena_release(&arena);
+}
+
+static void
+op_search(void *arg)
+{
+	struct request *r = arg;
+	struct arena arena = { NULL };
+	char sep[] = "$*";
+
+	parse_search_criteria(&arena, r->search, sep);
+	arena_release(&arena);
+}
+
+static void
+op_escape(void *arg)
+{
+	free(escape_tag(arg, 1));
+}
+
+static void
+op_unescape(void *arg)
+{
+	free(unescape_tag(arg, 1));
+}
+
+struct didl {
+	struct Response args;
+	struct string_s str;
+	struct arena arena;
+	char **argv;
+};
+
+static void
+op_callback(void *arg)
+{
+	struct didl *d = arg;
+
+	d->str.off = 0;
+	d->args.returned = 0;
+	callback(&d->args, 25, d->argv, NULL);
+	arena_release(&d->arena);
+}
+
+/* Split each recorded request the way the daemon does, once */
+static void
+prepare_requests(void)
+{
+	struct NameValueParserData data;
+	char *p;
+	int i, blen;
+
+	for (i = 0; i < NRECORDED; i++)
+	{
+		struct request *r = &requests[i];
+
+		r->name = recorded[i].name;
+		blen = recorded[i].body ? strlen(recorded[i].body) : 0;
+		r->buf = malloc(strlen(recorded[i].headers) + 16 + blen);
+		r->buflen = sprintf(r->buf, recorded[i].headers, blen);
+		r->contentoff = r->buflen;
+		if (blen)
+			r->buflen += sprintf(r->buf + r->buflen, "%s", recorded[i].body);
+		r->body = r->buf + r->contentoff;
+		r->bodylen = blen;
+		/* One address per client, so each gets its own cache slot */
+		r->h.clientaddr.s_addr = htonl(0x7f000101 + i);
+		parse_request(&r->h, r);
+		if (!blen)
+			continue;
+
+		ParseNameValue(r->body, r->bodylen, &data, 0);
+		/* Keep a byte in front of the filter, which set_filter_flags() touches */
+		if ((p = GetValueFromNameValueList(&data, "Filter")))
+		{
+			r->filter = malloc(strlen(p) + 2);
+			strcpy(r->filter + 1, p);
+			r->filter++;
+		}
+		if ((p = GetValueFromNameValueList(&data, "SortCriteria")) && *p)
+			r->sort = strdup(p);
+		if ((p = GetValueFromNameValueList(&data, "SearchCriteria")))
+			r->search = strdup(p);
+		ClearNameValueList(&data);
+	}
+}
+
+/* An in-memory database for the child counts and caption lookups that
+ * callback() makes */
+static int
+prepare_db(void)
+{
+	int i;
+
+	if (sqlite3_open(":memory:", &db) != SQLITE_OK ||
+	    sql_exec(db, create_objectTable_sqlite) != SQLITE_OK ||
+	    sql_exec(db, create_detailTable_sqlite) != SQLITE_OK ||
+	    sql_exec(db, create_captionTable_sqlite) != SQLITE_OK ||
+	    sql_exec(db, create_bookmarkTable_sqlite) != SQLITE_OK)
+		return -1;
+	for (i = 0; i < 40; i++)
+	{
+		sql_exec(db, "INSERT into OBJECTS (OBJECT_ID, PARENT_ID, CLASS) "
+		             "values ('64$2$%X', '64$2', 'item.videoItem')", i);
+		sql_exec(db, "INSERT into OBJECTS (OBJECT_ID, PARENT_ID, CLASS) "
+		             "values ('1$7$2A$%X', '1$7$2A', 'item.audioItem.musicTrack')", i);
+	}
+	sql_exec(db, "INSERT into CAPTIONS (ID, PATH) values (2481, '/media/Big Buck Bunny.srt')");
+
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct didl d;
+	char *escaped;
+	int opt, i, j;
+
+	while ((opt = getopt(argc, argv, "t:")) != -1)
+	{
+		switch (opt)
+		{
+		case 't':
+			target_ns = atof(optarg) * 1e6;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-t milliseconds] [case]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (optind < argc)
+		only = argv[optind];
+
+	runtime_vars.port = 8200;
+	n_lan_addr = 1;
+	strcpy(lan_addr[0].str, "192.168.1.10");
+	inet_pton(AF_INET, lan_addr[0].str, &lan_addr[0].addr);
+	if (prepare_db() != 0)
+	{
+		fprintf(stderr, "Unable to set up the database\n");
+		return 1;
+	}
+	prepare_requests();
+
+	for (i = 0; i < NRECORDED; i++)
+		run("ParseHttpRequest", requests[i].name, op_headers, &requests[i]);
+	for (i = 0; i < NRECORDED; i++)
+		if (requests[i].bodylen)
+			run("ParseNameValue", requests[i].name, op_namevalue, &requests[i]);
+	for (i = 0; i < NRECORDED; i++)
+		if (requests[i].bodylen)
+			run("ParseNameValueArena", requests[i].name, op_namevalue_arena, &requests[i]);
+	for (i = 0; i < NRECORDED; i++)
+		if (requests[i].filter)
+			run("set_filter_flags", requests[i].name, op_filter, &requests[i]);
+	for (i = 0; i < NRECORDED; i++)
+		if (requests[i].sort)
+			run("parse_sort_criteria", requests[i].name, op_sort, &requests[i]);
+	for (i = 0; i < NRECORDED; i++)
+		if (requests[i].search)
+			run("parse_search_criteria", requests[i].name, op_search, &requests[i]);
+	for (i = 0; i < (int)(sizeof(tags) / sizeof(tags[0])); i++)
+	{
+		char label[8];
+
+		snprintf(label, sizeof(label), "%d", i);
+		escaped = escape_tag(tags[i], 1);
+		run("escape_tag", label, op_escape, (void *)tags[i]);
+		run("unescape_tag", label, op_unescape, escaped);
+		free(escaped);
+	}
+
+	/* DIDL-Lite for each kind of row, as each browsing client asked for it */
+	memset(&d, 0, sizeof(d));
+	d.str.data = malloc(DEFAULT_RESP_SIZE);
+	d.str.size = DEFAULT_RESP_SIZE;
+	d.args.str = &d.str;
+	d.args.arena = &d.arena;
+	d.args.requested = 30;
+	for (i = 0; i < NRECORDED; i++)
+	{
+		struct request *r = &requests[i];
+		char label[64];
+
+		if (!r->filter)
+			continue;
+		d.args.client = r->h.req_client ? r->h.req_client->type->type : 0;
+		d.args.flags = r->h.req_client ? r->h.req_client->type->flags : 0;
+		d.args.filter = set_filter_flags(r->filter, &r->h);
+		for (j = 0; j < NROWS; j++)
+		{
+			d.argv = (char **)rows[j].argv;
+			snprintf(label, sizeof(label), "%s/%s", rows[j].name, r->name);
+			run("callback", label, op_callback, &d);
+		}
+	}
+	free(d.str.data);
+	sqlite3_close(db);
+
+	return 0;
+}
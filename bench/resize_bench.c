@@ -0,0 +1,170 @@
+/* Image resampler micro-benchmark
+ *
+ * MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Compares the separable fixed-point resampler kernels against the original
+ * image_downsize()/image_upsize() code, for speed and for how far their
+ * output drifts from it (PSNR).  Every SIMD kernel must also produce the
+ * exact same pixels as the scalar one.
+ *
+ * usage: resize_bench [srcw srch dstw dsth [iterations]] */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <math.h>
+#include <sys/time.h>
+
+#include "config.h"
+#include "image_utils.h"
+#include "log.h"
+
+image_s *image_new(int32_t width, int32_t height);
+
+void
+log_err(int level, enum _log_facility facility, char *fname, int lineno, char *fmt, ...)
+{
+	va_list ap;
+
+	if (level > E_WARN)
+		return;
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+}
+
+static double
+now_ms(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+/* Smooth gradients plus some fine detail, roughly like a photo */
+static image_s *
+make_test_image(int32_t w, int32_t h)
+{
+	image_s *img = image_new(w, h);
+	int32_t x, y;
+	uint32_t r, g, b;
+
+	if (!img)
+		return NULL;
+	for (y = 0; y < h; y++)
+	{
+		for (x = 0; x < w; x++)
+		{
+			r = x * 255 / w;
+			g = y * 255 / h;
+			b = (uint32_t)(127.5 + 127.5 * sin(x * 0.05) * cos(y * 0.07));
+			img->buf[y * w + x] = (r << 24) | (g << 16) | (b << 8) | 0xFF;
+		}
+	}
+	return img;
+}
+
+static double
+psnr(const image_s *a, const image_s *b)
+{
+	double err = 0.0;
+	int32_t i, c, d;
+
+	for (i = 0; i < a->width * a->height; i++)
+	{
+		for (c = 8; c < 32; c += 8)
+		{
+			d = (int)((a->buf[i] >> c) & 0xFF) - (int)((b->buf[i] >> c) & 0xFF);
+			err += d * d;
+		}
+	}
+	err /= a->width * a->height * 3.0;
+	return (err == 0.0) ? INFINITY : 10.0 * log10(255.0 * 255.0 / err);
+}
+
+int
+main(int argc, char **argv)
+{
+	static const char *impls[] = { "scalar", "sse2", "avx2", "neon" };
+	int32_t srcw = 4000, srch = 3000, dstw = 640, dsth = 480;
+	int iterations = 10, i, n, ret = 0;
+	image_s *src, *ref, *scalar = NULL, *dst;
+	double start, elapsed;
+
+	if (argc >= 5)
+	{
+		srcw = atoi(argv[1]);
+		srch = atoi(argv[2]);
+		dstw = atoi(argv[3]);
+		dsth = atoi(argv[4]);
+	}
+	if (argc >= 6)
+		iterations = atoi(argv[5]);
+	if (srcw <= 0 || srch <= 0 || dstw <= 0 || dsth <= 0 || iterations <= 0)
+	{
+		fprintf(stderr, "usage: %s [srcw srch dstw dsth [iterations]]\n", argv[0]);
+		return 1;
+	}
+
+	src = make_test_image(srcw, srch);
+	ref = image_new(dstw, dsth);
+	if (!src || !ref)
+		return 1;
+	printf("%dx%d -> %dx%d, %d iterations, default kernel: %s\n",
+	       srcw, srch, dstw, dsth, iterations, image_resample_impl());
+
+	start = now_ms();
+	for (i = 0; i < iterations; i++)
+	{
+		if (srcw < dstw || srch < dsth)
+			image_upsize(ref, src, dstw, dsth);
+		else
+			image_downsize(ref, src, dstw, dsth);
+	}
+	elapsed = (now_ms() - start) / iterations;
+	printf("%-8s %9.2f ms\n", "original", elapsed);
+
+	for (n = 0; n < sizeof(impls)/sizeof(impls[0]); n++)
+	{
+		if (image_resample_force(impls[n]) != 0)
+			continue;
+		dst = image_new(dstw, dsth);
+		if (!dst)
+			return 1;
+		start = now_ms();
+		for (i = 0; i < iterations; i++)
+			image_resample(dst, src);
+		elapsed = (now_ms() - start) / iterations;
+		printf("%-8s %9.2f ms  PSNR vs original %6.2f dB", impls[n], elapsed, psnr(dst, ref));
+		if (!scalar)
+			scalar = dst;
+		else
+		{
+			if (memcmp(scalar->buf, dst->buf, dstw * dsth * sizeof(pix)) != 0)
+			{
+				printf("  MISMATCH vs scalar");
+				ret = 1;
+			}
+			image_free(dst);
+		}
+		printf("\n");
+	}
+
+	return ret;
+}
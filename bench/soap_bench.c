@@ -0,0 +1,513 @@
+/* End-to-end scan and SOAP load benchmark
+ *
+ * MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Generates a synthetic library, has minidlnad scan it from scratch (stage
+ * timings come from its /metrics endpoint), and then runs a number of
+ * simulated control points against it on loopback.  Each control point
+ * replays sessions shaped like a real client's: the User-Agent that
+ * clients.c matches on, the same mix of actions, page sizes, filters and
+ * sort orders, and a walk down the tree following the IDs it got back.
+ *
+ * usage: soap_bench [-b minidlnad] [-w workdir] [-k] [-n files] [-D depth]
+ *                   [-F fanout] [-m audio:video:image] [-c clients]
+ *                   [-t seconds] [-p port] [-i interface] [-P profile] */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "benchutil.h"
+#include "genlib.h"
+
+enum action {
+	A_BROWSE_CHILDREN,
+	A_BROWSE_META,
+	A_SEARCH,
+	A_SORT_CAPS,
+	A_SEARCH_CAPS,
+	A_FEATURE_LIST,
+	A_MAX
+};
+
+static const char *action_name[A_MAX] = {
+	"Browse(children)",
+	"Browse(metadata)",
+	"Search",
+	"GetSortCapabilities",
+	"GetSearchCapabilities",
+	"X_GetFeatureList"
+};
+
+struct session;
+
+struct profile {
+	const char *name;
+	const char *user_agent;
+	void (*run)(struct session *);
+};
+
+struct thread_stats {
+	struct bench_samples lat[A_MAX];
+	long requests;
+	long errors;
+	long sessions;
+};
+
+struct session {
+	const struct profile *prof;
+	struct thread_stats *st;
+	struct bench_buf resp;
+	unsigned int seed;
+	double deadline;
+};
+
+#define MAX_IDS		64
+#define ID_LEN		64
+
+struct id_list {
+	char id[MAX_IDS][ID_LEN];
+	int n;
+};
+
+static int port = 8299;
+
+/* Send one ContentDirectory action and record how long it took.
+ * Returns 0 if the server answered 200 OK. */
+static int
+soap(struct session *s, enum action act, const char *method, const char *args)
+{
+	double start;
+	int status;
+
+	start = bench_now();
+	status = bench_soap(port, s->prof->user_agent, method, args, &s->resp);
+	bench_add_sample(&s->st->lat[act], bench_now() - start);
+	s->st->requests++;
+	if (status != 200)
+	{
+		s->st->errors++;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int
+browse(struct session *s, const char *id, int children, const char *filter,
+       int start, int count, const char *sort)
+{
+	char args[512];
+
+	snprintf(args, sizeof(args),
+		"<ObjectID>%s</ObjectID><BrowseFlag>%s</BrowseFlag><Filter>%s</Filter>"
+		"<StartingIndex>%d</StartingIndex><RequestedCount>%d</RequestedCount>"
+		"<SortCriteria>%s</SortCriteria>",
+		id, children ? "BrowseDirectChildren" : "BrowseMetadata", filter,
+		start, count, sort);
+
+	return soap(s, children ? A_BROWSE_CHILDREN : A_BROWSE_META, "Browse", args);
+}
+
+static int
+search(struct session *s, const char *id, const char *criteria, const char *filter,
+       int start, int count, const char *sort)
+{
+	char args[1024];
+
+	snprintf(args, sizeof(args),
+		"<ContainerID>%s</ContainerID><SearchCriteria>%s</SearchCriteria>"
+		"<Filter>%s</Filter><StartingIndex>%d</StartingIndex>"
+		"<RequestedCount>%d</RequestedCount><SortCriteria>%s</SortCriteria>",
+		id, criteria, filter, start, count, sort);
+
+	return soap(s, A_SEARCH, "Search", args);
+}
+
+/* Pull the container or item IDs out of the (escaped) DIDL-Lite result */
+static void
+parse_ids(const struct bench_buf *resp, const char *kind, struct id_list *ids)
+{
+	char pat[32];
+	const char *p, *end;
+	size_t len;
+
+	ids->n = 0;
+	if (!resp->data)
+		return;
+	len = snprintf(pat, sizeof(pat), "&lt;%s id=&quot;", kind);
+	for (p = resp->data; ids->n < MAX_IDS && (p = strstr(p, pat)); p = end)
+	{
+		p += len;
+		end = strstr(p, "&quot;");
+		if (!end)
+			break;
+		if (end - p < ID_LEN)
+		{
+			memcpy(ids->id[ids->n], p, end - p);
+			ids->id[ids->n][end - p] = '\0';
+			ids->n++;
+		}
+	}
+}
+
+static int
+total_matches(const struct bench_buf *resp)
+{
+	const char *p;
+
+	if (!resp->data || !(p = strstr(resp->data, "<TotalMatches>")))
+		return 0;
+	return atoi(p + 14);
+}
+
+/* Browse down the tree the way a user clicking through folders would:
+ * list a container a page at a time, sometimes open an item, then pick a
+ * child container and carry on. */
+static void
+walk(struct session *s, const char *id, int depth, int count, const char *filter,
+     const char *sort, int meta_first)
+{
+	struct id_list containers, items;
+	char cur[ID_LEN];
+	int total, start = 0;
+
+	while (depth-- >= 0 && bench_now() < s->deadline)
+	{
+		if (meta_first)
+			browse(s, id, 0, filter, 0, 0, "");
+		if (browse(s, id, 1, filter, start, count, sort) != 0)
+			return;
+		total = total_matches(&s->resp);
+		parse_ids(&s->resp, "container", &containers);
+		parse_ids(&s->resp, "item", &items);
+		/* Scroll to the next page now and then */
+		if (total > start + count && rand_r(&s->seed) % 2)
+		{
+			start += count;
+			depth++;
+			continue;
+		}
+		start = 0;
+		if (items.n && rand_r(&s->seed) % 2)
+			browse(s, items.id[rand_r(&s->seed) % items.n], 0, filter, 0, 0, "");
+		if (!containers.n)
+			return;
+		/* containers is overwritten on the next pass, so keep a copy */
+		snprintf(cur, sizeof(cur), "%s", containers.id[rand_r(&s->seed) % containers.n]);
+		id = cur;
+	}
+}
+
+/* Samsung TVs ask for the feature list first, then page through
+ * containers 30 at a time with a full filter. */
+static void
+run_samsung(struct session *s)
+{
+	soap(s, A_FEATURE_LIST, "X_GetFeatureList", "");
+	soap(s, A_SORT_CAPS, "GetSortCapabilities", "");
+	walk(s, "0", 5, 30, "*", "", 0);
+}
+
+/* LG TVs fetch the root metadata, then list 50 at a time asking only for
+ * the properties they display. */
+static void
+run_lg(struct session *s)
+{
+	walk(s, "0", 5, 50,
+	     "@id,@parentID,@childCount,dc:title,upnp:class,res,upnp:album,upnp:artist,upnp:albumArtURI",
+	     "", 1);
+}
+
+/* The Xbox 360 never browses; it searches its magic containers with
+ * class criteria, 50 results at a time, sorted by title. */
+static void
+run_xbox(struct session *s)
+{
+	static const struct {
+		const char *id;
+		const char *criteria;
+	} searches[] = {
+		{ "4", "upnp:class derivedfrom &quot;object.item.audioItem&quot;" },
+		{ "7", "upnp:class = &quot;object.container.album.musicAlbum&quot;" },
+		{ "6", "upnp:class = &quot;object.container.person.musicArtist&quot;" },
+		{ "5", "upnp:class = &quot;object.container.genre.musicGenre&quot;" },
+		{ "15", "upnp:class derivedfrom &quot;object.item.videoItem&quot;" },
+		{ "16", "upnp:class derivedfrom &quot;object.item.imageItem&quot;" }
+	};
+	struct id_list albums;
+	int i, total, start;
+
+	for (i = 0; i < sizeof(searches) / sizeof(searches[0]) && bench_now() < s->deadline; i++)
+	{
+		start = 0;
+		do {
+			if (search(s, searches[i].id, searches[i].criteria, "*", start, 50, "+dc:title") != 0)
+				break;
+			total = total_matches(&s->resp);
+			start += 50;
+		} while (start < total && start < 200 && rand_r(&s->seed) % 2);
+		if (i == 1)
+		{
+			/* Open one of the albums */
+			parse_ids(&s->resp, "container", &albums);
+			if (albums.n)
+				search(s, albums.id[rand_r(&s->seed) % albums.n],
+				       "upnp:class derivedfrom &quot;object.item.audioItem&quot;",
+				       "*", 0, 50, "+upnp:originalTrackNumber");
+		}
+	}
+}
+
+/* Kodi (Platinum UPnP) checks both capabilities, fetches the metadata of
+ * each container before listing it, and asks for 200 sorted entries. */
+static void
+run_kodi(struct session *s)
+{
+	soap(s, A_SEARCH_CAPS, "GetSearchCapabilities", "");
+	soap(s, A_SORT_CAPS, "GetSortCapabilities", "");
+	walk(s, "0", 5, 200, "*", "+dc:title", 1);
+}
+
+static const struct profile profiles[] = {
+	{ "samsung", "SEC_HHP_[TV]UE40D7000/1.0 DLNADOC/1.50", run_samsung },
+	{ "lg", "Linux/2.6.31-1.0 UPnP/1.0 DLNADOC/1.50 INTEL_NMPR/2.0 LGE_DLNA_SDK/1.5.0", run_lg },
+	{ "xbox", "Xbox/2.0.4548.0 UPnP/1.0 Xbox/2.0.4548.0", run_xbox },
+	{ "kodi", "Kodi/17.6 (Linux; Android 7.1.2) UPnP/1.0 DLNADOC/1.50 Platinum/1.0.5.13", run_kodi },
+};
+#define NPROFILES	(int)(sizeof(profiles) / sizeof(profiles[0]))
+
+struct worker {
+	pthread_t thread;
+	int index;
+	int profile;		/* -1 for a mix of all of them */
+	double deadline;
+	struct thread_stats st;
+};
+
+static void *
+worker_main(void *arg)
+{
+	struct worker *w = arg;
+	struct session s;
+	int n = 0;
+
+	memset(&s, 0, sizeof(s));
+	s.st = &w->st;
+	s.seed = 1234 + w->index;
+	s.deadline = w->deadline;
+	while (bench_now() < w->deadline)
+	{
+		s.prof = &profiles[w->profile >= 0 ? w->profile : (w->index + n++) % NPROFILES];
+		s.prof->run(&s);
+		w->st.sessions++;
+	}
+	free(s.resp.data);
+
+	return NULL;
+}
+
+static double
+metric(const char *series)
+{
+	double v = -1;
+
+	bench_metric(port, series, &v);
+	return v;
+}
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-b minidlnad] [-w workdir] [-k] [-n files] [-D depth] [-F fanout]\n"
+	                "       [-m audio:video:image] [-c clients] [-t seconds] [-p port]\n"
+	                "       [-i interface] [-P samsung|lg|xbox|kodi]\n", prog);
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct genlib_opts gen = { NULL, 2000, 2, 4, 60, 10, 30, 1 };
+	struct genlib_stats gstats;
+	struct bench_samples all = { NULL, 0, 0 }, merged;
+	struct worker *workers;
+	const char *bin = "./minidlnad", *iface = "lo", *workdir = NULL;
+	char dir[PATH_MAX - 32], media[PATH_MAX], conf[PATH_MAX], pidfile[PATH_MAX];
+	char extra[128], cmd[PATH_MAX + 16];
+	double t0, t1, seconds = 10;
+	long requests = 0, errors = 0, sessions = 0;
+	int clients = 8, keep = 0, profile = -1, opt, i, a;
+	pid_t pid;
+
+	while ((opt = getopt(argc, argv, "b:w:kn:D:F:m:c:t:p:i:P:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'b': bin = optarg; break;
+		case 'w': workdir = optarg; break;
+		case 'k': keep = 1; break;
+		case 'n': gen.files = atoi(optarg); break;
+		case 'D': gen.depth = atoi(optarg); break;
+		case 'F': gen.fanout = atoi(optarg); break;
+		case 'm':
+			if (sscanf(optarg, "%d:%d:%d", &gen.audio, &gen.video, &gen.image) != 3)
+				usage(argv[0]);
+			break;
+		case 'c': clients = atoi(optarg); break;
+		case 't': seconds = atof(optarg); break;
+		case 'p': port = atoi(optarg); break;
+		case 'i': iface = optarg; break;
+		case 'P':
+			for (profile = 0; profile < NPROFILES; profile++)
+				if (strcmp(optarg, profiles[profile].name) == 0)
+					break;
+			if (profile == NPROFILES)
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (gen.files <= 0 || gen.fanout <= 0 || gen.depth < 0 || clients <= 0)
+		usage(argv[0]);
+	if (access(bin, X_OK) != 0)
+	{
+		fprintf(stderr, "Can't run %s; use -b to point at minidlnad\n", bin);
+		return 1;
+	}
+
+	if (workdir)
+		snprintf(dir, sizeof(dir), "%s", workdir);
+	else
+	{
+		snprintf(dir, sizeof(dir), "/tmp/minidlna-bench.XXXXXX");
+		if (!mkdtemp(dir))
+		{
+			perror("mkdtemp");
+			return 1;
+		}
+	}
+	/* minidlna.conf wants absolute paths */
+	if (!realpath(dir, media) || strlen(media) >= sizeof(dir))
+	{
+		perror(dir);
+		return 1;
+	}
+	strcpy(dir, media);
+	snprintf(media, sizeof(media), "%s/media", dir);
+	snprintf(conf, sizeof(conf), "%s/minidlna.conf", dir);
+	snprintf(pidfile, sizeof(pidfile), "%s/minidlna.pid", dir);
+
+	/* Library */
+	gen.root = media;
+	t0 = bench_now();
+	if (genlib_create(&gen, &gstats) != 0)
+		return 1;
+	t1 = bench_now();
+	printf("Library: %d files (%d audio, %d video, %d image) in %d directories, %.1f MB\n",
+	       gen.files, gstats.audio, gstats.video, gstats.image, gstats.dirs, gstats.bytes / 1e6);
+	printf("  generated in %.2fs under %s\n", t1 - t0, dir);
+
+	/* Scan */
+	snprintf(extra, sizeof(extra), "network_interface=%s", iface);
+	if (bench_write_conf(conf, dir, media, port, extra) != 0)
+	{
+		perror(conf);
+		return 1;
+	}
+	t0 = bench_now();
+	pid = bench_start_daemon(bin, conf, pidfile, 1);
+	if (pid < 0 || bench_wait_http(port, 30) != 0)
+	{
+		fprintf(stderr, "minidlnad didn't start listening on port %d\n", port);
+		bench_stop_daemon(pid);
+		return 1;
+	}
+	if (bench_wait_scan(port) != 0)
+	{
+		fprintf(stderr, "Unable to read /metrics\n");
+		bench_stop_daemon(pid);
+		return 1;
+	}
+	t1 = bench_now();
+	printf("Scan: %.0f files in %.2fs (%.0f files/s)\n",
+	       metric("minidlna_scan_files_total"), t1 - t0,
+	       metric("minidlna_scan_files_total") / (t1 - t0));
+	printf("  files %.3fs, index %.3fs, playlists %.3fs\n",
+	       metric("minidlna_scan_stage_seconds{stage=\"files\"}"),
+	       metric("minidlna_scan_stage_seconds{stage=\"index\"}"),
+	       metric("minidlna_scan_stage_seconds{stage=\"playlists\"}"));
+
+	/* Load */
+	workers = calloc(clients, sizeof(struct worker));
+	t0 = bench_now();
+	for (i = 0; i < clients; i++)
+	{
+		workers[i].index = i;
+		workers[i].profile = profile;
+		workers[i].deadline = t0 + seconds;
+		pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]);
+	}
+	for (i = 0; i < clients; i++)
+		pthread_join(workers[i].thread, NULL);
+	t1 = bench_now();
+
+	printf("Load: %d clients (%s) for %.1fs\n", clients,
+	       profile >= 0 ? profiles[profile].name : "mixed", t1 - t0);
+	printf("  %-24s %8s %10s %10s\n", "action", "count", "p50 ms", "p99 ms");
+	for (a = 0; a < A_MAX; a++)
+	{
+		memset(&merged, 0, sizeof(merged));
+		for (i = 0; i < clients; i++)
+			bench_merge_samples(&merged, &workers[i].st.lat[a]);
+		if (!merged.n)
+			continue;
+		bench_merge_samples(&all, &merged);
+		printf("  %-24s %8d %10.2f %10.2f\n", action_name[a], merged.n,
+		       bench_percentile(&merged, 50) * 1e3, bench_percentile(&merged, 99) * 1e3);
+		free(merged.v);
+	}
+	for (i = 0; i < clients; i++)
+	{
+		requests += workers[i].st.requests;
+		errors += workers[i].st.errors;
+		sessions += workers[i].st.sessions;
+		for (a = 0; a < A_MAX; a++)
+			free(workers[i].st.lat[a].v);
+	}
+	printf("  %-24s %8d %10.2f %10.2f\n", "all", all.n,
+	       bench_percentile(&all, 50) * 1e3, bench_percentile(&all, 99) * 1e3);
+	printf("  %ld requests in %ld sessions, %.1f requests/s, %ld errors\n",
+	       requests, sessions, requests / (t1 - t0), errors);
+
+	bench_stop_daemon(pid);
+	free(workers);
+	free(all.v);
+	if (!keep)
+	{
+		snprintf(cmd, sizeof(cmd), "rm -rf '%s'", dir);
+		if (system(cmd) != 0)
+			fprintf(stderr, "Unable to remove %s\n", dir);
+	}
+
+	return errors ? 2 : 0;
+}
@@ -0,0 +1,650 @@
+/* Streaming throughput benchmark
+ *
+ * MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Serves a set of generated videos and points a crowd of simulated
+ * renderers at /MediaItems/ on loopback.  Each renderer behaves the way
+ * TVs do: it probes the head and the tail of the file with Range requests,
+ * then plays it from the start at the file's bitrate, and every so often
+ * seeks (drops the connection and reopens at a new offset), pauses (stops
+ * reading and lets the server stall on a full socket), or is switched off
+ * (resets the connection mid-transfer).
+ *
+ * Reported are aggregate throughput, time to first byte, the daemon's CPU
+ * time (including its streaming children) per Gbit/s served, and how many
+ * processes and threads it needed to do it.
+ *
+ * usage: stream_bench [-b minidlnad] [-w workdir] [-k] [-n files] [-s MB]
+ *                     [-c renderers] [-t seconds] [-r Mbit/s]
+ *                     [-e seeks:pauses:drops] [-o option=value] [-p port]
+ *                     [-i interface] */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <math.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "benchutil.h"
+#include "genlib.h"
+
+#define FPS		25
+#define PROBE_BYTES	(256 * 1024)
+#define TAIL_BYTES	(128 * 1024)
+#define MAX_ITEMS	256
+
+struct renderer {
+	pthread_t thread;
+	unsigned int seed;
+	long long bytes;
+	long sessions;
+	long requests;
+	long seeks;
+	long pauses;
+	long drops;
+	long errors;
+	struct bench_samples ttfb_probe;
+	struct bench_samples ttfb_play;
+};
+
+static int port = 8299;
+static double deadline;
+static double rate;		/* bytes per second per renderer, 0 for unpaced */
+static double event_rate[3] = { 2, 1, 1 };	/* seeks, pauses, drops per minute */
+static char items[MAX_ITEMS][32];
+static int nitems;
+
+/* Start a GET for [start, end] (end < 0 meaning the rest of the file),
+ * and wait for the first byte of the body.  Returns the socket, with
+ * *got set to the body bytes already read into buf. */
+static int
+stream_open(struct renderer *r, const char *item, long long start, long long end,
+            long long *size, char *buf, size_t buflen, ssize_t *got, double *ttfb)
+{
+	char req[512], range[64];
+	struct bench_buf hdr = { NULL, 0, 0 };
+	const char *p;
+	double t0;
+	ssize_t n;
+	int s, status = -1, len;
+
+	if (end >= 0)
+		snprintf(range, sizeof(range), "%lld-%lld", start, end);
+	else
+		snprintf(range, sizeof(range), "%lld-", start);
+	len = snprintf(req, sizeof(req),
+		"GET %s HTTP/1.1\r\n"
+		"Host: 127.0.0.1:%d\r\n"
+		"User-Agent: Linux/3.10 UPnP/1.0 DLNADOC/1.50 bench-renderer/1.0\r\n"
+		"transferMode.dlna.org: Streaming\r\n"
+		"getcontentFeatures.dlna.org: 1\r\n"
+		"Range: bytes=%s\r\n"
+		"Connection: close\r\n"
+		"\r\n", item, port, range);
+
+	r->requests++;
+	t0 = bench_now();
+	s = bench_connect(port);
+	if (s < 0 || send(s, req, len, MSG_NOSIGNAL) != len)
+		goto error;
+	/* Read the headers; whatever follows them is body */
+	while (!hdr.data || !(p = strstr(hdr.data, "\r\n\r\n")))
+	{
+		n = recv(s, buf, buflen, 0);
+		if (n <= 0)
+			goto error;
+		bench_append(&hdr, buf, n);
+	}
+	sscanf(hdr.data, "HTTP/%*d.%*d %d", &status);
+	if (status != 206)
+		goto error;
+	p += 4;
+	*got = hdr.len - (p - hdr.data);
+	memcpy(buf, p, *got);
+	if ((p = strstr(hdr.data, "\r\nContent-Range: bytes ")) && (p = strchr(p, '/')))
+		*size = strtoll(p + 1, NULL, 10);
+	free(hdr.data);
+	if (*got == 0)
+	{
+		*got = recv(s, buf, buflen, 0);
+		if (*got <= 0)
+		{
+			close(s);
+			r->errors++;
+			return -1;
+		}
+	}
+	*ttfb = bench_now() - t0;
+	r->bytes += *got;
+
+	return s;
+error:
+	if (s >= 0)
+		close(s);
+	free(hdr.data);
+	r->errors++;
+	return -1;
+}
+
+/* Read a probe's worth of the response and hang up, like a TV sniffing
+ * the container format. */
+static int
+probe(struct renderer *r, const char *item, long long start, long long end,
+      long long *size, long long want)
+{
+	char buf[65536];
+	ssize_t got, n;
+	double ttfb;
+	int s;
+
+	s = stream_open(r, item, start, end, size, buf, sizeof(buf), &got, &ttfb);
+	if (s < 0)
+		return -1;
+	bench_add_sample(&r->ttfb_probe, ttfb);
+	while (got < want && (n = recv(s, buf, sizeof(buf), 0)) > 0)
+	{
+		got += n;
+		r->bytes += n;
+	}
+	close(s);
+
+	return 0;
+}
+
+/* Seconds until the next seek, pause or drop */
+static double
+next_event(struct renderer *r)
+{
+	double per_sec = (event_rate[0] + event_rate[1] + event_rate[2]) / 60;
+	double u = (rand_r(&r->seed) + 1.0) / ((double)RAND_MAX + 2);
+
+	if (per_sec <= 0)
+		return 1e9;
+	return -log(u) / per_sec;
+}
+
+static void
+hang_up(int s)
+{
+	struct linger lg = { 1, 0 };
+
+	/* Abort rather than close, so the server sees a reset */
+	setsockopt(s, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+	close(s);
+}
+
+static void
+session(struct renderer *r)
+{
+	char buf[65536];
+	const char *item = items[rand_r(&r->seed) % nitems];
+	long long size = 0, pos, paced;
+	double ttfb, now, paced_start, event;
+	ssize_t n;
+	int s, e;
+
+	r->sessions++;
+	if (probe(r, item, 0, -1, &size, PROBE_BYTES) != 0 || size <= 0)
+		return;
+	if (size > TAIL_BYTES)
+		probe(r, item, size - TAIL_BYTES, -1, &size, TAIL_BYTES);
+
+	pos = 0;
+	s = stream_open(r, item, pos, -1, &size, buf, sizeof(buf), &n, &ttfb);
+	if (s < 0)
+		return;
+	bench_add_sample(&r->ttfb_play, ttfb);
+	paced = n;
+	paced_start = bench_now();
+	event = paced_start + next_event(r);
+	pos += n;
+	for (;;)
+	{
+		now = bench_now();
+		if (now >= deadline)
+			break;
+		if (now >= event)
+		{
+			event = now + next_event(r);
+			e = rand_r(&r->seed) % 1000;
+			if (e < 1000 * event_rate[0] / (event_rate[0] + event_rate[1] + event_rate[2]))
+			{
+				/* Seek: hang up and start again somewhere else */
+				r->seeks++;
+				close(s);
+				pos = (long long)((double)rand_r(&r->seed) / RAND_MAX * (size - 1));
+				s = stream_open(r, item, pos, -1, &size, buf, sizeof(buf), &n, &ttfb);
+				if (s < 0)
+					return;
+				bench_add_sample(&r->ttfb_play, ttfb);
+				pos += n;
+				paced = n;
+				paced_start = bench_now();
+				continue;
+			}
+			if (e < 1000 * (event_rate[0] + event_rate[1]) /
+			         (event_rate[0] + event_rate[1] + event_rate[2]))
+			{
+				/* Pause: stop reading for a while */
+				r->pauses++;
+				usleep(fmin(2 + rand_r(&r->seed) % 6000 / 1e3, deadline - now) * 1e6);
+				paced = 0;
+				paced_start = bench_now();
+				continue;
+			}
+			/* Switched off */
+			r->drops++;
+			hang_up(s);
+			return;
+		}
+		if (rate > 0 && paced > (now - paced_start) * rate)
+		{
+			usleep((paced / rate - (now - paced_start)) * 1e6);
+			continue;
+		}
+		n = recv(s, buf, sizeof(buf), 0);
+		if (n <= 0)
+			break;
+		r->bytes += n;
+		paced += n;
+		pos += n;
+	}
+	if (pos < size && bench_now() < deadline)
+		r->errors++;
+	close(s);
+}
+
+static void *
+renderer_main(void *arg)
+{
+	struct renderer *r = arg;
+
+	while (bench_now() < deadline)
+		session(r);
+
+	return NULL;
+}
+
+/* Process accounting from /proc: the daemon and its streaming children */
+struct proc_stats {
+	int procs;
+	int threads;
+	double cpu;		/* seconds, including reaped children */
+};
+
+static int
+read_stat(pid_t pid, pid_t *ppid, double *cpu, double *child_cpu, int *threads)
+{
+	char path[64], line[1024], *p;
+	unsigned long utime, stime;
+	long cutime, cstime, nthreads;
+	int ppid_i;
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+	fp = fopen(path, "r");
+	if (!fp)
+		return -1;
+	p = fgets(line, sizeof(line), fp);
+	fclose(fp);
+	/* The command name may contain anything, so skip past its last ')' */
+	if (!p || !(p = strrchr(line, ')')))
+		return -1;
+	if (sscanf(p + 2, "%*c %d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu %ld %ld %*d %*d %ld",
+	           &ppid_i, &utime, &stime, &cutime, &cstime, &nthreads) != 6)
+		return -1;
+	*ppid = ppid_i;
+	*cpu = (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+	*child_cpu = (double)(cutime + cstime) / sysconf(_SC_CLK_TCK);
+	*threads = nthreads;
+
+	return 0;
+}
+
+static int
+proc_stats(pid_t pid, struct proc_stats *ps)
+{
+	struct dirent *d;
+	double cpu, child_cpu;
+	pid_t ppid;
+	int threads;
+	DIR *dir;
+
+	if (read_stat(pid, &ppid, &cpu, &child_cpu, &threads) != 0)
+		return -1;
+	ps->procs = 1;
+	ps->threads = threads;
+	ps->cpu = cpu + child_cpu;
+	dir = opendir("/proc");
+	if (!dir)
+		return -1;
+	while ((d = readdir(dir)))
+	{
+		if (!isdigit(d->d_name[0]) || atoi(d->d_name) == pid)
+			continue;
+		if (read_stat(atoi(d->d_name), &ppid, &cpu, &child_cpu, &threads) != 0 || ppid != pid)
+			continue;
+		ps->procs++;
+		ps->threads += threads;
+		ps->cpu += cpu + child_cpu;
+	}
+	closedir(dir);
+
+	return 0;
+}
+
+struct monitor {
+	pthread_t thread;
+	pid_t pid;
+	int done;
+	int max_procs;
+	int max_threads;
+	double sum_procs;
+	double sum_threads;
+	int samples;
+};
+
+static void *
+monitor_main(void *arg)
+{
+	struct monitor *m = arg;
+	struct proc_stats ps;
+
+	while (!__atomic_load_n(&m->done, __ATOMIC_RELAXED))
+	{
+		if (proc_stats(m->pid, &ps) == 0)
+		{
+			if (ps.procs > m->max_procs)
+				m->max_procs = ps.procs;
+			if (ps.threads > m->max_threads)
+				m->max_threads = ps.threads;
+			m->sum_procs += ps.procs;
+			m->sum_threads += ps.threads;
+			m->samples++;
+		}
+		usleep(200000);
+	}
+
+	return NULL;
+}
+
+/* Find the generated videos' /MediaItems/ paths through ContentDirectory */
+static int
+find_items(void)
+{
+	struct bench_buf resp = { NULL, 0, 0 };
+	const char *p, *end;
+
+	if (bench_soap(port, "bench-renderer/1.0", "Search",
+	               "<ContainerID>0</ContainerID>"
+	               "<SearchCriteria>upnp:class derivedfrom &quot;object.item.videoItem&quot;</SearchCriteria>"
+	               "<Filter>res</Filter><StartingIndex>0</StartingIndex>"
+	               "<RequestedCount>256</RequestedCount><SortCriteria></SortCriteria>",
+	               &resp) != 200)
+	{
+		free(resp.data);
+		return -1;
+	}
+	for (p = resp.data; nitems < MAX_ITEMS && (p = strstr(p, "/MediaItems/")); p = end)
+	{
+		end = strstr(p, "&lt;");
+		if (!end)
+			break;
+		if (end - p < (int)sizeof(items[0]))
+		{
+			memcpy(items[nitems], p, end - p);
+			items[nitems][end - p] = '\0';
+			nitems++;
+		}
+	}
+	free(resp.data);
+
+	return nitems ? 0 : -1;
+}
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-b minidlnad] [-w workdir] [-k] [-n files] [-s MB]\n"
+	                "       [-c renderers] [-t seconds] [-r Mbit/s] [-e seeks:pauses:drops]\n"
+	                "       [-o option=value] [-p port] [-i interface]\n", prog);
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct renderer *renderers;
+	struct monitor mon;
+	struct proc_stats before, after;
+	struct bench_samples probe_all = { NULL, 0, 0 }, play_all = { NULL, 0, 0 };
+	const char *bin = "./minidlnad", *iface = "lo", *workdir = NULL;
+	char dir[PATH_MAX - 32], media[PATH_MAX], conf[PATH_MAX], pidfile[PATH_MAX];
+	char path[PATH_MAX + 32], extra[1024] = "", cmd[PATH_MAX + 16];
+	double t0, t1, seconds = 20, mbits = 8, gbits, sent[3][2];
+	long long bytes = 0;
+	long sessions = 0, requests = 0, seeks = 0, pauses = 0, drops = 0, errors = 0;
+	int files = 8, file_mb = 64, count = 16, keep = 0, frame_bytes, opt, i;
+	size_t extra_len = 0;
+	pid_t pid;
+	static const char *methods[3] = { "sendfile", "read", "cache" };
+
+	while ((opt = getopt(argc, argv, "b:w:kn:s:c:t:r:e:o:p:i:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'b': bin = optarg; break;
+		case 'w': workdir = optarg; break;
+		case 'k': keep = 1; break;
+		case 'n': files = atoi(optarg); break;
+		case 's': file_mb = atoi(optarg); break;
+		case 'c': count = atoi(optarg); break;
+		case 't': seconds = atof(optarg); break;
+		case 'r': mbits = atof(optarg); break;
+		case 'e':
+			if (sscanf(optarg, "%lf:%lf:%lf", &event_rate[0], &event_rate[1], &event_rate[2]) != 3)
+				usage(argv[0]);
+			break;
+		case 'o':
+			extra_len += snprintf(extra + extra_len, sizeof(extra) - extra_len, "%s\n", optarg);
+			if (extra_len >= sizeof(extra))
+				usage(argv[0]);
+			break;
+		case 'p': port = atoi(optarg); break;
+		case 'i': iface = optarg; break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (files <= 0 || files > MAX_ITEMS || file_mb <= 0 || count <= 0 || mbits < 0)
+		usage(argv[0]);
+	extra_len += snprintf(extra + extra_len, sizeof(extra) - extra_len,
+	                      "network_interface=%s", iface);
+	if (extra_len >= sizeof(extra))
+		usage(argv[0]);
+	if (access(bin, X_OK) != 0)
+	{
+		fprintf(stderr, "Can't run %s; use -b to point at minidlnad\n", bin);
+		return 1;
+	}
+	rate = mbits * 1e6 / 8;
+
+	if (workdir)
+		snprintf(dir, sizeof(dir), "%s", workdir);
+	else
+	{
+		snprintf(dir, sizeof(dir), "/tmp/minidlna-bench.XXXXXX");
+		if (!mkdtemp(dir))
+		{
+			perror("mkdtemp");
+			return 1;
+		}
+	}
+	/* minidlna.conf wants absolute paths */
+	if (!realpath(dir, media) || strlen(media) >= sizeof(dir))
+	{
+		perror(dir);
+		return 1;
+	}
+	strcpy(dir, media);
+	snprintf(media, sizeof(media), "%s/media", dir);
+	snprintf(conf, sizeof(conf), "%s/minidlna.conf", dir);
+	snprintf(pidfile, sizeof(pidfile), "%s/minidlna.pid", dir);
+
+	/* Videos whose bitrate matches the renderers' playback rate, so the
+	 * server's own pacing (if enabled with -o) agrees with them */
+	frame_bytes = (mbits > 0 ? mbits : 8) * 1e6 / 8 / FPS;
+	if (mkdir(media, 0755) != 0)
+	{
+		perror(media);
+		return 1;
+	}
+	t0 = bench_now();
+	for (i = 0; i < files; i++)
+	{
+		snprintf(path, sizeof(path), "%s/Movie %02d.avi", media, i + 1);
+		if (genlib_avi(path, 320, 240, (long long)file_mb * 1000000 / frame_bytes,
+		               FPS, frame_bytes) < 0)
+		{
+			fprintf(stderr, "Unable to write %s\n", path);
+			return 1;
+		}
+	}
+	printf("Library: %d videos of %d MB at %.1f Mbit/s, generated in %.2fs under %s\n",
+	       files, file_mb, frame_bytes * 8.0 * FPS / 1e6, bench_now() - t0, dir);
+
+	if (bench_write_conf(conf, dir, media, port, extra) != 0)
+	{
+		perror(conf);
+		return 1;
+	}
+	pid = bench_start_daemon(bin, conf, pidfile, 1);
+	if (pid < 0 || bench_wait_http(port, 30) != 0 || bench_wait_scan(port) != 0)
+	{
+		fprintf(stderr, "minidlnad didn't come up on port %d\n", port);
+		bench_stop_daemon(pid);
+		return 1;
+	}
+	if (find_items() != 0)
+	{
+		fprintf(stderr, "No videos found in the content directory\n");
+		bench_stop_daemon(pid);
+		return 1;
+	}
+	for (i = 0; i < 3; i++)
+	{
+		snprintf(cmd, sizeof(cmd), "minidlna_transfer_bytes_total{method=\"%s\"}", methods[i]);
+		sent[i][0] = 0;
+		bench_metric(port, cmd, &sent[i][0]);
+	}
+
+	/* Stream */
+	memset(&mon, 0, sizeof(mon));
+	mon.pid = pid;
+	if (proc_stats(pid, &before) != 0)
+	{
+		fprintf(stderr, "Unable to read /proc/%d\n", (int)pid);
+		bench_stop_daemon(pid);
+		return 1;
+	}
+	pthread_create(&mon.thread, NULL, monitor_main, &mon);
+	renderers = calloc(count, sizeof(struct renderer));
+	t0 = bench_now();
+	deadline = t0 + seconds;
+	for (i = 0; i < count; i++)
+	{
+		renderers[i].seed = 4321 + i;
+		pthread_create(&renderers[i].thread, NULL, renderer_main, &renderers[i]);
+	}
+	for (i = 0; i < count; i++)
+		pthread_join(renderers[i].thread, NULL);
+	t1 = bench_now();
+	/* Let the streaming children notice and get reaped, so their CPU
+	 * time is charged to the daemon */
+	for (i = 0; i < 50; i++)
+	{
+		if (proc_stats(pid, &after) != 0 || after.procs == 1)
+			break;
+		usleep(100000);
+	}
+	__atomic_store_n(&mon.done, 1, __ATOMIC_RELAXED);
+	pthread_join(mon.thread, NULL);
+	proc_stats(pid, &after);
+	for (i = 0; i < 3; i++)
+	{
+		snprintf(cmd, sizeof(cmd), "minidlna_transfer_bytes_total{method=\"%s\"}", methods[i]);
+		sent[i][1] = 0;
+		bench_metric(port, cmd, &sent[i][1]);
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		bytes += renderers[i].bytes;
+		sessions += renderers[i].sessions;
+		requests += renderers[i].requests;
+		seeks += renderers[i].seeks;
+		pauses += renderers[i].pauses;
+		drops += renderers[i].drops;
+		errors += renderers[i].errors;
+		bench_merge_samples(&probe_all, &renderers[i].ttfb_probe);
+		bench_merge_samples(&play_all, &renderers[i].ttfb_play);
+		free(renderers[i].ttfb_probe.v);
+		free(renderers[i].ttfb_play.v);
+	}
+	gbits = bytes * 8 / 1e9;
+
+	printf("Streaming: %d renderers at %s for %.1fs\n", count,
+	       mbits > 0 ? "the file bitrate" : "full speed", t1 - t0);
+	printf("  throughput   %.1f MB/s (%.3f Gbit/s), %.1f MB received\n",
+	       bytes / (t1 - t0) / 1e6, gbits / (t1 - t0), bytes / 1e6);
+	printf("  requests     %ld in %ld sessions: %ld seeks, %ld pauses, %ld drops, %ld errors\n",
+	       requests, sessions, seeks, pauses, drops, errors);
+	printf("  ttfb probe   p50 %.2f ms, p99 %.2f ms (%d)\n",
+	       bench_percentile(&probe_all, 50) * 1e3, bench_percentile(&probe_all, 99) * 1e3, probe_all.n);
+	printf("  ttfb play    p50 %.2f ms, p99 %.2f ms (%d)\n",
+	       bench_percentile(&play_all, 50) * 1e3, bench_percentile(&play_all, 99) * 1e3, play_all.n);
+	printf("  daemon CPU   %.2fs, %.2f cores, %.3f CPU-seconds per Gbit\n",
+	       after.cpu - before.cpu, (after.cpu - before.cpu) / (t1 - t0),
+	       gbits > 0 ? (after.cpu - before.cpu) / gbits : 0);
+	if (mon.samples)
+		printf("  processes    peak %d, mean %.1f; threads peak %d, mean %.1f\n",
+		       mon.max_procs, mon.sum_procs / mon.samples,
+		       mon.max_threads, mon.sum_threads / mon.samples);
+	printf("  server sent  %.1f MB by sendfile, %.1f MB by read, %.1f MB from the block cache\n",
+	       (sent[0][1] - sent[0][0]) / 1e6, (sent[1][1] - sent[1][0]) / 1e6,
+	       (sent[2][1] - sent[2][0]) / 1e6);
+
+	bench_stop_daemon(pid);
+	free(renderers);
+	free(probe_all.v);
+	free(play_all.v);
+	if (!keep)
+	{
+		snprintf(cmd, sizeof(cmd), "rm -rf '%s'", dir);
+		if (system(cmd) != 0)
+			fprintf(stderr, "Unable to remove %s\n", dir);
+	}
+
+	return errors ? 2 : 0;
+}
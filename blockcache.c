@@ -0,0 +1,234 @@
+/* Shared head/tail block cache for renderer probe requests
+ *
+ * MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "config.h"
+#include "blockcache.h"
+#include "metrics.h"
+#include "log.h"
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+#define BLOCK_CACHE_DATA (BLOCK_CACHE_HEAD + BLOCK_CACHE_TAIL)
+
+/* The cache lives in an anonymous shared mapping, so entries loaded by one
+ * streaming child are visible to the parent and every later child.
+ * Each slot is protected by a sequence count: it is odd while a writer is
+ * filling the slot, and readers retry on disk if it changed under them. */
+struct block_slot {
+	volatile unsigned int seq;
+	int64_t id;
+	time_t mtime;
+	off_t size;
+	off_t head_len;		/* bytes cached from the start of the file */
+	off_t tail_len;		/* bytes cached from the end of the file */
+	volatile time_t used;
+};
+
+static struct block_slot *slots = NULL;
+static char *slot_data = NULL;
+static int num_slots = 0;
+
+int
+blockcache_init(int entries)
+{
+	size_t len;
+	void *map;
+
+	if (entries <= 0)
+		return 0;
+
+	len = entries * (sizeof(struct block_slot) + BLOCK_CACHE_DATA);
+	map = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED)
+	{
+		DPRINTF(E_ERROR, L_HTTP, "Unable to map block cache: %s\n", strerror(errno));
+		return -1;
+	}
+	memset(map, 0, entries * sizeof(struct block_slot));
+	slots = map;
+	slot_data = (char *)map + entries * sizeof(struct block_slot);
+	num_slots = entries;
+	DPRINTF(E_DEBUG, L_HTTP, "Block cache enabled [%d entries, %lu KB]\n",
+		entries, (unsigned long)(len / 1024));
+
+	return 0;
+}
+
+static inline char *
+slot_buf(int i)
+{
+	return slot_data + (size_t)i * BLOCK_CACHE_DATA;
+}
+
+static inline int
+slot_matches(struct block_slot *slot, int64_t id, const struct stat *st)
+{
+	return (slot->id == id && slot->mtime == st->st_mtime && slot->size == st->st_size);
+}
+
+static int
+find_slot(int64_t id, const struct stat *st)
+{
+	int i;
+
+	for (i = 0; i < num_slots; i++)
+	{
+		if (!(slots[i].seq & 1) && slot_matches(&slots[i], id, st))
+			return i;
+	}
+
+	return -1;
+}
+
+/* Read the head and tail of the file into the least recently used slot. */
+static int
+fill_slot(int64_t id, int fd, const struct stat *st)
+{
+	struct block_slot *slot;
+	unsigned int seq;
+	off_t head, tail = 0;
+	char *buf;
+	int i, victim = 0;
+
+	for (i = 1; i < num_slots; i++)
+	{
+		if (slots[i].used < slots[victim].used)
+			victim = i;
+	}
+	slot = &slots[victim];
+	seq = slot->seq;
+	if ((seq & 1) || !__sync_bool_compare_and_swap(&slot->seq, seq, seq + 1))
+		return -1;
+
+	buf = slot_buf(victim);
+	if (st->st_size <= BLOCK_CACHE_DATA)
+		head = st->st_size;
+	else
+	{
+		head = BLOCK_CACHE_HEAD;
+		tail = BLOCK_CACHE_TAIL;
+	}
+	if (pread(fd, buf, head, 0) != head ||
+	    (tail && pread(fd, buf + head, tail, st->st_size - tail) != tail))
+	{
+		DPRINTF(E_DEBUG, L_HTTP, "Block cache read failed for %lld\n", (long long)id);
+		slot->id = 0;
+		__sync_synchronize();
+		slot->seq = seq + 2;
+		return -1;
+	}
+	slot->id = id;
+	slot->mtime = st->st_mtime;
+	slot->size = st->st_size;
+	slot->head_len = head;
+	slot->tail_len = tail;
+	slot->used = time(NULL);
+	__sync_synchronize();
+	slot->seq = seq + 2;
+
+	return victim;
+}
+
+off_t
+blockcache_read(int64_t id, int fd, const struct stat *st, off_t offset, off_t len, char *buf)
+{
+	struct block_slot *slot;
+	unsigned int seq;
+	off_t ret;
+	int i;
+
+	if (!num_slots || len <= 0)
+		return -1;
+
+	i = find_slot(id, st);
+	if (i < 0)
+	{
+		/* Don't evict anything for ranges the cache could never serve */
+		if (offset >= BLOCK_CACHE_HEAD && offset < st->st_size - BLOCK_CACHE_TAIL)
+			return -1;
+		metrics_add(M_PROBE_MISS, 1);
+		i = fill_slot(id, fd, st);
+		if (i < 0)
+			return -1;
+		DPRINTF(E_DEBUG, L_HTTP, "Block cache loaded %lld into slot %d\n", (long long)id, i);
+	}
+	else
+		metrics_add(M_PROBE_HIT, 1);
+	slot = &slots[i];
+
+	seq = slot->seq;
+	if (seq & 1)
+		return -1;
+	__sync_synchronize();
+	if (!slot_matches(slot, id, st))
+		return -1;
+
+	if (offset < slot->head_len)
+	{
+		ret = slot->head_len - offset;
+		if (ret > len)
+			ret = len;
+		memcpy(buf, slot_buf(i) + offset, ret);
+	}
+	else if (slot->tail_len && offset >= slot->size - slot->tail_len)
+	{
+		ret = slot->size - offset;
+		if (ret > len)
+			ret = len;
+		memcpy(buf, slot_buf(i) + slot->head_len + (offset - (slot->size - slot->tail_len)), ret);
+	}
+	else
+		return -1;
+
+	__sync_synchronize();
+	if (slot->seq != seq)
+		return -1;
+	slot->used = time(NULL);
+
+	return ret;
+}
+
+void
+blockcache_prefill(int64_t id, const char *path)
+{
+	struct stat st;
+	int fd;
+
+	if (!num_slots || id <= 0)
+		return;
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return;
+	if (fstat(fd, &st) == 0 && find_slot(id, &st) < 0)
+	{
+		if (fill_slot(id, fd, &st) >= 0)
+			DPRINTF(E_DEBUG, L_HTTP, "Block cache prefilled %s\n", path);
+	}
+	close(fd);
+}
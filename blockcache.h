@@ -0,0 +1,61 @@
+/* Shared head/tail block cache for renderer probe requests
+ *
+ * MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __BLOCKCACHE_H__
+#define __BLOCKCACHE_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/* Renderers typically probe the first few hundred KB (headers, moov atom)
+ * and the last few KB (MKV cues, trailing index) before starting playback. */
+#define BLOCK_CACHE_HEAD	(256*1024)
+#define BLOCK_CACHE_TAIL	(64*1024)
+
+/**
+ * Set up the shared cache.  This must be called before any children are
+ * forked, so that they all share the same mapping.
+ * @param entries Number of files to keep cached, 0 to disable the cache.
+ * @return 0 on success, -1 on failure.
+ */
+int blockcache_init(int entries);
+
+/**
+ * Copy cached file data starting at offset into buf, loading the head and
+ * tail blocks of the file into the cache if they aren't there yet.
+ * @param id The DETAILS ID of the file.
+ * @param fd An open descriptor for the file.
+ * @param st The result of fstat() on fd, used to validate the entry.
+ * @param offset Offset of the first byte wanted.
+ * @param len Maximum number of bytes to copy.
+ * @param buf Destination buffer, at least len bytes long.
+ * @return The number of contiguous bytes copied, which may be less than len
+ *         if the request runs past a cached block, or -1 if nothing could be
+ *         served from the cache.
+ */
+off_t blockcache_read(int64_t id, int fd, const struct stat *st, off_t offset, off_t len, char *buf);
+
+/**
+ * Load the head and tail blocks of a newly added file ahead of time.
+ * @param id The DETAILS ID of the file.
+ * @param path The path of the file.
+ */
+void blockcache_prefill(int64_t id, const char *path);
+
+#endif
@@ -0,0 +1,464 @@
+/* MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Separable fixed-point image resampler.
+ *
+ * Each axis gets a table of source taps and 14-bit weights: an area
+ * (box) filter with fractional edge coverage when shrinking, and
+ * bilinear interpolation when growing.  Rows are filtered horizontally
+ * into a small ring buffer, which is then filtered vertically, so the
+ * intermediate image never needs to be held in full.  The inner loops
+ * treat the four bytes of a pix as independent channels and have SSE2,
+ * AVX2 and NEON versions, picked at runtime. */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+#include "image_utils.h"
+#include "log.h"
+
+#define RESAMPLE_BITS  14
+#define RESAMPLE_ONE   (1 << RESAMPLE_BITS)
+#define RESAMPLE_ROUND (1 << (RESAMPLE_BITS - 1))
+
+struct contrib {
+	int32_t start;
+	int32_t n;
+	int16_t *w;
+};
+
+typedef void (*hpass_fn)(const pix *src, pix *dst, int32_t width, const struct contrib *c);
+typedef void (*vpass_fn)(const pix **rows, const int16_t *w, int32_t n, pix *dst, int32_t width);
+
+struct resample_ops {
+	const char *name;
+	hpass_fn hpass;
+	vpass_fn vpass;
+};
+
+/* Build the per-destination tap tables for one axis.  Weights for each
+ * destination coordinate always add up to exactly RESAMPLE_ONE. */
+static struct contrib *
+make_contribs(int32_t src, int32_t dst, int32_t *maxn)
+{
+	struct contrib *c;
+	int16_t *w;
+	int32_t i, j, n, taps, big;
+	int64_t left, right, lo, hi, sum;
+
+	taps = (dst < src) ? (src + dst - 1) / dst + 1 : 2;
+	c = malloc(dst * sizeof(struct contrib) + dst * taps * sizeof(int16_t));
+	if( !c )
+		return NULL;
+	w = (int16_t *)(c + dst);
+	*maxn = 1;
+
+	for( i = 0; i < dst; i++ )
+	{
+		c[i].w = w + i * taps;
+		if( dst < src )
+		{
+			/* Source span [left, right) in units of 1/dst pixel */
+			left = (int64_t)i * src;
+			right = (int64_t)(i + 1) * src;
+			c[i].start = left / dst;
+			n = (right - 1) / dst - c[i].start + 1;
+			for( j = 0; j < n; j++ )
+			{
+				lo = (int64_t)(c[i].start + j) * dst;
+				hi = lo + dst;
+				if( lo < left )
+					lo = left;
+				if( hi > right )
+					hi = right;
+				c[i].w[j] = (hi - lo) * RESAMPLE_ONE / src;
+			}
+		}
+		else
+		{
+			/* Pixel-center aligned bilinear, in 1/256 pixel units */
+			int64_t pos = ((int64_t)(2 * i + 1) * src - dst) * 256 / (2 * dst);
+			int32_t f;
+
+			if( pos < 0 )
+				pos = 0;
+			c[i].start = pos >> 8;
+			f = pos & 0xFF;
+			if( c[i].start >= src - 1 || f == 0 )
+			{
+				if( c[i].start > src - 1 )
+					c[i].start = src - 1;
+				n = 1;
+				c[i].w[0] = RESAMPLE_ONE;
+			}
+			else
+			{
+				n = 2;
+				c[i].w[0] = (256 - f) << (RESAMPLE_BITS - 8);
+				c[i].w[1] = f << (RESAMPLE_BITS - 8);
+			}
+		}
+		/* Give any rounding error to the heaviest tap */
+		sum = 0;
+		big = 0;
+		for( j = 0; j < n; j++ )
+		{
+			sum += c[i].w[j];
+			if( c[i].w[j] > c[i].w[big] )
+				big = j;
+		}
+		c[i].w[big] += RESAMPLE_ONE - sum;
+		c[i].n = n;
+		if( n > *maxn )
+			*maxn = n;
+	}
+
+	return c;
+}
+
+static inline uint8_t
+clamp_channel(int32_t v)
+{
+	v = (v + RESAMPLE_ROUND) >> RESAMPLE_BITS;
+	return (v > 255) ? 255 : ((v < 0) ? 0 : v);
+}
+
+static void
+hpass_scalar(const pix *src, pix *dst, int32_t width, const struct contrib *c)
+{
+	int32_t x, k, a0, a1, a2, a3;
+	pix p;
+
+	for( x = 0; x < width; x++, c++ )
+	{
+		a0 = a1 = a2 = a3 = 0;
+		for( k = 0; k < c->n; k++ )
+		{
+			p = src[c->start + k];
+			a0 += (int32_t)(p & 0xFF) * c->w[k];
+			a1 += (int32_t)((p >> 8) & 0xFF) * c->w[k];
+			a2 += (int32_t)((p >> 16) & 0xFF) * c->w[k];
+			a3 += (int32_t)(p >> 24) * c->w[k];
+		}
+		dst[x] = clamp_channel(a0) | (clamp_channel(a1) << 8) |
+		         (clamp_channel(a2) << 16) | ((pix)clamp_channel(a3) << 24);
+	}
+}
+
+static void
+vpass_scalar(const pix **rows, const int16_t *w, int32_t n, pix *dst, int32_t width)
+{
+	int32_t x, k, a0, a1, a2, a3;
+	pix p;
+
+	for( x = 0; x < width; x++ )
+	{
+		a0 = a1 = a2 = a3 = 0;
+		for( k = 0; k < n; k++ )
+		{
+			p = rows[k][x];
+			a0 += (int32_t)(p & 0xFF) * w[k];
+			a1 += (int32_t)((p >> 8) & 0xFF) * w[k];
+			a2 += (int32_t)((p >> 16) & 0xFF) * w[k];
+			a3 += (int32_t)(p >> 24) * w[k];
+		}
+		dst[x] = clamp_channel(a0) | (clamp_channel(a1) << 8) |
+		         (clamp_channel(a2) << 16) | ((pix)clamp_channel(a3) << 24);
+	}
+}
+
+#if defined(__SSE2__)
+/* Channels are widened to 32-bit lanes with a zero high half, so
+ * _mm_madd_epi16 against a broadcast weight yields channel * weight. */
+static void
+hpass_sse2(const pix *src, pix *dst, int32_t width, const struct contrib *c)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i acc, p;
+	int32_t x, k;
+
+	for( x = 0; x < width; x++, c++ )
+	{
+		acc = _mm_set1_epi32(RESAMPLE_ROUND);
+		for( k = 0; k < c->n; k++ )
+		{
+			p = _mm_cvtsi32_si128(src[c->start + k]);
+			p = _mm_unpacklo_epi16(_mm_unpacklo_epi8(p, zero), zero);
+			acc = _mm_add_epi32(acc, _mm_madd_epi16(p, _mm_set1_epi32(c->w[k])));
+		}
+		acc = _mm_srai_epi32(acc, RESAMPLE_BITS);
+		acc = _mm_packs_epi32(acc, acc);
+		dst[x] = _mm_cvtsi128_si32(_mm_packus_epi16(acc, acc));
+	}
+}
+
+static void
+vpass_sse2(const pix **rows, const int16_t *w, int32_t n, pix *dst, int32_t width)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i a0, a1, a2, a3, v, lo, hi, wv;
+	int32_t x, k;
+
+	for( x = 0; x + 4 <= width; x += 4 )
+	{
+		a0 = a1 = a2 = a3 = _mm_set1_epi32(RESAMPLE_ROUND);
+		for( k = 0; k < n; k++ )
+		{
+			v = _mm_loadu_si128((const __m128i *)(rows[k] + x));
+			wv = _mm_set1_epi32(w[k]);
+			lo = _mm_unpacklo_epi8(v, zero);
+			hi = _mm_unpackhi_epi8(v, zero);
+			a0 = _mm_add_epi32(a0, _mm_madd_epi16(_mm_unpacklo_epi16(lo, zero), wv));
+			a1 = _mm_add_epi32(a1, _mm_madd_epi16(_mm_unpackhi_epi16(lo, zero), wv));
+			a2 = _mm_add_epi32(a2, _mm_madd_epi16(_mm_unpacklo_epi16(hi, zero), wv));
+			a3 = _mm_add_epi32(a3, _mm_madd_epi16(_mm_unpackhi_epi16(hi, zero), wv));
+		}
+		lo = _mm_packs_epi32(_mm_srai_epi32(a0, RESAMPLE_BITS), _mm_srai_epi32(a1, RESAMPLE_BITS));
+		hi = _mm_packs_epi32(_mm_srai_epi32(a2, RESAMPLE_BITS), _mm_srai_epi32(a3, RESAMPLE_BITS));
+		_mm_storeu_si128((__m128i *)(dst + x), _mm_packus_epi16(lo, hi));
+	}
+	if( x < width )
+	{
+		const pix *tail[n];
+
+		for( k = 0; k < n; k++ )
+			tail[k] = rows[k] + x;
+		vpass_scalar(tail, w, n, dst + x, width - x);
+	}
+}
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && defined(__SSE2__)
+#define HAVE_RESAMPLE_AVX2 1
+/* Same as vpass_sse2, eight pixels at a time.  The 256-bit unpack and
+ * pack instructions work within 128-bit lanes, so they cancel out and
+ * pixel order is preserved. */
+__attribute__((target("avx2"))) static void
+vpass_avx2(const pix **rows, const int16_t *w, int32_t n, pix *dst, int32_t width)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i a0, a1, a2, a3, v, lo, hi, wv;
+	int32_t x, k;
+
+	for( x = 0; x + 8 <= width; x += 8 )
+	{
+		a0 = a1 = a2 = a3 = _mm256_set1_epi32(RESAMPLE_ROUND);
+		for( k = 0; k < n; k++ )
+		{
+			v = _mm256_loadu_si256((const __m256i *)(rows[k] + x));
+			wv = _mm256_set1_epi32(w[k]);
+			lo = _mm256_unpacklo_epi8(v, zero);
+			hi = _mm256_unpackhi_epi8(v, zero);
+			a0 = _mm256_add_epi32(a0, _mm256_madd_epi16(_mm256_unpacklo_epi16(lo, zero), wv));
+			a1 = _mm256_add_epi32(a1, _mm256_madd_epi16(_mm256_unpackhi_epi16(lo, zero), wv));
+			a2 = _mm256_add_epi32(a2, _mm256_madd_epi16(_mm256_unpacklo_epi16(hi, zero), wv));
+			a3 = _mm256_add_epi32(a3, _mm256_madd_epi16(_mm256_unpackhi_epi16(hi, zero), wv));
+		}
+		lo = _mm256_packs_epi32(_mm256_srai_epi32(a0, RESAMPLE_BITS), _mm256_srai_epi32(a1, RESAMPLE_BITS));
+		hi = _mm256_packs_epi32(_mm256_srai_epi32(a2, RESAMPLE_BITS), _mm256_srai_epi32(a3, RESAMPLE_BITS));
+		_mm256_storeu_si256((__m256i *)(dst + x), _mm256_packus_epi16(lo, hi));
+	}
+	if( x < width )
+	{
+		const pix *tail[n];
+
+		for( k = 0; k < n; k++ )
+			tail[k] = rows[k] + x;
+		vpass_sse2(tail, w, n, dst + x, width - x);
+	}
+}
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+static void
+hpass_neon(const pix *src, pix *dst, int32_t width, const struct contrib *c)
+{
+	uint32x4_t acc;
+	uint16x4_t ch;
+	uint8x8_t b;
+	int32_t x, k;
+
+	for( x = 0; x < width; x++, c++ )
+	{
+		acc = vdupq_n_u32(RESAMPLE_ROUND);
+		for( k = 0; k < c->n; k++ )
+		{
+			ch = vget_low_u16(vmovl_u8(vreinterpret_u8_u32(vdup_n_u32(src[c->start + k]))));
+			acc = vmlal_n_u16(acc, ch, c->w[k]);
+		}
+		ch = vshrn_n_u32(acc, RESAMPLE_BITS);
+		b = vqmovn_u16(vcombine_u16(ch, ch));
+		dst[x] = vget_lane_u32(vreinterpret_u32_u8(b), 0);
+	}
+}
+
+static void
+vpass_neon(const pix **rows, const int16_t *w, int32_t n, pix *dst, int32_t width)
+{
+	uint32x4_t a0, a1, a2, a3;
+	uint16x8_t lo, hi;
+	uint8x16_t v;
+	int32_t x, k;
+
+	for( x = 0; x + 4 <= width; x += 4 )
+	{
+		a0 = a1 = a2 = a3 = vdupq_n_u32(RESAMPLE_ROUND);
+		for( k = 0; k < n; k++ )
+		{
+			v = vld1q_u8((const uint8_t *)(rows[k] + x));
+			lo = vmovl_u8(vget_low_u8(v));
+			hi = vmovl_u8(vget_high_u8(v));
+			a0 = vmlal_n_u16(a0, vget_low_u16(lo), w[k]);
+			a1 = vmlal_n_u16(a1, vget_high_u16(lo), w[k]);
+			a2 = vmlal_n_u16(a2, vget_low_u16(hi), w[k]);
+			a3 = vmlal_n_u16(a3, vget_high_u16(hi), w[k]);
+		}
+		lo = vcombine_u16(vshrn_n_u32(a0, RESAMPLE_BITS), vshrn_n_u32(a1, RESAMPLE_BITS));
+		hi = vcombine_u16(vshrn_n_u32(a2, RESAMPLE_BITS), vshrn_n_u32(a3, RESAMPLE_BITS));
+		vst1q_u8((uint8_t *)(dst + x), vcombine_u8(vqmovn_u16(lo), vqmovn_u16(hi)));
+	}
+	if( x < width )
+	{
+		const pix *tail[n];
+
+		for( k = 0; k < n; k++ )
+			tail[k] = rows[k] + x;
+		vpass_scalar(tail, w, n, dst + x, width - x);
+	}
+}
+#endif
+
+static const struct resample_ops resample_impls[] = {
+#ifdef HAVE_RESAMPLE_AVX2
+	{ "avx2", hpass_sse2, vpass_avx2 },
+#endif
+#if defined(__SSE2__)
+	{ "sse2", hpass_sse2, vpass_sse2 },
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+	{ "neon", hpass_neon, vpass_neon },
+#endif
+	{ "scalar", hpass_scalar, vpass_scalar }
+};
+
+static const struct resample_ops *resample_ops = NULL;
+
+static int
+impl_supported(const struct resample_ops *ops)
+{
+#ifdef HAVE_RESAMPLE_AVX2
+	if( strcmp(ops->name, "avx2") == 0 )
+	{
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("avx2");
+	}
+#endif
+	return 1;
+}
+
+const char *
+image_resample_impl(void)
+{
+	int i;
+
+	if( !resample_ops )
+	{
+		/* Implementations are listed fastest first */
+		for( i = 0; !impl_supported(&resample_impls[i]); i++ )
+			;
+		resample_ops = &resample_impls[i];
+		DPRINTF(E_DEBUG, L_METADATA, "Using %s image resampler\n", resample_ops->name);
+	}
+
+	return resample_ops->name;
+}
+
+int
+image_resample_force(const char *name)
+{
+	int i;
+
+	for( i = 0; i < sizeof(resample_impls)/sizeof(resample_impls[0]); i++ )
+	{
+		if( strcmp(resample_impls[i].name, name) == 0 && impl_supported(&resample_impls[i]) )
+		{
+			resample_ops = &resample_impls[i];
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+int
+image_resample(image_s *pdest, image_s *psrc)
+{
+	struct contrib *cx, *cy;
+	const pix **rows;
+	pix *ring;
+	int32_t maxx, maxy, y, k, next = 0;
+
+	if( !pdest || !psrc || pdest->width <= 0 || pdest->height <= 0 ||
+	    psrc->width <= 0 || psrc->height <= 0 )
+		return -1;
+	image_resample_impl();
+
+	cx = make_contribs(psrc->width, pdest->width, &maxx);
+	cy = make_contribs(psrc->height, pdest->height, &maxy);
+	ring = malloc((size_t)maxy * pdest->width * sizeof(pix));
+	rows = malloc(maxy * sizeof(pix *));
+	if( !cx || !cy || !ring || !rows )
+	{
+		free(cx);
+		free(cy);
+		free(ring);
+		free(rows);
+		return -1;
+	}
+
+	/* Source row r is filtered horizontally into ring slot r % maxy.  Tap
+	 * starts only move forward, so rows fall out of the window in order. */
+	for( y = 0; y < pdest->height; y++ )
+	{
+		for( ; next < cy[y].start + cy[y].n; next++ )
+			resample_ops->hpass(psrc->buf + (size_t)next * psrc->width,
+			                    ring + (size_t)(next % maxy) * pdest->width,
+			                    pdest->width, cx);
+		for( k = 0; k < cy[y].n; k++ )
+			rows[k] = ring + (size_t)((cy[y].start + k) % maxy) * pdest->width;
+		resample_ops->vpass(rows, cy[y].w, cy[y].n,
+		                    pdest->buf + (size_t)y * pdest->width, pdest->width);
+	}
+
+	free(cx);
+	free(cy);
+	free(ring);
+	free(rows);
+
+	return 0;
+}
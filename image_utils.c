@@ -788,6 +788,8 @@ image_resize(image_s * src_image, int32_t width, int32_t height)
 	dst_image = image_new(width, height);
 	if( !dst_image )
 		return NULL;
+	if( image_resample(dst_image, src_image) == 0 )
+		return dst_image;
 	if( (src_image->width < width) || (src_image->height < height) )
 		image_upsize(dst_image, src_image, width, height);
 	else
@@ -797,6 +799,257 @@ image_resize(image_s * src_image, int32_t width, int32_t height)
 }
 
 
+/* Destination manager to hand compressed data to a writer as it's produced */
+#define STREAM_BUF_SIZE 16384
+
+struct stream_dst_mgr {
+	struct jpeg_destination_mgr jdst;
+	image_writer writer;
+	void *arg;
+	int error;
+	JOCTET buf[STREAM_BUF_SIZE];
+};
+
+static void
+stream_dst_init(j_compress_ptr cinfo)
+{
+	struct stream_dst_mgr *dst = (void *)cinfo->dest;
+
+	dst->jdst.next_output_byte = dst->buf;
+	dst->jdst.free_in_buffer = STREAM_BUF_SIZE;
+}
+
+static boolean
+stream_dst_empty(j_compress_ptr cinfo)
+{
+	struct stream_dst_mgr *dst = (void *)cinfo->dest;
+
+	/* Once the writer fails, throw the rest away until the caller notices */
+	if( !dst->error && dst->writer(dst->arg, dst->buf, STREAM_BUF_SIZE) != 0 )
+		dst->error = 1;
+	dst->jdst.next_output_byte = dst->buf;
+	dst->jdst.free_in_buffer = STREAM_BUF_SIZE;
+
+	return TRUE;
+}
+
+static void
+stream_dst_term(j_compress_ptr cinfo)
+{
+	struct stream_dst_mgr *dst = (void *)cinfo->dest;
+	int len = STREAM_BUF_SIZE - dst->jdst.free_in_buffer;
+
+	if( len && !dst->error && dst->writer(dst->arg, dst->buf, len) != 0 )
+		dst->error = 1;
+}
+
+/* Scale one decoded scanline horizontally into 8.8 fixed-point RGB values,
+ * averaging the covered source pixels when shrinking and interpolating
+ * linearly when growing. */
+static void
+resample_row(const unsigned char *in, int ncomp, int srcw, uint32_t *out, int dstw)
+{
+	int x, sx, x0, x1, c, n;
+	uint32_t sum[3];
+
+	for( x = 0; x < dstw; x++ )
+	{
+		if( srcw >= dstw )
+		{
+			x0 = (int64_t)x * srcw / dstw;
+			x1 = (int64_t)(x + 1) * srcw / dstw;
+			sum[0] = sum[1] = sum[2] = 0;
+			for( sx = x0; sx < x1; sx++ )
+				for( c = 0; c < 3; c++ )
+					sum[c] += in[sx * ncomp + (ncomp == 1 ? 0 : c)];
+			n = x1 - x0;
+			for( c = 0; c < 3; c++ )
+				out[x * 3 + c] = (sum[c] << 8) / n;
+		}
+		else
+		{
+			uint32_t fx = (dstw > 1) ? (int64_t)x * (srcw - 1) * 256 / (dstw - 1) : 0;
+			uint32_t f = fx & 0xFF;
+			x0 = fx >> 8;
+			x1 = (x0 + 1 < srcw) ? x0 + 1 : x0;
+			for( c = 0; c < 3; c++ )
+			{
+				int cc = (ncomp == 1) ? 0 : c;
+				out[x * 3 + c] = in[x0 * ncomp + cc] * (256 - f) + in[x1 * ncomp + cc] * f;
+			}
+		}
+	}
+}
+
+static inline JSAMPLE
+fixed_to_sample(uint32_t v)
+{
+	v = (v + 128) >> 8;
+	return (v > 255) ? 255 : v;
+}
+
+/* Decode, resize and re-encode a JPEG file one scanline at a time.  Only a
+ * couple of rows are kept in memory, so peak usage depends on the image
+ * width rather than its area.  Compressed output is passed to writer in
+ * small blocks as soon as libjpeg produces it.  Rotation isn't supported,
+ * since it needs the whole image; use image_new_from_jpeg() for that.
+ * Stops as soon as the writer returns an error.
+ * Returns 0 on success, -1 if decoding failed or the writer returned an error. */
+int
+image_resize_jpeg_stream(const char *path, int scale, int32_t width, int32_t height,
+                         image_writer writer, void *arg)
+{
+	struct jpeg_decompress_struct dinfo;
+	struct jpeg_compress_struct cinfo;
+	struct jpeg_error_mgr derr, cerr;
+	struct stream_dst_mgr * volatile dst = NULL;
+	FILE *file;
+	JSAMPROW row[1];
+	unsigned char * volatile in = NULL;
+	JSAMPLE * volatile out = NULL;
+	uint32_t * volatile rows = NULL;
+	uint32_t *prev, *cur, *acc, *tmp;
+	int srcw, srch, ncomp, y, oy, next_oy, count, x, ret;
+
+	if( width <= 0 || height <= 0 )
+		return -1;
+	if( (file = fopen(path, "r")) == NULL )
+		return -1;
+
+	dinfo.err = jpeg_std_error(&derr);
+	derr.error_exit = libjpeg_error_handler;
+	cinfo.err = jpeg_std_error(&cerr);
+	cerr.error_exit = libjpeg_error_handler;
+	jpeg_create_decompress(&dinfo);
+	jpeg_create_compress(&cinfo);
+	if( setjmp(setjmp_buffer) )
+	{
+		ret = -1;
+		goto done;
+	}
+	jpeg_stdio_src(&dinfo, file);
+	jpeg_read_header(&dinfo, TRUE);
+	dinfo.scale_denom = scale;
+	dinfo.do_fancy_upsampling = FALSE;
+	dinfo.do_block_smoothing = FALSE;
+	dinfo.dct_method = JDCT_IFAST;
+	jpeg_start_decompress(&dinfo);
+	srcw = dinfo.output_width;
+	srch = dinfo.output_height;
+	ncomp = dinfo.output_components;
+	if( ncomp != 1 && ncomp != 3 )
+	{
+		DPRINTF(E_WARN, L_METADATA, "Unsupported JPEG color components (%d) in %s\n", ncomp, path);
+		ret = -1;
+		goto done;
+	}
+
+	/* prev/cur hold horizontally scaled source rows, acc sums them when shrinking */
+	in = malloc(srcw * ncomp);
+	out = malloc(width * 3);
+	rows = calloc(width * 3 * 3, sizeof(uint32_t));
+	dst = malloc(sizeof(struct stream_dst_mgr));
+	if( !in || !out || !rows || !dst )
+	{
+		DPRINTF(E_WARN, L_METADATA, "malloc failed\n");
+		ret = -1;
+		goto done;
+	}
+	prev = rows;
+	cur = rows + width * 3;
+	acc = rows + width * 6;
+
+	dst->jdst.init_destination = stream_dst_init;
+	dst->jdst.empty_output_buffer = stream_dst_empty;
+	dst->jdst.term_destination = stream_dst_term;
+	dst->writer = writer;
+	dst->arg = arg;
+	dst->error = 0;
+	cinfo.dest = (void *)dst;
+	cinfo.image_width = width;
+	cinfo.image_height = height;
+	cinfo.input_components = 3;
+	cinfo.in_color_space = JCS_RGB;
+	jpeg_set_defaults(&cinfo);
+	jpeg_set_quality(&cinfo, JPEG_QUALITY, TRUE);
+	jpeg_start_compress(&cinfo, TRUE);
+
+	count = 0;
+	next_oy = 0;
+	for( y = 0; y < srch; y++ )
+	{
+		/* No point compressing the rest into a dead sink */
+		if( dst->error )
+		{
+			ret = -1;
+			goto done;
+		}
+		row[0] = in;
+		jpeg_read_scanlines(&dinfo, row, 1);
+		resample_row(in, ncomp, srcw, cur, width);
+
+		if( srch >= height )
+		{
+			/* Shrinking: average every source row that maps to this output row */
+			for( x = 0; x < width * 3; x++ )
+				acc[x] += cur[x];
+			count++;
+			oy = (int64_t)(y + 1) * height / srch;
+			if( oy == next_oy && y != srch - 1 )
+				continue;
+			for( x = 0; x < width * 3; x++ )
+			{
+				out[x] = fixed_to_sample(acc[x] / count);
+				acc[x] = 0;
+			}
+			count = 0;
+			next_oy++;
+			row[0] = out;
+			jpeg_write_scanlines(&cinfo, row, 1);
+		}
+		else
+		{
+			/* Growing: interpolate between the previous and current rows */
+			while( next_oy < height )
+			{
+				uint32_t fy = (height > 1) ? (int64_t)next_oy * (srch - 1) * 256 / (height - 1) : 0;
+				uint32_t f = fy & 0xFF;
+				int y0 = fy >> 8;
+
+				if( y0 + 1 > y && y < srch - 1 )
+					break;
+				for( x = 0; x < width * 3; x++ )
+				{
+					if( y0 == y )
+						out[x] = fixed_to_sample(cur[x]);
+					else
+						out[x] = fixed_to_sample((prev[x] * (256 - f) + cur[x] * f) >> 8);
+				}
+				row[0] = out;
+				jpeg_write_scanlines(&cinfo, row, 1);
+				next_oy++;
+			}
+			tmp = prev;
+			prev = cur;
+			cur = tmp;
+		}
+	}
+	jpeg_finish_decompress(&dinfo);
+	jpeg_finish_compress(&cinfo);
+	ret = dst->error ? -1 : 0;
+done:
+	jpeg_destroy_compress(&cinfo);
+	jpeg_destroy_decompress(&dinfo);
+	fclose(file);
+	free(in);
+	free(out);
+	free(rows);
+	free(dst);
+
+	return ret;
+}
+
+
 unsigned char *
 image_save_to_jpeg_buf(image_s * pimage, int * size)
 {
@@ -30,6 +30,9 @@
 
 typedef uint32_t pix;
 
+/* Receives compressed output; returns 0 on success */
+typedef int (*image_writer)(void *arg, const unsigned char *buf, int len);
+
 typedef struct {
 	int32_t width;
 	int32_t height;
@@ -51,6 +54,25 @@ image_new_from_jpeg(const char *path, int is_file, const uint8_t *ptr, int size,
 image_s *
 image_resize(image_s * src_image, int32_t width, int32_t height);
 
+void
+image_upsize(image_s * pdest, image_s * psrc, int32_t width, int32_t height);
+
+void
+image_downsize(image_s * pdest, image_s * psrc, int32_t width, int32_t height);
+
+int
+image_resample(image_s *pdest, image_s *psrc);
+
+const char *
+image_resample_impl(void);
+
+int
+image_resample_force(const char *name);
+
+int
+image_resize_jpeg_stream(const char *path, int scale, int32_t width, int32_t height,
+                         image_writer writer, void *arg);
+
 unsigned char *
 image_save_to_jpeg_buf(image_s * pimage, int * size);
 
@@ -31,12 +31,24 @@
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <poll.h>
+#include <pthread.h>
+#include <ctype.h>
+#include <mntent.h>
+#include <sys/ioctl.h>
 #ifdef HAVE_SYS_INOTIFY_H
 #include <sys/inotify.h>
 #else
 #include "linux/inotify.h"
 #include "linux/inotify-syscalls.h"
 #endif
+#if defined(HAVE_SYS_FANOTIFY_H) && defined(HAVE_FANOTIFY_INIT) && defined(HAVE_OPEN_BY_HANDLE_AT)
+#include <fcntl.h>
+#include <sys/statfs.h>
+#include <sys/fanotify.h>
+#ifdef FAN_REPORT_DFID_NAME
+#define HAVE_FANOTIFY 1
+#endif
+#endif
 #include "libav.h"
 
 #include "upnpglobalvars.h"
@@ -47,6 +59,8 @@
 #include "metadata.h"
 #include "albumart.h"
 #include "playlist.h"
+#include "blockcache.h"
+#include "metrics.h"
 #include "log.h"
 
 #define EVENT_SIZE  ( sizeof (struct inotify_event) )
@@ -278,6 +292,249 @@ int add_dir_watch(int fd, char * path, char * filename)
 	return(i);
 }
 
+/* inotify and fanotify only see changes made through this host, so the
+ * directories of media dirs on network filesystems are polled as well.  Their
+ * stamps, loaded from the ones the scanner saved, are compared with stat(),
+ * and only a directory whose stamp changed is listed and compared with the
+ * database.  A directory that changed is polled again after POLL_MIN seconds,
+ * and its interval doubles each time it is found unchanged, up to
+ * poll_interval.  Directories are polled in path order, POLL_BUDGET stat()
+ * calls a second at most.  Like with a rescan, a file rewritten in place is
+ * only noticed once something else in its directory changed. */
+#define POLL_MIN	5
+#define POLL_BUDGET	256
+
+struct poll_root
+{
+	char *path;
+	dev_t dev;		/* of the network filesystem */
+};
+
+struct poll_dir
+{
+	char *path;
+	time_t mtime;		/* stamp of its last listing, -1 if unknown */
+	ino_t ino;
+	int root;
+	int interval;
+	time_t next;
+};
+
+static const char * const poll_fstypes[] = { "nfs", "nfs4", "cifs", "smb3", "smbfs", "ceph", NULL };
+static struct poll_root *poll_roots;
+static int poll_nroots;
+static struct poll_dir *poll_dirs;	/* sorted by path */
+static int poll_ndirs, poll_size, poll_cursor;
+static time_t poll_last;
+
+/* returns: the index of path in poll_dirs, or the one it would get */
+static int
+poll_find(const char *path)
+{
+	int lo = 0, hi = poll_ndirs, mid;
+
+	while( lo < hi )
+	{
+		mid = (lo + hi) / 2;
+		if( strcmp(poll_dirs[mid].path, path) < 0 )
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static int
+is_below(const char *path, const char *dir)
+{
+	size_t len = strlen(dir);
+
+	return strncmp(path, dir, len) == 0 && (path[len] == '\0' || path[len] == '/');
+}
+
+/* start polling path if it is on a network filesystem */
+static void
+poll_add(const char *path, time_t mtime, ino_t ino, int interval, time_t next)
+{
+	struct poll_dir *p;
+	size_t best = 0;
+	int i, root = -1;
+
+	for( i = 0; i < poll_nroots; i++ )
+	{
+		if( strlen(poll_roots[i].path) >= best && is_below(path, poll_roots[i].path) )
+		{
+			root = i;
+			best = strlen(poll_roots[i].path);
+		}
+	}
+	if( root < 0 )
+		return;
+	i = poll_find(path);
+	if( i < poll_ndirs && strcmp(poll_dirs[i].path, path) == 0 )
+		return;
+	if( poll_ndirs == poll_size )
+	{
+		p = realloc(poll_dirs, (poll_size ? poll_size * 2 : 256) * sizeof(*p));
+		if( !p )
+		{
+			DPRINTF(E_ERROR, L_INOTIFY, "Out of memory polling %s\n", path);
+			return;
+		}
+		poll_dirs = p;
+		poll_size = poll_size ? poll_size * 2 : 256;
+	}
+	memmove(&poll_dirs[i + 1], &poll_dirs[i], (poll_ndirs - i) * sizeof(*p));
+	p = &poll_dirs[i];
+	p->path = strdup(path);
+	if( !p->path )
+	{
+		memmove(&poll_dirs[i], &poll_dirs[i + 1], (poll_ndirs - i) * sizeof(*p));
+		return;
+	}
+	p->mtime = mtime;
+	p->ino = ino;
+	p->root = root;
+	p->interval = interval;
+	p->next = next;
+	poll_ndirs++;
+	if( i < poll_cursor )
+		poll_cursor++;
+}
+
+/* stop polling path and everything below it */
+static void
+poll_remove_tree(const char *path)
+{
+	int i, n = 0, cursor = poll_cursor;
+
+	for( i = 0; i < poll_ndirs; i++ )
+	{
+		if( is_below(poll_dirs[i].path, path) )
+		{
+			free(poll_dirs[i].path);
+			if( i < poll_cursor )
+				cursor--;
+			continue;
+		}
+		poll_dirs[n++] = poll_dirs[i];
+	}
+	poll_ndirs = n;
+	poll_cursor = cursor;
+}
+
+static void
+poll_add_root(char *path)
+{
+	struct poll_root *r;
+	struct stat st;
+	int i;
+
+	for( i = 0; i < poll_nroots; i++ )
+	{
+		if( strcmp(poll_roots[i].path, path) == 0 )
+		{
+			free(path);
+			return;
+		}
+	}
+	r = realloc(poll_roots, (poll_nroots + 1) * sizeof(*r));
+	if( !r || stat(path, &st) != 0 )
+	{
+		DPRINTF(E_WARN, L_INOTIFY, "Unable to poll %s for changes\n", path);
+		if( r )
+			poll_roots = r;
+		free(path);
+		return;
+	}
+	poll_roots = r;
+	poll_roots[poll_nroots].path = path;
+	poll_roots[poll_nroots].dev = st.st_dev;
+	poll_nroots++;
+}
+
+/* find the media dirs on network filesystems, or the network filesystems
+ * mounted inside media dirs, and load the stamps of their directories */
+static void
+poll_init(void)
+{
+	struct media_dir_s *media_path;
+	struct mntent *mnt;
+	FILE *mounts;
+	char real[PATH_MAX];
+	char *sql, *root, **result;
+	time_t now = time(NULL);
+	size_t len;
+	int i, j, rows;
+
+	if( runtime_vars.poll_interval <= 0 )
+		return;
+	mounts = setmntent("/proc/self/mounts", "r");
+	if( !mounts )
+	{
+		DPRINTF(E_WARN, L_INOTIFY, "Unable to read the mounted filesystems [%s]\n", strerror(errno));
+		return;
+	}
+	while( (mnt = getmntent(mounts)) )
+	{
+		for( i = 0; poll_fstypes[i] && strcmp(mnt->mnt_type, poll_fstypes[i]) != 0; i++ )
+			;
+		if( !poll_fstypes[i] )
+			continue;
+		for( media_path = media_dirs; media_path; media_path = media_path->next )
+		{
+			if( !realpath(media_path->path, real) )
+				continue;
+			len = strlen(real);
+			if( strcmp(mnt->mnt_dir, "/") == 0 || is_below(real, mnt->mnt_dir) )
+				root = strdup(media_path->path);
+			else if( strncmp(mnt->mnt_dir, real, len) == 0 && mnt->mnt_dir[len] == '/' )
+				xasprintf(&root, "%s%s", media_path->path, mnt->mnt_dir + len);
+			else
+				continue;
+			if( root )
+				poll_add_root(root);
+		}
+	}
+	endmntent(mounts);
+
+	for( i = 0; i < poll_nroots; i++ )
+	{
+		root = poll_roots[i].path;
+		sql = sqlite3_mprintf("SELECT d.PATH, s.MTIME, s.INODE from DETAILS d"
+		                      " left join DIRECTORIES s on (s.PATH = d.PATH)"
+		                      " where d.MIME is NULL and (d.PATH = '%q' or (d.PATH > '%q/' and d.PATH < '%q0'))"
+		                      " order by d.PATH", root, root, root);
+		if( sql_get_table(db, sql, &result, &rows, NULL) == SQLITE_OK )
+		{
+			/* spread the first round over the interval */
+			for( j = 1; j <= rows; j++ )
+				poll_add(result[3*j], result[3*j+1] ? strtoll(result[3*j+1], NULL, 10) : -1,
+				         result[3*j+2] ? strtoll(result[3*j+2], NULL, 10) : 0,
+				         runtime_vars.poll_interval, now + j % runtime_vars.poll_interval);
+			sqlite3_free_table(result);
+		}
+		sqlite3_free(sql);
+		DPRINTF(E_INFO, L_INOTIFY, "Polling %s for changes, it is on a network filesystem\n", root);
+	}
+}
+
+static void
+poll_free(void)
+{
+	int i;
+
+	for( i = 0; i < poll_ndirs; i++ )
+		free(poll_dirs[i].path);
+	for( i = 0; i < poll_nroots; i++ )
+		free(poll_roots[i].path);
+	free(poll_dirs);
+	free(poll_roots);
+	poll_dirs = NULL;
+	poll_roots = NULL;
+	poll_ndirs = poll_size = poll_nroots = 0;
+}
+
 int
 inotify_insert_file(char * name, const char * path)
 {
@@ -362,14 +619,14 @@ inotify_insert_file(char * name, const char * path)
 	if( !ts && is_playlist(path) && (sql_get_int_field(db, "SELECT ID from PLAYLISTS where PATH = '%q'", path) > 0) )
 	{
 		DPRINTF(E_DEBUG, L_INOTIFY, "Re-reading modified playlist (%s).\n", path);
-		inotify_remove_file(path);
+		remove_file(path);
 		next_pl_fill = 1;
 	}
 	else if( ts < st.st_mtime )
 	{
 		if( ts > 0 )
 			DPRINTF(E_DEBUG, L_INOTIFY, "%s is newer than the last db entry.\n", path);
-		inotify_remove_file(path);
+		remove_file(path);
 	}
 
 	/* Find the parentID.  If it's not found, create all necessary parents. */
@@ -425,6 +682,8 @@ inotify_insert_file(char * name, const char * path)
 		//DEBUG DPRINTF(E_DEBUG, L_INOTIFY, "Inserting %s\n", name);
 		insert_file(name, path, id+2, get_next_available_id("OBJECTS", id), types);
 		sqlite3_free(id);
+		if( GETFLAG(PROBE_PREFILL_MASK) && (is_video(path) || is_audio(path)) )
+			blockcache_prefill(sql_get_int64_field(db, "SELECT ID from DETAILS where PATH = '%q'", path), path);
 		if( (is_audio(path) || is_playlist(path)) && next_pl_fill != 1 )
 		{
 			next_pl_fill = time(NULL) + 120; // Schedule a playlist scan for 2 minutes from now.
@@ -466,15 +725,21 @@ inotify_insert_directory(int fd, char *name, const char * path)
 	insert_directory(name, path, BROWSEDIR_ID, id+2, get_next_available_id("OBJECTS", id));
 	sqlite3_free(id);
 	free(parent_buf);
+	/* files in it may still be being written, so it is listed again soon */
+	poll_add(path, -1, 0, POLL_MIN, time(NULL) + POLL_MIN);
 
-	wd = add_watch(fd, path);
-	if( wd == -1 )
-	{
-		DPRINTF(E_ERROR, L_INOTIFY, "add_watch() failed\n");
-	}
-	else
+	/* fanotify watches whole filesystems, and passes no fd */
+	if( fd >= 0 )
 	{
-		DPRINTF(E_INFO, L_INOTIFY, "Added watch to %s [%d]\n", path, wd);
+		wd = add_watch(fd, path);
+		if( wd == -1 )
+		{
+			DPRINTF(E_ERROR, L_INOTIFY, "add_watch() failed\n");
+		}
+		else
+		{
+			DPRINTF(E_INFO, L_INOTIFY, "Added watch to %s [%d]\n", path, wd);
+		}
 	}
 
 	media_path = media_dirs;
@@ -529,127 +794,827 @@ inotify_insert_directory(int fd, char *name, const char * path)
 }
 
 int
-inotify_remove_file(const char * path)
+inotify_remove_directory(int fd, const char * path)
 {
-	char sql[128];
-	char art_cache[PATH_MAX];
-	char *id;
-	char *ptr;
-	char **result;
-	int64_t detailID;
-	int rows, playlist;
+	if( fd >= 0 )
+		remove_watch(fd, path);
+	poll_remove_tree(path);
+
+	return remove_directory(path);
+}
+
+struct sync_stats
+{
+	int dirs;
+	int added;
+	int updated;
+	int removed;
+};
+
+/* bring the entries of dir in the database in line with what it holds now;
+ * files modified at settle or later are left alone unless settle is 0
+ * returns: the number of entries looked at; settled is cleared if dir has
+ *          to be listed again, because it could not be read or a file in it
+ *          was left alone */
+static int
+sync_dir(int fd, const char *dir, time_t settle, int *settled, struct sync_stats *stats)
+{
+	DIR *ds;
+	struct dirent *e;
+	struct stat st;
+	char path_buf[PATH_MAX];
+	char *sql, *esc_name, **result;
+	int64_t ts;
+	int i, rows, n = 0;
 
-	if( is_caption(path) )
+	*settled = 0;
+	ds = opendir(dir);
+	if( !ds )
 	{
-		return sql_exec(db, "DELETE from CAPTIONS where PATH = '%q'", path);
+		DPRINTF(E_WARN, L_INOTIFY, "Unable to read %s [%s]\n", dir, strerror(errno));
+		return 0;
 	}
-	/* Invalidate the scanner cache so we don't insert files into non-existent containers */
-	valid_cache = 0;
-	playlist = is_playlist(path);
-	id = sql_get_text_field(db, "SELECT ID from %s where PATH = '%q'", playlist?"PLAYLISTS":"DETAILS", path);
-	if( !id )
-		return 1;
-	detailID = strtoll(id, NULL, 10);
-	sqlite3_free(id);
-	if( playlist )
+	stats->dirs++;
+
+	/* drop what is gone; other errors may be the network's */
+	sql = sqlite3_mprintf("SELECT PATH, MIME from DETAILS where PATH > '%q/' and PATH < '%q0'"
+	                      " and instr(substr(PATH, %d), '/') = 0", dir, dir, (int)strlen(dir) + 2);
+	if( sql_get_table(db, sql, &result, &rows, NULL) == SQLITE_OK )
 	{
-		sql_exec(db, "DELETE from PLAYLISTS where ID = %lld", detailID);
-		sql_exec(db, "DELETE from DETAILS where ID ="
-		             " (SELECT DETAIL_ID from OBJECTS where OBJECT_ID = '%s$%llX')",
-		         MUSIC_PLIST_ID, detailID);
-		sql_exec(db, "DELETE from OBJECTS where OBJECT_ID = '%s$%llX' or PARENT_ID = '%s$%llX'",
-		         MUSIC_PLIST_ID, detailID, MUSIC_PLIST_ID, detailID);
+		for( i = 1; i <= rows; i++ )
+		{
+			if( access(result[2*i], F_OK) == 0 || errno != ENOENT )
+				continue;
+			DPRINTF(E_DEBUG, L_INOTIFY, "The %s %s was deleted.\n",
+				(result[2*i+1] ? "file" : "directory"), result[2*i]);
+			if( result[2*i+1] ? remove_file(result[2*i]) : inotify_remove_directory(fd, result[2*i]) )
+				continue;
+			stats->removed++;
+		}
+		sqlite3_free_table(result);
 	}
-	else
+	sqlite3_free(sql);
+	sql = sqlite3_mprintf("SELECT PATH from PLAYLISTS where PATH > '%q/' and PATH < '%q0'"
+	                      " and instr(substr(PATH, %d), '/') = 0", dir, dir, (int)strlen(dir) + 2);
+	if( sql_get_table(db, sql, &result, &rows, NULL) == SQLITE_OK )
 	{
-		/* Delete the parent containers if we are about to empty them. */
-		snprintf(sql, sizeof(sql), "SELECT PARENT_ID from OBJECTS where DETAIL_ID = %lld"
-		                           " and PARENT_ID not like '64$%%'",
-		                           (long long int)detailID);
-		if( (sql_get_table(db, sql, &result, &rows, NULL) == SQLITE_OK) )
+		for( i = 1; i <= rows; i++ )
+		{
+			if( access(result[i], F_OK) != 0 && errno == ENOENT && remove_file(result[i]) == 0 )
+				stats->removed++;
+		}
+		sqlite3_free_table(result);
+	}
+	sqlite3_free(sql);
+
+	/* add what is new or newer */
+	*settled = 1;
+	while( (e = readdir(ds)) )
+	{
+		if( e->d_name[0] == '.' )
+			continue;
+		n++;
+		snprintf(path_buf, sizeof(path_buf), "%s/%s", dir, e->d_name);
+		if( stat(path_buf, &st) != 0 )
+			continue;
+		if( S_ISDIR(st.st_mode) )
+		{
+			if( sql_get_int_field(db, "SELECT ID from DETAILS where PATH = '%q'", path_buf) > 0 )
+				continue;
+			DPRINTF(E_DEBUG, L_INOTIFY, "The directory %s was created.\n", path_buf);
+			esc_name = escape_tag(e->d_name, 1);
+			if( inotify_insert_directory(fd, esc_name, path_buf) == 0 )
+				stats->added++;
+			free(esc_name);
+		}
+		else if( S_ISREG(st.st_mode) && st.st_size > 0 )
 		{
-			int i, children;
-			for( i = 1; i <= rows; i++ )
+			if( settle && st.st_mtime >= settle )
 			{
-				/* If it's a playlist item, adjust the item count of the playlist */
-				if( strncmp(result[i], MUSIC_PLIST_ID, strlen(MUSIC_PLIST_ID)) == 0 )
-				{
-					sql_exec(db, "UPDATE PLAYLISTS set FOUND = (FOUND-1) where ID = %d",
-					         atoi(strrchr(result[i], '$') + 1));
-				}
+				*settled = 0;
+				continue;
+			}
+			ts = sql_get_int64_field(db, "SELECT TIMESTAMP from DETAILS where PATH = '%q'", path_buf);
+			/* playlists are only read once */
+			if( ts <= 0 && is_playlist(path_buf) &&
+			    sql_get_int_field(db, "SELECT ID from PLAYLISTS where PATH = '%q'", path_buf) > 0 )
+				continue;
+			if( ts >= st.st_mtime )
+				continue;
+			DPRINTF(E_DEBUG, L_INOTIFY, "The file %s was %s.\n", path_buf, (ts > 0 ? "changed" : "created"));
+			esc_name = escape_tag(e->d_name, 1);
+			if( inotify_insert_file(esc_name, path_buf) == 0 )
+			{
+				if( ts > 0 )
+					stats->updated++;
+				else
+					stats->added++;
+			}
+			free(esc_name);
+		}
+	}
+	closedir(ds);
 
-				children = sql_get_int_field(db, "SELECT count(*) from OBJECTS where PARENT_ID = '%s'", result[i]);
-				if( children < 0 )
-					continue;
-				if( children < 2 )
-				{
-					sql_exec(db, "DELETE from OBJECTS where OBJECT_ID = '%s'", result[i]);
-
-					ptr = strrchr(result[i], '$');
-					if( ptr )
-						*ptr = '\0';
-					if( sql_get_int_field(db, "SELECT count(*) from OBJECTS where PARENT_ID = '%s'", result[i]) == 0 )
-					{
-						sql_exec(db, "DELETE from OBJECTS where OBJECT_ID = '%s'", result[i]);
-					}
-				}
+	return n;
+}
+
+static void
+poll_backoff(struct poll_dir *p, time_t now)
+{
+	p->interval *= 2;
+	if( p->interval > runtime_vars.poll_interval )
+		p->interval = runtime_vars.poll_interval;
+	p->next = now + p->interval;
+}
+
+/* poll the directories that are due, at most once a second */
+static void
+poll_network_dirs(int fd)
+{
+	struct poll_dir *p;
+	struct stat st;
+	struct sync_stats stats;
+	time_t now = time(NULL);
+	char *dir;
+	int i, n, entries, settled;
+	int budget = POLL_BUDGET;
+
+	if( !poll_ndirs || now == poll_last )
+		return;
+	poll_last = now;
+	for( n = poll_ndirs; n > 0 && budget > 0 && !quitting; n-- )
+	{
+		if( poll_cursor >= poll_ndirs )
+			poll_cursor = 0;
+		p = &poll_dirs[poll_cursor++];
+		if( p->next > now )
+			continue;
+		budget--;
+		/* if it is gone the listing of its parent notices; if it is on
+		 * another device the network filesystem is not mounted */
+		if( stat(p->path, &st) != 0 || st.st_dev != poll_roots[p->root].dev ||
+		    (st.st_mtime == p->mtime && st.st_ino == p->ino) )
+		{
+			poll_backoff(p, now);
+			continue;
+		}
+		dir = strdup(p->path);
+		if( !dir )
+			break;
+		DPRINTF(E_DEBUG, L_INOTIFY, "The directory %s changed.\n", dir);
+		memset(&stats, 0, sizeof(stats));
+		entries = sync_dir(fd, dir, now - POLL_MIN, &settled, &stats);
+		budget -= entries;
+		/* the listing may have added or removed directories */
+		i = poll_find(dir);
+		if( i < poll_ndirs && strcmp(poll_dirs[i].path, dir) == 0 )
+		{
+			p = &poll_dirs[i++];
+			if( settled )
+			{
+				save_dir_stamp(dir, &st, entries);
+				p->mtime = st.st_mtime < now ? st.st_mtime : -1;
+				p->ino = st.st_ino;
 			}
-			sqlite3_free_table(result);
+			p->interval = POLL_MIN < runtime_vars.poll_interval ? POLL_MIN : runtime_vars.poll_interval;
+			p->next = now + p->interval;
 		}
-		/* Now delete the actual objects */
-		sql_exec(db, "DELETE from DETAILS where ID = %lld", detailID);
-		sql_exec(db, "DELETE from OBJECTS where DETAIL_ID = %lld", detailID);
+		poll_cursor = i;
+		free(dir);
 	}
-	snprintf(art_cache, sizeof(art_cache), "%s/art_cache%s", db_path, path);
-	remove(art_cache);
+}
+
+/* Rescans asked for through the HTTP control interface are queued by the main
+ * thread and run by this one, through the same code paths as events.  Named
+ * files are read again; named directories are compared with the database
+ * like polled ones, all the way down.  The last RESCAN_JOBS jobs are kept for
+ * their progress to be looked up. */
+#define RESCAN_JOBS	32
+
+enum rescan_state {
+	RESCAN_QUEUED,
+	RESCAN_RUNNING,
+	RESCAN_DONE
+};
 
+static const char * const rescan_states[] = { "queued", "running", "done" };
+
+struct rescan_job
+{
+	int id;			/* 0 if unused */
+	enum rescan_state state;
+	char **paths;
+	int npaths;
+	int done;		/* paths rescanned so far */
+	struct sync_stats stats;
+	time_t queued;
+	time_t finished;
+};
+
+static struct rescan_job rescan_jobs[RESCAN_JOBS];
+static int rescan_last, rescan_next = 1;
+static pthread_mutex_t rescan_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* only absolute paths below a media dir, without . or .. components */
+static int
+rescan_allowed(const char *path)
+{
+	struct media_dir_s *media_path;
+	const char *p;
+
+	if( path[0] != '/' || strstr(path, "//") )
+		return 0;
+	/* no . or .. components, but hidden files are fine */
+	for( p = path; (p = strstr(p, "/.")); p++ )
+	{
+		if( p[2] == '.' )
+			p++;
+		if( p[2] == '/' || p[2] == '\0' )
+			return 0;
+	}
+	for( media_path = media_dirs; media_path; media_path = media_path->next )
+	{
+		if( is_below(path, media_path->path) )
+			return 1;
+	}
 	return 0;
 }
 
 int
-inotify_remove_directory(int fd, const char * path)
+inotify_rescan(const char *paths, int len)
 {
-	char * sql;
-	char **result;
-	int64_t detailID = 0;
-	int rows, i, ret = 1;
+	struct rescan_job *job;
+	const char *p, *eol, *end = paths + len;
+	char **list = NULL, **tmp, *path;
+	int i, n = 0, id = 0;
 
-	/* Invalidate the scanner cache so we don't insert files into non-existent containers */
-	valid_cache = 0;
-	remove_watch(fd, path);
-	sql = sqlite3_mprintf("SELECT ID from DETAILS where (PATH > '%q/' and PATH <= '%q/%c')"
-	                      " or PATH = '%q'", path, path, 0xFF, path);
-	if( (sql_get_table(db, sql, &result, &rows, NULL) == SQLITE_OK) )
+	for( p = paths; p < end; p = eol + 1 )
 	{
-		if( rows )
+		eol = memchr(p, '\n', end - p);
+		if( !eol )
+			eol = end;
+		while( p < eol && isspace((unsigned char)*p) )
+			p++;
+		for( len = eol - p; len > 1 && (isspace((unsigned char)p[len-1]) || p[len-1] == '/'); len-- )
+			;
+		if( p == eol )
+			continue;
+		path = malloc(len + 1);
+		tmp = realloc(list, (n + 1) * sizeof(*list));
+		if( tmp )
+			list = tmp;
+		if( !path || !tmp )
 		{
-			for( i=1; i <= rows; i++ )
-			{
-				detailID = strtoll(result[i], NULL, 10);
-				sql_exec(db, "DELETE from DETAILS where ID = %lld", detailID);
-				sql_exec(db, "DELETE from OBJECTS where DETAIL_ID = %lld", detailID);
-			}
+			DPRINTF(E_ERROR, L_INOTIFY, "Out of memory queueing a rescan\n");
+			free(path);
+			id = -1;
+			goto error;
+		}
+		memcpy(path, p, len);
+		path[len] = '\0';
+		list[n++] = path;
+		if( !rescan_allowed(path) )
+		{
+			DPRINTF(E_WARN, L_INOTIFY, "Not rescanning %s, it is not below a media dir\n", path);
+			goto error;
+		}
+	}
+	if( !n )
+		goto error;
+
+	pthread_mutex_lock(&rescan_mutex);
+	job = &rescan_jobs[(rescan_last + 1) % RESCAN_JOBS];
+	if( job->id && job->state != RESCAN_DONE )
+	{
+		pthread_mutex_unlock(&rescan_mutex);
+		DPRINTF(E_WARN, L_INOTIFY, "Too many rescans pending\n");
+		id = -1;
+		goto error;
+	}
+	for( i = 0; i < job->npaths; i++ )
+		free(job->paths[i]);
+	free(job->paths);
+	memset(job, 0, sizeof(*job));
+	job->id = id = ++rescan_last;
+	job->state = RESCAN_QUEUED;
+	job->paths = list;
+	job->npaths = n;
+	job->queued = time(NULL);
+	pthread_mutex_unlock(&rescan_mutex);
+	DPRINTF(E_INFO, L_INOTIFY, "Queued rescan %d of %d path(s), starting with %s\n", id, n, list[0]);
+
+	return id;
+error:
+	for( i = 0; i < n; i++ )
+		free(list[i]);
+	free(list);
+	return id;
+}
+
+static void
+rescan_json(const struct rescan_job *job, struct string_s *str)
+{
+	strcatf(str, "{\"id\":%d,\"state\":\"%s\",\"paths\":%d,\"done\":%d,"
+	             "\"dirs\":%d,\"added\":%d,\"updated\":%d,\"removed\":%d,\"queued\":%lld",
+	             job->id, rescan_states[job->state], job->npaths, job->done,
+	             job->stats.dirs, job->stats.added, job->stats.updated, job->stats.removed,
+	             (long long)job->queued);
+	if( job->finished )
+		strcatf(str, ",\"finished\":%lld", (long long)job->finished);
+	strcatf(str, "}");
+}
+
+int
+inotify_rescan_status(int id, struct string_s *str)
+{
+	const struct rescan_job *job;
+	int i, n = 0, ret = -1;
+
+	pthread_mutex_lock(&rescan_mutex);
+	if( id > 0 )
+	{
+		job = &rescan_jobs[id % RESCAN_JOBS];
+		if( job->id == id )
+		{
+			rescan_json(job, str);
 			ret = 0;
 		}
-		sqlite3_free_table(result);
+	}
+	else
+	{
+		strcatf(str, "[");
+		for( i = rescan_last - RESCAN_JOBS + 1; i <= rescan_last; i++ )
+		{
+			job = &rescan_jobs[(i + RESCAN_JOBS) % RESCAN_JOBS];
+			if( i <= 0 || job->id != i )
+				continue;
+			if( n++ )
+				strcatf(str, ",");
+			rescan_json(job, str);
+		}
+		strcatf(str, "]");
+		ret = 0;
+	}
+	pthread_mutex_unlock(&rescan_mutex);
+
+	return ret;
+}
+
+static void
+rescan_account(struct rescan_job *job, const struct sync_stats *stats)
+{
+	pthread_mutex_lock(&rescan_mutex);
+	job->stats.dirs += stats->dirs;
+	job->stats.added += stats->added;
+	job->stats.updated += stats->updated;
+	job->stats.removed += stats->removed;
+	pthread_mutex_unlock(&rescan_mutex);
+}
+
+/* compare dir, which is in the database, and everything below it */
+static void
+rescan_tree(int fd, const char *dir, struct rescan_job *job)
+{
+	struct sync_stats stats;
+	struct stat st;
+	char *sql, **result;
+	int i, n, rows, settled;
+
+	if( quitting || stat(dir, &st) != 0 )
+		return;
+	/* the subdirectories known before, new ones are added whole */
+	sql = sqlite3_mprintf("SELECT PATH from DETAILS where MIME is NULL and PATH > '%q/' and PATH < '%q0'"
+	                      " and instr(substr(PATH, %d), '/') = 0", dir, dir, (int)strlen(dir) + 2);
+	if( sql_get_table(db, sql, &result, &rows, NULL) != SQLITE_OK )
+	{
+		result = NULL;
+		rows = 0;
 	}
 	sqlite3_free(sql);
-	/* Clean up any album art entries in the deleted directory */
-	sql_exec(db, "DELETE from ALBUM_ART where (PATH > '%q/' and PATH <= '%q/%c')", path, path, 0xFF);
+
+	memset(&stats, 0, sizeof(stats));
+	n = sync_dir(fd, dir, 0, &settled, &stats);
+	if( settled )
+		save_dir_stamp(dir, &st, n);
+	rescan_account(job, &stats);
+	for( i = 1; i <= rows; i++ )
+		rescan_tree(fd, result[i], job);
+	if( result )
+		sqlite3_free_table(result);
+}
+
+static void
+rescan_path(int fd, const char *path, struct rescan_job *job)
+{
+	struct sync_stats stats;
+	struct stat st;
+	char *esc_name;
+	int64_t ts;
+
+	memset(&stats, 0, sizeof(stats));
+	if( stat(path, &st) != 0 )
+	{
+		if( errno != ENOENT )
+			DPRINTF(E_WARN, L_INOTIFY, "Unable to rescan %s [%s]\n", path, strerror(errno));
+		else if( sql_get_int_field(db, "SELECT count(*) from DETAILS where PATH = '%q' and MIME is NULL", path) > 0 )
+		{
+			if( inotify_remove_directory(fd, path) == 0 )
+				stats.removed++;
+		}
+		else if( remove_file(path) == 0 )
+			stats.removed++;
+	}
+	else if( S_ISDIR(st.st_mode) )
+	{
+		if( sql_get_int_field(db, "SELECT ID from DETAILS where PATH = '%q'", path) > 0 )
+		{
+			rescan_tree(fd, path, job);
+			return;
+		}
+		esc_name = escape_tag(strrchr(path, '/') + 1, 1);
+		if( inotify_insert_directory(fd, esc_name, path) == 0 )
+			stats.added++;
+		free(esc_name);
+	}
+	else if( S_ISREG(st.st_mode) )
+	{
+		/* it was named, so it changed even if its timestamp did not */
+		ts = sql_get_int64_field(db, "SELECT TIMESTAMP from DETAILS where PATH = '%q'", path);
+		if( ts > 0 )
+			remove_file(path);
+		esc_name = escape_tag(strrchr(path, '/') + 1, 1);
+		if( inotify_insert_file(esc_name, path) == 0 )
+		{
+			if( ts > 0 )
+				stats.updated++;
+			else
+				stats.added++;
+		}
+		else if( ts > 0 )
+			stats.removed++;
+		free(esc_name);
+	}
+	rescan_account(job, &stats);
+}
+
+/* run the next queued rescan, if there is one */
+static void
+rescan_run(int fd)
+{
+	struct rescan_job *job;
+	int i;
+
+	pthread_mutex_lock(&rescan_mutex);
+	job = &rescan_jobs[rescan_next % RESCAN_JOBS];
+	if( job->id != rescan_next || job->state != RESCAN_QUEUED )
+	{
+		pthread_mutex_unlock(&rescan_mutex);
+		return;
+	}
+	job->state = RESCAN_RUNNING;
+	rescan_next++;
+	pthread_mutex_unlock(&rescan_mutex);
+
+	DPRINTF(E_INFO, L_INOTIFY, "Starting rescan %d\n", job->id);
+	for( i = 0; i < job->npaths && !quitting; i++ )
+	{
+		rescan_path(fd, job->paths[i], job);
+		pthread_mutex_lock(&rescan_mutex);
+		job->done++;
+		pthread_mutex_unlock(&rescan_mutex);
+	}
+	pthread_mutex_lock(&rescan_mutex);
+	job->state = RESCAN_DONE;
+	job->finished = time(NULL);
+	DPRINTF(E_INFO, L_INOTIFY, "Rescan %d finished: %d added, %d updated, %d removed\n",
+		job->id, job->stats.added, job->stats.updated, job->stats.removed);
+	pthread_mutex_unlock(&rescan_mutex);
+}
+
+/* act on a change to name in dir; mask is in inotify terms, and fd is the
+ * inotify descriptor, or -1 if the whole filesystem is watched */
+static void
+process_event(int fd, uint32_t mask, const char *dir, const char *name)
+{
+	char path_buf[PATH_MAX];
+	char * esc_name = NULL;
+	struct stat st;
+
+	esc_name = modifyString(strdup(name), "&", "&amp;amp;", 0);
+	snprintf(path_buf, sizeof(path_buf), "%s/%s", dir, name);
+	if ( mask & IN_ISDIR && (mask & (IN_CREATE|IN_MOVED_TO)) )
+	{
+		DPRINTF(E_DEBUG, L_INOTIFY,  "The directory %s was %s.\n",
+			path_buf, (mask & IN_MOVED_TO ? "moved here" : "created"));
+		inotify_insert_directory(fd, esc_name, path_buf);
+	}
+	else if ( (mask & (IN_CLOSE_WRITE|IN_MOVED_TO|IN_CREATE)) &&
+	          (lstat(path_buf, &st) == 0) )
+	{
+		if( (mask & (IN_MOVED_TO|IN_CREATE)) && (S_ISLNK(st.st_mode) || st.st_nlink > 1) )
+		{
+			DPRINTF(E_DEBUG, L_INOTIFY, "The %s link %s was %s.\n",
+				(S_ISLNK(st.st_mode) ? "symbolic" : "hard"),
+				path_buf, (mask & IN_MOVED_TO ? "moved here" : "created"));
+			if( stat(path_buf, &st) == 0 && S_ISDIR(st.st_mode) )
+				inotify_insert_directory(fd, esc_name, path_buf);
+			else
+				inotify_insert_file(esc_name, path_buf);
+		}
+		else if( mask & (IN_CLOSE_WRITE|IN_MOVED_TO) && st.st_size > 0 )
+		{
+			if( (mask & IN_MOVED_TO) ||
+			    (sql_get_int_field(db, "SELECT TIMESTAMP from DETAILS where PATH = '%q'", path_buf) != st.st_mtime) )
+			{
+				DPRINTF(E_DEBUG, L_INOTIFY, "The file %s was %s.\n",
+					path_buf, (mask & IN_MOVED_TO ? "moved here" : "changed"));
+				inotify_insert_file(esc_name, path_buf);
+			}
+		}
+	}
+	else if ( mask & (IN_DELETE|IN_MOVED_FROM) )
+	{
+		DPRINTF(E_DEBUG, L_INOTIFY, "The %s %s was %s.\n",
+			(mask & IN_ISDIR ? "directory" : "file"),
+			path_buf, (mask & IN_MOVED_FROM ? "moved away" : "deleted"));
+		if ( mask & IN_ISDIR )
+			inotify_remove_directory(fd, path_buf);
+		else
+			remove_file(path_buf);
+	}
+	free(esc_name);
+}
+
+/* nothing happened for a second */
+static void
+monitor_idle(void)
+{
+	metrics_set(M_INOTIFY_QUEUE, 0);
+	art_cache_sweep(0);
+	if( next_pl_fill && (time(NULL) >= next_pl_fill) )
+	{
+		fill_playlists();
+		next_pl_fill = 0;
+	}
+}
+
+#ifdef HAVE_FANOTIFY
+/* fanotify marks whole filesystems and reports the directory of each event
+ * as a file handle, so nothing is set up per directory.  The handles are
+ * turned back into paths with open_by_handle_at(), which, like filesystem
+ * marks, needs root privileges.  Events outside the media dirs are dropped. */
+#define FAN_EVENTS	(FAN_CREATE|FAN_DELETE|FAN_MOVED_FROM|FAN_MOVED_TO|FAN_CLOSE_WRITE|FAN_ONDIR)
+#define FAN_BUF_LEN	(64*1024)
+
+struct fan_dir
+{
+	struct media_dir_s *media_dir;
+	char *real;		/* its path with symbolic links resolved */
+	size_t len;
+	fsid_t fsid;
+	int fd;			/* for open_by_handle_at() */
+};
+
+static struct fan_dir *fan_dirs;
+static int fan_ndirs;
+
+static void
+fanotify_remove_marks(void)
+{
+	int i;
+
+	for( i = 0; i < fan_ndirs; i++ )
+	{
+		free(fan_dirs[i].real);
+		close(fan_dirs[i].fd);
+	}
+	free(fan_dirs);
+	fan_dirs = NULL;
+	fan_ndirs = 0;
+}
+
+static int
+fanotify_create_marks(int fd)
+{
+	struct media_dir_s *media_path;
+	struct fan_dir *d;
+	struct statfs sfs;
+	int i, n = 0;
+
+	for( media_path = media_dirs; media_path != NULL; media_path = media_path->next )
+		n++;
+	fan_dirs = calloc(n, sizeof(struct fan_dir));
+	if( !fan_dirs )
+		return -1;
+	for( media_path = media_dirs; media_path != NULL; media_path = media_path->next )
+	{
+		d = &fan_dirs[fan_ndirs];
+		d->media_dir = media_path;
+		d->real = realpath(media_path->path, NULL);
+		d->fd = open(media_path->path, O_RDONLY|O_DIRECTORY);
+		if( !d->real || d->fd < 0 || fstatfs(d->fd, &sfs) != 0 )
+		{
+			DPRINTF(E_ERROR, L_INOTIFY, "Unable to watch %s [%s]\n", media_path->path, strerror(errno));
+			free(d->real);
+			if( d->fd >= 0 )
+				close(d->fd);
+			return -1;
+		}
+		d->len = strlen(d->real);
+		d->fsid = sfs.f_fsid;
+		fan_ndirs++;
+		for( i = 0; i < fan_ndirs - 1; i++ )
+		{
+			if( memcmp(&fan_dirs[i].fsid, &d->fsid, sizeof(d->fsid)) == 0 )
+				break;
+		}
+		if( i < fan_ndirs - 1 )
+			continue;
+		/* filesystems without a usable fsid (or btrfs subvolumes) refuse
+		 * these marks; a partial watch would miss changes, so give up */
+		if( fanotify_mark(fd, FAN_MARK_ADD|FAN_MARK_FILESYSTEM, FAN_EVENTS, AT_FDCWD, media_path->path) != 0 )
+		{
+			DPRINTF(E_ERROR, L_INOTIFY, "fanotify_mark(%s) [%s]\n", media_path->path, strerror(errno));
+			return -1;
+		}
+		DPRINTF(E_INFO, L_INOTIFY, "Watching the filesystem of %s\n", media_path->path);
+	}
+
+	return fan_ndirs;
+}
+
+/* the path, as configured under media_dir, of the directory fid names
+ * returns: 0 if it is in a media dir, -1 otherwise */
+static int
+fanotify_get_path(const struct fanotify_event_info_fid *fid, char *path, size_t size)
+{
+	char real[PATH_MAX], proc[32];
+	struct fan_dir *d = NULL;
+	ssize_t len;
+	int i, dfd;
+
+	for( i = 0; i < fan_ndirs; i++ )
+	{
+		if( memcmp(&fan_dirs[i].fsid, &fid->fsid, sizeof(fid->fsid)) == 0 )
+			break;
+	}
+	if( i == fan_ndirs )
+		return -1;
+	dfd = open_by_handle_at(fan_dirs[i].fd, (struct file_handle *)fid->handle, O_PATH);
+	if( dfd < 0 )
+		return -1;
+	snprintf(proc, sizeof(proc), "/proc/self/fd/%d", dfd);
+	len = readlink(proc, real, sizeof(real) - 1);
+	close(dfd);
+	if( len <= 0 )
+		return -1;
+	real[len] = '\0';
+
+	for( i = 0; i < fan_ndirs; i++ )
+	{
+		if( strncmp(real, fan_dirs[i].real, fan_dirs[i].len) == 0 &&
+		    (real[fan_dirs[i].len] == '/' || real[fan_dirs[i].len] == '\0') )
+		{
+			d = &fan_dirs[i];
+			break;
+		}
+	}
+	if( !d )
+		return -1;
+	snprintf(path, size, "%s%s", d->media_dir->path, real + d->len);
+
+	return 0;
+}
+
+static uint32_t
+fanotify_to_inotify(uint64_t mask)
+{
+	uint32_t ret = 0;
+
+	if( mask & FAN_CREATE )
+		ret |= IN_CREATE;
+	if( mask & FAN_DELETE )
+		ret |= IN_DELETE;
+	if( mask & FAN_MOVED_FROM )
+		ret |= IN_MOVED_FROM;
+	if( mask & FAN_MOVED_TO )
+		ret |= IN_MOVED_TO;
+	if( mask & FAN_CLOSE_WRITE )
+		ret |= IN_CLOSE_WRITE;
+	if( mask & FAN_ONDIR )
+		ret |= IN_ISDIR;
 
 	return ret;
 }
 
+/* returns: -1 if fanotify cannot be used, 0 once quitting */
+static int
+start_fanotify(void)
+{
+	struct pollfd pollfds[1];
+	struct fanotify_event_metadata *event;
+	struct fanotify_event_info_fid *fid;
+	struct file_handle *handle;
+	const char *name;
+	char dir[PATH_MAX];
+	char *buffer;
+	pid_t self = getpid();
+	ssize_t length;
+	int pending;
+
+	pollfds[0].fd = fanotify_init(FAN_CLASS_NOTIF|FAN_REPORT_DFID_NAME|FAN_UNLIMITED_QUEUE, O_RDONLY|O_LARGEFILE);
+	pollfds[0].events = POLLIN;
+	if( pollfds[0].fd < 0 )
+	{
+		DPRINTF(E_WARN, L_INOTIFY, "fanotify_init() failed [%s], using inotify\n", strerror(errno));
+		return -1;
+	}
+	buffer = malloc(FAN_BUF_LEN);
+	if( !buffer || fanotify_create_marks(pollfds[0].fd) <= 0 )
+	{
+		DPRINTF(E_WARN, L_INOTIFY, "Unable to watch the media dirs with fanotify, using inotify\n");
+		fanotify_remove_marks();
+		free(buffer);
+		close(pollfds[0].fd);
+		return -1;
+	}
+
+	while( !quitting )
+	{
+		poll_network_dirs(-1);
+		rescan_run(-1);
+		length = poll(pollfds, 1, 1000);
+		if( !length )
+		{
+			monitor_idle();
+			continue;
+		}
+		else if( length < 0 )
+		{
+			if( (errno == EINTR) || (errno == EAGAIN) )
+				continue;
+			DPRINTF(E_ERROR, L_INOTIFY, "poll failed!\n");
+			break;
+		}
+		if( ioctl(pollfds[0].fd, FIONREAD, &pending) == 0 )
+			metrics_set(M_INOTIFY_QUEUE, pending);
+		length = read(pollfds[0].fd, buffer, FAN_BUF_LEN);
+		if( length < 0 )
+		{
+			if( (errno == EINTR) || (errno == EAGAIN) )
+				continue;
+			DPRINTF(E_ERROR, L_INOTIFY, "read failed!\n");
+			break;
+		}
+
+		for( event = (struct fanotify_event_metadata *)buffer; FAN_EVENT_OK(event, length);
+		     event = FAN_EVENT_NEXT(event, length) )
+		{
+			metrics_add(M_INOTIFY_EVENTS, 1);
+			if( event->vers != FANOTIFY_METADATA_VERSION )
+			{
+				DPRINTF(E_ERROR, L_INOTIFY, "Unknown fanotify event version %d\n", event->vers);
+				break;
+			}
+			if( event->fd >= 0 )
+				close(event->fd);
+			if( event->mask & FAN_Q_OVERFLOW )
+			{
+				DPRINTF(E_WARN, L_INOTIFY, "fanotify queue overflow, changes were missed\n");
+				continue;
+			}
+			/* our own database and caches */
+			if( event->pid == self )
+				continue;
+			fid = (struct fanotify_event_info_fid *)(event + 1);
+			if( event->event_len < sizeof(*event) + sizeof(*fid) + sizeof(*handle) ||
+			    fid->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME )
+				continue;
+			handle = (struct file_handle *)fid->handle;
+			name = (const char *)handle->f_handle + handle->handle_bytes;
+			if( *name == '.' )
+				continue;
+			if( fanotify_get_path(fid, dir, sizeof(dir)) != 0 )
+				continue;
+			process_event(-1, fanotify_to_inotify(event->mask), dir, name);
+		}
+	}
+	fanotify_remove_marks();
+	free(buffer);
+	close(pollfds[0].fd);
+
+	return 0;
+}
+#endif
+
 void *
 start_inotify()
 {
 	struct pollfd pollfds[1];
 	int timeout = 1000;
 	char buffer[BUF_LEN];
-	char path_buf[PATH_MAX];
 	int length, i = 0;
-	char * esc_name = NULL;
-	struct stat st;
+	int pending;
         
 	pollfds[0].fd = inotify_init();
 	pollfds[0].events = POLLIN;
@@ -663,22 +1628,30 @@ start_inotify()
 			goto quitting;
 		sleep(1);
 	}
-	inotify_create_watches(pollfds[0].fd);
 	if (setpriority(PRIO_PROCESS, 0, 19) == -1)
 		DPRINTF(E_WARN, L_INOTIFY,  "Failed to reduce inotify thread priority\n");
 	sqlite3_release_memory(1<<31);
 	av_register_all();
+	poll_init();
+	if( GETFLAG(FANOTIFY_MASK) )
+	{
+#ifdef HAVE_FANOTIFY
+		if( start_fanotify() == 0 )
+			goto quitting;
+#else
+		DPRINTF(E_WARN, L_INOTIFY, "fanotify support is not available, using inotify\n");
+#endif
+	}
+	inotify_create_watches(pollfds[0].fd);
         
 	while( !quitting )
 	{
+		poll_network_dirs(pollfds[0].fd);
+		rescan_run(pollfds[0].fd);
                 length = poll(pollfds, 1, timeout);
 		if( !length )
 		{
-			if( next_pl_fill && (time(NULL) >= next_pl_fill) )
-			{
-				fill_playlists();
-				next_pl_fill = 0;
-			}
+			monitor_idle();
 			continue;
 		}
 		else if( length < 0 )
@@ -690,6 +1663,8 @@ start_inotify()
 		}
 		else
 		{
+			if( ioctl(pollfds[0].fd, FIONREAD, &pending) == 0 )
+				metrics_set(M_INOTIFY_QUEUE, pending);
 			length = read(pollfds[0].fd, buffer, BUF_LEN);
 			buffer[BUF_LEN-1] = '\0';
 		}
@@ -698,62 +1673,15 @@ start_inotify()
 		while( i < length )
 		{
 			struct inotify_event * event = (struct inotify_event *) &buffer[i];
-			if( event->len )
-			{
-				if( *(event->name) == '.' )
-				{
-					i += EVENT_SIZE + event->len;
-					continue;
-				}
-				esc_name = modifyString(strdup(event->name), "&", "&amp;amp;", 0);
-				snprintf(path_buf, sizeof(path_buf), "%s/%s", get_path_from_wd(event->wd), event->name);
-				if ( event->mask & IN_ISDIR && (event->mask & (IN_CREATE|IN_MOVED_TO)) )
-				{
-					DPRINTF(E_DEBUG, L_INOTIFY,  "The directory %s was %s.\n",
-						path_buf, (event->mask & IN_MOVED_TO ? "moved here" : "created"));
-					inotify_insert_directory(pollfds[0].fd, esc_name, path_buf);
-				}
-				else if ( (event->mask & (IN_CLOSE_WRITE|IN_MOVED_TO|IN_CREATE)) &&
-				          (lstat(path_buf, &st) == 0) )
-				{
-					if( (event->mask & (IN_MOVED_TO|IN_CREATE)) && (S_ISLNK(st.st_mode) || st.st_nlink > 1) )
-					{
-						DPRINTF(E_DEBUG, L_INOTIFY, "The %s link %s was %s.\n",
-							(S_ISLNK(st.st_mode) ? "symbolic" : "hard"),
-							path_buf, (event->mask & IN_MOVED_TO ? "moved here" : "created"));
-						if( stat(path_buf, &st) == 0 && S_ISDIR(st.st_mode) )
-							inotify_insert_directory(pollfds[0].fd, esc_name, path_buf);
-						else
-							inotify_insert_file(esc_name, path_buf);
-					}
-					else if( event->mask & (IN_CLOSE_WRITE|IN_MOVED_TO) && st.st_size > 0 )
-					{
-						if( (event->mask & IN_MOVED_TO) ||
-						    (sql_get_int_field(db, "SELECT TIMESTAMP from DETAILS where PATH = '%q'", path_buf) != st.st_mtime) )
-						{
-							DPRINTF(E_DEBUG, L_INOTIFY, "The file %s was %s.\n",
-								path_buf, (event->mask & IN_MOVED_TO ? "moved here" : "changed"));
-							inotify_insert_file(esc_name, path_buf);
-						}
-					}
-				}
-				else if ( event->mask & (IN_DELETE|IN_MOVED_FROM) )
-				{
-					DPRINTF(E_DEBUG, L_INOTIFY, "The %s %s was %s.\n",
-						(event->mask & IN_ISDIR ? "directory" : "file"),
-						path_buf, (event->mask & IN_MOVED_FROM ? "moved away" : "deleted"));
-					if ( event->mask & IN_ISDIR )
-						inotify_remove_directory(pollfds[0].fd, path_buf);
-					else
-						inotify_remove_file(path_buf);
-				}
-				free(esc_name);
-			}
+			metrics_add(M_INOTIFY_EVENTS, 1);
+			if( event->len && *(event->name) != '.' )
+				process_event(pollfds[0].fd, event->mask, get_path_from_wd(event->wd), event->name);
 			i += EVENT_SIZE + event->len;
 		}
 	}
 	inotify_remove_watches(pollfds[0].fd);
 quitting:
+	poll_free();
 	close(pollfds[0].fd);
 
 	return 0;
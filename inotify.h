@@ -1,7 +1,23 @@
 #ifdef HAVE_INOTIFY
-int
-inotify_remove_file(const char * path);
+/* room for the status of all the rescans that are kept */
+#define RESCAN_RESP_SIZE	8192
+
+struct string_s;
 
 void *
 start_inotify();
+
+/* inotify_rescan()
+ * queue a rescan of paths, one per line, for the monitor thread
+ * returns: the job id, 0 if a path is not below a media dir, or -1 if too
+ *          many rescans are pending */
+int
+inotify_rescan(const char *paths, int len);
+
+/* inotify_rescan_status()
+ * append the progress of rescan id as a JSON object to str, or that of all
+ * recent rescans as an array if id is 0
+ * returns: 0 on success, -1 if id is unknown */
+int
+inotify_rescan_status(int id, struct string_s *str);
 #endif
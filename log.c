@@ -22,8 +22,12 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <string.h>
+#include <unistd.h>
 #include <time.h>
+#include <pthread.h>
 
 #include "upnpglobalvars.h"
 #include "log.h"
@@ -31,6 +35,7 @@
 static FILE *log_fp = NULL;
 static const int _default_log_level = E_WARN;
 int log_level[L_MAX];
+static int log_mode[L_MAX];
 
 const char *facility_name[] = {
 	"general",
@@ -56,9 +61,508 @@ const char *level_name[] = {
 	0
 };
 
+const char *mode_name[] = {
+	"sync",					// LOG_SYNC
+	"async",				// LOG_ASYNC
+	"binary",				// LOG_BINARY
+	0
+};
+
+/* Asynchronous logging
+ *
+ * Messages from async and binary facilities are queued in a bounded
+ * multi-producer ring and written out by a dedicated thread, so DPRINTF
+ * never blocks on the log file.  Each slot carries a sequence number:
+ * producers claim a slot by advancing ring_head with a CAS, fill it in,
+ * then publish it by bumping the slot sequence; the writer consumes
+ * slots in order.  When the ring is full the message is dropped and
+ * counted, and the writer reports the count once there is room again.
+ *
+ * Async facilities format the message in the caller.  Binary facilities
+ * only copy the format pointer and arguments (strings are copied into the
+ * slot), and the writer thread does the formatting.  Messages that can't
+ * be captured that way, e.g. with '*' widths, are formatted up front.
+ *
+ * The writer thread doesn't survive fork(), so children log synchronously
+ * unless they call log_start_writer() again. */
+#define LOG_RING_SLOTS	512	/* must be a power of two */
+#define LOG_SLOT_TEXT	384
+#define LOG_MAX_ARGS	12
+#define LOG_OUT_SIZE	65536
+#define LOG_IDLE_MIN	1000000		/* writer poll interval, in ns */
+#define LOG_IDLE_MAX	64000000
+
+enum log_arg_type {
+	ARG_NONE,
+	ARG_INT,
+	ARG_LONG,
+	ARG_LLONG,
+	ARG_INTMAX,
+	ARG_SIZE,
+	ARG_PTRDIFF,
+	ARG_DOUBLE,
+	ARG_PTR,
+	ARG_STR,
+	ARG_BAD
+};
+
+#define ARG_STR_NULL	0xffff
+
+struct log_arg {
+	union {
+		int i;
+		long l;
+		long long ll;
+		intmax_t j;
+		size_t z;
+		ptrdiff_t t;
+		double d;
+		void *p;
+		unsigned short s;	/* offset of the copied string in text */
+	} v;
+	unsigned char type;
+};
+
+struct log_record {
+	volatile unsigned long seq;
+	time_t time;
+	const char *fname;
+	int lineno;
+	int level;
+	const char *fmt;	/* NULL if text already holds the message */
+	char *heap;		/* formatted messages too long for text */
+	int nargs;
+	struct log_arg args[LOG_MAX_ARGS];
+	char text[LOG_SLOT_TEXT];
+};
+
+struct ts_cache {
+	time_t sec;
+	char str[80];
+};
+
+static struct log_record *ring = NULL;
+static volatile unsigned long ring_head = 0;
+static unsigned long ring_tail = 0;
+static volatile unsigned long ring_done = 0;
+static volatile unsigned long ring_dropped = 0;
+static volatile int ring_running = 0;
+static volatile int ring_stop = 0;
+static pthread_t writer_thread;
+
+/* Formatting the timestamp only once per second saves a localtime() call
+ * per message. */
+static const char *
+format_time(struct ts_cache *cache, time_t t)
+{
+	struct tm tm;
+
+	if (t != cache->sec || !cache->str[0])
+	{
+		localtime_r(&t, &tm);
+		snprintf(cache->str, sizeof(cache->str), "[%04d/%02d/%02d %02d:%02d:%02d] ",
+		         tm.tm_year+1900, tm.tm_mon+1, tm.tm_mday,
+		         tm.tm_hour, tm.tm_min, tm.tm_sec);
+		cache->sec = t;
+	}
+	return cache->str;
+}
+
+/* Parse the printf conversion starting at fmt (which points at the '%'),
+ * and return the argument type it consumes.  *end is set past it. */
+static enum log_arg_type
+parse_spec(const char *fmt, const char **end)
+{
+	const char *p = fmt + 1;
+	int len = 0;
+	enum log_arg_type type;
+
+	if (*p == '%')
+	{
+		*end = p + 1;
+		return ARG_NONE;
+	}
+	while (*p && strchr("-+ #0'", *p))
+		p++;
+	if (*p == '*')
+		return ARG_BAD;
+	while (*p >= '0' && *p <= '9')
+		p++;
+	if (*p == '.')
+	{
+		p++;
+		if (*p == '*')
+			return ARG_BAD;
+		while (*p >= '0' && *p <= '9')
+			p++;
+	}
+	switch (*p)
+	{
+	case 'h':
+		p += (p[1] == 'h') ? 2 : 1;
+		break;
+	case 'l':
+		if (p[1] == 'l')
+		{
+			len = 2;
+			p += 2;
+		}
+		else
+		{
+			len = 1;
+			p++;
+		}
+		break;
+	case 'q':
+		len = 2;
+		p++;
+		break;
+	case 'j':
+		len = 'j';
+		p++;
+		break;
+	case 'z':
+		len = 'z';
+		p++;
+		break;
+	case 't':
+		len = 't';
+		p++;
+		break;
+	}
+	switch (*p)
+	{
+	case 'd': case 'i': case 'o': case 'u': case 'x': case 'X':
+		switch (len)
+		{
+		case 1:   type = ARG_LONG; break;
+		case 2:   type = ARG_LLONG; break;
+		case 'j': type = ARG_INTMAX; break;
+		case 'z': type = ARG_SIZE; break;
+		case 't': type = ARG_PTRDIFF; break;
+		default:  type = ARG_INT; break;
+		}
+		break;
+	case 'c':
+		type = len ? ARG_BAD : ARG_INT;
+		break;
+	case 'e': case 'E': case 'f': case 'F':
+	case 'g': case 'G': case 'a': case 'A':
+		type = (len == 0 || len == 1) ? ARG_DOUBLE : ARG_BAD;
+		break;
+	case 's':
+		type = len ? ARG_BAD : ARG_STR;
+		break;
+	case 'p':
+		type = len ? ARG_BAD : ARG_PTR;
+		break;
+	default:
+		return ARG_BAD;
+	}
+	/* Leave room to copy the spec out for snprintf() */
+	if (p + 1 - fmt >= 32)
+		return ARG_BAD;
+	*end = p + 1;
+
+	return type;
+}
+
+/* Copy the arguments for fmt into rec, for formatting later.
+ * Returns 0 on success, -1 if the format can't be deferred. */
+static int
+capture_args(struct log_record *rec, const char *fmt, va_list ap)
+{
+	const char *p, *str;
+	size_t used = 0, len;
+	enum log_arg_type type;
+	struct log_arg *arg;
+
+	rec->nargs = 0;
+	for (p = fmt; (p = strchr(p, '%')); )
+	{
+		type = parse_spec(p, &p);
+		if (type == ARG_NONE)
+			continue;
+		if (type == ARG_BAD || rec->nargs == LOG_MAX_ARGS)
+			return -1;
+		arg = &rec->args[rec->nargs++];
+		arg->type = type;
+		switch (type)
+		{
+		case ARG_INT:     arg->v.i = va_arg(ap, int); break;
+		case ARG_LONG:    arg->v.l = va_arg(ap, long); break;
+		case ARG_LLONG:   arg->v.ll = va_arg(ap, long long); break;
+		case ARG_INTMAX:  arg->v.j = va_arg(ap, intmax_t); break;
+		case ARG_SIZE:    arg->v.z = va_arg(ap, size_t); break;
+		case ARG_PTRDIFF: arg->v.t = va_arg(ap, ptrdiff_t); break;
+		case ARG_DOUBLE:  arg->v.d = va_arg(ap, double); break;
+		case ARG_PTR:     arg->v.p = va_arg(ap, void *); break;
+		case ARG_STR:
+			str = va_arg(ap, const char *);
+			if (!str)
+			{
+				arg->v.s = ARG_STR_NULL;
+				break;
+			}
+			len = strlen(str) + 1;
+			if (used + len > sizeof(rec->text))
+				return -1;
+			memcpy(rec->text + used, str, len);
+			arg->v.s = used;
+			used += len;
+			break;
+		default:
+			return -1;
+		}
+	}
+	rec->fmt = fmt;
+
+	return 0;
+}
+
+/* Format a captured record into buf, one conversion at a time */
+static int
+format_args(const struct log_record *rec, char *buf, int size)
+{
+	const char *p = rec->fmt, *next, *end;
+	const struct log_arg *arg = rec->args;
+	char spec[32];
+	int off = 0, n;
+
+	while (*p && off < size - 1)
+	{
+		next = strchr(p, '%');
+		if (!next)
+			next = p + strlen(p);
+		n = next - p;
+		if (n > size - 1 - off)
+			n = size - 1 - off;
+		memcpy(buf + off, p, n);
+		off += n;
+		if (!*next || off >= size - 1)
+			break;
+		if (parse_spec(next, &end) == ARG_NONE)
+		{
+			buf[off++] = '%';
+			p = end;
+			continue;
+		}
+		memcpy(spec, next, end - next);
+		spec[end - next] = '\0';
+		switch (arg->type)
+		{
+		case ARG_INT:     n = snprintf(buf + off, size - off, spec, arg->v.i); break;
+		case ARG_LONG:    n = snprintf(buf + off, size - off, spec, arg->v.l); break;
+		case ARG_LLONG:   n = snprintf(buf + off, size - off, spec, arg->v.ll); break;
+		case ARG_INTMAX:  n = snprintf(buf + off, size - off, spec, arg->v.j); break;
+		case ARG_SIZE:    n = snprintf(buf + off, size - off, spec, arg->v.z); break;
+		case ARG_PTRDIFF: n = snprintf(buf + off, size - off, spec, arg->v.t); break;
+		case ARG_DOUBLE:  n = snprintf(buf + off, size - off, spec, arg->v.d); break;
+		case ARG_PTR:     n = snprintf(buf + off, size - off, spec, arg->v.p); break;
+		case ARG_STR:
+			n = snprintf(buf + off, size - off, spec,
+			             arg->v.s == ARG_STR_NULL ? NULL : rec->text + arg->v.s);
+			break;
+		default:
+			n = 0;
+			break;
+		}
+		if (n > 0)
+			off += (n < size - off) ? n : size - 1 - off;
+		arg++;
+		p = end;
+	}
+	buf[off] = '\0';
+
+	return off;
+}
+
+/* Format the timestamp and source location of a queued record into out */
+static int
+render_prefix(const struct log_record *rec, char *out, int size, struct ts_cache *ts)
+{
+	int off = 0, n;
+
+	if (!GETFLAG(SYSTEMD_MASK))
+		off = snprintf(out, size, "%s", format_time(ts, rec->time));
+	if (rec->level)
+		n = snprintf(out + off, size - off, "%s:%d: %s: ", rec->fname, rec->lineno, level_name[rec->level]);
+	else
+		n = snprintf(out + off, size - off, "%s:%d: ", rec->fname, rec->lineno);
+
+	return off + ((n < size - off) ? n : size - 1 - off);
+}
+
+static void
+write_out(const char *buf, int len)
+{
+	int n;
+
+	while (len > 0)
+	{
+		n = write(fileno(log_fp), buf, len);
+		if (n <= 0)
+			return;
+		buf += n;
+		len -= n;
+	}
+}
+
+static void *
+log_writer(void *arg)
+{
+	struct ts_cache ts = { 0, "" };
+	struct timespec idle = { 0, LOG_IDLE_MIN };
+	struct log_record *rec;
+	unsigned long reported = 0, dropped;
+	const char *msg;
+	char *out;
+	int len = 0, n;
+
+	out = malloc(LOG_OUT_SIZE);
+	if (!out)
+		return NULL;
+	for (;;)
+	{
+		rec = &ring[ring_tail & (LOG_RING_SLOTS - 1)];
+		if (rec->seq != ring_tail + 1)
+		{
+			/* Nothing ready; flush what we have and wait */
+			if (len)
+			{
+				write_out(out, len);
+				len = 0;
+			}
+			dropped = ring_dropped;
+			if (dropped != reported)
+			{
+				len = snprintf(out, LOG_OUT_SIZE, "%s%s:%d: %s: %lu log messages dropped\n",
+				               GETFLAG(SYSTEMD_MASK) ? "" : format_time(&ts, time(NULL)),
+				               __FILE__, __LINE__, level_name[E_WARN], dropped - reported);
+				reported = dropped;
+				continue;
+			}
+			if (ring_stop && ring_tail == ring_head)
+				break;
+			/* Poll quickly while messages are flowing, and back off
+			 * when the server is quiet */
+			nanosleep(&idle, NULL);
+			if (idle.tv_nsec < LOG_IDLE_MAX)
+				idle.tv_nsec *= 2;
+			continue;
+		}
+		idle.tv_nsec = LOG_IDLE_MIN;
+		__sync_synchronize();
+		/* Keep at least half the buffer free for the next record */
+		if (len > LOG_OUT_SIZE / 2)
+		{
+			write_out(out, len);
+			len = 0;
+		}
+		len += render_prefix(rec, out + len, LOG_OUT_SIZE - len, &ts);
+		if (rec->fmt)
+			len += format_args(rec, out + len, LOG_OUT_SIZE - len);
+		else
+		{
+			msg = rec->heap ? rec->heap : rec->text;
+			n = strlen(msg);
+			if (n < LOG_OUT_SIZE - len)
+			{
+				memcpy(out + len, msg, n);
+				len += n;
+			}
+			else
+			{
+				/* Large debug dumps go straight out */
+				write_out(out, len);
+				write_out(msg, n);
+				len = 0;
+			}
+		}
+		free(rec->heap);
+		rec->heap = NULL;
+		__sync_synchronize();
+		rec->seq = ring_tail + LOG_RING_SLOTS;
+		ring_tail++;
+		ring_done = ring_tail;
+	}
+	free(out);
+
+	return NULL;
+}
+
+/* Wait for everything queued so far to be written */
+static void
+log_flush(void)
+{
+	struct timespec wait = { 0, 1000000 };
+	unsigned long head = ring_head;
+	int i;
+
+	if (!ring_running || pthread_equal(pthread_self(), writer_thread))
+		return;
+	for (i = 0; i < 5000 && (long)(ring_done - head) < 0; i++)
+		nanosleep(&wait, NULL);
+}
+
+static void
+log_atfork_child(void)
+{
+	ring_running = 0;
+}
+
+int
+log_start_writer(void)
+{
+	static int atfork = 0;
+	unsigned long i;
+
+	for (i = 0; i < L_MAX; i++)
+	{
+		if (log_mode[i] != LOG_SYNC)
+			break;
+	}
+	if (i == L_MAX)
+		return 0;
+
+	if (!ring)
+	{
+		ring = calloc(LOG_RING_SLOTS, sizeof(struct log_record));
+		if (!ring)
+			return -1;
+	}
+	for (i = 0; i < LOG_RING_SLOTS; i++)
+	{
+		free(ring[i].heap);
+		ring[i].heap = NULL;
+		ring[i].seq = i;
+	}
+	ring_head = ring_tail = ring_done = ring_dropped = 0;
+	ring_stop = 0;
+	if (!log_fp)
+		log_fp = stdout;
+	fflush(log_fp);
+	if (pthread_create(&writer_thread, NULL, log_writer, NULL) != 0)
+		return -1;
+	if (!atfork)
+	{
+		pthread_atfork(NULL, NULL, log_atfork_child);
+		atfork = 1;
+	}
+	ring_running = 1;
+
+	return 0;
+}
+
 void
 log_close(void)
 {
+	if (ring_running)
+	{
+		ring_stop = 1;
+		pthread_join(writer_thread, NULL);
+		ring_running = 0;
+	}
 	if (log_fp)
 		fclose(log_fp);
 }
@@ -75,29 +579,30 @@ int find_matching_name(const char* str, const char* names[]) {
 	return -1;
 }
 
-int
-log_init(const char *fname, const char *debug)
+/* Parse a "facility,facility=value,..." list, as used by log_level and
+ * log_mode, into a per-facility array. */
+static void
+parse_facility_list(const char *str, const char *names[], int *values, int def)
 {
 	int i;
-	FILE *fp;
 
-	int level = find_matching_name(debug, level_name);
-	int default_log_level = (level == -1) ? _default_log_level : level;
+	int value = find_matching_name(str, names);
+	int default_value = (value == -1) ? def : value;
 
 	for (i=0; i<L_MAX; i++)
-		log_level[i] = default_log_level;
+		values[i] = default_value;
 
-	if (debug)
+	if (str)
 	{
 		const char *rhs, *lhs, *nlhs;
-		int level, facility;
+		int value, facility;
 
-		rhs = nlhs = debug;
+		rhs = nlhs = str;
 		while (rhs && (rhs = strchr(rhs, '='))) {
 			rhs++;
-			level = find_matching_name(rhs, level_name);
-			if (level == -1) {
-				DPRINTF(E_WARN, L_GENERAL, "unknown level in debug string: %s", debug);
+			value = find_matching_name(rhs, names);
+			if (value == -1) {
+				DPRINTF(E_WARN, L_GENERAL, "unknown value in log string: %s", str);
 				continue;
 			}
 
@@ -107,47 +612,111 @@ log_init(const char *fname, const char *debug)
 				if (*lhs==',') lhs++;
 				facility = find_matching_name(lhs, facility_name);
 				if (facility == -1) {
-					DPRINTF(E_WARN, L_GENERAL, "unknown debug facility in debug string: %s", debug);
+					DPRINTF(E_WARN, L_GENERAL, "unknown facility in log string: %s", str);
 				} else {
-					log_level[facility] = level;
+					values[facility] = value;
 				}
 
 				lhs = strpbrk(lhs, ",=");
 			} while (*lhs && *lhs==',');
 		}
 	}
+}
 
-	if (!fname)					// use default i.e. stdout
-		return 0;
+int
+log_init(const char *fname, const char *debug, const char *mode)
+{
+	FILE *fp;
+
+	parse_facility_list(debug, level_name, log_level, _default_log_level);
+	parse_facility_list(mode, mode_name, log_mode, LOG_SYNC);
+
+	if (fname)					// else use default i.e. stdout
+	{
+		if (!(fp = fopen(fname, "a")))
+			return 1;
+		log_fp = fp;
+	}
+
+	if (log_start_writer() != 0)
+		DPRINTF(E_WARN, L_GENERAL, "Unable to start log writer, logging synchronously\n");
 
-	if (!(fp = fopen(fname, "a")))
-		return 1;
-	log_fp = fp;
 	return 0;
 }
 
+static void
+log_queue(int level, int mode, char *fname, int lineno, char *fmt, va_list ap)
+{
+	struct log_record *rec;
+	unsigned long pos, seq;
+	va_list aq;
+	int len;
+
+	pos = ring_head;
+	for (;;)
+	{
+		rec = &ring[pos & (LOG_RING_SLOTS - 1)];
+		seq = rec->seq;
+		if (seq == pos)
+		{
+			if (__sync_bool_compare_and_swap(&ring_head, pos, pos + 1))
+				break;
+		}
+		else if ((long)(seq - pos) < 0)
+		{
+			__sync_fetch_and_add(&ring_dropped, 1);
+			return;
+		}
+		pos = ring_head;
+	}
+
+	rec->time = time(NULL);
+	rec->fname = fname;
+	rec->lineno = lineno;
+	rec->level = level;
+	rec->fmt = NULL;
+	va_copy(aq, ap);
+	if (mode != LOG_BINARY || capture_args(rec, fmt, aq) != 0)
+	{
+		rec->fmt = NULL;
+		va_end(aq);
+		va_copy(aq, ap);
+		len = vsnprintf(rec->text, sizeof(rec->text), fmt, aq);
+		if (len >= (int)sizeof(rec->text) && (rec->heap = malloc(len + 1)))
+			vsnprintf(rec->heap, len + 1, fmt, ap);
+	}
+	va_end(aq);
+	__sync_synchronize();
+	rec->seq = pos + 1;
+}
+
 void
 log_err(int level, enum _log_facility facility, char *fname, int lineno, char *fmt, ...)
 {
+	static __thread struct ts_cache ts;
 	va_list ap;
 
 	if (level && level>log_level[facility] && level>E_FATAL)
 		return;
 
+	if (ring_running && log_mode[facility] != LOG_SYNC && level != E_FATAL)
+	{
+		va_start(ap, fmt);
+		log_queue(level, log_mode[facility], fname, lineno, fmt, ap);
+		va_end(ap);
+		return;
+	}
+
 	if (!log_fp)
 		log_fp = stdout;
 
+	/* Keep fatal errors in order with anything still queued */
+	if (level == E_FATAL)
+		log_flush();
+
 	// timestamp
 	if (!GETFLAG(SYSTEMD_MASK))
-	{
-		time_t t;
-		struct tm *tm;
-		t = time(NULL);
-		tm = localtime(&t);
-		fprintf(log_fp, "[%04d/%02d/%02d %02d:%02d:%02d] ",
-		        tm->tm_year+1900, tm->tm_mon+1, tm->tm_mday,
-		        tm->tm_hour, tm->tm_min, tm->tm_sec);
-	}
+		fputs(format_time(&ts, time(NULL)), log_fp);
 
 	if (level)
 		fprintf(log_fp, "%s:%d: %s: ", fname, lineno, level_name[level]);
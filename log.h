@@ -43,8 +43,16 @@ enum _log_facility
   L_MAX
 };
 
+enum _log_mode
+{
+  LOG_SYNC=0,	/* format and write in the caller */
+  LOG_ASYNC,	/* format in the caller, write from the log thread */
+  LOG_BINARY	/* copy the arguments, format and write from the log thread */
+};
+
 extern int log_level[L_MAX];
-extern int log_init(const char *fname, const char *debug);
+extern int log_init(const char *fname, const char *debug, const char *mode);
+extern int log_start_writer(void);
 extern void log_close(void);
 extern void log_err(int level, enum _log_facility facility, char *fname, int lineno, char *fmt, ...)
 	__attribute__((__format__ (__printf__, 5, 6)));
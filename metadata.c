@@ -277,6 +277,85 @@ GetFolderMetadata(const char *name, const char *path, const char *artist, const
 	return ret;
 }
 
+/* MIME types by extension, for entries that have not been probed yet; the
+ * full parsers replace them with what they find in the file */
+static const struct {
+	const char *ext;
+	const char *mime;
+} basic_mimes[] = {
+	{ ".mp3",  "audio/mpeg" },
+	{ ".m4a",  "audio/mp4" },
+	{ ".aac",  "audio/mp4" },
+	{ ".m4p",  "audio/mp4" },
+	{ ".wma",  "audio/x-ms-wma" },
+	{ ".flac", "audio/x-flac" },
+	{ ".fla",  "audio/x-flac" },
+	{ ".flc",  "audio/x-flac" },
+	{ ".wav",  "audio/x-wav" },
+	{ ".ogg",  "audio/ogg" },
+	{ ".oga",  "audio/ogg" },
+	{ ".pcm",  "audio/L16" },
+	{ ".mpg",  "video/mpeg" },
+	{ ".mpeg", "video/mpeg" },
+	{ ".vob",  "video/mpeg" },
+	{ ".ts",   "video/mpeg" },
+	{ ".mts",  "video/mpeg" },
+	{ ".m2ts", "video/mpeg" },
+	{ ".m2t",  "video/mpeg" },
+	{ ".avi",  "video/x-msvideo" },
+	{ ".divx", "video/x-msvideo" },
+	{ ".xvid", "video/x-msvideo" },
+	{ ".mkv",  "video/x-matroska" },
+	{ ".mp4",  "video/mp4" },
+	{ ".m4v",  "video/mp4" },
+	{ ".mov",  "video/quicktime" },
+	{ ".wmv",  "video/x-ms-wmv" },
+	{ ".flv",  "video/x-flv" },
+	{ NULL, NULL }
+};
+
+int64_t
+GetBasicMetadata(const char *path, char *name, media_types type)
+{
+	struct stat file;
+	const char *mime = NULL;
+	int ret, i;
+
+	if ( stat(path, &file) != 0 )
+		return 0;
+	strip_ext(name);
+
+	if( type == TYPE_IMAGES )
+		mime = "image/jpeg";
+	else if( ends_with(path, ".3gp") )
+		mime = (type == TYPE_AUDIO) ? "audio/3gpp" : "video/3gpp";
+	else if( ends_with(path, ".asf") )
+		mime = (type == TYPE_AUDIO) ? "audio/x-ms-wma" : "video/x-ms-wmv";
+	else if( type == TYPE_AUDIO && ends_with(path, ".mp4") )
+		mime = "audio/mp4";
+	else
+	{
+		for( i = 0; basic_mimes[i].ext; i++ )
+		{
+			if( ends_with(path, basic_mimes[i].ext) )
+			{
+				mime = basic_mimes[i].mime;
+				break;
+			}
+		}
+	}
+
+	ret = sql_exec(db, "INSERT into DETAILS"
+	                   " (PATH, SIZE, TIMESTAMP, TITLE, MIME) "
+	                   "VALUES"
+	                   " (%Q, %lld, %lld, '%q', %Q);",
+	                   path, (long long)file.st_size, (long long)file.st_mtime, name, mime);
+	if( ret != SQLITE_OK )
+		return 0;
+
+	return sqlite3_last_insert_rowid(db);
+}
+
 int64_t
 GetAudioMetadata(const char *path, char *name)
 {
@@ -91,6 +91,9 @@ check_for_captions(const char *path, int64_t detailID);
 int64_t
 GetFolderMetadata(const char *name, const char *path, const char *artist, const char *genre, int64_t album_art);
 
+int64_t
+GetBasicMetadata(const char *path, char *name, media_types type);
+
 int64_t
 GetAudioMetadata(const char *path, char *name);
 
@@ -0,0 +1,453 @@
+/* Prometheus metrics for the /metrics endpoint
+ *
+ * MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "config.h"
+#include "metrics.h"
+#include "clients.h"
+#include "upnphttp.h"
+#include "upnpsoap.h"
+#include "utils.h"
+#include "log.h"
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+#define CLIENT_TYPES	(EStandardUPnP + 1)
+
+/* Latencies are kept in log-linear buckets, HDR histogram style: values
+ * below 4us get a bucket each, and every power of two above that is split
+ * into 4 sub-buckets, which bounds the error at 25% over the whole range.
+ * Anything above 2^32us lands in the last bucket. */
+#define HIST_SUB_BITS	2
+#define HIST_SUB	(1 << HIST_SUB_BITS)
+#define HIST_BUCKETS	(32 * HIST_SUB)
+
+/* Exported bucket boundaries run from 64us to ~50s */
+#define HIST_MIN_POW	6
+#define HIST_MAX_POW	25
+
+struct histogram {
+	uint64_t sum;			/* microseconds */
+	uint64_t buckets[HIST_BUCKETS];
+};
+
+/* Everything lives in an anonymous shared mapping, so the streaming
+ * children and the scanner update the same counters the parent reports. */
+struct stream_slot {
+	pid_t pid;		/* 0 while the slot is free */
+	uint32_t client;	/* client IPv4 address, network order */
+};
+
+struct metrics_shm {
+	int64_t counters[M_COUNTERS];
+	uint64_t stream_bytes[CLIENT_TYPES];
+	struct stream_slot streams[METRICS_STREAMS];
+	struct histogram soap[METRICS_SOAP_METHODS];
+	struct histogram sql;
+};
+
+static struct metrics_shm *shm = NULL;
+
+int
+metrics_init(void)
+{
+	void *map;
+
+	map = mmap(NULL, sizeof(struct metrics_shm), PROT_READ|PROT_WRITE,
+	           MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED)
+	{
+		DPRINTF(E_ERROR, L_GENERAL, "Unable to map metrics: %s\n", strerror(errno));
+		return -1;
+	}
+	memset(map, 0, sizeof(struct metrics_shm));
+	shm = map;
+
+	return 0;
+}
+
+void
+metrics_add(enum metrics_counter c, int64_t delta)
+{
+	if (shm)
+		__sync_fetch_and_add(&shm->counters[c], delta);
+}
+
+void
+metrics_set(enum metrics_counter c, int64_t value)
+{
+	if (shm)
+		shm->counters[c] = value;
+}
+
+int64_t
+metrics_get(enum metrics_counter c)
+{
+	return shm ? shm->counters[c] : 0;
+}
+
+int
+metrics_scan_progress(double *done, long *eta)
+{
+	int64_t *c;
+	int64_t total, files, left;
+	time_t elapsed;
+
+	if (!shm)
+		return 0;
+	c = shm->counters;
+	total = c[M_SCAN_ESTIMATE];
+	if (!c[M_SCAN_START] || c[M_SCAN_END] || c[M_SCAN_STAGE_FILES] || total <= 0)
+		return 0;
+	files = c[M_SCAN_FILES];
+	left = MAX(total - files - c[M_SCAN_RESUMED], 0);
+	*done = (double)(total - left) / total;
+	elapsed = time(NULL) - c[M_SCAN_START];
+	*eta = files ? (long)((double)elapsed / files * left) : -1;
+
+	return 1;
+}
+
+static int
+hist_index(unsigned long long v)
+{
+	int msb;
+
+	if (v < HIST_SUB)
+		return v;
+	msb = 63 - __builtin_clzll(v);
+	if (msb >= 32)
+		return HIST_BUCKETS - 1;
+	return ((msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS) +
+	       ((v >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* Exclusive upper bound of a bucket, in microseconds */
+static unsigned long long
+hist_upper(int i)
+{
+	int shift;
+
+	if (i < HIST_SUB)
+		return i + 1;
+	shift = (i >> HIST_SUB_BITS) - 1;
+	return (unsigned long long)(HIST_SUB + (i & (HIST_SUB - 1)) + 1) << shift;
+}
+
+/* Prometheus bucket bounds are inclusive, so file each value by the
+ * microsecond below it: a value on a boundary then counts towards le. */
+static void
+hist_record(struct histogram *hist, unsigned long long usecs)
+{
+	__sync_fetch_and_add(&hist->buckets[hist_index(usecs ? usecs - 1 : 0)], 1);
+	__sync_fetch_and_add(&hist->sum, usecs);
+}
+
+void
+metrics_soap(int method, unsigned long long usecs)
+{
+	if (shm && method >= 0 && method < METRICS_SOAP_METHODS)
+		hist_record(&shm->soap[method], usecs);
+}
+
+void
+metrics_sql(unsigned long long usecs)
+{
+	if (shm)
+		hist_record(&shm->sql, usecs);
+}
+
+void
+metrics_stream(int type, int64_t bytes)
+{
+	if (!shm || bytes <= 0)
+		return;
+	if (type < 0 || type >= CLIENT_TYPES)
+		type = 0;
+	__sync_fetch_and_add(&shm->stream_bytes[type], bytes);
+}
+
+int
+metrics_stream_begin(uint32_t client)
+{
+	int i;
+
+	if (!shm)
+		return -1;
+	for (i = 0; i < METRICS_STREAMS; i++)
+	{
+		if (!__sync_bool_compare_and_swap(&shm->streams[i].pid, 0, getpid()))
+			continue;
+		shm->streams[i].client = client;
+		__sync_fetch_and_add(&shm->counters[M_ACTIVE_STREAMS], 1);
+		return i;
+	}
+	return -1;
+}
+
+void
+metrics_stream_end(int slot)
+{
+	if (!shm || slot < 0 || slot >= METRICS_STREAMS)
+		return;
+	if (__sync_bool_compare_and_swap(&shm->streams[slot].pid, getpid(), 0))
+		__sync_fetch_and_sub(&shm->counters[M_ACTIVE_STREAMS], 1);
+}
+
+/* Called from the SIGCHLD handler, so it only touches the shared mapping */
+void
+metrics_stream_reap(pid_t pid)
+{
+	int i;
+
+	if (!shm || pid <= 0)
+		return;
+	for (i = 0; i < METRICS_STREAMS; i++)
+	{
+		if (__sync_bool_compare_and_swap(&shm->streams[i].pid, pid, 0))
+			__sync_fetch_and_sub(&shm->counters[M_ACTIVE_STREAMS], 1);
+	}
+}
+
+int
+metrics_stream_share(uint32_t client, int *nstreams)
+{
+	uint32_t seen[METRICS_STREAMS];
+	int nclients = 0, i, j;
+
+	*nstreams = 0;
+	if (!shm)
+		return 0;
+	for (i = 0; i < METRICS_STREAMS; i++)
+	{
+		if (!shm->streams[i].pid)
+			continue;
+		if (shm->streams[i].client == client)
+			(*nstreams)++;
+		for (j = 0; j < nclients; j++)
+		{
+			if (seen[j] == shm->streams[i].client)
+				break;
+		}
+		if (j == nclients)
+			seen[nclients++] = shm->streams[i].client;
+	}
+	return nclients;
+}
+
+/* Emit the buckets at 1x and 1.5x each power of two, both of which fall on
+ * sub-bucket boundaries, so the cumulative counts are exact. */
+static void
+render_histogram(struct string_s *str, const char *name, const char *labels,
+                 const struct histogram *hist)
+{
+	uint64_t count = 0;
+	unsigned long long bound;
+	int i = 0, p, half;
+
+	for (p = HIST_MIN_POW; p <= HIST_MAX_POW; p++)
+	{
+		for (half = 0; half < 2; half++)
+		{
+			bound = (1ULL << p) + (half ? (1ULL << (p - 1)) : 0);
+			for (; i < HIST_BUCKETS && hist_upper(i) <= bound; i++)
+				count += hist->buckets[i];
+			strcatf(str, "%s_bucket{%s%sle=\"%.9g\"} %llu\n", name, labels,
+			        *labels ? "," : "", bound / 1e6, (unsigned long long)count);
+		}
+	}
+	for (; i < HIST_BUCKETS; i++)
+		count += hist->buckets[i];
+	strcatf(str, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels,
+	        *labels ? "," : "", (unsigned long long)count);
+	strcatf(str, "%s_sum%s%s%s %.6f\n", name, *labels ? "{" : "", labels,
+	        *labels ? "}" : "", hist->sum / 1e6);
+	strcatf(str, "%s_count%s%s%s %llu\n", name, *labels ? "{" : "", labels,
+	        *labels ? "}" : "", (unsigned long long)count);
+}
+
+static int
+hist_empty(const struct histogram *hist)
+{
+	int i;
+
+	for (i = 0; i < HIST_BUCKETS; i++)
+		if (hist->buckets[i])
+			return 0;
+	return 1;
+}
+
+static void
+render_cache(struct string_s *str, const char *cache, int64_t hits, int64_t misses)
+{
+	strcatf(str, "minidlna_cache_requests_total{cache=\"%s\",result=\"hit\"} %lld\n"
+	             "minidlna_cache_requests_total{cache=\"%s\",result=\"miss\"} %lld\n",
+	        cache, (long long)hits, cache, (long long)misses);
+}
+
+static void
+render_ratio(struct string_s *str, const char *cache, int64_t hits, int64_t misses)
+{
+	strcatf(str, "minidlna_cache_hit_ratio{cache=\"%s\"} %g\n", cache,
+	        (hits + misses) ? (double)hits / (hits + misses) : 0.0);
+}
+
+/* client_types[] can hold several entries per type, so look it up */
+static const char *
+client_name(int type)
+{
+	int i;
+
+	for (i = 0; client_types[i].name; i++)
+	{
+		if (client_types[i].type == type)
+			return client_types[i].name;
+	}
+	return client_types[0].name;
+}
+
+void
+metrics_render(struct string_s *str)
+{
+	const int64_t *c;
+	const char *method;
+	char labels[64];
+	time_t start, end;
+	double done;
+	long eta;
+	int i;
+
+	if (!shm)
+		return;
+	c = shm->counters;
+
+	strcatf(str, "# HELP minidlna_soap_request_duration_seconds Time spent handling SOAP actions.\n"
+	             "# TYPE minidlna_soap_request_duration_seconds histogram\n");
+	for (i = 0; i < METRICS_SOAP_METHODS && (method = SoapMethodName(i)); i++)
+	{
+		if (hist_empty(&shm->soap[i]))
+			continue;
+		snprintf(labels, sizeof(labels), "action=\"%s\"", method);
+		render_histogram(str, "minidlna_soap_request_duration_seconds", labels, &shm->soap[i]);
+	}
+
+	strcatf(str, "# HELP minidlna_sql_query_duration_seconds Time spent executing SQL statements.\n"
+	             "# TYPE minidlna_sql_query_duration_seconds histogram\n");
+	render_histogram(str, "minidlna_sql_query_duration_seconds", "", &shm->sql);
+
+	strcatf(str, "# HELP minidlna_stream_bytes_total Bytes of media streamed, by client type.\n"
+	             "# TYPE minidlna_stream_bytes_total counter\n");
+	for (i = 0; i < CLIENT_TYPES; i++)
+	{
+		if (!shm->stream_bytes[i])
+			continue;
+		strcatf(str, "minidlna_stream_bytes_total{client=\"%s\"} %llu\n",
+		        client_name(i), (unsigned long long)shm->stream_bytes[i]);
+	}
+
+	strcatf(str, "# HELP minidlna_transfer_bytes_total Bytes of media streamed, by transfer method.\n"
+	             "# TYPE minidlna_transfer_bytes_total counter\n"
+	             "minidlna_transfer_bytes_total{method=\"sendfile\"} %lld\n"
+	             "minidlna_transfer_bytes_total{method=\"read\"} %lld\n"
+	             "minidlna_transfer_bytes_total{method=\"cache\"} %lld\n",
+	        (long long)c[M_SENDFILE_BYTES], (long long)c[M_READ_BYTES],
+	        (long long)c[M_BLOCKCACHE_BYTES]);
+
+	strcatf(str, "# HELP minidlna_active_streams Media streams currently being served.\n"
+	             "# TYPE minidlna_active_streams gauge\n"
+	             "minidlna_active_streams %lld\n", (long long)c[M_ACTIVE_STREAMS]);
+
+	start = c[M_SCAN_START];
+	end = c[M_SCAN_END] ? c[M_SCAN_END] : time(NULL);
+	strcatf(str, "# HELP minidlna_scan_files_total Files added by the media scanner.\n"
+	             "# TYPE minidlna_scan_files_total counter\n"
+	             "minidlna_scan_files_total %lld\n"
+	             "# HELP minidlna_scan_files_per_second Average rate of the current or last scan.\n"
+	             "# TYPE minidlna_scan_files_per_second gauge\n"
+	             "minidlna_scan_files_per_second %g\n"
+	             "# HELP minidlna_scan_in_progress Whether a media scan is running.\n"
+	             "# TYPE minidlna_scan_in_progress gauge\n"
+	             "minidlna_scan_in_progress %d\n",
+	        (long long)c[M_SCAN_FILES],
+	        start ? (double)c[M_SCAN_FILES] / (end > start ? end - start : 1) : 0.0,
+	        (start && !c[M_SCAN_END]) ? 1 : 0);
+
+	if (metrics_scan_progress(&done, &eta))
+	{
+		strcatf(str, "# HELP minidlna_scan_progress_ratio Estimated fraction of the running scan done.\n"
+		             "# TYPE minidlna_scan_progress_ratio gauge\n"
+		             "minidlna_scan_progress_ratio %g\n", done);
+		if (eta >= 0)
+			strcatf(str, "# HELP minidlna_scan_remaining_seconds Estimated time left for the running scan.\n"
+			             "# TYPE minidlna_scan_remaining_seconds gauge\n"
+			             "minidlna_scan_remaining_seconds %ld\n", eta);
+	}
+
+	strcatf(str, "# HELP minidlna_scan_stage_seconds Time spent in each stage of the current or last scan.\n"
+	             "# TYPE minidlna_scan_stage_seconds gauge\n"
+	             "minidlna_scan_stage_seconds{stage=\"files\"} %.6f\n"
+	             "minidlna_scan_stage_seconds{stage=\"index\"} %.6f\n"
+	             "minidlna_scan_stage_seconds{stage=\"playlists\"} %.6f\n"
+	             "minidlna_scan_stage_seconds{stage=\"metadata\"} %.6f\n"
+	             "# HELP minidlna_scan_pending_files Files cataloged but not yet probed for metadata.\n"
+	             "# TYPE minidlna_scan_pending_files gauge\n"
+	             "minidlna_scan_pending_files %lld\n",
+	        c[M_SCAN_STAGE_FILES] / 1e6, c[M_SCAN_STAGE_INDEX] / 1e6,
+	        c[M_SCAN_STAGE_PLAYLISTS] / 1e6, c[M_SCAN_STAGE_METADATA] / 1e6,
+	        (long long)c[M_SCAN_PENDING]);
+
+	strcatf(str, "# HELP minidlna_inotify_queue_bytes Unread inotify events, in bytes.\n"
+	             "# TYPE minidlna_inotify_queue_bytes gauge\n"
+	             "minidlna_inotify_queue_bytes %lld\n"
+	             "# HELP minidlna_inotify_events_total inotify events processed.\n"
+	             "# TYPE minidlna_inotify_events_total counter\n"
+	             "minidlna_inotify_events_total %lld\n",
+	        (long long)c[M_INOTIFY_QUEUE], (long long)c[M_INOTIFY_EVENTS]);
+
+	strcatf(str, "# HELP minidlna_cache_requests_total Cache lookups, by cache and result.\n"
+	             "# TYPE minidlna_cache_requests_total counter\n");
+	render_cache(str, "probe", c[M_PROBE_HIT], c[M_PROBE_MISS]);
+	render_cache(str, "resized", c[M_RESIZE_HIT], c[M_RESIZE_MISS]);
+	render_cache(str, "details", c[M_DETAILS_HIT], c[M_DETAILS_MISS]);
+	render_cache(str, "album_art", c[M_ART_HIT], c[M_ART_MISS]);
+	strcatf(str, "# HELP minidlna_cache_hit_ratio Fraction of cache lookups that hit.\n"
+	             "# TYPE minidlna_cache_hit_ratio gauge\n");
+	render_ratio(str, "probe", c[M_PROBE_HIT], c[M_PROBE_MISS]);
+	render_ratio(str, "resized", c[M_RESIZE_HIT], c[M_RESIZE_MISS]);
+	render_ratio(str, "details", c[M_DETAILS_HIT], c[M_DETAILS_MISS]);
+	render_ratio(str, "album_art", c[M_ART_HIT], c[M_ART_MISS]);
+	strcatf(str, "# HELP minidlna_resized_cache_bytes Size of the resized image cache.\n"
+	             "# TYPE minidlna_resized_cache_bytes gauge\n"
+	             "minidlna_resized_cache_bytes %lld\n", (long long)c[M_RESIZE_BYTES]);
+
+	strcatf(str, "# HELP minidlna_ssdp_searches_total SSDP M-SEARCH requests, by outcome.\n"
+	             "# TYPE minidlna_ssdp_searches_total counter\n"
+	             "minidlna_ssdp_searches_total{result=\"answered\"} %lld\n"
+	             "minidlna_ssdp_searches_total{result=\"coalesced\"} %lld\n"
+	             "minidlna_ssdp_searches_total{result=\"ratelimited\"} %lld\n",
+	        (long long)c[M_SSDP_SENT], (long long)c[M_SSDP_COALESCED],
+	        (long long)c[M_SSDP_LIMITED]);
+}
@@ -0,0 +1,131 @@
+/* Prometheus metrics for the /metrics endpoint
+ *
+ * MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "minidlnatypes.h"
+
+/* Size of the buffer the /metrics response is rendered into */
+#define METRICS_RESP_SIZE	131072
+
+/* Upper bound on the number of soapMethods[] entries */
+#define METRICS_SOAP_METHODS	16
+
+/* Upper bound on the audio/video streams that share max_stream_bandwidth */
+#define METRICS_STREAMS		64
+
+enum metrics_counter {
+	M_SENDFILE_BYTES,	/* bytes sent with sendfile() */
+	M_READ_BYTES,		/* bytes sent with the read()/write() fallback */
+	M_BLOCKCACHE_BYTES,	/* bytes sent from the probe block cache */
+	M_ACTIVE_STREAMS,	/* gauge, slots held in the stream table */
+	M_SCAN_FILES,
+	M_SCAN_ESTIMATE,	/* files the running scan is expected to look at */
+	M_SCAN_RESUMED,		/* files committed by the interrupted scan it resumed */
+	M_SCAN_START,		/* wall clock time the scan started */
+	M_SCAN_END,		/* wall clock time the scan finished, 0 while running */
+	M_SCAN_STAGE_FILES,	/* microseconds spent walking and tagging files */
+	M_SCAN_STAGE_INDEX,	/* microseconds spent building the search index */
+	M_SCAN_STAGE_PLAYLISTS,	/* microseconds spent filling playlists */
+	M_SCAN_STAGE_METADATA,	/* microseconds spent reading deferred metadata */
+	M_SCAN_PENDING,		/* gauge, cataloged files waiting for their metadata */
+	M_INOTIFY_QUEUE,	/* gauge, bytes of unread inotify events */
+	M_INOTIFY_EVENTS,
+	M_PROBE_HIT,
+	M_PROBE_MISS,
+	M_RESIZE_HIT,
+	M_RESIZE_MISS,
+	M_RESIZE_BYTES,		/* gauge, size of the resized image cache */
+	M_DETAILS_HIT,
+	M_DETAILS_MISS,
+	M_ART_HIT,		/* album art found in the store */
+	M_ART_MISS,		/* album art decoded and added to it */
+	M_SSDP_SENT,		/* M-SEARCH responses sent */
+	M_SSDP_COALESCED,	/* repeated M-SEARCHes answered by a pending response */
+	M_SSDP_LIMITED,		/* M-SEARCHes dropped by the per-source rate limit */
+	M_COUNTERS
+};
+
+/* metrics_init()
+ * map the shared counters; must be called before any children are forked
+ * returns: 0 on success, -1 on failure */
+int metrics_init(void);
+
+/* monotonic_us()
+ * microseconds from an arbitrary fixed point, for timing (see uuid.c) */
+unsigned long long monotonic_us(void);
+
+/* metrics_add()
+ * atomically add delta to a counter or gauge */
+void metrics_add(enum metrics_counter c, int64_t delta);
+
+/* metrics_set()
+ * set a gauge to an absolute value */
+void metrics_set(enum metrics_counter c, int64_t value);
+
+/* metrics_soap()
+ * record the duration of a call to soapMethods[method] */
+void metrics_soap(int method, unsigned long long usecs);
+
+/* metrics_sql()
+ * record the duration of one SQL statement */
+void metrics_sql(unsigned long long usecs);
+
+/* metrics_stream()
+ * account bytes streamed to a client of the given enum client_types */
+void metrics_stream(int type, int64_t bytes);
+
+/* metrics_stream_begin()
+ * register the calling process as streaming to client, an IPv4 address,
+ * and count it in M_ACTIVE_STREAMS
+ * returns: a slot for metrics_stream_end(), or -1 if the table is full */
+int metrics_stream_begin(uint32_t client);
+
+/* metrics_stream_end()
+ * release a slot taken by metrics_stream_begin() */
+void metrics_stream_end(int slot);
+
+/* metrics_stream_reap()
+ * release any slot still held by a child that exited or was killed */
+void metrics_stream_reap(pid_t pid);
+
+/* metrics_stream_share()
+ * count the registered streams, in every process
+ * returns: the number of distinct clients, with the number of streams
+ *          going to client in *nstreams */
+int metrics_stream_share(uint32_t client, int *nstreams);
+
+/* metrics_get()
+ * returns: the current value of a counter or gauge */
+int64_t metrics_get(enum metrics_counter c);
+
+/* metrics_scan_progress()
+ * estimate how far along the running scan's walk of the media dirs is
+ * returns: 1 with the fraction done in *done and the seconds left in *eta
+ *          (-1 until a file is added), or 0 if no scan is walking them */
+int metrics_scan_progress(double *done, long *eta);
+
+/* metrics_render()
+ * append every metric to str in the Prometheus text exposition format */
+void metrics_render(struct string_s *str);
+
+#endif
@@ -88,6 +88,9 @@
 #include "minissdp.h"
 #include "minidlnatypes.h"
 #include "process.h"
+#include "blockcache.h"
+#include "metrics.h"
+#include "resizecache.h"
 #include "upnpevents.h"
 #include "scanner.h"
 #include "inotify.h"
@@ -312,6 +315,11 @@ check_db(sqlite3 *db, int new_db, pid_t *scanner_pid)
 	int i, rows = 0;
 	int ret;
 
+	if (!new_db && scanner_can_resume())
+	{
+		DPRINTF(E_WARN, L_GENERAL, "Resuming interrupted media scan...\n");
+		goto scan;
+	}
 	if (!new_db)
 	{
 		/* Check if any new media dirs appeared */
@@ -348,6 +356,11 @@ check_db(sqlite3 *db, int new_db, pid_t *scanner_pid)
 	}
 
 	ret = db_upgrade(db);
+	if (ret == 0 && !new_db && GETFLAG(RESCAN_MASK))
+	{
+		DPRINTF(E_WARN, L_GENERAL, "Rescanning media dirs for changes...\n");
+		goto scan;
+	}
 	if (ret != 0)
 	{
 rescan:
@@ -362,13 +375,14 @@ rescan:
 				ret, DB_VERSION);
 		sqlite3_close(db);
 
-		snprintf(cmd, sizeof(cmd), "rm -rf %s/files.db %s/art_cache", db_path, db_path);
+		snprintf(cmd, sizeof(cmd), "rm -rf %s/files.db %s/art_cache %s/resized_cache", db_path, db_path, db_path);
 		if (system(cmd) != 0)
 			DPRINTF(E_FATAL, L_GENERAL, "Failed to clean old file cache!  Exiting...\n");
 
 		open_db(&db);
 		if (CreateDatabase() != 0)
 			DPRINTF(E_FATAL, L_GENERAL, "ERROR: Failed to create sqlite database!  Exiting...\n");
+scan:
 #if USE_FORK
 		scanning = 1;
 		sqlite3_close(db);
@@ -376,6 +390,7 @@ rescan:
 		open_db(&db);
 		if (*scanner_pid == 0) /* child (scanner) process */
 		{
+			log_start_writer();
 			start_scanner();
 			sqlite3_close(db);
 			log_close();
@@ -392,6 +407,47 @@ rescan:
 	}
 }
 
+/* list the containers changed since the last ContentDirectory event in
+ * container_update_ids
+ * returns: 1 if a container changed since the last call, 0 if not */
+static int
+update_container_ids(void)
+{
+	sqlite3_stmt *stmt;
+	char *p = container_update_ids;
+	char *end = container_update_ids + CONTAINER_UPDATE_IDS_LEN;
+	int64_t seq;
+	int n;
+
+	seq = sql_get_int64_field(db, "SELECT max(UPDATE_ID) from CONTAINER_UPDATES");
+	if (seq < 0 || seq == container_update_seq)
+		return 0;
+	container_update_seq = seq;
+
+	*p = '\0';
+	if (sqlite3_prepare_v2(db, "SELECT OBJECT_ID, UPDATE_ID from CONTAINER_UPDATES"
+	                           " where UPDATE_ID > ? order by UPDATE_ID", -1, &stmt, NULL) != SQLITE_OK)
+		return 1;
+	sqlite3_bind_int64(stmt, 1, container_evented_seq);
+	while (sqlite3_step(stmt) == SQLITE_ROW)
+	{
+		n = snprintf(p, end - p, "%s%s,%u", p == container_update_ids ? "" : ",",
+		             (const char *)sqlite3_column_text(stmt, 0),
+		             (unsigned int)sqlite3_column_int64(stmt, 1));
+		if (n >= end - p)
+		{
+			/* too many to list; control points have SystemUpdateID */
+			DPRINTF(E_DEBUG, L_GENERAL, "Too many changed containers to event\n");
+			container_update_ids[0] = '\0';
+			break;
+		}
+		p += n;
+	}
+	sqlite3_finalize(stmt);
+
+	return 1;
+}
+
 static int
 writepidfile(const char *fname, int pid, uid_t uid)
 {
@@ -499,6 +555,7 @@ init(int argc, char **argv)
 	char buf[PATH_MAX];
 	char log_str[75] = "general,artwork,database,inotify,scanner,metadata,http,ssdp,tivo=warn";
 	char *log_level = NULL;
+	char *log_mode = NULL;
 	struct media_dir_s *media_dir;
 	int ifaces = 0;
 	media_types types;
@@ -529,7 +586,14 @@ init(int argc, char **argv)
 	runtime_vars.port = 8200;
 	runtime_vars.notify_interval = 895;	/* seconds between SSDP announces */
 	runtime_vars.max_connections = 50;
+	runtime_vars.stream_burst = 0;
+	runtime_vars.max_bandwidth = 0;
+	runtime_vars.probe_cache = 16;
+	runtime_vars.resize_cache = 64;
+	runtime_vars.scan_threads = 1;
+	runtime_vars.poll_interval = 0;
 	runtime_vars.root_container = NULL;
+	runtime_vars.control_token = NULL;
 	runtime_vars.ifaces[0] = NULL;
 
 	/* read options file first since
@@ -669,10 +733,17 @@ init(int argc, char **argv)
 		case UPNPLOGLEVEL:
 			log_level = ary_options[i].value;
 			break;
+		case LOG_MODE:
+			log_mode = ary_options[i].value;
+			break;
 		case UPNPINOTIFY:
 			if (!strtobool(ary_options[i].value))
 				CLEARFLAG(INOTIFY_MASK);
 			break;
+		case UPNPFANOTIFY:
+			if (strtobool(ary_options[i].value))
+				SETFLAG(FANOTIFY_MASK);
+			break;
 		case ENABLE_TIVO:
 			if (strtobool(ary_options[i].value))
 				SETFLAG(TIVO_MASK);
@@ -737,6 +808,41 @@ init(int argc, char **argv)
 			if (strtobool(ary_options[i].value))
 				SETFLAG(MERGE_MEDIA_DIRS_MASK);
 			break;
+		case STREAM_BURST:
+			runtime_vars.stream_burst = atoi(ary_options[i].value);
+			break;
+		case MAX_STREAM_BANDWIDTH:
+			runtime_vars.max_bandwidth = atoi(ary_options[i].value);
+			break;
+		case PROBE_CACHE:
+			runtime_vars.probe_cache = atoi(ary_options[i].value);
+			break;
+		case PROBE_CACHE_PREFILL:
+			if (strtobool(ary_options[i].value))
+				SETFLAG(PROBE_PREFILL_MASK);
+			break;
+		case RESIZED_CACHE_SIZE:
+			runtime_vars.resize_cache = atoi(ary_options[i].value);
+			break;
+		case RESIZED_CACHE_PREGEN:
+			if (strtobool(ary_options[i].value))
+				SETFLAG(RESIZE_PREGEN_MASK);
+			break;
+		case DEFERRED_METADATA:
+			if (strtobool(ary_options[i].value))
+				SETFLAG(DEFERRED_METADATA_MASK);
+			break;
+		case SCAN_THREADS:
+			runtime_vars.scan_threads = atoi(ary_options[i].value);
+			break;
+		case POLL_INTERVAL:
+			runtime_vars.poll_interval = atoi(ary_options[i].value);
+			break;
+		case CONTROL_TOKEN:
+			if (strlen(ary_options[i].value) < 16)
+				DPRINTF(E_FATAL, L_GENERAL, "control_token must be at least 16 characters long\n");
+			runtime_vars.control_token = ary_options[i].value;
+			break;
 		default:
 			DPRINTF(E_ERROR, L_GENERAL, "Unknown option in file %s\n",
 				optionsfile);
@@ -836,8 +942,11 @@ init(int argc, char **argv)
 		case 'h':
 			runtime_vars.port = -1; // triggers help display
 			break;
+		case 'r':
+			SETFLAG(RESCAN_MASK);
+			break;
 		case 'R':
-			snprintf(buf, sizeof(buf), "rm -rf %s/files.db %s/art_cache", db_path, db_path);
+			snprintf(buf, sizeof(buf), "rm -rf %s/files.db %s/art_cache %s/resized_cache", db_path, db_path, db_path);
 			if (system(buf) != 0)
 				DPRINTF(E_FATAL, L_GENERAL, "Failed to clean old file cache. EXITING\n");
 			break;
@@ -882,9 +991,9 @@ init(int argc, char **argv)
 			"\t\t[-t notify_interval] [-P pid_filename]\n"
 			"\t\t[-s serial] [-m model_number]\n"
 #ifdef __linux__
-			"\t\t[-w url] [-R] [-L] [-S] [-V] [-h]\n"
+			"\t\t[-w url] [-r] [-R] [-L] [-S] [-V] [-h]\n"
 #else
-			"\t\t[-w url] [-R] [-L] [-V] [-h]\n"
+			"\t\t[-w url] [-r] [-R] [-L] [-V] [-h]\n"
 #endif
 			"\nNotes:\n\tNotify interval is in seconds. Default is 895 seconds.\n"
 			"\tDefault pid file is %s.\n"
@@ -892,6 +1001,7 @@ init(int argc, char **argv)
 			"\t-w sets the presentation url. Default is http address on port 80\n"
 			"\t-v enables verbose output\n"
 			"\t-h displays this text\n"
+			"\t-r rescans for changes made while not running\n"
 			"\t-R forces a full rescan\n"
 			"\t-L do not create playlists\n"
 #ifdef __linux__
@@ -935,7 +1045,7 @@ init(int argc, char **argv)
 		path = buf;
 		#endif
 	}
-	log_init(path, log_level);
+	log_init(path, log_level, log_mode);
 
 	if (process_check_if_running(pidfilename) < 0)
 	{
@@ -989,6 +1099,12 @@ init(int argc, char **argv)
 		return 1;
 	}
 
+	/* Must be shared with the streaming children, so set it up before forking */
+	blockcache_init(runtime_vars.probe_cache);
+	metrics_init();
+	resize_cache_init();
+	scanner_init();
+
 	return 0;
 }
 
@@ -1042,6 +1158,8 @@ main(int argc, char **argv)
 			ret = -1;
 	}
 	check_db(db, ret, &scanner_pid);
+	container_update_seq = sql_get_int64_field(db, "SELECT max(UPDATE_ID) from CONTAINER_UPDATES");
+	container_evented_seq = container_update_seq;
 #ifdef HAVE_INOTIFY
 	if( GETFLAG(INOTIFY_MASK) )
 	{
@@ -1150,6 +1268,8 @@ main(int argc, char **argv)
 					timeout.tv_sec = lastbeacontime.tv_sec + beacon_interval - timeofday.tv_sec;
 			}
 #endif
+			SendScheduledSSDPResponses(&timeofday, &timeout);
+			upnpevents_sendpending(&timeofday, &timeout);
 		}
 
 		if (scanning)
@@ -1228,10 +1348,11 @@ main(int argc, char **argv)
 			ProcessMonitorEvent(smonitor);
 		}
 		/* increment SystemUpdateID if the content database has changed,
-		 * and if there is an active HTTP connection, at most once every 2 seconds */
+		 * and if there is an active HTTP connection, at most once every 2 seconds;
+		 * the scanner process's changes only show up in CONTAINER_UPDATES */
 		if (i && (timeofday.tv_sec >= (lastupdatetime + 2)))
 		{
-			if (scanning || sqlite3_total_changes(db) != last_changecnt)
+			if (update_container_ids() || sqlite3_total_changes(db) != last_changecnt)
 			{
 				updateID++;
 				last_changecnt = sqlite3_total_changes(db);
@@ -49,7 +49,14 @@ struct runtime_vars_s {
 	int port;	/* HTTP Port */
 	int notify_interval;	/* seconds between SSDP announces */
 	int max_connections;	/* max number of simultaneous conenctions */
+	int stream_burst;	/* stream pacing multiplier applied to the item bitrate (0 = off) */
+	int max_bandwidth;	/* total streaming bandwidth in kbit/s (0 = unlimited) */
+	int probe_cache;	/* number of files in the head/tail block cache */
+	int resize_cache;	/* size limit of the resized image cache in MB (0 = off) */
+	int scan_threads;	/* directory reading threads per device while scanning (0 = off) */
+	int poll_interval;	/* seconds between polls of quiet network directories (0 = off) */
 	const char *root_container;	/* root ObjectID (instead of "0") */
+	const char *control_token;	/* secret of the control interface (NULL = off) */
 	const char *ifaces[MAX_LAN_ADDR];	/* list of configured network interfaces */
 };
 
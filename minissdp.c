@@ -41,6 +41,7 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <errno.h>
+#include <sys/time.h>
 
 #include "minidlnapath.h"
 #include "upnphttp.h"
@@ -50,6 +51,7 @@
 #include "minissdp.h"
 #include "codelength.h"
 #include "utils.h"
+#include "metrics.h"
 #include "log.h"
 
 /* SSDP ip/port */
@@ -203,6 +205,30 @@ static const char * const known_service_types[] =
 	"urn:microsoft.com:service:X_MS_MediaReceiverRegistrar:",
 	0
 };
+#define NUM_SERVICE_TYPES (int)(sizeof(known_service_types) / sizeof(known_service_types[0]) - 1)
+
+#define SSDP_MSG_SIZE 512
+#define SSDP_DATE_ZERO "Thu, 01 Jan 1970 00:00:00 GMT"
+#define SSDP_DATE_LEN (sizeof(SSDP_DATE_ZERO) - 1)
+
+/* The messages we send only depend on the address and port they advertise,
+ * so they are built once per interface and reused.  Of the M-SEARCH
+ * response, only the DATE header is patched before each send. */
+struct ssdp_templates {
+	char host[16];
+	unsigned short port;
+	unsigned int lifetime;
+	int date_off[NUM_SERVICE_TYPES];
+	int resp_len[NUM_SERVICE_TYPES];
+	int notify_len[NUM_SERVICE_TYPES];
+	char resp[NUM_SERVICE_TYPES][SSDP_MSG_SIZE];
+	char notify[NUM_SERVICE_TYPES][SSDP_MSG_SIZE];
+};
+
+/* one per interface, and one spare for replies from other addresses */
+static struct ssdp_templates templates[MAX_LAN_ADDR + 1];
+static int n_templates = 0;
+static int next_template = 0;
 
 static void
 _usleep(long usecs)
@@ -214,106 +240,376 @@ _usleep(long usecs)
 	nanosleep(&sleep_time, NULL);
 }
 
+static void
+build_templates(struct ssdp_templates *t, const char *host, unsigned short port,
+                unsigned int lifetime)
+{
+	int i, l;
+
+	strncpyt(t->host, host, sizeof(t->host));
+	t->port = port;
+	t->lifetime = lifetime;
+	for (i = 0; i < NUM_SERVICE_TYPES; i++)
+	{
+		/*
+		 * follow guideline from document "UPnP Device Architecture 1.0"
+		 * uppercase is recommended.
+		 * DATE: is recommended
+		 * SERVER: OS/ver UPnP/1.0 minidlna/1.0
+		 * - check what to put in the 'Cache-Control' header 
+		 * */
+		l = snprintf(t->resp[i], SSDP_MSG_SIZE, "HTTP/1.1 200 OK\r\n"
+			"CACHE-CONTROL: max-age=%u\r\n"
+			"DATE: " SSDP_DATE_ZERO "\r\n"
+			"ST: %s%s\r\n"
+			"USN: %s%s%s%s\r\n"
+			"EXT:\r\n"
+			"SERVER: " MINIDLNA_SERVER_STRING "\r\n"
+			"LOCATION: http://%s:%u" ROOTDESC_PATH "\r\n"
+			"Content-Length: 0\r\n"
+			"\r\n",
+			lifetime,
+			known_service_types[i],
+			(i > 1 ? "1" : ""),
+			uuidvalue,
+			(i > 0 ? "::" : ""),
+			(i > 0 ? known_service_types[i] : ""),
+			(i > 1 ? "1" : ""),
+			host, (unsigned int)port);
+		t->resp_len[i] = MIN(l, SSDP_MSG_SIZE - 1);
+		t->date_off[i] = strstr(t->resp[i], "DATE: ") + 6 - t->resp[i];
+
+		l = snprintf(t->notify[i], SSDP_MSG_SIZE,
+				"NOTIFY * HTTP/1.1\r\n"
+				"HOST:%s:%d\r\n"
+				"CACHE-CONTROL:max-age=%u\r\n"
+				"LOCATION:http://%s:%d" ROOTDESC_PATH"\r\n"
+				"SERVER: " MINIDLNA_SERVER_STRING "\r\n"
+				"NT:%s%s\r\n"
+				"USN:%s%s%s%s\r\n"
+				"NTS:ssdp:alive\r\n"
+				"\r\n",
+				SSDP_MCAST_ADDR, SSDP_PORT,
+				lifetime,
+				host, port,
+				known_service_types[i],
+				(i > 1 ? "1" : ""),
+				uuidvalue,
+				(i > 0 ? "::" : ""),
+				(i > 0 ? known_service_types[i] : ""),
+				(i > 1 ? "1" : ""));
+		if (l >= SSDP_MSG_SIZE)
+		{
+			DPRINTF(E_WARN, L_SSDP, "SendSSDPNotifies(): truncated output\n");
+			l = SSDP_MSG_SIZE - 1;
+		}
+		t->notify_len[i] = l;
+	}
+}
+
+static struct ssdp_templates *
+get_templates(const char *host, unsigned short port, unsigned int lifetime)
+{
+	struct ssdp_templates *t;
+	int i;
+
+	for (i = 0; i < n_templates; i++)
+	{
+		t = &templates[i];
+		if (t->port == port && t->lifetime == lifetime &&
+		    strcmp(t->host, host) == 0)
+			return t;
+	}
+	/* new or changed interface; reuse the oldest slot */
+	if (n_templates < MAX_LAN_ADDR + 1)
+		i = n_templates++;
+	else
+	{
+		i = next_template;
+		next_template = (next_template + 1) % (MAX_LAN_ADDR + 1);
+	}
+	t = &templates[i];
+	DPRINTF(E_DEBUG, L_SSDP, "Building SSDP messages for %s:%u\n", host, port);
+	build_templates(t, host, port, lifetime);
+
+	return t;
+}
+
+/* Set the DATE header of a response template to the current time */
+static void
+patch_date(struct ssdp_templates *t, int st_no)
+{
+	static time_t last = 0;
+	static char tmstr[SSDP_DATE_LEN + 1];
+	time_t tm = time(NULL);
+
+	if (tm != last)
+	{
+		strftime(tmstr, sizeof(tmstr), "%a, %d %b %Y %H:%M:%S GMT", gmtime(&tm));
+		last = tm;
+	}
+	memcpy(t->resp[st_no] + t->date_off[st_no], tmstr, SSDP_DATE_LEN);
+}
+
+/* send_burst()
+ * send several datagrams to the same destination, in one system call
+ * where sendmmsg() is available
+ * returns: number of datagrams sent, or -1 on error */
+static int
+send_burst(int s, struct sockaddr_in *dest, struct iovec *iov, int count)
+{
+#ifdef HAVE_SENDMMSG
+	struct mmsghdr msgs[NUM_SERVICE_TYPES * 2];
+	int i, n, sent = 0;
+
+	memset(msgs, 0, sizeof(msgs));
+	for (i = 0; i < count; i++)
+	{
+		msgs[i].msg_hdr.msg_name = dest;
+		msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	while (sent < count)
+	{
+		n = sendmmsg(s, msgs + sent, count - sent, 0);
+		if (n < 0)
+			return sent ? sent : -1;
+		sent += n;
+	}
+	return sent;
+#else
+	int i;
+
+	for (i = 0; i < count; i++)
+	{
+		if (sendto(s, iov[i].iov_base, iov[i].iov_len, 0,
+		           (struct sockaddr *)dest, sizeof(struct sockaddr_in)) < 0)
+			return i ? i : -1;
+	}
+	return count;
+#endif
+}
+
 /* not really an SSDP "announce" as it is the response
- * to a SSDP "M-SEARCH" */
+ * to a SSDP "M-SEARCH"
+ * st_no is the service type to answer with, or -1 for all of them */
 static void
 SendSSDPResponse(int s, struct sockaddr_in sockname, int st_no,
                   const char *host, unsigned short port)
 {
-	int l, n;
-	char buf[512];
-	char tmstr[30];
-	time_t tm = time(NULL);
+	struct ssdp_templates *t;
+	struct iovec iov[NUM_SERVICE_TYPES];
+	int i, n = 0;
 
-	/*
-	 * follow guideline from document "UPnP Device Architecture 1.0"
-	 * uppercase is recommended.
-	 * DATE: is recommended
-	 * SERVER: OS/ver UPnP/1.0 minidlna/1.0
-	 * - check what to put in the 'Cache-Control' header 
-	 * */
-	strftime(tmstr, sizeof(tmstr), "%a, %d %b %Y %H:%M:%S GMT", gmtime(&tm));
-	l = snprintf(buf, sizeof(buf), "HTTP/1.1 200 OK\r\n"
-		"CACHE-CONTROL: max-age=%u\r\n"
-		"DATE: %s\r\n"
-		"ST: %s%s\r\n"
-		"USN: %s%s%s%s\r\n"
-		"EXT:\r\n"
-		"SERVER: " MINIDLNA_SERVER_STRING "\r\n"
-		"LOCATION: http://%s:%u" ROOTDESC_PATH "\r\n"
-		"Content-Length: 0\r\n"
-		"\r\n",
-		(runtime_vars.notify_interval<<1)+10,
-		tmstr,
-		known_service_types[st_no],
-		(st_no > 1 ? "1" : ""),
-		uuidvalue,
-		(st_no > 0 ? "::" : ""),
-		(st_no > 0 ? known_service_types[st_no] : ""),
-		(st_no > 1 ? "1" : ""),
-		host, (unsigned int)port);
+	t = get_templates(host, port, (runtime_vars.notify_interval<<1)+10);
+	for (i = 0; i < NUM_SERVICE_TYPES; i++)
+	{
+		if (st_no >= 0 && i != st_no)
+			continue;
+		patch_date(t, i);
+		iov[n].iov_base = t->resp[i];
+		iov[n].iov_len = t->resp_len[i];
+		n++;
+	}
 	DPRINTF(E_DEBUG, L_SSDP, "Sending M-SEARCH response to %s:%d ST: %s\n",
 		inet_ntoa(sockname.sin_addr), ntohs(sockname.sin_port),
-		known_service_types[st_no]);
-	n = sendto(s, buf, l, 0,
-	           (struct sockaddr *)&sockname, sizeof(struct sockaddr_in) );
-	if (n < 0)
+		st_no >= 0 ? known_service_types[st_no] : "ssdp:all");
+	if (send_burst(s, &sockname, iov, n) < n)
 		DPRINTF(E_ERROR, L_SSDP, "sendto(udp): %s\n", strerror(errno));
 }
 
+/* M-SEARCH responses are not sent straight away, but at a random time
+ * within the MX delay the control point asked for, as the UPnP Device
+ * Architecture expects.  Repeats of a search that is still waiting to be
+ * answered are dropped, and each control point gets a limited rate of
+ * responses, so a busy network can't keep us sending multicast replies. */
+#define SSDP_MAX_PENDING	64
+#define SSDP_MAX_MX		5	/* seconds; UDA 1.1 caps MX at 5 */
+#define SSDP_SOURCE_SLOTS	32
+#define SSDP_SOURCE_RATE	12	/* responses per second per control point */
+#define SSDP_SOURCE_BURST	36
+
+struct ssdp_pending {
+	int s;
+	struct sockaddr_in dest;
+	char host[16];
+	unsigned short port;
+	int st_no;		/* -1 for ssdp:all */
+	struct timeval due;
+};
+
+struct ssdp_source {
+	struct in_addr addr;
+	double tokens;
+	struct timeval last;
+};
+
+static struct ssdp_pending pending[SSDP_MAX_PENDING];
+static int n_pending = 0;
+static struct ssdp_source sources[SSDP_SOURCE_SLOTS];
+
+static double
+tv_diff(const struct timeval *a, const struct timeval *b)
+{
+	return (a->tv_sec - b->tv_sec) + (a->tv_usec - b->tv_usec) / 1e6;
+}
+
+/* take count responses from the control point's allowance
+ * returns: 1 if they may be sent, 0 if it is over its rate */
+static int
+ssdp_rate_ok(struct in_addr addr, const struct timeval *now, int count)
+{
+	struct ssdp_source *src = NULL, *oldest = &sources[0];
+	int i;
+
+	for (i = 0; i < SSDP_SOURCE_SLOTS; i++)
+	{
+		if (sources[i].addr.s_addr == addr.s_addr)
+		{
+			src = &sources[i];
+			break;
+		}
+		if (timercmp(&sources[i].last, &oldest->last, <))
+			oldest = &sources[i];
+	}
+	if (!src)
+	{
+		src = oldest;
+		src->addr = addr;
+		src->tokens = SSDP_SOURCE_BURST;
+	}
+	else
+	{
+		src->tokens += tv_diff(now, &src->last) * SSDP_SOURCE_RATE;
+		if (src->tokens > SSDP_SOURCE_BURST)
+			src->tokens = SSDP_SOURCE_BURST;
+	}
+	src->last = *now;
+	if (src->tokens < count)
+		return 0;
+	src->tokens -= count;
+
+	return 1;
+}
+
+static void
+ScheduleSSDPResponse(int s, struct sockaddr_in *dest, int st_no, int mx,
+                     const char *host, unsigned short port)
+{
+	struct ssdp_pending *p;
+	struct timeval now;
+	long delay;
+	int i;
+
+	for (i = 0; i < n_pending; i++)
+	{
+		p = &pending[i];
+		if (p->dest.sin_addr.s_addr != dest->sin_addr.s_addr ||
+		    p->dest.sin_port != dest->sin_port)
+			continue;
+		/* already answering this, or everything */
+		if (p->st_no == st_no || p->st_no == -1)
+		{
+			DPRINTF(E_MAXDEBUG, L_SSDP, "Coalescing repeated M-SEARCH from %s:%d\n",
+				inet_ntoa(dest->sin_addr), ntohs(dest->sin_port));
+			metrics_add(M_SSDP_COALESCED, 1);
+			return;
+		}
+		/* ssdp:all covers any single type we were going to send */
+		if (st_no == -1)
+		{
+			pending[i--] = pending[--n_pending];
+			metrics_add(M_SSDP_COALESCED, 1);
+		}
+	}
+
+	gettimeofday(&now, NULL);
+	if (!ssdp_rate_ok(dest->sin_addr, &now, st_no == -1 ? NUM_SERVICE_TYPES : 1))
+	{
+		DPRINTF(E_DEBUG, L_SSDP, "Not answering M-SEARCH from %s:%d [rate limit]\n",
+			inet_ntoa(dest->sin_addr), ntohs(dest->sin_port));
+		metrics_add(M_SSDP_LIMITED, 1);
+		return;
+	}
+	if (n_pending >= SSDP_MAX_PENDING)
+	{
+		DPRINTF(E_DEBUG, L_SSDP, "Not answering M-SEARCH from %s:%d [queue full]\n",
+			inet_ntoa(dest->sin_addr), ntohs(dest->sin_port));
+		metrics_add(M_SSDP_LIMITED, 1);
+		return;
+	}
+
+	p = &pending[n_pending++];
+	p->s = s;
+	p->dest = *dest;
+	strncpyt(p->host, host, sizeof(p->host));
+	p->port = port;
+	p->st_no = st_no;
+	/* pick a time in the first 90% of the window, so the answer doesn't
+	 * arrive after the control point has stopped listening */
+	delay = MIN(mx, SSDP_MAX_MX) * 900000L;
+	delay = delay ? random() % delay : 0;
+	p->due.tv_sec = now.tv_sec + delay / 1000000;
+	p->due.tv_usec = now.tv_usec + delay % 1000000;
+	if (p->due.tv_usec >= 1000000)
+	{
+		p->due.tv_sec++;
+		p->due.tv_usec -= 1000000;
+	}
+}
+
+void
+SendScheduledSSDPResponses(const struct timeval *now, struct timeval *timeout)
+{
+	struct ssdp_pending *p;
+	struct timeval left;
+	int i;
+
+	for (i = 0; i < n_pending; i++)
+	{
+		p = &pending[i];
+		if (!timercmp(&p->due, now, >))
+		{
+			SendSSDPResponse(p->s, p->dest, p->st_no, p->host, p->port);
+			metrics_add(M_SSDP_SENT, 1);
+			pending[i--] = pending[--n_pending];
+			continue;
+		}
+		timersub(&p->due, now, &left);
+		if (timercmp(&left, timeout, <))
+			*timeout = left;
+	}
+}
+
 void
 SendSSDPNotifies(int s, const char *host, unsigned short port,
                  unsigned int interval)
 {
 	struct sockaddr_in sockname;
-	int l, n, dup, i=0;
-	unsigned int lifetime;
-	char bufr[512];
+	struct ssdp_templates *t;
+	struct iovec iov[NUM_SERVICE_TYPES];
+	int dup, i;
 
 	memset(&sockname, 0, sizeof(struct sockaddr_in));
 	sockname.sin_family = AF_INET;
 	sockname.sin_port = htons(SSDP_PORT);
 	sockname.sin_addr.s_addr = inet_addr(SSDP_MCAST_ADDR);
-	lifetime = (interval << 1) + 10;
+
+	t = get_templates(host, port, (interval << 1) + 10);
+	for (i = 0; i < NUM_SERVICE_TYPES; i++)
+	{
+		iov[i].iov_base = t->notify[i];
+		iov[i].iov_len = t->notify_len[i];
+	}
 
 	for (dup = 0; dup < 2; dup++)
 	{
 		if (dup)
 			_usleep(200000);
-		i = 0;
-		while (known_service_types[i])
-		{
-			l = snprintf(bufr, sizeof(bufr), 
-					"NOTIFY * HTTP/1.1\r\n"
-					"HOST:%s:%d\r\n"
-					"CACHE-CONTROL:max-age=%u\r\n"
-					"LOCATION:http://%s:%d" ROOTDESC_PATH"\r\n"
-					"SERVER: " MINIDLNA_SERVER_STRING "\r\n"
-					"NT:%s%s\r\n"
-					"USN:%s%s%s%s\r\n"
-					"NTS:ssdp:alive\r\n"
-					"\r\n",
-					SSDP_MCAST_ADDR, SSDP_PORT,
-					lifetime,
-					host, port,
-					known_service_types[i],
-					(i > 1 ? "1" : ""),
-					uuidvalue,
-					(i > 0 ? "::" : ""),
-					(i > 0 ? known_service_types[i] : ""),
-					(i > 1 ? "1" : ""));
-			if (l >= sizeof(bufr))
-			{
-				DPRINTF(E_WARN, L_SSDP, "SendSSDPNotifies(): truncated output\n");
-				l = sizeof(bufr);
-			}
-			DPRINTF(E_MAXDEBUG, L_SSDP, "Sending ssdp:alive [%d]\n", s);
-			n = sendto(s, bufr, l, 0,
-				(struct sockaddr *)&sockname, sizeof(struct sockaddr_in));
-			if (n < 0)
-				DPRINTF(E_ERROR, L_SSDP, "sendto(udp_notify=%d, %s): %s\n", s, host, strerror(errno));
-			i++;
-		}
+		DPRINTF(E_MAXDEBUG, L_SSDP, "Sending ssdp:alive [%d]\n", s);
+		if (send_burst(s, &sockname, iov, NUM_SERVICE_TYPES) < NUM_SERVICE_TYPES)
+			DPRINTF(E_ERROR, L_SSDP, "sendto(udp_notify=%d, %s): %s\n", s, host, strerror(errno));
 	}
 }
 
@@ -722,8 +1018,7 @@ ProcessSSDPRequest(int s, unsigned short port)
 					if (l != st_len)
 						break;
 				}
-				_usleep(random()>>20);
-				SendSSDPResponse(s, sendername, i,
+				ScheduleSSDPResponse(s, &sendername, i, mx_val,
 						host, port);
 				return;
 			}
@@ -731,12 +1026,8 @@ ProcessSSDPRequest(int s, unsigned short port)
 			/* strlen("ssdp:all") == 8 */
 			if ((st_len == 8) && (memcmp(st, "ssdp:all", 8) == 0))
 			{
-				for (i=0; known_service_types[i]; i++)
-				{
-					l = strlen(known_service_types[i]);
-					SendSSDPResponse(s, sendername, i,
-							host, port);
-				}
+				ScheduleSSDPResponse(s, &sendername, -1, mx_val,
+						host, port);
 			}
 		}
 		else
@@ -761,22 +1052,22 @@ ProcessSSDPRequest(int s, unsigned short port)
 int
 SendSSDPGoodbyes(int s)
 {
+	static char bufr[NUM_SERVICE_TYPES][SSDP_MSG_SIZE];
+	static struct iovec iov[NUM_SERVICE_TYPES * 2];
 	struct sockaddr_in sockname;
-	int n, l;
-	int i;
-	int dup, ret = 0;
-	char bufr[512];
+	int i, l;
 
 	memset(&sockname, 0, sizeof(struct sockaddr_in));
 	sockname.sin_family = AF_INET;
 	sockname.sin_port = htons(SSDP_PORT);
 	sockname.sin_addr.s_addr = inet_addr(SSDP_MCAST_ADDR);
 
-	for (dup = 0; dup < 2; dup++)
+	/* these don't depend on the interface, so only build them once */
+	if (!iov[0].iov_base)
 	{
-		for (i = 0; known_service_types[i]; i++)
+		for (i = 0; i < NUM_SERVICE_TYPES; i++)
 		{
-			l = snprintf(bufr, sizeof(bufr),
+			l = snprintf(bufr[i], SSDP_MSG_SIZE,
 					"NOTIFY * HTTP/1.1\r\n"
 					"HOST:%s:%d\r\n"
 					"NT:%s%s\r\n"
@@ -789,18 +1080,19 @@ SendSSDPGoodbyes(int s)
 					(i > 0 ? "::" : ""),
 					(i > 0 ? known_service_types[i] : ""),
 					(i > 1 ? "1" : ""));
-			DPRINTF(E_MAXDEBUG, L_SSDP, "Sending ssdp:byebye [%d]\n", s);
-			n = sendto(s, bufr, l, 0,
-			           (struct sockaddr *)&sockname, sizeof(struct sockaddr_in) );
-			if (n < 0)
-			{
-				DPRINTF(E_ERROR, L_SSDP, "sendto(udp_shutdown=%d): %s\n", s, strerror(errno));
-				ret = -1;
-				break;
-			}
+			/* each one goes out twice */
+			iov[i].iov_base = iov[i + NUM_SERVICE_TYPES].iov_base = bufr[i];
+			iov[i].iov_len = iov[i + NUM_SERVICE_TYPES].iov_len = MIN(l, SSDP_MSG_SIZE - 1);
 		}
 	}
-	return ret;
+
+	DPRINTF(E_MAXDEBUG, L_SSDP, "Sending ssdp:byebye [%d]\n", s);
+	if (send_burst(s, &sockname, iov, NUM_SERVICE_TYPES * 2) < NUM_SERVICE_TYPES * 2)
+	{
+		DPRINTF(E_ERROR, L_SSDP, "sendto(udp_shutdown=%d): %s\n", s, strerror(errno));
+		return -1;
+	}
+	return 0;
 }
 
 /* SubmitServicesToMiniSSDPD() :
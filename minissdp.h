@@ -37,6 +37,11 @@ void SendSSDPNotifies(int s, const char *host, unsigned short port, unsigned int
 
 void ProcessSSDPRequest(int s, unsigned short port);
 
+/* SendScheduledSSDPResponses()
+ * send the M-SEARCH responses that are due by now, and lower timeout to
+ * the time left until the next one */
+void SendScheduledSSDPResponses(const struct timeval *now, struct timeval *timeout);
+
 int SendSSDPGoodbyes(int s);
 
 int SubmitServicesToMiniSSDPD(const char *host, unsigned short port);
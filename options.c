@@ -54,6 +54,7 @@ static const struct {
 	{ UPNPMEDIADIR, "media_dir"},
 	{ UPNPALBUMART_NAMES, "album_art_names"},
 	{ UPNPINOTIFY, "inotify" },
+	{ UPNPFANOTIFY, "fanotify" },
 	{ UPNPDBDIR, "db_dir" },
 	{ UPNPLOGDIR, "log_dir" },
 	{ UPNPLOGLEVEL, "log_level" },
@@ -64,7 +65,18 @@ static const struct {
 	{ USER_ACCOUNT, "user" },
 	{ FORCE_SORT_CRITERIA, "force_sort_criteria" },
 	{ MAX_CONNECTIONS, "max_connections" },
-	{ MERGE_MEDIA_DIRS, "merge_media_dirs" }
+	{ MERGE_MEDIA_DIRS, "merge_media_dirs" },
+	{ STREAM_BURST, "stream_burst" },
+	{ MAX_STREAM_BANDWIDTH, "max_stream_bandwidth" },
+	{ PROBE_CACHE, "probe_cache" },
+	{ PROBE_CACHE_PREFILL, "probe_cache_prefill" },
+	{ RESIZED_CACHE_SIZE, "resized_cache_size" },
+	{ RESIZED_CACHE_PREGEN, "resized_cache_pregen" },
+	{ DEFERRED_METADATA, "deferred_metadata" },
+	{ SCAN_THREADS, "scan_threads" },
+	{ POLL_INTERVAL, "poll_interval" },
+	{ CONTROL_TOKEN, "control_token" },
+	{ LOG_MODE, "log_mode" }
 };
 
 int
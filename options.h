@@ -47,6 +47,7 @@ enum upnpconfigoptions {
 	UPNPMEDIADIR,			/* directory to search for UPnP-A/V content */
 	UPNPALBUMART_NAMES,		/* list of '/'-delimited file names to check for album art */
 	UPNPINOTIFY,			/* enable inotify on the media directories */
+	UPNPFANOTIFY,			/* watch the filesystems of the media directories with fanotify */
 	UPNPDBDIR,			/* base directory to store the database and album art cache */
 	UPNPLOGDIR,			/* base directory to store the log file */
 	UPNPLOGLEVEL,			/* logging verbosity */
@@ -57,7 +58,18 @@ enum upnpconfigoptions {
 	USER_ACCOUNT,			/* user account to run as */
 	FORCE_SORT_CRITERIA,		/* force sorting by a given sort criteria */
 	MAX_CONNECTIONS,		/* maximum number of simultaneous connections */
-	MERGE_MEDIA_DIRS		/* don't add an extra directory level when there are multiple media dirs */
+	MERGE_MEDIA_DIRS,		/* don't add an extra directory level when there are multiple media dirs */
+	STREAM_BURST,			/* pace media streams to this multiple of their bitrate */
+	MAX_STREAM_BANDWIDTH,		/* total streaming bandwidth shared between clients, in kbit/s */
+	PROBE_CACHE,			/* number of files to keep head/tail blocks cached for */
+	PROBE_CACHE_PREFILL,		/* load head/tail blocks of newly added files */
+	RESIZED_CACHE_SIZE,		/* size limit of the resized image cache, in MB */
+	RESIZED_CACHE_PREGEN,		/* generate JPEG_SM/JPEG_TN renditions while scanning */
+	DEFERRED_METADATA,		/* catalog files first, read their tags after the scan */
+	SCAN_THREADS,			/* threads reading directories on each device while scanning */
+	POLL_INTERVAL,			/* seconds between checks of quiet directories on network filesystems */
+	CONTROL_TOKEN,			/* secret required by the HTTP control interface */
+	LOG_MODE			/* synchronous, async or binary logging per facility */
 };
 
 /* readoptionsfile()
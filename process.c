@@ -40,6 +40,7 @@
 
 #include "upnpglobalvars.h"
 #include "process.h"
+#include "metrics.h"
 #include "config.h"
 #include "log.h"
 
@@ -121,6 +122,7 @@ process_handle_child_termination(int signal)
 		}
 		number_of_children--;
 		remove_process_info(pid);
+		metrics_stream_reap(pid);
 	}
 }
 
@@ -0,0 +1,339 @@
+/* Disk cache of resized JPEG renditions
+ *
+ * MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <utime.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include "config.h"
+#include "upnpglobalvars.h"
+#include "resizecache.h"
+#include "image_utils.h"
+#include "utils.h"
+#include "sql.h"
+#include "metrics.h"
+#include "log.h"
+
+struct cache_entry {
+	char name[64];
+	time_t used;
+	off_t size;
+};
+
+int
+resize_cache_path(char *buf, size_t len, int64_t id, time_t mtime, int width, int height, int rotate)
+{
+	if( runtime_vars.resize_cache <= 0 )
+		return -1;
+	snprintf(buf, len, "%s/resized_cache/%lld-%lx-%dx%d-%d.jpg",
+	         db_path, (long long)id, (unsigned long)mtime, width, height, rotate);
+	return 0;
+}
+
+int
+resize_cache_open(const char *path, off_t *size)
+{
+	struct stat st;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if( fd < 0 )
+		return -1;
+	if( fstat(fd, &st) != 0 || st.st_size <= 0 )
+	{
+		close(fd);
+		return -1;
+	}
+	*size = st.st_size;
+	/* The file mtime doubles as the LRU timestamp */
+	utime(path, NULL);
+
+	return fd;
+}
+
+static int
+cmp_used(const void *a, const void *b)
+{
+	const struct cache_entry *x = a, *y = b;
+
+	if( x->used < y->used )
+		return -1;
+	return (x->used > y->used);
+}
+
+/* Add up the size of the cache, and evict the least recently used
+ * renditions if it grew past the limit. The total is left in the shared
+ * counters, so commits only need to come back here once it's over again. */
+static void
+resize_cache_trim(void)
+{
+	struct cache_entry *entries = NULL, *tmp;
+	struct dirent *e;
+	struct stat st;
+	char dir[PATH_MAX];
+	off_t total = 0, limit;
+	int n = 0, alloc = 0, i, fd;
+	DIR *d;
+
+	snprintf(dir, sizeof(dir), "%s/resized_cache", db_path);
+	d = opendir(dir);
+	if( !d )
+	{
+		metrics_set(M_RESIZE_BYTES, 0);
+		return;
+	}
+	fd = dirfd(d);
+	while( (e = readdir(d)) )
+	{
+		if( !ends_with(e->d_name, ".jpg") || strlen(e->d_name) >= sizeof(entries->name) )
+			continue;
+		if( fstatat(fd, e->d_name, &st, 0) != 0 )
+			continue;
+		if( n == alloc )
+		{
+			alloc += 256;
+			tmp = realloc(entries, alloc * sizeof(struct cache_entry));
+			if( !tmp )
+				break;
+			entries = tmp;
+		}
+		strcpy(entries[n].name, e->d_name);
+		entries[n].used = st.st_mtime;
+		entries[n].size = st.st_size;
+		total += st.st_size;
+		n++;
+	}
+
+	limit = (off_t)runtime_vars.resize_cache * 1024 * 1024;
+	if( total > limit )
+	{
+		/* Evict down to 90% so we don't rescan on every store */
+		qsort(entries, n, sizeof(struct cache_entry), cmp_used);
+		for( i = 0; i < n && total > limit / 10 * 9; i++ )
+		{
+			if( unlinkat(fd, entries[i].name, 0) == 0 || errno == ENOENT )
+				total -= entries[i].size;
+		}
+		DPRINTF(E_DEBUG, L_HTTP, "Evicted %d resized images from cache\n", i);
+	}
+	closedir(d);
+	free(entries);
+	metrics_set(M_RESIZE_BYTES, total);
+}
+
+void
+resize_cache_init(void)
+{
+	if( runtime_vars.resize_cache > 0 )
+		resize_cache_trim();
+}
+
+/* Renditions are written to a private name first and renamed into place,
+ * since other children may be reading the cache at the same time. */
+static void
+temp_path(char *buf, size_t len, const char *path)
+{
+	snprintf(buf, len, "%s.%d.tmp", path, (int)getpid());
+}
+
+int
+resize_cache_create(const char *path)
+{
+	char dir[PATH_MAX];
+	char tmp[PATH_MAX];
+	int fd;
+
+	snprintf(dir, sizeof(dir), "%s/resized_cache", db_path);
+	if( access(dir, F_OK) != 0 )
+		make_dir(dir, S_IRWXU|S_IRGRP|S_IXGRP|S_IROTH|S_IXOTH);
+
+	temp_path(tmp, sizeof(tmp), path);
+	fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+	if( fd < 0 )
+		DPRINTF(E_WARN, L_HTTP, "Unable to create %s [%s]\n", tmp, strerror(errno));
+
+	return fd;
+}
+
+void
+resize_cache_commit(const char *path, int fd, int ok)
+{
+	char tmp[PATH_MAX];
+	struct stat st;
+	int64_t total;
+
+	temp_path(tmp, sizeof(tmp), path);
+	if( fstat(fd, &st) != 0 )
+		ok = 0;
+	if( close(fd) != 0 )
+		ok = 0;
+	if( !ok || rename(tmp, path) != 0 )
+	{
+		unlink(tmp);
+		return;
+	}
+
+	metrics_add(M_RESIZE_BYTES, st.st_size);
+	total = metrics_get(M_RESIZE_BYTES);
+	/* Without the shared counters, add it all up every time */
+	if( total <= 0 || total > (int64_t)runtime_vars.resize_cache * 1024 * 1024 )
+		resize_cache_trim();
+}
+
+void
+resize_cache_store(const char *path, const unsigned char *data, int size)
+{
+	int fd;
+
+	if( !data || size <= 0 )
+		return;
+	fd = resize_cache_create(path);
+	if( fd < 0 )
+		return;
+	resize_cache_commit(path, fd, write(fd, data, size) == size);
+}
+
+/* Same fit-within-box calculation as add_resized_res() and SendResp_resizedimg() */
+static void
+fit_dimensions(int srcw, int srch, int reqw, int reqh, int *dstw, int *dsth)
+{
+	*dstw = reqw;
+	*dsth = ((((reqw<<10)/srcw)*srch)>>10);
+	if( *dsth > reqh )
+	{
+		*dsth = reqh;
+		*dstw = (((reqh<<10)/srch) * srcw>>10);
+	}
+}
+
+static int
+write_fd(void *arg, const unsigned char *data, int len)
+{
+	return (write(*(int *)arg, data, len) == len) ? 0 : -1;
+}
+
+void
+resize_cache_pregen(int64_t id)
+{
+	static const int sizes[][2] = { { 640, 480 }, { 160, 160 } };
+	char **result;
+	char buf[128];
+	char cache_path[PATH_MAX];
+	int rows = 0, ret, i;
+	int resw, resh, srcw, srch, linkw, linkh, dstw, dsth;
+	int rotation = 0, rotate, scale, size, fd;
+	time_t mtime;
+	image_s *imsrc = NULL, *imdst;
+	unsigned char *data;
+
+	if( runtime_vars.resize_cache <= 0 )
+		return;
+	snprintf(buf, sizeof(buf), "SELECT PATH, RESOLUTION, ROTATION, TIMESTAMP from DETAILS"
+	                           " where ID = %lld", (long long)id);
+	ret = sql_get_table(db, buf, &result, &rows, NULL);
+	if( ret != SQLITE_OK )
+		return;
+	if( !rows || !result[4] || !result[5] || sscanf(result[5], "%dx%d", &resw, &resh) != 2 ||
+	    resw <= 0 || resh <= 0 )
+		goto done;
+	if( result[6] )
+		rotation = atoi(result[6]);
+	mtime = result[7] ? strtoll(result[7], NULL, 10) : 0;
+
+	switch( rotation )
+	{
+		case 90:
+			rotate = ROTATE_90;
+			break;
+		case 270:
+			rotate = ROTATE_270;
+			break;
+		case 180:
+			rotate = ROTATE_180;
+			break;
+		default:
+			rotate = ROTATE_NONE;
+			break;
+	}
+	if( rotate & (ROTATE_90|ROTATE_270) )
+	{
+		srcw = resh;
+		srch = resw;
+	}
+	else
+	{
+		srcw = resw;
+		srch = resh;
+	}
+
+	for( i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++ )
+	{
+		/* Clients request the size advertised in the DIDL <res> URL, which
+		 * was already fitted once against the stored resolution. */
+		fit_dimensions(resw, resh, sizes[i][0], sizes[i][1], &linkw, &linkh);
+		fit_dimensions(srcw, srch, linkw, linkh, &dstw, &dsth);
+		if( dstw <= 0 || dsth <= 0 || (dstw >= srcw && dsth >= srch) )
+			continue;
+		if( resize_cache_path(cache_path, sizeof(cache_path), id, mtime, dstw, dsth, rotate) != 0 ||
+		    access(cache_path, F_OK) == 0 )
+			continue;
+		if( srcw>>4 >= dstw && srch>>4 >= dsth )
+			scale = 8;
+		else if( srcw>>3 >= dstw && srch>>3 >= dsth )
+			scale = 4;
+		else if( srcw>>2 >= dstw && srch>>2 >= dsth )
+			scale = 2;
+		else
+			scale = 1;
+		if( rotate == ROTATE_NONE )
+		{
+			/* Bounded memory, even for huge panoramas */
+			fd = resize_cache_create(cache_path);
+			if( fd < 0 )
+				break;
+			ret = image_resize_jpeg_stream(result[4], scale, dstw, dsth, write_fd, &fd);
+			resize_cache_commit(cache_path, fd, ret == 0);
+			continue;
+		}
+		if( !imsrc )
+		{
+			/* Decode once, at a scale that still suits the largest rendition */
+			imsrc = image_new_from_jpeg(result[4], 1, NULL, 0, scale, rotate);
+			if( !imsrc )
+				break;
+		}
+		imdst = image_resize(imsrc, dstw, dsth);
+		if( !imdst )
+			continue;
+		data = image_save_to_jpeg_buf(imdst, &size);
+		image_free(imdst);
+		resize_cache_store(cache_path, data, size);
+		free(data);
+	}
+	if( imsrc )
+		image_free(imsrc);
+done:
+	sqlite3_free_table(result);
+}
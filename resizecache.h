@@ -0,0 +1,59 @@
+/* Disk cache of resized JPEG renditions
+ *
+ * MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __RESIZECACHE_H__
+#define __RESIZECACHE_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* resize_cache_init()
+ * add up the size of the cache, trimming it if needed; must be called after
+ * metrics_init() and before any children are forked */
+void resize_cache_init(void);
+
+/* resize_cache_path()
+ * build the cache file name for a rendition of a DETAILS item
+ * returns: 0 on success, -1 if the cache is disabled */
+int resize_cache_path(char *buf, size_t len, int64_t id, time_t mtime, int width, int height, int rotate);
+
+/* resize_cache_open()
+ * open a cached rendition and mark it as recently used
+ * returns: an open file descriptor, or -1 if it isn't cached */
+int resize_cache_open(const char *path, off_t *size);
+
+/* resize_cache_create()
+ * open a temporary file to write a new rendition into
+ * returns: an open file descriptor, or -1 on failure */
+int resize_cache_create(const char *path);
+
+/* resize_cache_commit()
+ * close a file from resize_cache_create(), and move it into place if ok
+ * is non-zero, evicting old renditions as needed */
+void resize_cache_commit(const char *path, int fd, int ok);
+
+/* resize_cache_store()
+ * save a freshly encoded rendition, evicting the least recently used
+ * files if the cache grew past resized_cache_size */
+void resize_cache_store(const char *path, const unsigned char *data, int size);
+
+/* resize_cache_pregen()
+ * generate the JPEG_SM and JPEG_TN renditions of a newly scanned image */
+void resize_cache_pregen(int64_t id);
+
+#endif
@@ -27,6 +27,12 @@
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "config.h"
 
@@ -44,14 +50,11 @@
 #include "sql.h"
 #include "scanner.h"
 #include "albumart.h"
+#include "resizecache.h"
+#include "metrics.h"
 #include "containers.h"
 #include "log.h"
 
-#if SCANDIR_CONST
-typedef const struct dirent scan_filter;
-#else
-typedef struct dirent scan_filter;
-#endif
 #ifndef AV_LOG_PANIC
 #define AV_LOG_PANIC AV_LOG_FATAL
 #endif
@@ -65,6 +68,30 @@ struct virtual_item
 	char name[256];
 };
 
+/* The scan runs in one transaction per checkpoint, so clients only ever
+ * see whole directory subtrees appear.  Each checkpoint also records the
+ * last subtree it committed, and an interrupted scan picks up after it. */
+#define SCAN_CHECKPOINT_DIRS	64
+#define SCAN_CHECKPOINT_SECS	3
+
+static struct {
+	char *resume;	/* last path committed by an interrupted scan */
+	int start;	/* first ID of the top level of a media dir */
+	int dirs;	/* directories (or enriched files) since the last checkpoint */
+	time_t last;	/* time of the last checkpoint */
+	int deferred;	/* only catalog files, and queue them for metadata */
+	int bytesort;	/* the collation order is plain byte order */
+} scan;
+
+/* Containers clients browsed while the scanner is busy, most recent last.
+ * Shared with the scanner process, which reads their files' metadata first. */
+#define SCAN_HINTS	8
+
+static struct scan_hints {
+	unsigned int seq;
+	char id[SCAN_HINTS][64];
+} *hints;
+
 int64_t
 get_next_available_id(const char *table, const char *parentID)
 {
@@ -462,14 +489,24 @@ insert_file(char *name, const char *path, const char *parentID, int object, medi
 			return -1;
 		strcpy(base, IMAGE_DIR_ID);
 		strcpy(class, "item.imageItem.photo");
-		detailID = GetImageMetadata(path, name);
+		if( scan.deferred )
+			detailID = GetBasicMetadata(path, name, TYPE_IMAGES);
+		else
+		{
+			detailID = GetImageMetadata(path, name);
+			if( detailID && GETFLAG(RESIZE_PREGEN_MASK) )
+				resize_cache_pregen(detailID);
+		}
 	}
 	else if( (types & TYPE_VIDEO) && is_video(name) )
 	{
  		orig_name = strdup(name);
 		strcpy(base, VIDEO_DIR_ID);
 		strcpy(class, "item.videoItem");
-		detailID = GetVideoMetadata(path, name);
+		if( scan.deferred )
+			detailID = GetBasicMetadata(path, name, TYPE_VIDEO);
+		else
+			detailID = GetVideoMetadata(path, name);
 		if( !detailID )
 			strcpy(name, orig_name);
 	}
@@ -482,7 +519,10 @@ insert_file(char *name, const char *path, const char *parentID, int object, medi
 	{
 		strcpy(base, MUSIC_DIR_ID);
 		strcpy(class, "item.audioItem.musicTrack");
-		detailID = GetAudioMetadata(path, name);
+		if( scan.deferred )
+			detailID = GetBasicMetadata(path, name, TYPE_AUDIO);
+		else
+			detailID = GetAudioMetadata(path, name);
 	}
 	free(orig_name);
 	if( !detailID )
@@ -518,10 +558,125 @@ insert_file(char *name, const char *path, const char *parentID, int object, medi
 	             " ('%s%s$%X', '%s%s', '%s', '%s', %lld, '%q')",
 	             base, parentID, object, base, parentID, objectID, class, detailID, name);
 
-	insert_containers(name, path, objectID, class, detailID);
+	/* the artist, album, genre and date views need the tags */
+	if( scan.deferred )
+		sql_exec(db, "INSERT into PENDING_METADATA values (%lld, '%s', %d)",
+		             (long long)detailID, objectID, types);
+	else
+		insert_containers(name, path, objectID, class, detailID);
+	return 0;
+}
+
+int
+remove_file(const char *path)
+{
+	char sql[128];
+	char *id;
+	char *ptr;
+	char **result;
+	int64_t detailID;
+	int rows, playlist;
+
+	if( is_caption(path) )
+	{
+		return sql_exec(db, "DELETE from CAPTIONS where PATH = '%q'", path);
+	}
+	/* Invalidate the scanner cache so we don't insert files into non-existent containers */
+	valid_cache = 0;
+	playlist = is_playlist(path);
+	id = sql_get_text_field(db, "SELECT ID from %s where PATH = '%q'", playlist?"PLAYLISTS":"DETAILS", path);
+	if( !id )
+		return 1;
+	detailID = strtoll(id, NULL, 10);
+	sqlite3_free(id);
+	if( playlist )
+	{
+		sql_exec(db, "DELETE from PLAYLISTS where ID = %lld", detailID);
+		sql_exec(db, "DELETE from DETAILS where ID ="
+		             " (SELECT DETAIL_ID from OBJECTS where OBJECT_ID = '%s$%llX')",
+		         MUSIC_PLIST_ID, detailID);
+		sql_exec(db, "DELETE from OBJECTS where OBJECT_ID = '%s$%llX' or PARENT_ID = '%s$%llX'",
+		         MUSIC_PLIST_ID, detailID, MUSIC_PLIST_ID, detailID);
+	}
+	else
+	{
+		/* Delete the parent containers if we are about to empty them. */
+		snprintf(sql, sizeof(sql), "SELECT PARENT_ID from OBJECTS where DETAIL_ID = %lld"
+		                           " and PARENT_ID not like '64$%%'",
+		                           (long long int)detailID);
+		if( (sql_get_table(db, sql, &result, &rows, NULL) == SQLITE_OK) )
+		{
+			int i, children;
+			for( i = 1; i <= rows; i++ )
+			{
+				/* If it's a playlist item, adjust the item count of the playlist */
+				if( strncmp(result[i], MUSIC_PLIST_ID, strlen(MUSIC_PLIST_ID)) == 0 )
+				{
+					sql_exec(db, "UPDATE PLAYLISTS set FOUND = (FOUND-1) where ID = %d",
+					         atoi(strrchr(result[i], '$') + 1));
+				}
+
+				children = sql_get_int_field(db, "SELECT count(*) from OBJECTS where PARENT_ID = '%s'", result[i]);
+				if( children < 0 )
+					continue;
+				if( children < 2 )
+				{
+					sql_exec(db, "DELETE from OBJECTS where OBJECT_ID = '%s'", result[i]);
+
+					ptr = strrchr(result[i], '$');
+					if( ptr )
+						*ptr = '\0';
+					if( sql_get_int_field(db, "SELECT count(*) from OBJECTS where PARENT_ID = '%s'", result[i]) == 0 )
+					{
+						sql_exec(db, "DELETE from OBJECTS where OBJECT_ID = '%s'", result[i]);
+					}
+				}
+			}
+			sqlite3_free_table(result);
+		}
+		/* Now delete the actual objects */
+		sql_exec(db, "DELETE from DETAILS where ID = %lld", detailID);
+		sql_exec(db, "DELETE from OBJECTS where DETAIL_ID = %lld", detailID);
+	}
+	art_cache_unref();
+
 	return 0;
 }
 
+int
+remove_directory(const char *path)
+{
+	char * sql;
+	char **result;
+	int64_t detailID = 0;
+	int rows, i, ret = 1;
+
+	/* Invalidate the scanner cache so we don't insert files into non-existent containers */
+	valid_cache = 0;
+	sql = sqlite3_mprintf("SELECT ID from DETAILS where (PATH > '%q/' and PATH <= '%q/%c')"
+	                      " or PATH = '%q'", path, path, 0xFF, path);
+	if( (sql_get_table(db, sql, &result, &rows, NULL) == SQLITE_OK) )
+	{
+		if( rows )
+		{
+			for( i=1; i <= rows; i++ )
+			{
+				detailID = strtoll(result[i], NULL, 10);
+				sql_exec(db, "DELETE from DETAILS where ID = %lld", detailID);
+				sql_exec(db, "DELETE from OBJECTS where DETAIL_ID = %lld", detailID);
+			}
+			art_cache_unref();
+			ret = 0;
+		}
+		sqlite3_free_table(result);
+	}
+	sqlite3_free(sql);
+	sql_exec(db, "DELETE from DIRECTORIES where (PATH > '%q/' and PATH <= '%q/%c')"
+	             " or PATH = '%q'", path, path, 0xFF, path);
+
+	return ret;
+}
+
 int
 CreateDatabase(void)
 {
@@ -567,6 +722,18 @@ CreateDatabase(void)
 	if( ret != SQLITE_OK )
 		goto sql_failed;
 	ret = sql_exec(db, create_settingsTable_sqlite);
+	if( ret != SQLITE_OK )
+		goto sql_failed;
+	ret = sql_exec(db, create_containerUpdatesTable_sqlite);
+	if( ret != SQLITE_OK )
+		goto sql_failed;
+	ret = sql_exec(db, create_containerUpdatesTriggers_sqlite);
+	if( ret != SQLITE_OK )
+		goto sql_failed;
+	ret = sql_exec(db, create_pendingMetadataTable_sqlite);
+	if( ret != SQLITE_OK )
+		goto sql_failed;
+	ret = sql_exec(db, create_directoriesTable_sqlite);
 	if( ret != SQLITE_OK )
 		goto sql_failed;
 	ret = sql_exec(db, "INSERT into SETTINGS values ('UPDATE_ID', '0')");
@@ -607,6 +774,7 @@ CreateDatabase(void)
 	sql_exec(db, "create INDEX IDX_DETAILS_PATH ON DETAILS(PATH);");
 	sql_exec(db, "create INDEX IDX_DETAILS_ID ON DETAILS(ID);");
 	sql_exec(db, "create INDEX IDX_ALBUM_ART ON ALBUM_ART(ID);");
+	sql_exec(db, "create INDEX IDX_ALBUM_ART_HASH ON ALBUM_ART(HASH);");
 	sql_exec(db, "create INDEX IDX_SCANNER_OPT ON OBJECTS(PARENT_ID, NAME, OBJECT_ID);");
 
 sql_failed:
@@ -616,276 +784,1603 @@ sql_failed:
 }
 
 static inline int
-filter_hidden(scan_filter *d)
+filter_hidden(const char *name)
 {
-	return (d->d_name[0] != '.');
+	return (name[0] != '.');
 }
 
-static int
-filter_type(scan_filter *d)
+static inline int
+filter_type(unsigned char type)
 {
-#if HAVE_STRUCT_DIRENT_D_TYPE
-	return ( (d->d_type == DT_DIR) ||
-	         (d->d_type == DT_LNK) ||
-	         (d->d_type == DT_UNKNOWN)
+	return ( (type == DT_DIR) ||
+	         (type == DT_LNK) ||
+	         (type == DT_UNKNOWN)
 	       );
-#else
-	return 1;
-#endif
 }
 
 static int
-filter_a(scan_filter *d)
+filter_a(const char *name, unsigned char type)
 {
-	return ( filter_hidden(d) &&
-	         (filter_type(d) ||
-		  (is_reg(d) &&
-		   (is_audio(d->d_name) ||
-	            is_playlist(d->d_name))))
+	return ( filter_hidden(name) &&
+	         (filter_type(type) ||
+		  (type == DT_REG &&
+		   (is_audio(name) ||
+	            is_playlist(name))))
 	       );
 }
 
 static int
-filter_av(scan_filter *d)
-{
-	return ( filter_hidden(d) &&
-	         (filter_type(d) ||
-		  (is_reg(d) &&
-		   (is_audio(d->d_name) ||
-		    is_video(d->d_name) ||
-	            is_playlist(d->d_name))))
+filter_av(const char *name, unsigned char type)
+{
+	return ( filter_hidden(name) &&
+	         (filter_type(type) ||
+		  (type == DT_REG &&
+		   (is_audio(name) ||
+		    is_video(name) ||
+	            is_playlist(name))))
 	       );
 }
 
 static int
-filter_ap(scan_filter *d)
-{
-	return ( filter_hidden(d) &&
-	         (filter_type(d) ||
-		  (is_reg(d) &&
-		   (is_audio(d->d_name) ||
-		    is_image(d->d_name) ||
-	            is_playlist(d->d_name))))
+filter_ap(const char *name, unsigned char type)
+{
+	return ( filter_hidden(name) &&
+	         (filter_type(type) ||
+		  (type == DT_REG &&
+		   (is_audio(name) ||
+		    is_image(name) ||
+	            is_playlist(name))))
 	       );
 }
 
 static int
-filter_v(scan_filter *d)
+filter_v(const char *name, unsigned char type)
 {
-	return ( filter_hidden(d) &&
-	         (filter_type(d) ||
-		  (is_reg(d) &&
-	           is_video(d->d_name)))
+	return ( filter_hidden(name) &&
+	         (filter_type(type) ||
+		  (type == DT_REG &&
+	           is_video(name)))
 	       );
 }
 
 static int
-filter_vp(scan_filter *d)
+filter_vp(const char *name, unsigned char type)
 {
-	return ( filter_hidden(d) &&
-	         (filter_type(d) ||
-		  (is_reg(d) &&
-		   (is_video(d->d_name) ||
-	            is_image(d->d_name))))
+	return ( filter_hidden(name) &&
+	         (filter_type(type) ||
+		  (type == DT_REG &&
+		   (is_video(name) ||
+	            is_image(name))))
 	       );
 }
 
 static int
-filter_p(scan_filter *d)
+filter_p(const char *name, unsigned char type)
 {
-	return ( filter_hidden(d) &&
-	         (filter_type(d) ||
-		  (is_reg(d) &&
-		   is_image(d->d_name)))
+	return ( filter_hidden(name) &&
+	         (filter_type(type) ||
+		  (type == DT_REG &&
+		   is_image(name)))
 	       );
 }
 
 static int
-filter_avp(scan_filter *d)
-{
-	return ( filter_hidden(d) &&
-	         (filter_type(d) ||
-		  (is_reg(d) &&
-		   (is_audio(d->d_name) ||
-		    is_image(d->d_name) ||
-		    is_video(d->d_name) ||
-	            is_playlist(d->d_name))))
+filter_avp(const char *name, unsigned char type)
+{
+	return ( filter_hidden(name) &&
+	         (filter_type(type) ||
+		  (type == DT_REG &&
+		   (is_audio(name) ||
+		    is_image(name) ||
+		    is_video(name) ||
+	            is_playlist(name))))
 	       );
 }
 
-static void
-ScanDirectory(const char *dir, const char *parent, media_types dir_types)
-{
-	struct dirent **namelist;
-	int i, n, startID = 0;
-	char *full_path;
-	char *name = NULL;
-	static long long unsigned int fileno = 0;
-	enum file_types type;
+typedef int (*filter_fn)(const char *name, unsigned char type);
 
-	DPRINTF(parent?E_INFO:E_WARN, L_SCANNER, _("Scanning %s\n"), dir);
+static filter_fn
+get_filter(media_types dir_types)
+{
 	switch( dir_types )
 	{
 		case ALL_MEDIA:
-			n = scandir(dir, &namelist, filter_avp, alphasort);
-			break;
+			return filter_avp;
 		case TYPE_AUDIO:
-			n = scandir(dir, &namelist, filter_a, alphasort);
-			break;
+			return filter_a;
 		case TYPE_AUDIO|TYPE_VIDEO:
-			n = scandir(dir, &namelist, filter_av, alphasort);
-			break;
+			return filter_av;
 		case TYPE_AUDIO|TYPE_IMAGES:
-			n = scandir(dir, &namelist, filter_ap, alphasort);
-			break;
+			return filter_ap;
 		case TYPE_VIDEO:
-			n = scandir(dir, &namelist, filter_v, alphasort);
-			break;
+			return filter_v;
 		case TYPE_VIDEO|TYPE_IMAGES:
-			n = scandir(dir, &namelist, filter_vp, alphasort);
-			break;
+			return filter_vp;
 		case TYPE_IMAGES:
-			n = scandir(dir, &namelist, filter_p, alphasort);
-			break;
+			return filter_p;
 		default:
-			n = -1;
-			break;
+			return NULL;
 	}
-	if( n < 0 )
-	{
-		DPRINTF(E_WARN, L_SCANNER, "Error scanning %s\n", dir);
+}
+
+static void
+scan_checkpoint(const char *path, int force)
+{
+	time_t now = time(NULL);
+
+	if( !force && ++scan.dirs < SCAN_CHECKPOINT_DIRS && now < scan.last + SCAN_CHECKPOINT_SECS )
 		return;
-	}
+	sql_exec(db, "DELETE from SETTINGS where KEY = 'scan_checkpoint'");
+	if( path )
+		sql_exec(db, "INSERT into SETTINGS values ('scan_checkpoint', %Q)", path);
+	sql_exec(db, "COMMIT");
+	sql_exec(db, "BEGIN");
+	scan.dirs = 0;
+	scan.last = now;
+}
 
-	full_path = malloc(PATH_MAX);
-	if (!full_path)
-	{
-		DPRINTF(E_ERROR, L_SCANNER, "Memory allocation failed scanning %s\n", dir);
+/* remember what dir looked like when its entries were added; st is from
+ * before it was listed */
+void
+save_dir_stamp(const char *dir, const struct stat *st, int entries)
+{
+	time_t mtime = st->st_mtime;
+
+	if( !st->st_ino )
 		return;
-	}
+	/* a change later in the same second would go unnoticed */
+	if( mtime >= time(NULL) )
+		mtime = -1;
+	sql_exec(db, "INSERT OR REPLACE into DIRECTORIES values (%Q, %lld, %lld, %d)",
+	         dir, (long long)mtime, (long long)st->st_ino, entries);
+}
 
-	if( !parent )
-	{
-		startID = get_next_available_id("OBJECTS", BROWSEDIR_ID);
-	}
+static struct {
+	int skipped_dirs;	/* unchanged directories */
+	int skipped_entries;	/* entries in them that were not looked at */
+	int changed_dirs;
+} rescan;
+
+/* where an entry of dir stands relative to resume, which is below dir
+ * returns: -1 if it was committed already, 0 if resume is inside it,
+ *          1 if it still has to be scanned */
+static int
+resume_cmp(const char *resume, const char *dir, const char *name)
+{
+	const char *p = resume + strlen(dir) + 1;
+	const char *slash = strchr(p, '/');
+	char comp[NAME_MAX+1];
+	size_t len;
+	int cmp;
+
+	len = slash ? slash - p : strlen(p);
+	if( len > NAME_MAX )
+		len = NAME_MAX;
+	memcpy(comp, p, len);
+	comp[len] = '\0';
+	/* same order as alphasort() */
+	cmp = strcoll(name, comp);
+	if( cmp == 0 )
+		cmp = strcmp(name, comp);
+	if( cmp )
+		return cmp < 0 ? -1 : 1;
+	return slash ? 0 : -1;
+}
+
+/* Directories are walked through open directory descriptors, so every
+ * lookup below is relative to the parent instead of resolving a full path
+ * again, and are read in large getdents64() batches where available.  The
+ * entries are sorted by strxfrm() keys computed once each, which gives the
+ * order alphasort() does without calling strcoll() for every comparison. */
+struct scan_entry {
+	const char *key;	/* collation key, NULL if unsorted */
+	unsigned char type;	/* DT_DIR or DT_REG */
+	unsigned char ok;	/* readable, if listed by read_dir() */
+	struct scan_dir *sub;	/* a directory's own listing, from read_dir() */
+	char name[];
+};
+
+static int
+scan_entry_cmp(const void *a, const void *b)
+{
+	const struct scan_entry *x = *(const struct scan_entry **)a;
+	const struct scan_entry *y = *(const struct scan_entry **)b;
+	int cmp;
+
+	cmp = strcmp(x->key, y->key);
+	if( cmp == 0 )
+		cmp = strcmp(x->name, y->name);
+	return cmp;
+}
+
+static int
+scan_add_entry(struct scan_entry ***list, int *n, int *alloc, int fd, const char *dir,
+               const char *name, unsigned char type, filter_fn filter, media_types dir_types, int sort)
+{
+	struct scan_entry *e, **l;
+	char path[PATH_MAX];
+	size_t len, keylen = 0;
 
-	for (i=0; i < n; i++)
+	if( !filter(name, type) )
+		return 0;
+	/* symbolic links and filesystems without d_type */
+	if( type != DT_DIR && type != DT_REG )
 	{
-#if !USE_FORK
-		if( quitting )
-			break;
-#endif
-		type = TYPE_UNKNOWN;
-		snprintf(full_path, PATH_MAX, "%s/%s", dir, namelist[i]->d_name);
-		name = escape_tag(namelist[i]->d_name, 1);
-		if( is_dir(namelist[i]) == 1 )
+		snprintf(path, sizeof(path), "%s/%s", dir, name);
+		switch( resolve_unknown_type_at(fd, name, path, dir_types) )
 		{
-			type = TYPE_DIR;
+			case TYPE_DIR:
+				type = DT_DIR;
+				break;
+			case TYPE_FILE:
+				type = DT_REG;
+				break;
+			default:
+				return 0;
 		}
-		else if( is_reg(namelist[i]) == 1 )
+	}
+
+	len = strlen(name) + 1;
+	if( sort && !scan.bytesort )
+		keylen = strxfrm(NULL, name, 0) + 1;
+	e = malloc(sizeof(*e) + len + keylen);
+	if( !e )
+		return -1;
+	memcpy(e->name, name, len);
+	e->type = type;
+	e->ok = 0;
+	e->sub = NULL;
+	e->key = NULL;
+	if( sort )
+	{
+		if( keylen )
 		{
-			type = TYPE_FILE;
+			strxfrm(e->name + len, name, keylen);
+			e->key = e->name + len;
 		}
 		else
+			e->key = e->name;
+	}
+	if( *n == *alloc )
+	{
+		*alloc = *alloc ? *alloc * 2 : 64;
+		l = realloc(*list, *alloc * sizeof(*l));
+		if( !l )
 		{
-			type = resolve_unknown_type(full_path, dir_types);
-		}
-		if( (type == TYPE_DIR) && (access(full_path, R_OK|X_OK) == 0) )
-		{
-			char *parent_id;
-			insert_directory(name, full_path, BROWSEDIR_ID, THISORNUL(parent), i+startID);
-			xasprintf(&parent_id, "%s$%X", THISORNUL(parent), i+startID);
-			ScanDirectory(full_path, parent_id, dir_types);
-			free(parent_id);
+			free(e);
+			return -1;
 		}
-		else if( type == TYPE_FILE && (access(full_path, R_OK) == 0) )
+		*list = l;
+	}
+	(*list)[(*n)++] = e;
+
+	return 0;
+}
+
+/* read the entries of the open directory fd (dir is its full path) that
+ * pass filter, in alphasort() order if sort is set
+ * returns: the number of entries in *list, or -1 on failure */
+static int
+scan_readdir(int fd, const char *dir, filter_fn filter, media_types dir_types,
+             int sort, struct scan_entry ***list)
+{
+	int n = 0, alloc = 0, ret = 0;
+#if defined(__linux__) && defined(SYS_getdents64)
+	uint64_t buf[32768 / sizeof(uint64_t)];
+	struct linux_dirent64 {
+		uint64_t d_ino;
+		int64_t d_off;
+		unsigned short d_reclen;
+		unsigned char d_type;
+		char d_name[];
+	} *d;
+	long len, off;
+
+	*list = NULL;
+	while( ret == 0 && (len = syscall(SYS_getdents64, fd, buf, sizeof(buf))) > 0 )
+	{
+		for( off = 0; ret == 0 && off < len; off += d->d_reclen )
 		{
-			if( insert_file(name, full_path, THISORNUL(parent), i+startID, dir_types) == 0 )
-				fileno++;
+			d = (struct linux_dirent64 *)((char *)buf + off);
+			ret = scan_add_entry(list, &n, &alloc, fd, dir, d->d_name, d->d_type,
+			                     filter, dir_types, sort);
 		}
-		free(name);
-		free(namelist[i]);
 	}
-	free(namelist);
-	free(full_path);
-	if( !parent )
+	if( len < 0 )
+		ret = -1;
+#else
+	DIR *d;
+	struct dirent *e;
+	int dfd;
+
+	*list = NULL;
+	/* closedir() closes the descriptor it was given */
+	dfd = dup(fd);
+	if( dfd < 0 )
+		return -1;
+	d = fdopendir(dfd);
+	if( !d )
+	{
+		close(dfd);
+		return -1;
+	}
+	while( ret == 0 && (e = readdir(d)) != NULL )
+	{
+#if HAVE_STRUCT_DIRENT_D_TYPE
+		ret = scan_add_entry(list, &n, &alloc, fd, dir, e->d_name, e->d_type,
+		                     filter, dir_types, sort);
+#else
+		ret = scan_add_entry(list, &n, &alloc, fd, dir, e->d_name, DT_UNKNOWN,
+		                     filter, dir_types, sort);
+#endif
+	}
+	closedir(d);
+#endif
+	if( ret != 0 )
 	{
-		DPRINTF(E_WARN, L_SCANNER, _("Scanning %s finished (%llu files)!\n"), dir, fileno);
+		while( n > 0 )
+			free((*list)[--n]);
+		free(*list);
+		*list = NULL;
+		return -1;
+	}
+	if( sort && n > 1 )
+		qsort(*list, n, sizeof(**list), scan_entry_cmp);
+
+	return n;
+}
+
+static int
+scan_opendir(int pfd, const char *dir)
+{
+	/* pfd is dir's parent, unless dir is a top level media dir */
+	if( pfd != AT_FDCWD )
+		dir = strrchr(dir, '/') + 1;
+	return openat(pfd, dir, O_RDONLY|O_DIRECTORY);
+}
+
+/* count what a scan of dir will look at, to estimate its progress */
+static int
+count_files(int pfd, const char *dir, filter_fn filter, media_types dir_types)
+{
+	struct scan_entry **list;
+	char *path;
+	int fd, i, n, count = 0;
+
+	fd = scan_opendir(pfd, dir);
+	if( fd < 0 )
+		return 0;
+	n = scan_readdir(fd, dir, filter, dir_types, 0, &list);
+	path = malloc(PATH_MAX);
+	for( i = 0; i < n; i++ )
+	{
+		if( path && list[i]->type == DT_DIR )
+		{
+			snprintf(path, PATH_MAX, "%s/%s", dir, list[i]->name);
+			count += count_files(fd, path, filter, dir_types);
+		}
+		else
+			count++;
+		free(list[i]);
 	}
+	free(list);
+	free(path);
+	close(fd);
+
+	return count;
+}
+
+/* A full scan reads directories in walker threads, scan_threads of them for
+ * each device holding media dirs, so media dirs on different disks are read
+ * at the same time.  The walkers run ahead of the scanner, which alone writes
+ * to the database and takes their listings in the same order a sequential
+ * scan would, so object IDs and checkpoints do not depend on which thread
+ * read what.  A directory no walker has started on is read by the scanner. */
+#define SCAN_AHEAD		65536	/* entries read ahead of the scanner per device */
+#define SCAN_PREFETCH		1024	/* below this, start reading the files too */
+#define SCAN_PREFETCH_BYTES	(128*1024)
+
+enum scan_dir_state {
+	SCAN_DIR_PENDING,
+	SCAN_DIR_READING,
+	SCAN_DIR_READ
+};
+
+struct scan_device;
+
+struct scan_dir {
+	struct scan_dir *prev, *next;	/* in the device's directories to read */
+	struct scan_device *dev;	/* NULL if only the scanner reads it */
+	enum scan_dir_state state;
+	media_types types;
+	struct stat st;			/* from before it was listed */
+	int n;				/* entries, -1 if it could not be read */
+	struct scan_entry **list;
+	char path[];
+};
+
+struct scan_device {
+	dev_t dev;
+	struct scan_dir *todo;		/* directories to read, next first */
+	int reading;			/* directories being read */
+	int ahead;			/* entries read and not taken by the scanner yet */
+	int count;			/* files found by count_files() */
+	int threads;
+	pthread_t *tid;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t work;		/* more to read, or room to read it */
+	pthread_cond_t read;		/* a directory was read */
+	struct scan_device *devs;
+	int ndevs;
+	struct scan_dir **roots;	/* one for each media dir */
+	int nroots;
+	int stop;
+	char *resume;			/* scan.resume as the scan started */
+} walk = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static struct scan_dir *
+new_dir(const char *path, media_types types, struct scan_device *dev)
+{
+	struct scan_dir *d;
+	size_t len = strlen(path) + 1;
+
+	d = calloc(1, sizeof(*d) + len);
+	if( !d )
+		return NULL;
+	memcpy(d->path, path, len);
+	d->types = types;
+	d->dev = dev;
+	d->n = -1;
+
+	return d;
 }
 
+static void free_dir(struct scan_dir *d);
+
 static void
-_notify_start(void)
+free_entry(struct scan_entry *e)
 {
-#ifdef READYNAS
-	FILE *flag = fopen("/ramfs/.upnp-av_scan", "w");
-	if( flag )
-		fclose(flag);
-#endif
+	if( e->sub )
+		free_dir(e->sub);
+	free(e);
 }
 
+/* only once no walker can get to d any more */
 static void
-_notify_stop(void)
+free_dir(struct scan_dir *d)
 {
-#ifdef READYNAS
-	if( access("/ramfs/.rescan_done", F_OK) == 0 )
-		system("/bin/sh /ramfs/.rescan_done");
-	unlink("/ramfs/.upnp-av_scan");
-#endif
+	int i;
+
+	for( i = 0; i < d->n; i++ )
+	{
+		if( d->list[i] )
+			free_entry(d->list[i]);
+	}
+	free(d->list);
+	free(d);
 }
 
-void
-start_scanner()
+/* start reading the part of a file the metadata readers look at */
+static void
+prefetch_file(int dfd, const char *name)
 {
-	struct media_dir_s *media_path;
-	char path[MAXPATHLEN];
+#ifdef POSIX_FADV_WILLNEED
+	int fd;
 
-	if (setpriority(PRIO_PROCESS, 0, 15) == -1)
-		DPRINTF(E_WARN, L_INOTIFY,  "Failed to reduce scanner thread priority\n");
-	_notify_start();
+	fd = openat(dfd, name, O_RDONLY);
+	if( fd < 0 )
+		return;
+	posix_fadvise(fd, 0, SCAN_PREFETCH_BYTES, POSIX_FADV_WILLNEED);
+	close(fd);
+#endif
+}
 
-	setlocale(LC_COLLATE, "");
+/* list d, check which of its entries can be read, and set up the listings
+ * of its subdirectories */
+static void
+read_dir(struct scan_dir *d, int pfd, int prefetch)
+{
+	struct scan_entry *e;
+	char path[PATH_MAX];
+	filter_fn filter;
+	size_t len;
+	int fd, i, skip;
 
-	av_register_all();
-	av_log_set_level(AV_LOG_PANIC);
-	for( media_path = media_dirs; media_path != NULL; media_path = media_path->next )
+	filter = get_filter(d->types);
+	fd = filter ? scan_opendir(pfd, d->path) : -1;
+	if( fd < 0 )
+		return;
+	/* stamp the directory before listing it, so a change made while it is
+	 * scanned is caught by the next rescan */
+	if( fstat(fd, &d->st) != 0 )
+		d->st.st_ino = 0;
+	d->n = scan_readdir(fd, d->path, filter, d->types, 1, &d->list);
+	/* leave out what an interrupted scan committed already */
+	len = strlen(d->path);
+	skip = walk.resume && strncmp(walk.resume, d->path, len) == 0 && walk.resume[len] == '/';
+	for( i = 0; i < d->n; i++ )
 	{
-		int64_t id;
-		char *bname, *parent = NULL;
-		char buf[8];
-		strncpyt(path, media_path->path, sizeof(path));
-		bname = basename(path);
-		/* If there are multiple media locations, add a level to the ContentDirectory */
-		if( !GETFLAG(MERGE_MEDIA_DIRS_MASK) && media_dirs->next )
+		e = d->list[i];
+		if( e->type == DT_DIR )
 		{
-			int startID = get_next_available_id("OBJECTS", BROWSEDIR_ID);
-			id = insert_directory(bname, path, BROWSEDIR_ID, "", startID);
-			sprintf(buf, "$%X", startID);
-			parent = buf;
+			e->ok = (faccessat(fd, e->name, R_OK|X_OK, 0) == 0);
+			if( !e->ok || (skip && resume_cmp(walk.resume, d->path, e->name) < 0) )
+				continue;
+			snprintf(path, sizeof(path), "%s/%s", d->path, e->name);
+			e->sub = new_dir(path, d->types, d->dev);
 		}
 		else
-			id = GetFolderMetadata(bname, media_path->path, NULL, NULL, 0);
-		/* Use TIMESTAMP to store the media type */
-		sql_exec(db, "UPDATE DETAILS set TIMESTAMP = %d where ID = %lld", media_path->types, (long long)id);
-		ScanDirectory(media_path->path, parent, media_path->types);
-		sql_exec(db, "INSERT into SETTINGS values (%Q, %Q)", "media_dir", media_path->path);
+		{
+			e->ok = (faccessat(fd, e->name, R_OK, 0) == 0);
+			if( e->ok && prefetch )
+				prefetch_file(fd, e->name);
+		}
 	}
-	_notify_stop();
-	/* Create this index after scanning, so it doesn't slow down the scanning process.
-	 * This index is very useful for large libraries used with an XBox360 (or any
-	 * client that uses UPnPSearch on large containers). */
-	sql_exec(db, "create INDEX IDX_SEARCH_OPT ON OBJECTS(OBJECT_ID, CLASS, DETAIL_ID);");
+	close(fd);
+}
 
-	if( GETFLAG(NO_PLAYLIST_MASK) )
-	{
-		DPRINTF(E_WARN, L_SCANNER, "Playlist creation disabled\n");	  
-	}
+/* with walk.lock held */
+static void
+push_dir(struct scan_dir *d)
+{
+	d->prev = NULL;
+	d->next = d->dev->todo;
+	if( d->next )
+		d->next->prev = d;
+	d->dev->todo = d;
+}
+
+static void
+unlink_dir(struct scan_dir *d)
+{
+	if( d->prev )
+		d->prev->next = d->next;
 	else
+		d->dev->todo = d->next;
+	if( d->next )
+		d->next->prev = d->prev;
+	d->prev = d->next = NULL;
+}
+
+/* with walk.lock held: d was read, queue its subdirectories so that the
+ * first one is read next */
+static void
+dir_read(struct scan_dir *d)
+{
+	int i;
+
+	for( i = d->n - 1; i >= 0; i-- )
 	{
-		fill_playlists();
+		if( d->list[i]->sub )
+			push_dir(d->list[i]->sub);
 	}
+	d->state = SCAN_DIR_READ;
+	d->dev->reading--;
+	if( d->n > 0 )
+		d->dev->ahead += d->n;
+	pthread_cond_broadcast(&walk.read);
+	pthread_cond_broadcast(&walk.work);
+}
 
-	DPRINTF(E_DEBUG, L_SCANNER, "Initial file scan completed\n");
-	//JM: Set up a db version number, so we know if we need to rebuild due to a new structure.
+static void *
+walker(void *arg)
+{
+	struct scan_device *dev = arg;
+	struct scan_dir *d;
+	int prefetch;
+
+	pthread_mutex_lock(&walk.lock);
+	while( !walk.stop && (dev->todo || dev->reading) )
+	{
+		if( !dev->todo || dev->ahead >= SCAN_AHEAD )
+		{
+			pthread_cond_wait(&walk.work, &walk.lock);
+			continue;
+		}
+		d = dev->todo;
+		unlink_dir(d);
+		d->state = SCAN_DIR_READING;
+		dev->reading++;
+		prefetch = !scan.deferred && dev->ahead < SCAN_PREFETCH;
+		pthread_mutex_unlock(&walk.lock);
+		read_dir(d, AT_FDCWD, prefetch);
+		pthread_mutex_lock(&walk.lock);
+		dir_read(d);
+	}
+	pthread_cond_broadcast(&walk.work);
+	pthread_mutex_unlock(&walk.lock);
+
+	return NULL;
+}
+
+/* get the listing of d, waiting for a walker that is reading it, or reading
+ * it here if none has started to */
+static void
+take_dir(struct scan_dir *d)
+{
+	struct scan_device *dev = d->dev;
+
+	if( !dev )
+	{
+		if( d->state != SCAN_DIR_READ )
+			read_dir(d, AT_FDCWD, 0);
+		d->state = SCAN_DIR_READ;
+		return;
+	}
+	pthread_mutex_lock(&walk.lock);
+	if( d->state == SCAN_DIR_PENDING )
+	{
+		unlink_dir(d);
+		d->state = SCAN_DIR_READING;
+		dev->reading++;
+		pthread_mutex_unlock(&walk.lock);
+		read_dir(d, AT_FDCWD, 0);
+		pthread_mutex_lock(&walk.lock);
+		dir_read(d);
+	}
+	while( d->state != SCAN_DIR_READ )
+		pthread_cond_wait(&walk.read, &walk.lock);
+	if( d->n > 0 )
+		dev->ahead -= d->n;
+	pthread_cond_broadcast(&walk.work);
+	pthread_mutex_unlock(&walk.lock);
+}
+
+/* group the media dirs by the device they are on */
+static void
+walk_init(struct scan_dir **roots, int n)
+{
+	struct stat st;
+	int i, j;
+
+	walk.roots = roots;
+	walk.nroots = n;
+	if( runtime_vars.scan_threads <= 0 )
+		return;
+	walk.devs = calloc(n, sizeof(*walk.devs));
+	if( !walk.devs )
+		return;
+	for( i = 0; i < n; i++ )
+	{
+		if( !roots[i] || stat(roots[i]->path, &st) != 0 )
+			continue;
+		for( j = 0; j < walk.ndevs && walk.devs[j].dev != st.st_dev; j++ )
+			;
+		if( j == walk.ndevs )
+			walk.devs[walk.ndevs++].dev = st.st_dev;
+		roots[i]->dev = &walk.devs[j];
+	}
+}
+
+static int
+count_roots(struct scan_device *dev)
+{
+	struct scan_dir *d;
+	int i, count = 0;
+
+	for( i = 0; i < walk.nroots; i++ )
+	{
+		d = walk.roots[i];
+		if( d && d->dev == dev && get_filter(d->types) )
+			count += count_files(AT_FDCWD, d->path, get_filter(d->types), d->types);
+	}
+
+	return count;
+}
+
+static void *
+count_device(void *arg)
+{
+	struct scan_device *dev = arg;
+
+	dev->count = count_roots(dev);
+
+	return NULL;
+}
+
+/* count the files of all media dirs, those on different devices at once */
+static int
+walk_count(void)
+{
+	struct scan_device *dev;
+	int i, total;
+
+	for( i = 0; i < walk.ndevs; i++ )
+	{
+		dev = &walk.devs[i];
+		dev->tid = malloc(sizeof(*dev->tid));
+		if( dev->tid && pthread_create(dev->tid, NULL, count_device, dev) == 0 )
+			dev->threads = 1;
+		else
+			count_device(dev);
+	}
+	/* media dirs that could not be looked at */
+	total = count_roots(NULL);
+	for( i = 0; i < walk.ndevs; i++ )
+	{
+		dev = &walk.devs[i];
+		if( dev->threads )
+			pthread_join(*dev->tid, NULL);
+		free(dev->tid);
+		dev->tid = NULL;
+		dev->threads = 0;
+		total += dev->count;
+	}
+
+	return total;
+}
+
+/* start reading the media dirs left in walk.roots */
+static void
+walk_start(void)
+{
+	struct scan_device *dev;
+	int i, t;
+
+	pthread_mutex_lock(&walk.lock);
+	for( i = walk.nroots - 1; i >= 0; i-- )
+	{
+		if( walk.roots[i] && walk.roots[i]->dev )
+			push_dir(walk.roots[i]);
+	}
+	pthread_mutex_unlock(&walk.lock);
+	for( i = 0; i < walk.ndevs; i++ )
+	{
+		dev = &walk.devs[i];
+		if( !dev->todo )
+			continue;
+		dev->tid = calloc(runtime_vars.scan_threads, sizeof(*dev->tid));
+		for( t = 0; dev->tid && t < runtime_vars.scan_threads; t++ )
+		{
+			if( pthread_create(&dev->tid[dev->threads], NULL, walker, dev) != 0 )
+			{
+				DPRINTF(E_ERROR, L_SCANNER, "Unable to start directory reader: %s\n", strerror(errno));
+				break;
+			}
+			dev->threads++;
+		}
+	}
+	if( walk.ndevs )
+		DPRINTF(E_INFO, L_SCANNER, "Reading media dirs on %d device(s) with up to %d thread(s) each\n",
+		        walk.ndevs, runtime_vars.scan_threads);
+}
+
+/* stop the walkers; only after this may listings they could get to be
+ * freed.  The scanner reads whatever is left itself. */
+static void
+walk_stop(void)
+{
+	struct scan_device *dev;
+	int i, t;
+
+	pthread_mutex_lock(&walk.lock);
+	walk.stop = 1;
+	pthread_cond_broadcast(&walk.work);
+	pthread_mutex_unlock(&walk.lock);
+	for( i = 0; i < walk.ndevs; i++ )
+	{
+		dev = &walk.devs[i];
+		for( t = 0; t < dev->threads; t++ )
+			pthread_join(dev->tid[t], NULL);
+		free(dev->tid);
+		dev->tid = NULL;
+		dev->threads = 0;
+		while( dev->todo )
+			unlink_dir(dev->todo);
+	}
+}
+
+/* once every listing is gone */
+static void
+walk_end(void)
+{
+	walk_stop();
+	free(walk.devs);
+	walk.devs = NULL;
+	walk.ndevs = 0;
+	walk.roots = NULL;
+	walk.nroots = 0;
+	walk.stop = 0;
+	free(walk.resume);
+	walk.resume = NULL;
+}
+
+/* add the entries of d, which has been read, and everything below them */
+static void
+add_dir(struct scan_dir *d, const char *parent)
+{
+	struct scan_entry *e;
+	struct scan_dir *sub;
+	int i, r, startID = 0;
+	char *full_path, *entry;
+	char *name = NULL;
+	static long long unsigned int fileno = 0;
+	size_t len;
+
+	DPRINTF(parent?E_INFO:E_WARN, L_SCANNER, _("Scanning %s\n"), d->path);
+	if( d->n < 0 )
+	{
+		DPRINTF(E_WARN, L_SCANNER, "Error scanning %s\n", d->path);
+		free_dir(d);
+		return;
+	}
+
+	full_path = malloc(PATH_MAX);
+	if (!full_path)
+	{
+		DPRINTF(E_ERROR, L_SCANNER, "Memory allocation failed scanning %s\n", d->path);
+		walk_stop();
+		free_dir(d);
+		return;
+	}
+	len = snprintf(full_path, PATH_MAX, "%s/", d->path);
+	entry = full_path + len;
+
+	if( !parent )
+	{
+		startID = scan.start;
+	}
+
+	for (i=0; i < d->n; i++)
+	{
+		e = d->list[i];
+		d->list[i] = NULL;
+#if !USE_FORK
+		if( quitting )
+		{
+			walk_stop();
+			free_entry(e);
+			continue;
+		}
+#endif
+		r = 1;
+		if( scan.resume && (r = resume_cmp(scan.resume, d->path, e->name)) != 0 )
+		{
+			if( r < 0 )
+			{
+				free_entry(e);
+				continue;
+			}
+			DPRINTF(E_WARN, L_SCANNER, "Resuming interrupted scan at %s/%s\n", d->path, e->name);
+			free(scan.resume);
+			scan.resume = NULL;
+		}
+		strncpyt(entry, e->name, PATH_MAX - len);
+		name = escape_tag(e->name, 1);
+		if( r == 0 && e->type != DT_DIR )
+		{
+			free(scan.resume);
+			scan.resume = NULL;
+		}
+		if( e->type == DT_DIR && e->ok )
+		{
+			char *parent_id;
+			/* an interrupted scan already added the directory itself */
+			if( r != 0 )
+				insert_directory(name, full_path, BROWSEDIR_ID, THISORNUL(parent), i+startID);
+			xasprintf(&parent_id, "%s$%X", THISORNUL(parent), i+startID);
+			sub = e->sub;
+			e->sub = NULL;
+			if( sub )
+			{
+				take_dir(sub);
+				add_dir(sub, parent_id);
+			}
+			else
+				DPRINTF(E_ERROR, L_SCANNER, "Memory allocation failed scanning %s\n", full_path);
+			free(parent_id);
+			scan_checkpoint(full_path, 0);
+		}
+		else if( e->type == DT_REG && e->ok )
+		{
+			if( insert_file(name, full_path, THISORNUL(parent), i+startID, d->types) == 0 )
+			{
+				fileno++;
+				metrics_add(M_SCAN_FILES, 1);
+			}
+		}
+		free(name);
+		free_entry(e);
+	}
+	free(full_path);
+#if !USE_FORK
+	if( !quitting )
+#endif
+	save_dir_stamp(d->path, &d->st, d->n);
+	if( !parent )
+	{
+		DPRINTF(E_WARN, L_SCANNER, _("Scanning %s finished (%llu files)!\n"), d->path, fileno);
+	}
+	free_dir(d);
+}
+
+static void
+ScanDirectory(int pfd, const char *dir, const char *parent, media_types dir_types)
+{
+	struct scan_dir *d;
+
+	d = new_dir(dir, dir_types, NULL);
+	if( !d )
+	{
+		DPRINTF(E_ERROR, L_SCANNER, "Memory allocation failed scanning %s\n", dir);
+		return;
+	}
+	read_dir(d, pfd, 0);
+	d->state = SCAN_DIR_READ;
+	add_dir(d, parent);
+}
+
+/* Rescan a directory that was scanned before.  If its stamp still matches,
+ * no entry was added, removed or renamed in it, and only its subdirectories
+ * are looked at.  Files modified in place are only noticed in directories
+ * that changed otherwise; inotify catches those while minidlna runs. */
+static void
+RescanDirectory(const char *dir, const char *parent, media_types dir_types)
+{
+	struct scan_entry **list;
+	int i, n, rows, fd;
+	char **result;
+	char *sql, *id, *name, *parent_id;
+	char full_path[PATH_MAX];
+	char parent_obj[64];
+	filter_fn filter;
+	struct stat st, fst;
+	int64_t ts;
+
+	if( stat(dir, &st) != 0 )
+		return;
+	snprintf(parent_obj, sizeof(parent_obj), "%s%s", BROWSEDIR_ID, parent);
+
+	/* 0 if there is no matching stamp */
+	n = sql_get_int_field(db, "SELECT ENTRIES + 1 from DIRECTORIES where PATH = %Q"
+	                          " and MTIME = %lld and INODE = %lld",
+	                          dir, (long long)st.st_mtime, (long long)st.st_ino);
+	if( n > 0 )
+	{
+		rescan.skipped_dirs++;
+		rescan.skipped_entries += n - 1;
+		sql = sqlite3_mprintf("SELECT d.PATH, o.OBJECT_ID from OBJECTS o"
+		                      " join DETAILS d on (d.ID = o.DETAIL_ID)"
+		                      " where o.PARENT_ID = '%s' and o.CLASS = 'container.storageFolder'"
+		                      " and d.PATH > '%q/' and d.PATH < '%q0'", parent_obj, dir, dir);
+		if( sql_get_table(db, sql, &result, &rows, NULL) == SQLITE_OK )
+		{
+			for( i = 1; i <= rows; i++ )
+			{
+#if !USE_FORK
+				if( quitting )
+					break;
+#endif
+				RescanDirectory(result[2*i], result[2*i+1] + strlen(BROWSEDIR_ID), dir_types);
+			}
+			sqlite3_free_table(result);
+		}
+		sqlite3_free(sql);
+		return;
+	}
+
+	DPRINTF(E_INFO, L_SCANNER, "Rescanning %s\n", dir);
+	rescan.changed_dirs++;
+	/* drop what disappeared */
+	sql = sqlite3_mprintf("SELECT d.PATH, o.CLASS from OBJECTS o"
+	                      " join DETAILS d on (d.ID = o.DETAIL_ID)"
+	                      " where o.PARENT_ID = '%s' and d.PATH > '%q/' and d.PATH < '%q0'",
+	                      parent_obj, dir, dir);
+	if( sql_get_table(db, sql, &result, &rows, NULL) == SQLITE_OK )
+	{
+		for( i = 1; i <= rows; i++ )
+		{
+			if( access(result[2*i], F_OK) == 0 )
+				continue;
+			DPRINTF(E_DEBUG, L_SCANNER, "%s is gone\n", result[2*i]);
+			if( strncmp(result[2*i+1], "container", 9) == 0 )
+				remove_directory(result[2*i]);
+			else
+				remove_file(result[2*i]);
+		}
+		sqlite3_free_table(result);
+	}
+	sqlite3_free(sql);
+	sql = sqlite3_mprintf("SELECT PATH from PLAYLISTS where PATH > '%q/' and PATH < '%q0'"
+	                      " and instr(substr(PATH, %d), '/') = 0", dir, dir, (int)strlen(dir) + 2);
+	if( sql_get_table(db, sql, &result, &rows, NULL) == SQLITE_OK )
+	{
+		for( i = 1; i <= rows; i++ )
+		{
+			if( access(result[i], F_OK) != 0 )
+				remove_file(result[i]);
+		}
+		sqlite3_free_table(result);
+	}
+	sqlite3_free(sql);
+
+	/* add what is new or was modified */
+	filter = get_filter(dir_types);
+	fd = filter ? scan_opendir(AT_FDCWD, dir) : -1;
+	n = fd >= 0 ? scan_readdir(fd, dir, filter, dir_types, 1, &list) : -1;
+	if( n < 0 )
+	{
+		DPRINTF(E_WARN, L_SCANNER, "Error scanning %s\n", dir);
+		if( fd >= 0 )
+			close(fd);
+		return;
+	}
+	for( i = 0; i < n; i++ )
+	{
+#if !USE_FORK
+		if( quitting )
+		{
+			free(list[i]);
+			continue;
+		}
+#endif
+		snprintf(full_path, sizeof(full_path), "%s/%s", dir, list[i]->name);
+		name = escape_tag(list[i]->name, 1);
+		if( list[i]->type == DT_DIR && faccessat(fd, list[i]->name, R_OK|X_OK, 0) == 0 )
+		{
+			id = sql_get_text_field(db, "SELECT o.OBJECT_ID from OBJECTS o"
+			                            " join DETAILS d on (d.ID = o.DETAIL_ID)"
+			                            " where d.PATH = %Q and o.PARENT_ID = '%s'",
+			                            full_path, parent_obj);
+			if( id )
+			{
+				RescanDirectory(full_path, id + strlen(BROWSEDIR_ID), dir_types);
+				sqlite3_free(id);
+			}
+			else
+			{
+				int object = get_next_available_id("OBJECTS", parent_obj);
+				insert_directory(name, full_path, BROWSEDIR_ID, parent, object);
+				xasprintf(&parent_id, "%s$%X", parent, object);
+				ScanDirectory(fd, full_path, parent_id, dir_types);
+				free(parent_id);
+			}
+			scan_checkpoint(NULL, 0);
+		}
+		else if( list[i]->type == DT_REG && fstatat(fd, list[i]->name, &fst, 0) == 0 &&
+		         faccessat(fd, list[i]->name, R_OK, 0) == 0 )
+		{
+			ts = sql_get_int64_field(db, "SELECT TIMESTAMP from DETAILS where PATH = %Q", full_path);
+			/* playlists are only read once */
+			if( ts <= 0 && is_playlist(name) &&
+			    sql_get_int_field(db, "SELECT count(*) from PLAYLISTS where PATH = %Q", full_path) > 0 )
+				ts = fst.st_mtime;
+			if( ts < fst.st_mtime )
+			{
+				if( ts > 0 )
+				{
+					DPRINTF(E_DEBUG, L_SCANNER, "%s was modified\n", full_path);
+					remove_file(full_path);
+				}
+				if( insert_file(name, full_path, parent,
+				                get_next_available_id("OBJECTS", parent_obj), dir_types) == 0 )
+					metrics_add(M_SCAN_FILES, 1);
+			}
+		}
+		free(name);
+		free(list[i]);
+	}
+	free(list);
+	close(fd);
+#if !USE_FORK
+	if( !quitting )
+#endif
+	save_dir_stamp(dir, &st, n);
+}
+
+static void
+_notify_start(void)
+{
+#ifdef READYNAS
+	FILE *flag = fopen("/ramfs/.upnp-av_scan", "w");
+	if( flag )
+		fclose(flag);
+#endif
+}
+
+static void
+_notify_stop(void)
+{
+#ifdef READYNAS
+	if( access("/ramfs/.rescan_done", F_OK) == 0 )
+		system("/bin/sh /ramfs/.rescan_done");
+	unlink("/ramfs/.upnp-av_scan");
+#endif
+}
+
+/* describe what a scan covers, so only a scan of the same media dirs and
+ * database layout is resumed */
+static char *
+scan_config(void)
+{
+	struct media_dir_s *media_path;
+	char *str;
+
+	str = sqlite3_mprintf("v%d%s", DB_VERSION, GETFLAG(MERGE_MEDIA_DIRS_MASK) ? " merge" : "");
+	for( media_path = media_dirs; str && media_path != NULL; media_path = media_path->next )
+		str = sqlite3_mprintf("%z\n%d:%s", str, media_path->types, media_path->path);
+
+	return str;
+}
+
+int
+scanner_can_resume(void)
+{
+	char *config, *saved;
+	int ret = 0;
+
+	/* a finished first pass leaves scan_config behind until the second
+	 * pass is through too */
+	ret = sql_get_int_field(db, "PRAGMA user_version");
+	if( ret != 0 && ret != DB_VERSION )
+		return 0;
+	ret = 0;
+	saved = sql_get_text_field(db, "SELECT VALUE from SETTINGS where KEY = 'scan_config'");
+	if( !saved )
+		return 0;
+	config = scan_config();
+	if( config && strcmp(config, saved) == 0 )
+		ret = 1;
+	sqlite3_free(config);
+	sqlite3_free(saved);
+
+	return ret;
+}
+
+int
+scanner_init(void)
+{
+	void *map;
+
+	map = mmap(NULL, sizeof(struct scan_hints), PROT_READ|PROT_WRITE,
+	           MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if( map == MAP_FAILED )
+	{
+		DPRINTF(E_ERROR, L_SCANNER, "Unable to map scan hints: %s\n", strerror(errno));
+		return -1;
+	}
+	memset(map, 0, sizeof(struct scan_hints));
+	hints = map;
+
+	return 0;
+}
+
+void
+scanner_hint(const char *id)
+{
+	unsigned int seq;
+
+	if( !hints || !scanning )
+		return;
+	seq = hints->seq;
+	/* clients page through a container in several requests */
+	if( seq && strcmp(hints->id[(seq - 1) % SCAN_HINTS], id) == 0 )
+		return;
+	strncpyt(hints->id[seq % SCAN_HINTS], id, sizeof(hints->id[0]));
+	__sync_synchronize();
+	hints->seq = seq + 1;
+}
+
+/* fill in the details of a file the first pass only cataloged, and add it
+ * to the artist, album, genre and date views. The DETAILS row keeps its ID,
+ * so object IDs, playlist entries and /MediaItems URLs handed out in the
+ * meantime stay valid. */
+static void
+read_metadata(int64_t detailID)
+{
+	char *objectID, *path, *class, *name;
+	char buf[MAXPATHLEN];
+	int64_t newID = 0;
+
+	objectID = sql_get_text_field(db, "SELECT OBJECT_ID from PENDING_METADATA where DETAIL_ID = %lld",
+	                              (long long)detailID);
+	path = sql_get_text_field(db, "SELECT PATH from DETAILS where ID = %lld", (long long)detailID);
+	class = sql_get_text_field(db, "SELECT CLASS from OBJECTS where OBJECT_ID = %Q", objectID);
+	sql_exec(db, "DELETE from PENDING_METADATA where DETAIL_ID = %lld", (long long)detailID);
+	if( !objectID || !path || !class )
+		goto done;
+
+	strncpyt(buf, path, sizeof(buf));
+	name = escape_tag(basename(buf), 1);
+	/* stick to the media type the first pass filed it under */
+	if( strncmp(class, "item.imageItem", 14) == 0 )
+		newID = GetImageMetadata(path, name);
+	else if( strncmp(class, "item.videoItem", 14) == 0 )
+		newID = GetVideoMetadata(path, name);
+	else if( strncmp(class, "item.audioItem", 14) == 0 )
+		newID = GetAudioMetadata(path, name);
+	if( newID > 0 )
+	{
+		/* the parsers insert a new row, so move it over the basic one */
+		sql_exec(db, "DELETE from DETAILS where ID = %lld", (long long)detailID);
+		sql_exec(db, "UPDATE DETAILS set ID = %lld where ID = %lld", (long long)detailID, (long long)newID);
+		sql_exec(db, "UPDATE CAPTIONS set ID = %lld where ID = %lld", (long long)detailID, (long long)newID);
+		if( strncmp(class, "item.imageItem", 14) == 0 && GETFLAG(RESIZE_PREGEN_MASK) )
+			resize_cache_pregen(detailID);
+		insert_containers(name, path, objectID, class, detailID);
+	}
+	else
+		DPRINTF(E_WARN, L_SCANNER, "Unable to read the metadata of %s, keeping its basic details\n", path);
+	free(name);
+done:
+	sqlite3_free(objectID);
+	sqlite3_free(path);
+	sqlite3_free(class);
+}
+
+/* the second pass of a deferred scan: probe every file the first pass only
+ * cataloged, those in containers being browsed first */
+static void
+read_pending_metadata(void)
+{
+	char hint[64];
+	unsigned int seen;
+	unsigned long long start;
+	int64_t id;
+	int pending;
+
+	pending = sql_get_int_field(db, "SELECT count(*) from PENDING_METADATA");
+	metrics_set(M_SCAN_PENDING, pending > 0 ? pending : 0);
+	if( pending <= 0 )
+		return;
+	DPRINTF(E_WARN, L_SCANNER, "Reading metadata of %d files...\n", pending);
+	start = monotonic_us();
+	/* including containers browsed during the first pass */
+	seen = 0;
+
+	sql_exec(db, "BEGIN");
+	scan.dirs = 0;
+	scan.last = time(NULL);
+	for( ;; )
+	{
+#if !USE_FORK
+		if( quitting )
+			break;
+#endif
+		id = 0;
+		while( !id && hints && seen != hints->seq )
+		{
+			if( hints->seq - seen > SCAN_HINTS )
+				seen = hints->seq - SCAN_HINTS;
+			memcpy(hint, hints->id[seen % SCAN_HINTS], sizeof(hint));
+			hint[sizeof(hint)-1] = '\0';
+			id = sql_get_int64_field(db, "SELECT p.DETAIL_ID from OBJECTS o"
+			                             " join PENDING_METADATA p on (p.DETAIL_ID = o.DETAIL_ID)"
+			                             " where o.PARENT_ID = %Q limit 1", hint);
+			/* stay on this container until all of it is done */
+			if( id <= 0 )
+			{
+				id = 0;
+				seen++;
+			}
+		}
+		if( !id )
+			id = sql_get_int64_field(db, "SELECT DETAIL_ID from PENDING_METADATA"
+			                             " order by DETAIL_ID limit 1");
+		if( id <= 0 )
+			break;
+		read_metadata(id);
+		metrics_add(M_SCAN_PENDING, -1);
+		scan_checkpoint(NULL, 0);
+	}
+	sql_exec(db, "COMMIT");
+	metrics_set(M_SCAN_STAGE_METADATA, monotonic_us() - start);
+}
+
+/* A resumed walk numbers entries as if the listings had not changed since
+ * the interruption, so some may have collided with IDs committed before it
+ * and been dropped. Look the media dir it resumed in over like a rescan
+ * would, which picks free IDs, before calling the scan done. */
+static void
+verify_resumed(void)
+{
+	struct media_dir_s *media_path;
+	char *path, *id;
+
+	path = sql_get_text_field(db, "SELECT VALUE from SETTINGS where KEY = 'scan_verify'");
+	if( !path )
+		return;
+	for( media_path = media_dirs; media_path != NULL; media_path = media_path->next )
+	{
+		if( strcmp(media_path->path, path) != 0 )
+			continue;
+		DPRINTF(E_WARN, L_SCANNER, "Checking %s for entries the resumed scan missed\n", path);
+		/* the stamps were saved by the resumed walk, so they can't be trusted */
+		sql_exec(db, "DELETE from DIRECTORIES where PATH = %Q or (PATH > '%q/' and PATH <= '%q/%c')",
+		         path, path, path, 0xFF);
+		id = sql_get_text_field(db, "SELECT o.OBJECT_ID from OBJECTS o"
+		                            " join DETAILS d on (d.ID = o.DETAIL_ID)"
+		                            " where d.PATH = %Q and o.REF_ID is NULL", path);
+		RescanDirectory(path, id ? id + strlen(BROWSEDIR_ID) : "", media_path->types);
+		sqlite3_free(id);
+		break;
+	}
+	sqlite3_free(path);
+#if !USE_FORK
+	if( quitting )
+		return;
+#endif
+	sql_exec(db, "DELETE from SETTINGS where KEY = 'scan_verify'");
+	scan_checkpoint(NULL, 1);
+}
+
+/* the first pass: walk the media dirs and add every file
+ * returns: 0 when done, -1 if interrupted */
+static int
+scan_files(void)
+{
+	struct media_dir_s *media_path;
+	struct scan_dir **roots;
+	char path[MAXPATHLEN];
+	unsigned long long start, now;
+	char *config, *resume;
+	int i, nroots = 0, done;
+
+	start = monotonic_us();
+	scan.deferred = GETFLAG(DEFERRED_METADATA_MASK) ? 1 : 0;
+
+	for( media_path = media_dirs; media_path != NULL; media_path = media_path->next )
+		nroots++;
+	roots = calloc(nroots, sizeof(*roots));
+	if( !roots )
+		nroots = 0;
+	for( i = 0, media_path = media_dirs; i < nroots; i++, media_path = media_path->next )
+		roots[i] = new_dir(media_path->path, media_path->types, NULL);
+	walk_init(roots, nroots);
+	metrics_set(M_SCAN_ESTIMATE, walk_count());
+
+	resume = sql_get_text_field(db, "SELECT VALUE from SETTINGS where KEY = 'scan_checkpoint'");
+	if( resume )
+	{
+		scan.resume = strdup(resume);
+		sqlite3_free(resume);
+	}
+	done = sql_get_int_field(db, "SELECT count(*) from DETAILS where MIME is not NULL");
+	metrics_set(M_SCAN_RESUMED, done > 0 ? done : 0);
+
+	/* read ahead what is left to scan */
+	for( i = 0, media_path = media_dirs; i < nroots; i++, media_path = media_path->next )
+	{
+		if( roots[i] && sql_get_int_field(db, "SELECT count(*) from SETTINGS where KEY = 'media_dir'"
+		                                      " and VALUE = %Q", media_path->path) > 0 )
+		{
+			free_dir(roots[i]);
+			roots[i] = NULL;
+		}
+	}
+	if( scan.resume )
+		walk.resume = strdup(scan.resume);
+	walk_start();
+
+	sql_exec(db, "BEGIN");
+	scan.last = time(NULL);
+	config = scan_config();
+	sql_exec(db, "DELETE from SETTINGS where KEY = 'scan_config'");
+	sql_exec(db, "INSERT into SETTINGS values ('scan_config', %Q)", config);
+	sqlite3_free(config);
+
+	av_register_all();
+	av_log_set_level(AV_LOG_PANIC);
+	/* interrupted while checking the media dir it had resumed in */
+	verify_resumed();
+	for( i = 0, media_path = media_dirs; media_path != NULL; i++, media_path = media_path->next )
+	{
+		int64_t id;
+		char *bname, *parent = NULL;
+		char buf[16];
+		size_t len;
+		int resumed = 0;
+
+		/* finished by an interrupted scan */
+		if( sql_get_int_field(db, "SELECT count(*) from SETTINGS where KEY = 'media_dir' and VALUE = %Q",
+		                      media_path->path) > 0 )
+			continue;
+		len = strlen(media_path->path);
+		if( scan.resume && strncmp(scan.resume, media_path->path, len) == 0 && scan.resume[len] == '/' )
+		{
+			char *val = sql_get_text_field(db, "SELECT VALUE from SETTINGS where KEY = 'scan_parent'");
+			if( val && *val )
+			{
+				strncpyt(buf, val, sizeof(buf));
+				parent = buf;
+			}
+			sqlite3_free(val);
+			scan.start = sql_get_int_field(db, "SELECT VALUE from SETTINGS where KEY = 'scan_start'");
+			DPRINTF(E_WARN, L_SCANNER, "Resuming scan of %s after %s\n", media_path->path, scan.resume);
+			resumed = 1;
+		}
+		else
+		{
+			free(scan.resume);
+			scan.resume = NULL;
+			strncpyt(path, media_path->path, sizeof(path));
+			bname = basename(path);
+			/* If there are multiple media locations, add a level to the ContentDirectory */
+			if( !GETFLAG(MERGE_MEDIA_DIRS_MASK) && media_dirs->next )
+			{
+				int startID = get_next_available_id("OBJECTS", BROWSEDIR_ID);
+				id = insert_directory(bname, path, BROWSEDIR_ID, "", startID);
+				sprintf(buf, "$%X", startID);
+				parent = buf;
+				scan.start = 0;
+			}
+			else
+			{
+				id = GetFolderMetadata(bname, media_path->path, NULL, NULL, 0);
+				scan.start = get_next_available_id("OBJECTS", BROWSEDIR_ID);
+			}
+			/* Use TIMESTAMP to store the media type */
+			sql_exec(db, "UPDATE DETAILS set TIMESTAMP = %d where ID = %lld", media_path->types, (long long)id);
+			sql_exec(db, "DELETE from SETTINGS where KEY in ('scan_parent', 'scan_start')");
+			sql_exec(db, "INSERT into SETTINGS values ('scan_parent', %Q)", THISORNUL(parent));
+			sql_exec(db, "INSERT into SETTINGS values ('scan_start', '%d')", scan.start);
+		}
+		if( i < nroots && roots[i] )
+		{
+			take_dir(roots[i]);
+			add_dir(roots[i], parent);
+			roots[i] = NULL;
+		}
+		else
+			ScanDirectory(AT_FDCWD, media_path->path, parent, media_path->types);
+#if !USE_FORK
+		if( quitting )
+			break;
+#endif
+		sql_exec(db, "INSERT into SETTINGS values (%Q, %Q)", "media_dir", media_path->path);
+		if( resumed )
+			sql_exec(db, "INSERT into SETTINGS values ('scan_verify', %Q)", media_path->path);
+		scan_checkpoint(NULL, 1);
+		verify_resumed();
+#if !USE_FORK
+		if( quitting )
+			break;
+#endif
+	}
+	walk_stop();
+	for( i = 0; i < nroots; i++ )
+	{
+		if( roots[i] )
+			free_dir(roots[i]);
+	}
+	free(roots);
+	walk_end();
+	free(scan.resume);
+	scan.resume = NULL;
+	scan.deferred = 0;
+#if !USE_FORK
+	/* keep what was committed, to resume from next time */
+	if( quitting )
+	{
+		sql_exec(db, "ROLLBACK");
+		return -1;
+	}
+#endif
+	sql_exec(db, "COMMIT");
+	now = monotonic_us();
+	metrics_set(M_SCAN_STAGE_FILES, now - start);
+	start = now;
+	/* Create this index after scanning, so it doesn't slow down the scanning process.
+	 * This index is very useful for large libraries used with an XBox360 (or any
+	 * client that uses UPnPSearch on large containers). */
+	sql_exec(db, "create INDEX IDX_SEARCH_OPT ON OBJECTS(OBJECT_ID, CLASS, DETAIL_ID);");
+	now = monotonic_us();
+	metrics_set(M_SCAN_STAGE_INDEX, now - start);
+	start = now;
+
+	if( GETFLAG(NO_PLAYLIST_MASK) )
+	{
+		DPRINTF(E_WARN, L_SCANNER, "Playlist creation disabled\n");	  
+	}
+	else
+	{
+		fill_playlists();
+	}
+	metrics_set(M_SCAN_STAGE_PLAYLISTS, monotonic_us() - start);
+
+	DPRINTF(E_DEBUG, L_SCANNER, "Initial file scan completed\n");
+	sql_exec(db, "DELETE from SETTINGS where KEY in ('scan_parent', 'scan_start')");
+	//JM: Set up a db version number, so we know if we need to rebuild due to a new structure.
 	sql_exec(db, "pragma user_version = %d;", DB_VERSION);
+
+	return 0;
+}
+
+/* bring the database up to date with changes made while minidlna was not
+ * running, skipping unchanged directories
+ * returns: 0 when done, -1 if interrupted */
+static int
+rescan_files(void)
+{
+	struct media_dir_s *media_path;
+	unsigned long long start;
+	char *id;
+
+	start = monotonic_us();
+	scan.deferred = GETFLAG(DEFERRED_METADATA_MASK) ? 1 : 0;
+	sql_exec(db, "BEGIN");
+	scan.dirs = 0;
+	scan.last = time(NULL);
+	av_register_all();
+	av_log_set_level(AV_LOG_PANIC);
+	for( media_path = media_dirs; media_path != NULL; media_path = media_path->next )
+	{
+		DPRINTF(E_WARN, L_SCANNER, "Rescanning %s\n", media_path->path);
+		id = sql_get_text_field(db, "SELECT o.OBJECT_ID from OBJECTS o"
+		                            " join DETAILS d on (d.ID = o.DETAIL_ID)"
+		                            " where d.PATH = %Q and o.REF_ID is NULL", media_path->path);
+		RescanDirectory(media_path->path, id ? id + strlen(BROWSEDIR_ID) : "", media_path->types);
+		sqlite3_free(id);
+#if !USE_FORK
+		if( quitting )
+			break;
+#endif
+	}
+	scan.deferred = 0;
+	sql_exec(db, "COMMIT");
+#if !USE_FORK
+	if( quitting )
+		return -1;
+#endif
+	metrics_set(M_SCAN_STAGE_FILES, monotonic_us() - start);
+	DPRINTF(E_WARN, L_SCANNER, "Rescan finished: %d directories changed, %d unchanged (%d entries skipped)\n",
+	        rescan.changed_dirs, rescan.skipped_dirs, rescan.skipped_entries);
+
+	if( !GETFLAG(NO_PLAYLIST_MASK) && rescan.changed_dirs )
+	{
+		start = monotonic_us();
+		fill_playlists();
+		metrics_set(M_SCAN_STAGE_PLAYLISTS, monotonic_us() - start);
+	}
+
+	return 0;
+}
+
+void
+start_scanner()
+{
+	const char *collation;
+
+	if (setpriority(PRIO_PROCESS, 0, 15) == -1)
+		DPRINTF(E_WARN, L_INOTIFY,  "Failed to reduce scanner thread priority\n");
+	_notify_start();
+	metrics_set(M_SCAN_START, time(NULL));
+	metrics_set(M_SCAN_END, 0);
+	metrics_set(M_SCAN_STAGE_FILES, 0);
+
+	/* The scan's transactions must be atomic for it to be resumed, and a
+	 * large one spills pages into the database before it commits, so the
+	 * scanner can't run without a rollback journal like the server does. */
+	sql_exec(db, "pragma journal_mode = TRUNCATE");
+
+	setlocale(LC_COLLATE, "");
+	collation = setlocale(LC_COLLATE, NULL);
+	scan.bytesort = (!collation || strcmp(collation, "C") == 0 || strcmp(collation, "POSIX") == 0);
+
+	if( sql_get_int_field(db, "PRAGMA user_version") == DB_VERSION )
+	{
+		if( GETFLAG(RESCAN_MASK) )
+		{
+			if( rescan_files() != 0 )
+				return;
+		}
+		else /* only the metadata pass was left to do */
+			DPRINTF(E_WARN, L_SCANNER, "Resuming the metadata scan\n");
+	}
+	else if( scan_files() != 0 )
+		return;
+	read_pending_metadata();
+#if !USE_FORK
+	if( quitting )
+		return;
+#endif
+	/* Also catches entries orphaned before they were tracked */
+	art_cache_sweep(1);
+	_notify_stop();
+	metrics_set(M_SCAN_END, time(NULL));
+	sql_exec(db, "DELETE from SETTINGS where KEY = 'scan_config'");
+	sql_exec(db, "pragma journal_mode = OFF");
 }
@@ -77,9 +77,46 @@ insert_directory(const char *name, const char *path, const char *base, const cha
 int
 insert_file(char *name, const char *path, const char *parentID, int object, media_types dir_types);
 
+/* remove_file()
+ * drop a media file or playlist from the database, and any containers
+ * it leaves empty
+ * returns: 0 on success, 1 if it was not in the database */
+int
+remove_file(const char *path);
+
+/* remove_directory()
+ * drop a directory and everything below it from the database
+ * returns: 0 on success, 1 if nothing was found */
+int
+remove_directory(const char *path);
+
+/* save_dir_stamp()
+ * record the stamp of dir, taken with stat() before it was listed, once all
+ * of its entries are in the database */
+void
+save_dir_stamp(const char *dir, const struct stat *st, int entries);
+
 int
 CreateDatabase(void);
 
+/* scanner_can_resume()
+ * returns: 1 if the database holds an interrupted scan of the current
+ *          media dirs, which start_scanner() will pick up, 0 if not */
+int
+scanner_can_resume(void);
+
+/* scanner_init()
+ * map the browse hints shared with the scanner; call before it is forked
+ * returns: 0 on success, -1 on failure */
+int
+scanner_init(void);
+
+/* scanner_hint()
+ * tell a running scanner a client is browsing container id, so the metadata
+ * of its files is read first */
+void
+scanner_hint(const char *id);
+
 void
 start_scanner();
 
@@ -58,7 +58,8 @@ char create_detailTable_sqlite[] = "CREATE TABLE DETAILS ("
 
 char create_albumArtTable_sqlite[] = "CREATE TABLE ALBUM_ART ("
 					"ID INTEGER PRIMARY KEY AUTOINCREMENT, "
-					"PATH TEXT NOT NULL"
+					"PATH TEXT NOT NULL, "
+					"HASH TEXT"
                                         ");";
 
 char create_captionTable_sqlite[] = "CREATE TABLE CAPTIONS ("
@@ -79,6 +80,39 @@ char create_playlistTable_sqlite[] = "CREATE TABLE PLAYLISTS ("
 					"FOUND INTEGER DEFAULT 0"
 					");";
 
+/* UPDATE_ID is bumped for a container whenever one of its children is
+ * added, changed or removed; rows are replaced rather than updated, so
+ * the highest UPDATE_ID is always the latest change. */
+char create_containerUpdatesTable_sqlite[] = "CREATE TABLE CONTAINER_UPDATES ("
+					"UPDATE_ID INTEGER PRIMARY KEY AUTOINCREMENT, "
+					"OBJECT_ID TEXT UNIQUE NOT NULL"
+					");";
+
+char create_containerUpdatesTriggers_sqlite[] =
+	"CREATE TRIGGER TRG_OBJECTS_INSERT AFTER INSERT ON OBJECTS BEGIN "
+		"INSERT OR REPLACE into CONTAINER_UPDATES (OBJECT_ID) values (NEW.PARENT_ID); "
+	"END; "
+	"CREATE TRIGGER TRG_OBJECTS_UPDATE AFTER UPDATE ON OBJECTS BEGIN "
+		"INSERT OR REPLACE into CONTAINER_UPDATES (OBJECT_ID) values (NEW.PARENT_ID); "
+	"END; "
+	"CREATE TRIGGER TRG_OBJECTS_DELETE AFTER DELETE ON OBJECTS BEGIN "
+		"DELETE from CONTAINER_UPDATES where OBJECT_ID = OLD.OBJECT_ID; "
+		"INSERT OR REPLACE into CONTAINER_UPDATES (OBJECT_ID) values (OLD.PARENT_ID); "
+	"END;";
+
+char create_pendingMetadataTable_sqlite[] = "CREATE TABLE PENDING_METADATA ("
+					"DETAIL_ID INTEGER PRIMARY KEY, "
+					"OBJECT_ID TEXT NOT NULL, "
+					"TYPES INTEGER NOT NULL"
+					");";
+
+char create_directoriesTable_sqlite[] = "CREATE TABLE DIRECTORIES ("
+					"PATH TEXT PRIMARY KEY NOT NULL, "
+					"MTIME INTEGER, "
+					"INODE INTEGER, "
+					"ENTRIES INTEGER"
+					");";
+
 char create_settingsTable_sqlite[] = "CREATE TABLE SETTINGS ("
 					"KEY TEXT NOT NULL, "
 					"VALUE TEXT"
@@ -21,6 +21,7 @@
 
 #include "sql.h"
 #include "upnpglobalvars.h"
+#include "metrics.h"
 #include "log.h"
 
 int
@@ -30,12 +31,15 @@ sql_exec(sqlite3 *db, const char *fmt, ...)
 	char *errMsg = NULL;
 	char *sql;
 	va_list ap;
+	unsigned long long start;
 	//DPRINTF(E_DEBUG, L_DB_SQL, "SQL: %s\n", sql);
 
 	va_start(ap, fmt);
 	sql = sqlite3_vmprintf(fmt, ap);
 	va_end(ap);
+	start = monotonic_us();
 	ret = sqlite3_exec(db, sql, 0, 0, &errMsg);
+	metrics_sql(monotonic_us() - start);
 	if( ret != SQLITE_OK )
 	{
 		DPRINTF(E_ERROR, L_DB_SQL, "SQL ERROR %d [%s]\n%s\n", ret, errMsg, sql);
@@ -52,9 +56,12 @@ sql_get_table(sqlite3 *db, const char *sql, char ***pazResult, int *pnRow, int *
 {
 	int ret;
 	char *errMsg = NULL;
+	unsigned long long start;
 	//DPRINTF(E_DEBUG, L_DB_SQL, "SQL: %s\n", sql);
 	
+	start = monotonic_us();
 	ret = sqlite3_get_table(db, sql, pazResult, pnRow, pnColumn, &errMsg);
+	metrics_sql(monotonic_us() - start);
 	if( ret != SQLITE_OK )
 	{
 		DPRINTF(E_ERROR, L_DB_SQL, "SQL ERROR %d [%s]\n%s\n", ret, errMsg, sql);
@@ -73,6 +80,7 @@ sql_get_int_field(sqlite3 *db, const char *fmt, ...)
 	char		*sql;
 	int		ret;
 	sqlite3_stmt	*stmt;
+	unsigned long long start;
 	
 	va_start(ap, fmt);
 	sql = sqlite3_vmprintf(fmt, ap);
@@ -80,6 +88,7 @@ sql_get_int_field(sqlite3 *db, const char *fmt, ...)
 
 	//DPRINTF(E_DEBUG, L_DB_SQL, "sql: %s\n", sql);
 
+	start = monotonic_us();
 	switch (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL))
 	{
 		case SQLITE_OK:
@@ -98,6 +107,7 @@ sql_get_int_field(sqlite3 *db, const char *fmt, ...)
 		 if (result == SQLITE_LOCKED)
 		 	sleep(1);
 	}
+	metrics_sql(monotonic_us() - start);
 
 	switch (result)
 	{
@@ -132,6 +142,7 @@ sql_get_int64_field(sqlite3 *db, const char *fmt, ...)
 	char		*sql;
 	int64_t		ret;
 	sqlite3_stmt	*stmt;
+	unsigned long long start;
 	
 	va_start(ap, fmt);
 	sql = sqlite3_vmprintf(fmt, ap);
@@ -139,6 +150,7 @@ sql_get_int64_field(sqlite3 *db, const char *fmt, ...)
 
 	//DPRINTF(E_DEBUG, L_DB_SQL, "sql: %s\n", sql);
 
+	start = monotonic_us();
 	switch (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL))
 	{
 		case SQLITE_OK:
@@ -157,6 +169,7 @@ sql_get_int64_field(sqlite3 *db, const char *fmt, ...)
 		 if (result == SQLITE_LOCKED)
 		 	sleep(1);
 	}
+	metrics_sql(monotonic_us() - start);
 
 	switch (result)
 	{
@@ -191,6 +204,7 @@ sql_get_text_field(sqlite3 *db, const char *fmt, ...)
 	char            *sql;
 	char            *str;
 	sqlite3_stmt    *stmt;
+	unsigned long long start;
 
 	if (db == NULL)
 	{
@@ -204,6 +218,7 @@ sql_get_text_field(sqlite3 *db, const char *fmt, ...)
 
 	//DPRINTF(E_DEBUG, L_DB_SQL, "sql: %s\n", sql);
 
+	start = monotonic_us();
 	switch (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL))
 	{
 		case SQLITE_OK:
@@ -224,6 +239,7 @@ sql_get_text_field(sqlite3 *db, const char *fmt, ...)
 		if (result == SQLITE_LOCKED)
 			sleep(1);
 	}
+	metrics_sql(monotonic_us() - start);
 
 	switch (result)
 	{
@@ -272,8 +288,15 @@ db_upgrade(sqlite3 *db)
 		return -2;
 	if (db_vers < 1)
 		return -1;
-	if (db_vers < 9)
+	if (db_vers < 12)
 		return db_vers;
+	if (db_vers < 13)
+	{
+		/* album art moved to a store keyed by content; the existing
+		 * entries keep working, but are not shared */
+		sql_exec(db, "ALTER TABLE ALBUM_ART ADD HASH TEXT");
+		sql_exec(db, "create INDEX IDX_ALBUM_ART_HASH ON ALBUM_ART(HASH);");
+	}
 	sql_exec(db, "PRAGMA user_version = %d", DB_VERSION);
 
 	return 0;
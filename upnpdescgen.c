@@ -351,6 +351,7 @@ static const struct stateVar ContentDirectoryVars[] =
 	{"SearchCapabilities", 0, 0},
 	{"SortCapabilities", 0, 0},
 	{"SystemUpdateID", 3|EVENTED, 0, 0, 255},
+	{"ContainerUpdateIDs", 0|EVENTED, 0, 0, 255},
 	{0, 0}
 };
 
@@ -750,6 +751,8 @@ genEventVars(int * len, const struct serviceDesc * s, const char * servns)
 					snprintf(buf, sizeof(buf), "%d", updateID);
 					str = strcat_str(str, len, &tmplen, buf);
 				}
+				else if( strcmp(v->name, "ContainerUpdateIDs") == 0 )
+					str = strcat_str(str, len, &tmplen, container_update_ids);
 				break;
 			default:
 				str = strcat_str(str, len, &tmplen, upnpallowedvalues[v->ieventvalue]);
@@ -56,6 +56,8 @@
 #include <time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
 #include <sys/param.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -70,17 +72,32 @@
 #include "utils.h"
 #include "log.h"
 
+/* Events for a service are sent at most once every EVENT_MODERATION
+ * seconds; changes in between are folded into the next event. */
+#define EVENT_MODERATION	2
+/* connections to subscribers kept open for the next event */
+#define EVENT_IDLE_MAX		16
+#define EVENT_IDLE_TIMEOUT	30
+
 /* stuctures definitions */
 struct subscriber {
 	LIST_ENTRY(subscriber) entries;
 	struct upnp_event_notify * notify;
 	time_t timeout;
 	uint32_t seq;
+	int dirty;	/* changed while a notify was in flight */
 	enum subscriber_service_enum service;
 	char uuid[42];
 	char callback[];
 };
 
+/* propertyset XML, shared by all the notifies for one change */
+struct upnp_event_body {
+	int refs;
+	int len;
+	char xml[];
+};
+
 struct upnp_event_notify {
 	LIST_ENTRY(upnp_event_notify) entries;
     int s;  /* socket */
@@ -91,15 +108,28 @@ struct upnp_event_notify {
 	       EFinished,
 	       EError } state;
     struct subscriber * sub;
+    struct upnp_event_body * body;
     char * buffer;
     int buffersize;
 	int tosend;
     int sent;
+	int reused;	/* socket came from the idle list */
+	int keepalive;	/* response allows reusing the connection */
+	int resplen;
+	char resp[512];
+	struct sockaddr_in addr;
 	const char * path;
 	char addrstr[16];
 	char portstr[8];
 };
 
+struct upnp_event_conn {
+	LIST_ENTRY(upnp_event_conn) entries;
+	int s;
+	struct sockaddr_in addr;
+	time_t expires;
+};
+
 /* prototypes */
 static void
 upnp_event_create_notify(struct subscriber * sub);
@@ -110,6 +140,66 @@ LIST_HEAD(listhead, subscriber) subscriberlist = { NULL };
 /* notify list */
 LIST_HEAD(listheadnotif, upnp_event_notify) notifylist = { NULL };
 
+/* idle connection list */
+static LIST_HEAD(listheadconn, upnp_event_conn) idlelist = { NULL };
+static int n_idle = 0;
+
+static struct {
+	struct upnp_event_body * body;	/* current propertyset, if built */
+	struct timeval last;		/* when the last event was sent */
+	int pending;			/* a change is waiting for moderation */
+} services[EMSMediaReceiverRegistrar+1];
+
+static void
+upnp_event_body_release(struct upnp_event_body * body)
+{
+	if(body && --body->refs == 0)
+		free(body);
+}
+
+/* get a reference to the current propertyset of a service, building it
+ * if nothing has used it since the last change */
+static struct upnp_event_body *
+upnp_event_body_get(enum subscriber_service_enum service)
+{
+	struct upnp_event_body * body;
+	char * xml;
+	int l;
+
+	body = services[service].body;
+	if(body) {
+		body->refs++;
+		return body;
+	}
+	switch(service) {
+	case EContentDirectory:
+		xml = getVarsContentDirectory(&l);
+		break;
+	case EConnectionManager:
+		xml = getVarsConnectionManager(&l);
+		break;
+	case EMSMediaReceiverRegistrar:
+		xml = getVarsX_MS_MediaReceiverRegistrar(&l);
+		break;
+	default:
+		xml = NULL;
+		l = 0;
+	}
+	if(!xml)
+		l = 0;
+	body = malloc(sizeof(struct upnp_event_body)+l+3);
+	if(body) {
+		memcpy(body->xml, xml, l);
+		memcpy(body->xml+l, "\r\n", 3);
+		body->len = l+2;
+		/* one reference for the cache, one for the caller */
+		body->refs = 2;
+		services[service].body = body;
+	}
+	free(xml);
+	return body;
+}
+
 /* create a new subscriber */
 static struct subscriber *
 newSubscriber(const char * eventurl, const char * callback, int callbacklen)
@@ -200,20 +290,76 @@ void
 upnpevents_removeSubscribers(void)
 {
 	struct subscriber * sub;
+	struct upnp_event_conn * conn;
 
 	for(sub = subscriberlist.lh_first; sub != NULL; sub = subscriberlist.lh_first) {
 		upnpevents_removeSubscriber(sub->uuid, sizeof(sub->uuid));
 	}
+	while((conn = idlelist.lh_first) != NULL) {
+		close(conn->s);
+		LIST_REMOVE(conn, entries);
+		free(conn);
+	}
+	n_idle = 0;
 }
 
-/* notifies all subscribers of a SystemUpdateID change */
-void
-upnp_event_var_change_notify(enum subscriber_service_enum service)
+/* send the pending event of a service to all its subscribers */
+static void
+upnp_event_flush(enum subscriber_service_enum service, const struct timeval *now)
 {
 	struct subscriber * sub;
+
+	/* build the new propertyset now, as ContainerUpdateIDs only lists the
+	 * containers changed since the last event */
+	upnp_event_body_release(services[service].body);
+	services[service].body = NULL;
+	upnp_event_body_release(upnp_event_body_get(service));
+	if(service == EContentDirectory) {
+		container_update_ids[0] = '\0';
+		container_evented_seq = container_update_seq;
+	}
 	for(sub = subscriberlist.lh_first; sub != NULL; sub = sub->entries.le_next) {
-		if(sub->service == service && sub->notify == NULL)
+		if(sub->service != service)
+			continue;
+		if(sub->notify == NULL)
 			upnp_event_create_notify(sub);
+		else
+			sub->dirty = 1;
+	}
+	services[service].last = *now;
+	services[service].pending = 0;
+}
+
+/* notifies all subscribers of a SystemUpdateID change */
+void
+upnp_event_var_change_notify(enum subscriber_service_enum service)
+{
+	struct timeval now;
+
+	services[service].pending = 1;
+	gettimeofday(&now, NULL);
+	if(now.tv_sec >= services[service].last.tv_sec + EVENT_MODERATION)
+		upnp_event_flush(service, &now);
+}
+
+void
+upnpevents_sendpending(const struct timeval *now, struct timeval *timeout)
+{
+	struct timeval due, left;
+	int service;
+
+	for(service = EContentDirectory; service <= EMSMediaReceiverRegistrar; service++) {
+		if(!services[service].pending)
+			continue;
+		due = services[service].last;
+		due.tv_sec += EVENT_MODERATION;
+		if(!timercmp(&due, now, >)) {
+			upnp_event_flush(service, now);
+			continue;
+		}
+		timersub(&due, now, &left);
+		if(timercmp(&left, timeout, <))
+			*timeout = left;
 	}
 }
 
@@ -222,7 +368,6 @@ static void
 upnp_event_create_notify(struct subscriber * sub)
 {
 	struct upnp_event_notify * obj;
-	int flags;
 	obj = calloc(1, sizeof(struct upnp_event_notify));
 	if(!obj) {
 		DPRINTF(E_ERROR, L_HTTP, "%s: calloc(): %s\n", "upnp_event_create_notify", strerror(errno));
@@ -230,41 +375,62 @@ upnp_event_create_notify(struct subscriber * sub)
 	}
 	obj->sub = sub;
 	obj->state = ECreated;
-	obj->s = socket(PF_INET, SOCK_STREAM, 0);
-	if(obj->s<0) {
-		DPRINTF(E_ERROR, L_HTTP, "%s: socket(): %s\n", "upnp_event_create_notify", strerror(errno));
-		goto error;
-	}
-	if((flags = fcntl(obj->s, F_GETFL, 0)) < 0) {
-		DPRINTF(E_ERROR, L_HTTP, "%s: fcntl(..F_GETFL..): %s\n",
-		       "upnp_event_create_notify", strerror(errno));
-		goto error;
-	}
-	if(fcntl(obj->s, F_SETFL, flags | O_NONBLOCK) < 0) {
-		DPRINTF(E_ERROR, L_HTTP, "%s: fcntl(..F_SETFL..): %s\n",
-		       "upnp_event_create_notify", strerror(errno));
-		goto error;
-	}
+	obj->s = -1;
 	if(sub)
 		sub->notify = obj;
 	LIST_INSERT_HEAD(&notifylist, obj, entries);
-	return;
-error:
-	if(obj->s >= 0)
-		close(obj->s);
-	free(obj);
+}
+
+/* take a connection to addr from the idle list
+ * returns: the socket, or -1 if there is none */
+static int
+upnp_event_conn_get(const struct sockaddr_in * addr)
+{
+	struct upnp_event_conn * conn;
+	int s;
+	for(conn = idlelist.lh_first; conn != NULL; conn = conn->entries.le_next) {
+		if(conn->addr.sin_addr.s_addr == addr->sin_addr.s_addr &&
+		   conn->addr.sin_port == addr->sin_port) {
+			s = conn->s;
+			LIST_REMOVE(conn, entries);
+			free(conn);
+			n_idle--;
+			return s;
+		}
+	}
+	return -1;
+}
+
+/* keep the connection of a finished notify for the next event */
+static void
+upnp_event_conn_put(struct upnp_event_notify * obj)
+{
+	struct upnp_event_conn * conn;
+	if(n_idle >= EVENT_IDLE_MAX)
+		return;
+	conn = malloc(sizeof(struct upnp_event_conn));
+	if(!conn)
+		return;
+	conn->s = obj->s;
+	conn->addr = obj->addr;
+	conn->expires = time(NULL) + EVENT_IDLE_TIMEOUT;
+	LIST_INSERT_HEAD(&idlelist, conn, entries);
+	n_idle++;
+	obj->s = -1;
 }
 
 static void
 upnp_event_notify_connect(struct upnp_event_notify * obj)
 {
 	int i;
+	int flags;
 	const char * p;
 	unsigned short port;
-	struct sockaddr_in addr;
+	struct sockaddr_in *addr;
 	if(!obj)
 		return;
-	memset(&addr, 0, sizeof(addr));
+	addr = &obj->addr;
+	memset(addr, 0, sizeof(*addr));
 	i = 0;
 	if(obj->sub == NULL) {
 		obj->state = EError;
@@ -293,13 +459,33 @@ upnp_event_notify_connect(struct upnp_event_notify * obj)
 		obj->path = p;
 	else
 		obj->path = "/";
-	addr.sin_family = AF_INET;
-	inet_aton(obj->addrstr, &addr.sin_addr);
-	addr.sin_port = htons(port);
+	addr->sin_family = AF_INET;
+	inet_aton(obj->addrstr, &addr->sin_addr);
+	addr->sin_port = htons(port);
+	obj->state = EConnecting;
+	obj->s = upnp_event_conn_get(addr);
+	if(obj->s >= 0) {
+		DPRINTF(E_DEBUG, L_HTTP, "%s: '%s' %hu '%s' [reused]\n", "upnp_event_notify_connect",
+		       obj->addrstr, port, obj->path);
+		obj->reused = 1;
+		return;
+	}
 	DPRINTF(E_DEBUG, L_HTTP, "%s: '%s' %hu '%s'\n", "upnp_event_notify_connect",
 	       obj->addrstr, port, obj->path);
-	obj->state = EConnecting;
-	if(connect(obj->s, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+	obj->s = socket(PF_INET, SOCK_STREAM, 0);
+	if(obj->s<0) {
+		DPRINTF(E_ERROR, L_HTTP, "%s: socket(): %s\n", "upnp_event_notify_connect", strerror(errno));
+		obj->state = EError;
+		return;
+	}
+	if((flags = fcntl(obj->s, F_GETFL, 0)) < 0 ||
+	   fcntl(obj->s, F_SETFL, flags | O_NONBLOCK) < 0) {
+		DPRINTF(E_ERROR, L_HTTP, "%s: fcntl(): %s\n",
+		       "upnp_event_notify_connect", strerror(errno));
+		obj->state = EError;
+		return;
+	}
+	if(connect(obj->s, (struct sockaddr *)addr, sizeof(*addr)) < 0) {
 		if(errno != EINPROGRESS && errno != EWOULDBLOCK) {
 			DPRINTF(E_ERROR, L_HTTP, "%s: connect(): %s\n", "upnp_event_notify_connect", strerror(errno));
 			obj->state = EError;
@@ -307,6 +493,25 @@ upnp_event_notify_connect(struct upnp_event_notify * obj)
 	}
 }
 
+/* a kept-alive connection turned out to be closed by the subscriber;
+ * start over on a new one */
+static void
+upnp_event_retry(struct upnp_event_notify * obj)
+{
+	DPRINTF(E_DEBUG, L_HTTP, "%s: reused connection to %s%s was closed\n",
+	       "upnp_event_retry", obj->addrstr, obj->portstr);
+	close(obj->s);
+	obj->s = -1;
+	free(obj->buffer);
+	obj->buffer = NULL;
+	upnp_event_body_release(obj->body);
+	obj->body = NULL;
+	obj->sent = 0;
+	obj->resplen = 0;
+	obj->reused = 0;
+	obj->state = ECreated;
+}
+
 static void upnp_event_prepare(struct upnp_event_notify * obj)
 {
 	static const char notifymsg[] = 
@@ -318,47 +523,53 @@ static void upnp_event_prepare(struct upnp_event_notify * obj)
 		"NTS: upnp:propchange\r\n"
 		"SID: %s\r\n"
 		"SEQ: %u\r\n"
-		"Connection: close\r\n"
 		"Cache-Control: no-cache\r\n"
-		"\r\n"
-		"%.*s\r\n";
-	char * xml;
-	int l;
+		"\r\n";
 	if(obj->sub == NULL) {
 		obj->state = EError;
 		return;
 	}
-	switch(obj->sub->service) {
-	case EContentDirectory:
-		xml = getVarsContentDirectory(&l);
-		break;
-	case EConnectionManager:
-		xml = getVarsConnectionManager(&l);
-		break;
-	case EMSMediaReceiverRegistrar:
-		xml = getVarsX_MS_MediaReceiverRegistrar(&l);
-		break;
-	default:
-		xml = NULL;
-		l = 0;
+	obj->body = upnp_event_body_get(obj->sub->service);
+	if(obj->body == NULL) {
+		obj->state = EError;
+		return;
 	}
-	obj->tosend = asprintf(&(obj->buffer), notifymsg,
-	                       obj->path, obj->addrstr, obj->portstr, l+2,
-	                       obj->sub->uuid, obj->sub->seq,
-	                       l, xml);
-	obj->buffersize = obj->tosend;
-	free(xml);
-	DPRINTF(E_DEBUG, L_HTTP, "Sending UPnP Event response:\n%s\n", obj->buffer);
+	obj->buffersize = asprintf(&(obj->buffer), notifymsg,
+	                           obj->path, obj->addrstr, obj->portstr, obj->body->len,
+	                           obj->sub->uuid, obj->sub->seq);
+	if(obj->buffersize < 0) {
+		obj->buffer = NULL;
+		obj->state = EError;
+		return;
+	}
+	obj->tosend = obj->buffersize + obj->body->len;
+	DPRINTF(E_DEBUG, L_HTTP, "Sending UPnP Event response:\n%s%s\n", obj->buffer, obj->body->xml);
 	obj->state = ESending;
 }
 
 static void upnp_event_send(struct upnp_event_notify * obj)
 {
+	struct iovec iov[2];
 	int i;
 	//DEBUG DPRINTF(E_DEBUG, L_HTTP, "Sending UPnP Event:\n%s", obj->buffer+obj->sent);
 	while( obj->sent < obj->tosend ) {
-		i = send(obj->s, obj->buffer + obj->sent, obj->tosend - obj->sent, 0);
+		if(obj->sent < obj->buffersize) {
+			iov[0].iov_base = obj->buffer + obj->sent;
+			iov[0].iov_len = obj->buffersize - obj->sent;
+			iov[1].iov_base = obj->body->xml;
+			iov[1].iov_len = obj->body->len;
+			i = writev(obj->s, iov, 2);
+		} else {
+			i = send(obj->s, obj->body->xml + (obj->sent - obj->buffersize),
+			         obj->tosend - obj->sent, 0);
+		}
 		if(i<0) {
+			if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+				return;
+			if(obj->reused && obj->sent == 0) {
+				upnp_event_retry(obj);
+				return;
+			}
 			DPRINTF(E_WARN, L_HTTP, "%s: send(): %s\n", "upnp_event_send", strerror(errno));
 			obj->state = EError;
 			return;
@@ -369,18 +580,76 @@ static void upnp_event_send(struct upnp_event_notify * obj)
 		obj->state = EWaitingForResponse;
 }
 
+/* check whether the response is complete, and whether the connection can
+ * carry the next event
+ * returns: 1 if complete, 0 if more is needed */
+static int
+upnp_event_parse_response(struct upnp_event_notify * obj)
+{
+	char * hdrend;
+	char * p;
+	int bodylen;
+
+	obj->resp[obj->resplen] = '\0';
+	hdrend = strstr(obj->resp, "\r\n\r\n");
+	if(!hdrend)
+		return 0;
+	hdrend += 4;
+	obj->keepalive = 0;
+	if(strncmp(obj->resp, "HTTP/1.1 ", 9) != 0)
+		return 1;
+	p = strcasestr(obj->resp, "\r\nContent-Length:");
+	if(!p || p > hdrend)
+		return 1;
+	bodylen = atoi(p + 17);
+	if(bodylen < 0)
+		return 1;
+	if(obj->resp + obj->resplen < hdrend + bodylen) {
+		/* don't bother with long bodies, just close when done */
+		if(hdrend + bodylen >= obj->resp + sizeof(obj->resp))
+			return 1;
+		return 0;
+	}
+	p = strcasestr(obj->resp, "\r\nConnection:");
+	if(p && p < hdrend) {
+		p += 13;
+		while(*p == ' ')
+			p++;
+		if(strncasecmp(p, "close", 5) == 0)
+			return 1;
+	}
+	/* anything past the response is not ours to handle */
+	obj->keepalive = (obj->resp + obj->resplen == hdrend + bodylen);
+	return 1;
+}
+
 static void upnp_event_recv(struct upnp_event_notify * obj)
 {
 	int n;
-	n = recv(obj->s, obj->buffer, obj->buffersize, 0);
+	n = recv(obj->s, obj->resp + obj->resplen, sizeof(obj->resp) - 1 - obj->resplen, 0);
 	if(n<0) {
+		if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return;
+		if(obj->reused && obj->resplen == 0) {
+			upnp_event_retry(obj);
+			return;
+		}
 		DPRINTF(E_ERROR, L_HTTP, "%s: recv(): %s\n", "upnp_event_recv", strerror(errno));
 		obj->state = EError;
 		return;
 	}
+	if(n == 0 && obj->reused && obj->resplen == 0) {
+		upnp_event_retry(obj);
+		return;
+	}
+	obj->resplen += n;
+	if(n > 0 && obj->resplen < sizeof(obj->resp) - 1 && !upnp_event_parse_response(obj))
+		return;
 	DPRINTF(E_DEBUG, L_HTTP, "%s: (%dbytes) %.*s\n", "upnp_event_recv",
-	       n, n, obj->buffer);
+	       obj->resplen, obj->resplen, obj->resp);
 	obj->state = EFinished;
+	if(n > 0 && obj->keepalive)
+		upnp_event_conn_put(obj);
 	if(obj->sub)
 	{
 		obj->sub->seq++;
@@ -396,7 +665,8 @@ upnp_event_process_notify(struct upnp_event_notify * obj)
 	case EConnecting:
 		/* now connected or failed to connect */
 		upnp_event_prepare(obj);
-		upnp_event_send(obj);
+		if(obj->state == ESending)
+			upnp_event_send(obj);
 		break;
 	case ESending:
 		upnp_event_send(obj);
@@ -416,15 +686,14 @@ upnp_event_process_notify(struct upnp_event_notify * obj)
 void upnpevents_selectfds(fd_set *readset, fd_set *writeset, int * max_fd)
 {
 	struct upnp_event_notify * obj;
+	struct upnp_event_conn * conn;
 	for(obj = notifylist.lh_first; obj != NULL; obj = obj->entries.le_next) {
 		DPRINTF(E_DEBUG, L_HTTP, "upnpevents_selectfds: %p %d %d\n",
 		       obj, obj->state, obj->s);
+		if(obj->state == ECreated)
+			upnp_event_notify_connect(obj);
 		if(obj->s >= 0) {
 			switch(obj->state) {
-			case ECreated:
-				upnp_event_notify_connect(obj);
-				if(obj->state != EConnecting)
-					break;
 			case EConnecting:
 			case ESending:
 				FD_SET(obj->s, writeset);
@@ -441,19 +710,41 @@ void upnpevents_selectfds(fd_set *readset, fd_set *writeset, int * max_fd)
 			}
 		}
 	}
+	/* idle connections become readable when the subscriber closes them */
+	for(conn = idlelist.lh_first; conn != NULL; conn = conn->entries.le_next) {
+		FD_SET(conn->s, readset);
+		if(conn->s > *max_fd)
+			*max_fd = conn->s;
+	}
 }
 
 void upnpevents_processfds(fd_set *readset, fd_set *writeset)
 {
 	struct upnp_event_notify * obj;
 	struct upnp_event_notify * next;
+	struct upnp_event_conn * conn;
+	struct upnp_event_conn * connnext;
 	struct subscriber * sub;
 	struct subscriber * subnext;
 	time_t curtime;
+	/* close idle connections the subscriber gave up on, or that we've
+	 * kept long enough; done first, as connections that go idle below
+	 * may still be set in readset */
+	curtime = time(NULL);
+	for(conn = idlelist.lh_first; conn != NULL; conn = connnext) {
+		connnext = conn->entries.le_next;
+		if(FD_ISSET(conn->s, readset) || curtime > conn->expires) {
+			close(conn->s);
+			LIST_REMOVE(conn, entries);
+			free(conn);
+			n_idle--;
+		}
+	}
 	for(obj = notifylist.lh_first; obj != NULL; obj = obj->entries.le_next) {
 		DPRINTF(E_DEBUG, L_HTTP, "%s: %p %d %d %d %d\n",
 		       "upnpevents_processfds", obj, obj->state, obj->s,
-		       FD_ISSET(obj->s, readset), FD_ISSET(obj->s, writeset));
+		       obj->s >= 0 && FD_ISSET(obj->s, readset),
+		       obj->s >= 0 && FD_ISSET(obj->s, writeset));
 		if(obj->s >= 0) {
 			if(FD_ISSET(obj->s, readset) || FD_ISSET(obj->s, writeset))
 				upnp_event_process_notify(obj);
@@ -466,8 +757,9 @@ void upnpevents_processfds(fd_set *readset, fd_set *writeset)
 			if(obj->s >= 0) {
 				close(obj->s);
 			}
-			if(obj->sub)
-				obj->sub->notify = NULL;
+			sub = obj->sub;
+			if(sub)
+				sub->notify = NULL;
 #if 0 /* Just let it time out instead of explicitly removing the subscriber */
 			/* remove also the subscriber from the list if there was an error */
 			if(obj->state == EError && obj->sub) {
@@ -476,13 +768,18 @@ void upnpevents_processfds(fd_set *readset, fd_set *writeset)
 			}
 #endif
 			free(obj->buffer);
+			upnp_event_body_release(obj->body);
 			LIST_REMOVE(obj, entries);
 			free(obj);
+			/* send the changes made while this was in flight */
+			if(sub && sub->dirty) {
+				sub->dirty = 0;
+				upnp_event_create_notify(sub);
+			}
 		}
 		obj = next;
 	}
 	/* remove timeouted subscribers */
-	curtime = time(NULL);
 	for(sub = subscriberlist.lh_first; sub != NULL; ) {
 		subnext = sub->entries.le_next;
 		if(sub->timeout && curtime > sub->timeout && sub->notify == NULL) {
@@ -492,4 +789,3 @@ void upnpevents_processfds(fd_set *readset, fd_set *writeset)
 		sub = subnext;
 	}
 }
-
@@ -66,6 +66,11 @@ void upnpevents_removeSubscribers(void);
 
 int renewSubscription(const char * sid, int sidlen, int timeout);
 
+/* upnpevents_sendpending()
+ * send the events held back by moderation that are due by now, and lower
+ * timeout to the time left until the next one */
+void upnpevents_sendpending(const struct timeval *now, struct timeval *timeout);
+
 void upnpevents_selectfds(fd_set *readset, fd_set *writeset, int * max_fd);
 void upnpevents_processfds(fd_set *readset, fd_set *writeset);
 
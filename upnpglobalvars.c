@@ -91,4 +91,7 @@ struct album_art_name_s * album_art_names = NULL;
 short int scanning = 0;
 volatile short int quitting = 0;
 volatile uint32_t updateID = 0;
+char container_update_ids[CONTAINER_UPDATE_IDS_LEN];
+int64_t container_update_seq = 0;
+int64_t container_evented_seq = 0;
 const char *force_sort_criteria = NULL;
@@ -66,7 +66,7 @@
 #endif
 
 #define USE_FORK 1
-#define DB_VERSION 9
+#define DB_VERSION 13
 
 #ifdef ENABLE_NLS
 #define _(string) gettext(string)
@@ -191,6 +191,11 @@ extern uint32_t runtime_flags;
 #define NO_PLAYLIST_MASK      0x0008
 #define SYSTEMD_MASK          0x0010
 #define MERGE_MEDIA_DIRS_MASK 0x0020
+#define PROBE_PREFILL_MASK    0x0040
+#define RESIZE_PREGEN_MASK    0x0080
+#define DEFERRED_METADATA_MASK 0x0100
+#define RESCAN_MASK           0x0200
+#define FANOTIFY_MASK         0x0400
 
 #define SETFLAG(mask)	runtime_flags |= mask
 #define GETFLAG(mask)	(runtime_flags & mask)
@@ -234,6 +239,12 @@ extern struct album_art_name_s *album_art_names;
 extern short int scanning;
 extern volatile short int quitting;
 extern volatile uint32_t updateID;
+/* ContainerUpdateIDs value for the next ContentDirectory event, and the
+ * CONTAINER_UPDATES rows it and the last event covered */
+#define CONTAINER_UPDATE_IDS_LEN 2048
+extern char container_update_ids[];
+extern int64_t container_update_seq;
+extern int64_t container_evented_seq;
 extern const char *force_sort_criteria;
 
 #endif
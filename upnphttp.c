@@ -62,6 +62,7 @@
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <limits.h>
+#include <stddef.h>
 
 #include "config.h"
 #include "upnpglobalvars.h"
@@ -81,6 +82,10 @@
 #include "clients.h"
 #include "process.h"
 #include "sendfile.h"
+#include "blockcache.h"
+#include "resizecache.h"
+#include "metrics.h"
+#include "inotify.h"
 
 #define MAX_BUFFER_SIZE 2147483647
 #define MIN_BUFFER_SIZE 65536
@@ -111,8 +116,12 @@ New_upnphttp(int s)
 	ret = (struct upnphttp *)malloc(sizeof(struct upnphttp));
 	if(ret == NULL)
 		return NULL;
-	memset(ret, 0, sizeof(struct upnphttp));
+	/* no need to clear the request buffer */
+	memset(ret, 0, offsetof(struct upnphttp, req_fixed));
 	ret->socket = s;
+	ret->req_buf = ret->req_fixed;
+	ret->req_bufsize = sizeof(ret->req_fixed);
+	ret->req_contentlen = -1;
 	return ret;
 }
 
@@ -134,311 +143,491 @@ Delete_upnphttp(struct upnphttp * h)
 	{
 		if(h->socket >= 0)
 			CloseSocket_upnphttp(h);
-		free(h->req_buf);
+		if(h->req_buf != h->req_fixed)
+			free(h->req_buf);
+		arena_release(&h->arena);
 		free(h->res_buf);
 		free(h);
 	}
 }
 
-/* parse HttpHeaders of the REQUEST */
+/* grow_request()
+ * move the request to a heap buffer of the given size, keeping the
+ * pointers the parser saved into it valid
+ * returns: 0 on success, -1 on failure */
+static int
+grow_request(struct upnphttp * h, int size)
+{
+	char *old = h->req_buf;
+	char *buf;
+
+	if (size <= h->req_bufsize)
+		return 0;
+	if (size > UPNPHTTP_MAXREQ)
+	{
+		DPRINTF(E_ERROR, L_HTTP, "Request too large (%d bytes)\n", size);
+		return -1;
+	}
+	buf = malloc(size);
+	if (!buf)
+	{
+		DPRINTF(E_ERROR, L_HTTP, "Receive request body: %s\n", strerror(errno));
+		return -1;
+	}
+	memcpy(buf, old, h->req_buflen + 1);
+	if (old != h->req_fixed)
+		free(old);
+	h->req_buf = buf;
+	h->req_bufsize = size;
+
+#define REBASE(p) if (p) p = buf + ((p) - old)
+	REBASE(h->HttpVer);
+	REBASE(h->req_url);
+	REBASE(h->req_soapAction);
+	REBASE(h->req_Callback);
+	REBASE(h->req_NT);
+	REBASE(h->req_SID);
+	REBASE(h->req_Authorization);
+#undef REBASE
+
+	return 0;
+}
+
+enum http_header {
+	HDR_UNKNOWN,
+	HDR_CONTENT_LENGTH,
+	HDR_SOAPACTION,
+	HDR_CALLBACK,
+	HDR_SID,
+	HDR_NT,
+	HDR_TIMEOUT,
+	HDR_RANGE,
+	HDR_HOST,
+	HDR_USER_AGENT,
+	HDR_X_AV_CLIENT_INFO,
+	HDR_TRANSFER_ENCODING,
+	HDR_ACCEPT_LANGUAGE,
+	HDR_GETCONTENTFEATURES,
+	HDR_TIMESEEKRANGE,
+	HDR_PLAYSPEED,
+	HDR_REALTIMEINFO,
+	HDR_GETAVAILABLESEEKRANGE,
+	HDR_TRANSFERMODE,
+	HDR_GETCAPTIONINFO,
+	HDR_FRIENDLYNAME,
+	HDR_UCTT,
+	HDR_AUTHORIZATION
+};
+
+/* Look a header name up by its length and first character, so at most one
+ * string comparison is done per header line. */
+static enum http_header
+http_header_id(const char * name, int len)
+{
+	int c = tolower(*name);
+
+#define HDR(str, id) \
+	if (c == tolower(str[0]) && strncasecmp(name, str, sizeof(str) - 1) == 0) \
+		return id
+	switch (len)
+	{
+	case 2:
+		HDR("NT", HDR_NT);
+		break;
+	case 3:
+		HDR("SID", HDR_SID);
+		break;
+	case 4:
+		HDR("Host", HDR_HOST);
+		break;
+	case 5:
+		HDR("Range", HDR_RANGE);
+		break;
+	case 7:
+		HDR("Timeout", HDR_TIMEOUT);
+		break;
+	case 8:
+		HDR("Callback", HDR_CALLBACK);
+		break;
+	case 10:
+		HDR("User-Agent", HDR_USER_AGENT);
+		HDR("SOAPAction", HDR_SOAPACTION);
+		break;
+	case 12:
+		HDR("FriendlyName", HDR_FRIENDLYNAME);
+		break;
+	case 13:
+		HDR("uctt.upnp.org", HDR_UCTT);
+		HDR("Authorization", HDR_AUTHORIZATION);
+		break;
+	case 14:
+		HDR("Content-Length", HDR_CONTENT_LENGTH);
+		break;
+	case 15:
+		HDR("Accept-Language", HDR_ACCEPT_LANGUAGE);
+		break;
+	case 16:
+		HDR("X-AV-Client-Info", HDR_X_AV_CLIENT_INFO);
+		break;
+	case 17:
+		HDR("Transfer-Encoding", HDR_TRANSFER_ENCODING);
+		break;
+	case 18:
+		HDR("PlaySpeed.dlna.org", HDR_PLAYSPEED);
+		HDR("getCaptionInfo.sec", HDR_GETCAPTIONINFO);
+		break;
+	case 21:
+		HDR("transferMode.dlna.org", HDR_TRANSFERMODE);
+		HDR("realTimeInfo.dlna.org", HDR_REALTIMEINFO);
+		HDR("FriendlyName.DLNA.ORG", HDR_FRIENDLYNAME);
+		break;
+	case 22:
+		HDR("TimeSeekRange.dlna.org", HDR_TIMESEEKRANGE);
+		break;
+	case 27:
+		HDR("getcontentFeatures.dlna.org", HDR_GETCONTENTFEATURES);
+		break;
+	case 30:
+		HDR("getAvailableSeekRange.dlna.org", HDR_GETAVAILABLESEEKRANGE);
+		break;
+	}
+#undef HDR
+
+	return HDR_UNKNOWN;
+}
+
+/* parse the request line, terminating the URL and HTTP version in place */
 static void
-ParseHttpHeaders(struct upnphttp * h)
+ParseRequestLine(struct upnphttp * h, char * line, int len)
 {
-	int client = 0;
-	char * line;
+	char *end = line + len;
+	char *p, *url;
+	int i;
+
+	p = memchr(line, ' ', len);
+	if (!p)
+		p = end;
+	switch (p - line)
+	{
+	case 3:
+		if (memcmp(line, "GET", 3) == 0)
+			h->req_command = EGet;
+		break;
+	case 4:
+		if (memcmp(line, "POST", 4) == 0)
+			h->req_command = EPost;
+		else if (memcmp(line, "HEAD", 4) == 0)
+			h->req_command = EHead;
+		break;
+	case 9:
+		if (memcmp(line, "SUBSCRIBE", 9) == 0)
+			h->req_command = ESubscribe;
+		break;
+	case 11:
+		if (memcmp(line, "UNSUBSCRIBE", 11) == 0)
+			h->req_command = EUnSubscribe;
+		break;
+	}
+
+	while (p < end && *p == ' ')
+		p++;
+	if (end - p > 7 && strncmp(p, "http://", 7) == 0)
+	{
+		p += 7;
+		while (p < end && *p != '/')
+			p++;
+	}
+	url = p;
+	while (p < end && *p != ' ')
+		p++;
+	h->req_url = url;
+	if (p - url > 511)
+		url[511] = '\0';
+	*p = '\0';
+	if (p < end)
+		p++;
+	while (p < end && *p == ' ')
+		p++;
+	if (end - p > 15)
+		end = p + 15;
+	*end = '\0';
+	h->HttpVer = p;
+
+	/* set the interface here initially, in case there is no Host header */
+	for (i = 0; i < n_lan_addr; i++)
+	{
+		if( (h->clientaddr.s_addr & lan_addr[i].mask.s_addr)
+		   == (lan_addr[i].addr.s_addr & lan_addr[i].mask.s_addr))
+		{
+			h->iface = i;
+			break;
+		}
+	}
+}
+
+/* parse one header line of the request */
+static void
+ParseHttpHeader(struct upnphttp * h, char * line, int len)
+{
+	int client = h->req_clientidx;
 	char * colon;
 	char * p;
 	int n;
-	line = h->req_buf;
-	/* TODO : check if req_buf, contentoff are ok */
-	while(line < (h->req_buf + h->req_contentoff))
+
+	colon = memchr(line, ':', len);
+	if (!colon)
+		return;
+	for (n = colon - line; n > 0 && isspace(line[n-1]); n--)
+		;
+	switch (http_header_id(line, n))
 	{
-		colon = strchr(line, ':');
-		if(colon)
+	case HDR_CONTENT_LENGTH:
+		p = colon;
+		while(*p && (*p < '0' || *p > '9'))
+			p++;
+		h->req_contentlen = atoi(p);
+		if(h->req_contentlen < 0) {
+			DPRINTF(E_WARN, L_HTTP, "Invalid Content-Length %d", h->req_contentlen);
+			h->req_contentlen = 0;
+		}
+		break;
+	case HDR_SOAPACTION:
+		p = colon;
+		n = 0;
+		while(*p == ':' || *p == ' ' || *p == '\t')
+			p++;
+		while(p[n] >= ' ')
+			n++;
+		if(n >= 2 &&
+		   ((p[0] == '"' && p[n-1] == '"') ||
+		    (p[0] == '\'' && p[n-1] == '\'')))
 		{
-			if(strncasecmp(line, "Content-Length", 14)==0)
-			{
-				p = colon;
-				while(*p && (*p < '0' || *p > '9'))
-					p++;
-				h->req_contentlen = atoi(p);
-				if(h->req_contentlen < 0) {
-					DPRINTF(E_WARN, L_HTTP, "Invalid Content-Length %d", h->req_contentlen);
-					h->req_contentlen = 0;
-				}
-			}
-			else if(strncasecmp(line, "SOAPAction", 10)==0)
-			{
-				p = colon;
-				n = 0;
-				while(*p == ':' || *p == ' ' || *p == '\t')
-					p++;
-				while(p[n] >= ' ')
-					n++;
-				if(n >= 2 &&
-				   ((p[0] == '"' && p[n-1] == '"') ||
-				    (p[0] == '\'' && p[n-1] == '\'')))
-				{
-					p++;
-					n -= 2;
-				}
-				h->req_soapAction = p;
-				h->req_soapActionLen = n;
-			}
-			else if(strncasecmp(line, "Callback", 8)==0)
-			{
-				p = colon;
-				while(*p && *p != '<' && *p != '\r' )
-					p++;
-				n = 0;
-				while(p[n] && p[n] != '>' && p[n] != '\r' )
-					n++;
-				h->req_Callback = p + 1;
-				h->req_CallbackLen = MAX(0, n - 1);
-			}
-			else if(strncasecmp(line, "SID", 3)==0)
-			{
-				//zqiu: fix bug for test 4.0.5
-				//Skip extra headers like "SIDHEADER: xxxxxx xxx"
-				for(p=line+3;p<colon;p++)
-				{
-					if(!isspace(*p))
-					{
-						p = NULL; //unexpected header
-						break;
-					}
-				}
-				if(p) {
-					p = colon + 1;
-					while(isspace(*p))
-						p++;
-					n = 0;
-					while(p[n] && !isspace(p[n]))
-						n++;
-					h->req_SID = p;
-					h->req_SIDLen = n;
-				}
-			}
-			else if(strncasecmp(line, "NT", 2)==0)
-			{
-				p = colon + 1;
-				while(isspace(*p))
-					p++;
-				n = 0;
-				while(p[n] && !isspace(p[n]))
-					n++;
-				h->req_NT = p;
-				h->req_NTLen = n;
-			}
-			/* Timeout: Seconds-nnnn */
-			/* TIMEOUT
-			Recommended. Requested duration until subscription expires,
-			either number of seconds or infinite. Recommendation
-			by a UPnP Forum working committee. Defined by UPnP vendor.
-			Consists of the keyword "Second-" followed (without an
-			intervening space) by either an integer or the keyword "infinite". */
-			else if(strncasecmp(line, "Timeout", 7)==0)
-			{
-				p = colon + 1;
-				while(isspace(*p))
-					p++;
-				if(strncasecmp(p, "Second-", 7)==0) {
-					h->req_Timeout = atoi(p+7);
-				}
-			}
-			// Range: bytes=xxx-yyy
-			else if(strncasecmp(line, "Range", 5)==0)
-			{
-				p = colon + 1;
-				while(isspace(*p))
-					p++;
-				if(strncasecmp(p, "bytes=", 6)==0) {
-					h->reqflags |= FLAG_RANGE;
-					h->req_RangeStart = strtoll(p+6, &colon, 10);
-					h->req_RangeEnd = colon ? atoll(colon+1) : 0;
-					DPRINTF(E_DEBUG, L_HTTP, "Range Start-End: %lld - %lld\n",
-						(long long)h->req_RangeStart,
-						h->req_RangeEnd ? (long long)h->req_RangeEnd : -1);
-				}
-			}
-			else if(strncasecmp(line, "Host", 4)==0)
-			{
-				int i;
-				h->reqflags |= FLAG_HOST;
-				p = colon + 1;
-				while(isspace(*p))
-					p++;
-				for(n = 0; n<n_lan_addr; n++)
-				{
-					for(i=0; lan_addr[n].str[i]; i++)
-					{
-						if(lan_addr[n].str[i] != p[i])
-							break;
-					}
-					if(!lan_addr[n].str[i])
-					{
-						h->iface = n;
-						break;
-					}
-				}
-			}
-			else if(strncasecmp(line, "User-Agent", 10)==0)
-			{
-				int i;
-				/* Skip client detection if we already detected it. */
-				if( client )
-					goto next_header;
-				p = colon + 1;
-				while(isspace(*p))
-					p++;
-				for (i = 0; client_types[i].name; i++)
-				{
-					if (client_types[i].match_type != EUserAgent)
-						continue;
-					if (strstrc(p, client_types[i].match, '\r') != NULL)
-					{
-						client = i;
-						break;
-					}
-				}
-			}
-			else if(strncasecmp(line, "X-AV-Client-Info", 16)==0)
-			{
-				int i;
-				/* Skip client detection if we already detected it. */
-				if( client && client_types[client].type < EStandardDLNA150 )
-					goto next_header;
-				p = colon + 1;
-				while(isspace(*p))
-					p++;
-				for (i = 0; client_types[i].name; i++)
-				{
-					if (client_types[i].match_type != EXAVClientInfo)
-						continue;
-					if (strstrc(p, client_types[i].match, '\r') != NULL)
-					{
-						client = i;
-						break;
-					}
-				}
-			}
-			else if(strncasecmp(line, "Transfer-Encoding", 17)==0)
-			{
-				p = colon + 1;
-				while(isspace(*p))
-					p++;
-				if(strncasecmp(p, "chunked", 7)==0)
-				{
-					h->reqflags |= FLAG_CHUNKED;
-				}
-			}
-			else if(strncasecmp(line, "Accept-Language", 15)==0)
-			{
-				h->reqflags |= FLAG_LANGUAGE;
-			}
-			else if(strncasecmp(line, "getcontentFeatures.dlna.org", 27)==0)
-			{
-				p = colon + 1;
-				while(isspace(*p))
-					p++;
-				if( (*p != '1') || !isspace(p[1]) )
-					h->reqflags |= FLAG_INVALID_REQ;
-			}
-			else if(strncasecmp(line, "TimeSeekRange.dlna.org", 22)==0)
-			{
-				h->reqflags |= FLAG_TIMESEEK;
-			}
-			else if(strncasecmp(line, "PlaySpeed.dlna.org", 18)==0)
-			{
-				h->reqflags |= FLAG_PLAYSPEED;
-			}
-			else if(strncasecmp(line, "realTimeInfo.dlna.org", 21)==0)
-			{
-				h->reqflags |= FLAG_REALTIMEINFO;
-			}
-			else if(strncasecmp(line, "getAvailableSeekRange.dlna.org", 21)==0)
-			{
-				p = colon + 1;
-				while(isspace(*p))
-					p++;
-				if( (*p != '1') || !isspace(p[1]) )
-					h->reqflags |= FLAG_INVALID_REQ;
-			}
-			else if(strncasecmp(line, "transferMode.dlna.org", 21)==0)
-			{
-				p = colon + 1;
-				while(isspace(*p))
-					p++;
-				if(strncasecmp(p, "Streaming", 9)==0)
-				{
-					h->reqflags |= FLAG_XFERSTREAMING;
-				}
-				if(strncasecmp(p, "Interactive", 11)==0)
-				{
-					h->reqflags |= FLAG_XFERINTERACTIVE;
-				}
-				if(strncasecmp(p, "Background", 10)==0)
-				{
-					h->reqflags |= FLAG_XFERBACKGROUND;
-				}
-			}
-			else if(strncasecmp(line, "getCaptionInfo.sec", 18)==0)
+			p++;
+			n -= 2;
+		}
+		h->req_soapAction = p;
+		h->req_soapActionLen = n;
+		break;
+	case HDR_CALLBACK:
+		p = colon;
+		while(*p && *p != '<' && *p != '\r' )
+			p++;
+		n = 0;
+		while(p[n] && p[n] != '>' && p[n] != '\r' )
+			n++;
+		h->req_Callback = p + 1;
+		h->req_CallbackLen = MAX(0, n - 1);
+		break;
+	case HDR_SID:
+		p = colon + 1;
+		while(isspace(*p))
+			p++;
+		n = 0;
+		while(p[n] && !isspace(p[n]))
+			n++;
+		h->req_SID = p;
+		h->req_SIDLen = n;
+		break;
+	case HDR_AUTHORIZATION:
+		p = colon + 1;
+		while(*p == ' ' || *p == '\t')
+			p++;
+		n = 0;
+		while(p[n] >= ' ')
+			n++;
+		h->req_Authorization = p;
+		h->req_AuthorizationLen = n;
+		break;
+	case HDR_NT:
+		p = colon + 1;
+		while(isspace(*p))
+			p++;
+		n = 0;
+		while(p[n] && !isspace(p[n]))
+			n++;
+		h->req_NT = p;
+		h->req_NTLen = n;
+		break;
+	/* Timeout: Seconds-nnnn */
+	/* TIMEOUT
+	Recommended. Requested duration until subscription expires,
+	either number of seconds or infinite. Recommendation
+	by a UPnP Forum working committee. Defined by UPnP vendor.
+	Consists of the keyword "Second-" followed (without an
+	intervening space) by either an integer or the keyword "infinite". */
+	case HDR_TIMEOUT:
+		p = colon + 1;
+		while(isspace(*p))
+			p++;
+		if(strncasecmp(p, "Second-", 7)==0) {
+			h->req_Timeout = atoi(p+7);
+		}
+		break;
+	// Range: bytes=xxx-yyy
+	case HDR_RANGE:
+		p = colon + 1;
+		while(isspace(*p))
+			p++;
+		if(strncasecmp(p, "bytes=", 6)==0) {
+			h->reqflags |= FLAG_RANGE;
+			h->req_RangeStart = strtoll(p+6, &colon, 10);
+			h->req_RangeEnd = colon ? atoll(colon+1) : 0;
+			DPRINTF(E_DEBUG, L_HTTP, "Range Start-End: %lld - %lld\n",
+				(long long)h->req_RangeStart,
+				h->req_RangeEnd ? (long long)h->req_RangeEnd : -1);
+		}
+		break;
+	case HDR_HOST:
+	{
+		int i;
+		h->reqflags |= FLAG_HOST;
+		p = colon + 1;
+		while(isspace(*p))
+			p++;
+		for(n = 0; n<n_lan_addr; n++)
+		{
+			for(i=0; lan_addr[n].str[i]; i++)
 			{
-				h->reqflags |= FLAG_CAPTION;
+				if(lan_addr[n].str[i] != p[i])
+					break;
 			}
-			else if(strncasecmp(line, "FriendlyName", 12)==0)
+			if(!lan_addr[n].str[i])
 			{
-				int i;
-				p = colon + 1;
-				while(isspace(*p))
-					p++;
-				for (i = 0; client_types[i].name; i++)
-				{
-					if (client_types[i].match_type != EFriendlyName)
-						continue;
-					if (strstrc(p, client_types[i].match, '\r') != NULL)
-					{
-						client = i;
-						break;
-					}
-				}
+				h->iface = n;
+				break;
 			}
-			else if(strncasecmp(line, "uctt.upnp.org:", 14)==0)
+		}
+		break;
+	}
+	case HDR_USER_AGENT:
+	{
+		int i;
+		/* Skip client detection if we already detected it. */
+		if( client )
+			break;
+		p = colon + 1;
+		while(isspace(*p))
+			p++;
+		for (i = 0; client_types[i].name; i++)
+		{
+			if (client_types[i].match_type != EUserAgent)
+				continue;
+			if (strstrc(p, client_types[i].match, '\r') != NULL)
 			{
-				/* Conformance testing */
-				SETFLAG(DLNA_STRICT_MASK);
+				client = i;
+				break;
 			}
 		}
-next_header:
-		line = strstr(line, "\r\n");
-		if (!line)
-			return;
-		line += 2;
+		break;
 	}
-	if( h->reqflags & FLAG_CHUNKED )
+	case HDR_X_AV_CLIENT_INFO:
 	{
-		char *endptr;
-		h->req_chunklen = -1;
-		if( h->req_buflen <= h->req_contentoff )
-			return;
-		while( (line < (h->req_buf + h->req_buflen)) &&
-		       (h->req_chunklen = strtol(line, &endptr, 16)) &&
-		       (endptr != line) )
+		int i;
+		/* Skip client detection if we already detected it. */
+		if( client && client_types[client].type < EStandardDLNA150 )
+			break;
+		p = colon + 1;
+		while(isspace(*p))
+			p++;
+		for (i = 0; client_types[i].name; i++)
 		{
-			endptr = strstr(endptr, "\r\n");
-			if (!endptr)
+			if (client_types[i].match_type != EXAVClientInfo)
+				continue;
+			if (strstrc(p, client_types[i].match, '\r') != NULL)
 			{
-				return;
+				client = i;
+				break;
 			}
-			line = endptr+h->req_chunklen+2;
 		}
-
-		if( endptr == line )
+		break;
+	}
+	case HDR_TRANSFER_ENCODING:
+		p = colon + 1;
+		while(isspace(*p))
+			p++;
+		if(strncasecmp(p, "chunked", 7)==0)
 		{
-			h->req_chunklen = -1;
-			return;
+			h->reqflags |= FLAG_CHUNKED;
+		}
+		break;
+	case HDR_ACCEPT_LANGUAGE:
+		h->reqflags |= FLAG_LANGUAGE;
+		break;
+	case HDR_GETCONTENTFEATURES:
+	case HDR_GETAVAILABLESEEKRANGE:
+		p = colon + 1;
+		while(isspace(*p))
+			p++;
+		if( (*p != '1') || !isspace(p[1]) )
+			h->reqflags |= FLAG_INVALID_REQ;
+		break;
+	case HDR_TIMESEEKRANGE:
+		h->reqflags |= FLAG_TIMESEEK;
+		break;
+	case HDR_PLAYSPEED:
+		h->reqflags |= FLAG_PLAYSPEED;
+		break;
+	case HDR_REALTIMEINFO:
+		h->reqflags |= FLAG_REALTIMEINFO;
+		break;
+	case HDR_TRANSFERMODE:
+		p = colon + 1;
+		while(isspace(*p))
+			p++;
+		if(strncasecmp(p, "Streaming", 9)==0)
+		{
+			h->reqflags |= FLAG_XFERSTREAMING;
+		}
+		if(strncasecmp(p, "Interactive", 11)==0)
+		{
+			h->reqflags |= FLAG_XFERINTERACTIVE;
+		}
+		if(strncasecmp(p, "Background", 10)==0)
+		{
+			h->reqflags |= FLAG_XFERBACKGROUND;
 		}
+		break;
+	case HDR_GETCAPTIONINFO:
+		h->reqflags |= FLAG_CAPTION;
+		break;
+	case HDR_FRIENDLYNAME:
+	{
+		int i;
+		p = colon + 1;
+		while(isspace(*p))
+			p++;
+		for (i = 0; client_types[i].name; i++)
+		{
+			if (client_types[i].match_type != EFriendlyName)
+				continue;
+			if (strstrc(p, client_types[i].match, '\r') != NULL)
+			{
+				client = i;
+				break;
+			}
+		}
+		break;
 	}
+	case HDR_UCTT:
+		/* Conformance testing */
+		SETFLAG(DLNA_STRICT_MASK);
+		break;
+	case HDR_UNKNOWN:
+		break;
+	}
+	h->req_clientidx = client;
+}
+
+/* called once the empty line ending the headers has been seen */
+static void
+FinishHttpHeaders(struct upnphttp * h)
+{
+	int client = h->req_clientidx;
+
+	/* without a Content-Length, the body is whatever came with the headers */
+	if (h->req_contentlen < 0)
+		h->req_contentlen = h->req_buflen - h->req_contentoff;
+
 	/* If the client type wasn't found, search the cache.
 	 * This is done because a lot of clients like to send a
 	 * different User-Agent with different types of requests. */
@@ -462,6 +651,77 @@ next_header:
 	}
 }
 
+/* ParseHttpRequest()
+ * parse the lines received since the last call, picking up where the
+ * previous call stopped
+ * returns: 1 once all the headers have been parsed, 0 if more are needed */
+static int
+ParseHttpRequest(struct upnphttp * h)
+{
+	char * line;
+	char * eol;
+	int len;
+
+	while ((eol = memchr(h->req_buf + h->req_scanoff, '\n',
+	                     h->req_buflen - h->req_scanoff)))
+	{
+		line = h->req_buf + h->req_lineoff;
+		len = eol - line;
+		if (len && eol[-1] == '\r')
+			len--;
+		h->req_lineoff = h->req_scanoff = eol + 1 - h->req_buf;
+		if (!h->req_hdroff)
+		{
+			/* ignore empty lines in front of the request line */
+			if (!len)
+				continue;
+			ParseRequestLine(h, line, len);
+			h->req_hdroff = h->req_lineoff;
+		}
+		else if (!len)
+		{
+			h->req_contentoff = h->req_lineoff;
+			FinishHttpHeaders(h);
+			return 1;
+		}
+		else
+			ParseHttpHeader(h, line, len);
+	}
+	h->req_scanoff = h->req_buflen;
+
+	return 0;
+}
+
+/* check_chunks()
+ * walk the chunks of a chunked request body received so far
+ * returns: 0 if the last chunk is there, 1 if more data is needed,
+ *          -1 if the body is malformed */
+static int
+check_chunks(struct upnphttp * h)
+{
+	char *line = h->req_buf + h->req_contentoff;
+	char *end = h->req_buf + h->req_buflen;
+	char *endptr;
+	long chunklen;
+
+	for (;;)
+	{
+		while (line < end && (*line == '\r' || *line == '\n'))
+			line++;
+		if (line >= end)
+			return 1;
+		chunklen = strtol(line, &endptr, 16);
+		if (endptr == line || chunklen < 0 || chunklen > UPNPHTTP_MAXREQ)
+			return -1;
+		endptr = strstr(endptr, "\r\n");
+		if (!endptr)
+			return 1;
+		if (!chunklen)
+			return 0;
+		line = endptr + 2 + chunklen;
+	}
+}
+
 /* very minimalistic 400 error message */
 static void
 Send400(struct upnphttp * h)
@@ -616,8 +876,25 @@ SendResp_presentation(struct upnphttp * h)
 		"</table>", a, v, p);
 
 	if (scanning)
-		strcatf(&str,
-			"<br><i>* Media scan in progress</i><br>");
+	{
+		double done;
+		long eta;
+
+		if (metrics_get(M_SCAN_PENDING) > 0)
+			strcatf(&str,
+				"<br><i>* Media scan in progress (reading metadata, %lld files left)</i><br>",
+				(long long)metrics_get(M_SCAN_PENDING));
+		else if (!metrics_scan_progress(&done, &eta))
+			strcatf(&str,
+				"<br><i>* Media scan in progress</i><br>");
+		else if (eta < 0)
+			strcatf(&str,
+				"<br><i>* Media scan in progress (%d%% done)</i><br>", (int)(done * 100));
+		else
+			strcatf(&str,
+				"<br><i>* Media scan in progress (%d%% done, about %ld:%02ld remaining)</i><br>",
+				(int)(done * 100), eta / 60, eta % 60);
+	}
 
 	strcatf(&str,
 		"<h3>Connected clients</h3>"
@@ -642,6 +919,119 @@ SendResp_presentation(struct upnphttp * h)
 	CloseSocket_upnphttp(h);
 }
 
+/* Prometheus scrape target */
+static void
+SendResp_metrics(struct upnphttp * h)
+{
+	struct string_s str;
+
+	str.data = malloc(METRICS_RESP_SIZE);
+	if (!str.data)
+	{
+		Send500(h);
+		return;
+	}
+	str.size = METRICS_RESP_SIZE;
+	str.off = 0;
+
+	h->respflags = FLAG_PLAINTEXT;
+	metrics_render(&str);
+
+	BuildResp_upnphttp(h, str.data, str.off);
+	SendResp_upnphttp(h);
+	CloseSocket_upnphttp(h);
+	free(str.data);
+}
+
+/* The control interface lets the ingest side of a library say what changed:
+ * a POST to /control/rescan with one path per line queues a rescan of those
+ * paths, and GET /control/rescan[/<id>] reports on it.  Requests have to come
+ * from this host, with "Authorization: Bearer <control_token>". */
+static void
+SendResp_control(struct upnphttp * h, int code, const char * msg, const char * body)
+{
+	h->respflags = FLAG_JSON;
+	BuildResp2_upnphttp(h, code, msg, body, strlen(body));
+	SendResp_upnphttp(h);
+	CloseSocket_upnphttp(h);
+}
+
+/* returns: 0 if the request may go ahead, -1 once it was answered */
+static int
+check_control(struct upnphttp * h)
+{
+	const char *token = runtime_vars.control_token;
+	int len, i, diff = 0;
+
+	if (!token)
+	{
+		Send404(h);
+		return -1;
+	}
+	if ((ntohl(h->clientaddr.s_addr) >> 24) != 127)
+	{
+		DPRINTF(E_WARN, L_HTTP, "Control request from %s refused\n", inet_ntoa(h->clientaddr));
+		SendResp_control(h, 403, "Forbidden", "{\"error\":\"not a local client\"}");
+		return -1;
+	}
+	len = strlen(token);
+	if (!h->req_Authorization || h->req_AuthorizationLen != len + 7 ||
+	    strncasecmp(h->req_Authorization, "Bearer ", 7) != 0)
+		diff = 1;
+	else
+	{
+		/* in constant time */
+		for (i = 0; i < len; i++)
+			diff |= h->req_Authorization[7 + i] ^ token[i];
+	}
+	if (diff)
+	{
+		DPRINTF(E_WARN, L_HTTP, "Control request without the right token refused\n");
+		SendResp_control(h, 401, "Unauthorized", "{\"error\":\"bad token\"}");
+		return -1;
+	}
+#ifdef HAVE_INOTIFY
+	if (!GETFLAG(INOTIFY_MASK))
+#endif
+	{
+		SendResp_control(h, 503, "Service Unavailable", "{\"error\":\"inotify is disabled\"}");
+		return -1;
+	}
+
+	return 0;
+}
+
+static void
+ProcessRescanPOST(struct upnphttp * h)
+{
+#ifdef HAVE_INOTIFY
+	struct string_s str;
+	char body[512];
+	int id;
+
+	if (check_control(h) != 0)
+		return;
+	id = inotify_rescan(h->req_buf + h->req_contentoff, h->req_contentlen);
+	if (id == 0)
+	{
+		SendResp_control(h, 400, "Bad Request", "{\"error\":\"paths must be absolute, below a media dir, and free of . or .. components\"}");
+		return;
+	}
+	else if (id < 0)
+	{
+		SendResp_control(h, 503, "Service Unavailable", "{\"error\":\"too many rescans pending\"}");
+		return;
+	}
+	str.data = body;
+	str.size = sizeof(body);
+	str.off = 0;
+	inotify_rescan_status(id, &str);
+	SendResp_control(h, 202, "Accepted", body);
+#else
+	check_control(h);
+#endif
+}
+
 /* ProcessHTTPPOST_upnphttp()
  * executes the SOAP query if it is possible */
 static void
@@ -649,7 +1039,11 @@ ProcessHTTPPOST_upnphttp(struct upnphttp * h)
 {
 	if((h->req_buflen - h->req_contentoff) >= h->req_contentlen)
 	{
-		if(h->req_soapAction)
+		if(strcmp(h->req_url, "/control/rescan") == 0)
+		{
+			ProcessRescanPOST(h);
+		}
+		else if(h->req_soapAction)
 		{
 			/* we can process the request */
 			DPRINTF(E_DEBUG, L_HTTP, "SOAPAction: %.*s\n", h->req_soapActionLen, h->req_soapAction);
@@ -669,11 +1063,15 @@ ProcessHTTPPOST_upnphttp(struct upnphttp * h)
 			CloseSocket_upnphttp(h);
 		}
 	}
-	else
+	else if (grow_request(h, h->req_contentoff + h->req_contentlen + 1) == 0)
 	{
 		/* waiting for remaining data */
 		h->state = 1;
 	}
+	else
+	{
+		Send500(h);
+	}
 }
 
 static int
@@ -776,81 +1174,206 @@ ProcessHTTPSubscribe_upnphttp(struct upnphttp * h, const char * path)
 }
 
 static void
-ProcessHTTPUnSubscribe_upnphttp(struct upnphttp * h, const char * path)
+ProcessHTTPUnSubscribe_upnphttp(struct upnphttp * h, const char * path)
+{
+	enum event_type type;
+	DPRINTF(E_DEBUG, L_HTTP, "ProcessHTTPUnSubscribe %s\n", path);
+	DPRINTF(E_DEBUG, L_HTTP, "SID '%.*s'\n", h->req_SIDLen, h->req_SID);
+	/* Remove from the list */
+	type = check_event(h);
+	if (type != E_INVALID)
+	{
+		if(upnpevents_removeSubscriber(h->req_SID, h->req_SIDLen) < 0)
+			BuildResp2_upnphttp(h, 412, "Precondition Failed", 0, 0);
+		else
+			BuildResp_upnphttp(h, 0, 0);
+	}
+	SendResp_upnphttp(h);
+	CloseSocket_upnphttp(h);
+}
+
+static void
+SendResp_rootdesc(struct upnphttp * h, char * url)
+{
+	/* If it's a Xbox360, we might need a special friendly_name to be recognized */
+	if( h->req_client && h->req_client->type->type == EXbox )
+	{
+		char model_sav[2];
+		int i = 0;
+		memcpy(model_sav, modelnumber, 2);
+		strcpy(modelnumber, "1");
+		if( !strchr(friendly_name, ':') )
+		{
+			i = strlen(friendly_name);
+			snprintf(friendly_name+i, FRIENDLYNAME_MAX_LEN-i, ": 1");
+		}
+		sendXMLdesc(h, genRootDesc);
+		if( i )
+			friendly_name[i] = '\0';
+		memcpy(modelnumber, model_sav, 2);
+	}
+	else if( h->req_client && h->req_client->type->flags & FLAG_SAMSUNG_DCM10 )
+	{
+		sendXMLdesc(h, genRootDescSamsung);
+	}
+	else
+	{
+		sendXMLdesc(h, genRootDesc);
+	}
+}
+
+static void
+SendResp_contentdir(struct upnphttp * h, char * url)
+{
+	sendXMLdesc(h, genContentDirectory);
+}
+
+static void
+SendResp_connectionmgr(struct upnphttp * h, char * url)
+{
+	sendXMLdesc(h, genConnectionManager);
+}
+
+static void
+SendResp_registrar(struct upnphttp * h, char * url)
+{
+	sendXMLdesc(h, genX_MS_MediaReceiverRegistrar);
+}
+
+#ifdef TIVO_SUPPORT
+static void
+SendResp_tivo(struct upnphttp * h, char * url)
+{
+	if( GETFLAG(TIVO_MASK) )
+	{
+		if( *url == '?' )
+		{
+			ProcessTiVoCommand(h, url+1);
+		}
+		else
+		{
+			DPRINTF(E_WARN, L_HTTP, "Invalid TiVo request! %s\n", url);
+			Send404(h);
+		}
+	}
+	else
+	{
+		DPRINTF(E_WARN, L_HTTP, "TiVo request with out TiVo support enabled! %s\n", url);
+		Send404(h);
+	}
+}
+#endif
+
+static void
+SendResp_status(struct upnphttp * h, char * url)
+{
+	SendResp_presentation(h);
+}
+
+static void
+SendResp_index(struct upnphttp * h, char * url)
 {
-	enum event_type type;
-	DPRINTF(E_DEBUG, L_HTTP, "ProcessHTTPUnSubscribe %s\n", path);
-	DPRINTF(E_DEBUG, L_HTTP, "SID '%.*s'\n", h->req_SIDLen, h->req_SID);
-	/* Remove from the list */
-	type = check_event(h);
-	if (type != E_INVALID)
-	{
-		if(upnpevents_removeSubscriber(h->req_SID, h->req_SIDLen) < 0)
-			BuildResp2_upnphttp(h, 412, "Precondition Failed", 0, 0);
-		else
-			BuildResp_upnphttp(h, 0, 0);
-	}
-	SendResp_upnphttp(h);
-	CloseSocket_upnphttp(h);
+#ifdef READYNAS
+	SendResp_readynas_admin(h);
+#else
+	SendResp_presentation(h);
+#endif
 }
 
-/* Parse and process Http Query 
- * called once all the HTTP headers have been received. */
 static void
-ProcessHttpQuery_upnphttp(struct upnphttp * h)
+SendResp_metrics_url(struct upnphttp * h, char * url)
 {
-	char HttpCommand[16];
-	char HttpUrl[512];
-	char * HttpVer;
-	char * p;
-	int i;
-	p = h->req_buf;
-	if(!p)
-		return;
-	for(i = 0; i<15 && *p && *p != ' ' && *p != '\r'; i++)
-		HttpCommand[i] = *(p++);
-	HttpCommand[i] = '\0';
-	while(*p==' ')
-		p++;
-	if(strncmp(p, "http://", 7) == 0)
-	{
-		p = p+7;
-		while(*p!='/')
-			p++;
-	}
-	for(i = 0; i<511 && *p && *p != ' ' && *p != '\r'; i++)
-		HttpUrl[i] = *(p++);
-	HttpUrl[i] = '\0';
-	while(*p==' ')
-		p++;
-	HttpVer = h->HttpVer;
-	for(i = 0; i<15 && *p && *p != '\r'; i++)
-		HttpVer[i] = *(p++);
-	HttpVer[i] = '\0';
+	SendResp_metrics(h);
+}
 
-	/* set the interface here initially, in case there is no Host header */
-	for(i = 0; i<n_lan_addr; i++)
+static void
+SendResp_rescan(struct upnphttp * h, char * url)
+{
+#ifdef HAVE_INOTIFY
+	struct string_s str;
+	int id = 0;
+
+	if (*url)
 	{
-		if( (h->clientaddr.s_addr & lan_addr[i].mask.s_addr)
-		   == (lan_addr[i].addr.s_addr & lan_addr[i].mask.s_addr))
+		if (*url == '/' && url[1] && strlen(url + 1) < 10 &&
+		    url[1 + strspn(url + 1, "0123456789")] == '\0')
+			id = atoi(url + 1);
+		if (id <= 0)
 		{
-			h->iface = i;
-			break;
+			Send404(h);
+			return;
 		}
 	}
+	if (check_control(h) != 0)
+		return;
+	str.data = malloc(RESCAN_RESP_SIZE);
+	if (!str.data)
+	{
+		Send500(h);
+		return;
+	}
+	str.size = RESCAN_RESP_SIZE;
+	str.off = 0;
+	if (inotify_rescan_status(id, &str) == 0)
+		SendResp_control(h, 200, "OK", str.data);
+	else
+		SendResp_control(h, 404, "Not Found", "{\"error\":\"unknown rescan\"}");
+	free(str.data);
+#else
+	check_control(h);
+#endif
+}
+
+/* GET/HEAD targets, most frequently requested first.  Handlers are passed
+ * the part of the URL following the matched prefix. */
+static const struct {
+	const char * path;
+	int len;
+	int exact;
+	void (*handler)(struct upnphttp *, char *);
+} http_routes[] = {
+#define ROUTE(path, exact, fn) { path, sizeof(path) - 1, exact, fn }
+	ROUTE("/MediaItems/", 0, SendResp_dlnafile),
+	ROUTE("/AlbumArt/", 0, SendResp_albumArt),
+	ROUTE("/Thumbnails/", 0, SendResp_thumbnail),
+	ROUTE("/Resized/", 0, SendResp_resizedimg),
+	ROUTE("/Captions/", 0, SendResp_caption),
+	ROUTE(ROOTDESC_PATH, 1, SendResp_rootdesc),
+	ROUTE(CONTENTDIRECTORY_PATH, 1, SendResp_contentdir),
+	ROUTE(CONNECTIONMGR_PATH, 1, SendResp_connectionmgr),
+	ROUTE(X_MS_MEDIARECEIVERREGISTRAR_PATH, 1, SendResp_registrar),
+	ROUTE("/icons/", 0, SendResp_icon),
+#ifdef TIVO_SUPPORT
+	ROUTE("/TiVoConnect", 0, SendResp_tivo),
+#endif
+	ROUTE("/metrics", 1, SendResp_metrics_url),
+	ROUTE("/control/rescan", 0, SendResp_rescan),
+	ROUTE("/status", 0, SendResp_status),
+	ROUTE("/", 1, SendResp_index),
+#undef ROUTE
+};
+
+static const char * const http_command_names[] = {
+	"?", "GET", "POST", "HEAD", "SUBSCRIBE", "UNSUBSCRIBE"
+};
 
-	ParseHttpHeaders(h);
+/* Process Http Query 
+ * called once all the HTTP headers have been received and parsed. */
+static void
+ProcessHttpQuery_upnphttp(struct upnphttp * h)
+{
+	char * url = h->req_url;
+	int i;
 
 	/* see if we need to wait for remaining data */
 	if( (h->reqflags & FLAG_CHUNKED) )
 	{
-		if( h->req_chunklen == -1)
+		switch( check_chunks(h) )
 		{
+		case -1:
 			Send400(h);
 			return;
-		}
-		if( h->req_chunklen )
-		{
+		case 1:
 			h->state = 2;
 			return;
 		}
@@ -877,14 +1400,27 @@ ProcessHttpQuery_upnphttp(struct upnphttp * h)
 		h->state = 100;
 	}
 
-	DPRINTF(E_DEBUG, L_HTTP, "HTTP REQUEST: %.*s\n", h->req_buflen, h->req_buf);
-	if(strcmp("POST", HttpCommand) == 0)
+	/* Keep the control token out of the log */
+	if (h->req_Authorization)
 	{
-		h->req_command = EPost;
-		ProcessHTTPPOST_upnphttp(h);
+		const char *auth_end = h->req_Authorization + h->req_AuthorizationLen;
+
+		DPRINTF(E_DEBUG, L_HTTP, "HTTP REQUEST: %s %s %s\n%.*s<hidden>%.*s\n",
+			http_command_names[h->req_command], url, h->HttpVer,
+			(int)(h->req_Authorization - (h->req_buf + h->req_hdroff)), h->req_buf + h->req_hdroff,
+			(int)(h->req_buf + h->req_buflen - auth_end), auth_end);
 	}
-	else if((strcmp("GET", HttpCommand) == 0) || (strcmp("HEAD", HttpCommand) == 0))
+	else
+		DPRINTF(E_DEBUG, L_HTTP, "HTTP REQUEST: %s %s %s\n%.*s\n",
+			http_command_names[h->req_command], url, h->HttpVer,
+			h->req_buflen - h->req_hdroff, h->req_buf + h->req_hdroff);
+	switch(h->req_command)
 	{
+	case EPost:
+		ProcessHTTPPOST_upnphttp(h);
+		break;
+	case EGet:
+	case EHead:
 		if( ((strcmp(h->HttpVer, "HTTP/1.1")==0) && !(h->reqflags & FLAG_HOST)) || (h->reqflags & FLAG_INVALID_REQ) )
 		{
 			DPRINTF(E_WARN, L_HTTP, "Invalid request, responding ERROR 400.  (No Host specified in HTTP headers?)\n");
@@ -900,132 +1436,28 @@ ProcessHttpQuery_upnphttp(struct upnphttp * h)
 			Send406(h);
 			return;
 		}
-		else if(strcmp("GET", HttpCommand) == 0)
+		for (i = 0; i < sizeof(http_routes) / sizeof(http_routes[0]); i++)
 		{
-			h->req_command = EGet;
-		}
-		else
-		{
-			h->req_command = EHead;
-		}
-		if(strcmp(ROOTDESC_PATH, HttpUrl) == 0)
-		{
-			/* If it's a Xbox360, we might need a special friendly_name to be recognized */
-			if( h->req_client && h->req_client->type->type == EXbox )
-			{
-				char model_sav[2];
-				i = 0;
-				memcpy(model_sav, modelnumber, 2);
-				strcpy(modelnumber, "1");
-				if( !strchr(friendly_name, ':') )
-				{
-					i = strlen(friendly_name);
-					snprintf(friendly_name+i, FRIENDLYNAME_MAX_LEN-i, ": 1");
-				}
-				sendXMLdesc(h, genRootDesc);
-				if( i )
-					friendly_name[i] = '\0';
-				memcpy(modelnumber, model_sav, 2);
-			}
-			else if( h->req_client && h->req_client->type->flags & FLAG_SAMSUNG_DCM10 )
-			{
-				sendXMLdesc(h, genRootDescSamsung);
-			}
-			else
-			{
-				sendXMLdesc(h, genRootDesc);
-			}
-		}
-		else if(strcmp(CONTENTDIRECTORY_PATH, HttpUrl) == 0)
-		{
-			sendXMLdesc(h, genContentDirectory);
-		}
-		else if(strcmp(CONNECTIONMGR_PATH, HttpUrl) == 0)
-		{
-			sendXMLdesc(h, genConnectionManager);
-		}
-		else if(strcmp(X_MS_MEDIARECEIVERREGISTRAR_PATH, HttpUrl) == 0)
-		{
-			sendXMLdesc(h, genX_MS_MediaReceiverRegistrar);
-		}
-		else if(strncmp(HttpUrl, "/MediaItems/", 12) == 0)
-		{
-			SendResp_dlnafile(h, HttpUrl+12);
-		}
-		else if(strncmp(HttpUrl, "/Thumbnails/", 12) == 0)
-		{
-			SendResp_thumbnail(h, HttpUrl+12);
-		}
-		else if(strncmp(HttpUrl, "/AlbumArt/", 10) == 0)
-		{
-			SendResp_albumArt(h, HttpUrl+10);
-		}
-		#ifdef TIVO_SUPPORT
-		else if(strncmp(HttpUrl, "/TiVoConnect", 12) == 0)
-		{
-			if( GETFLAG(TIVO_MASK) )
-			{
-				if( *(HttpUrl+12) == '?' )
-				{
-					ProcessTiVoCommand(h, HttpUrl+13);
-				}
-				else
-				{
-					DPRINTF(E_WARN, L_HTTP, "Invalid TiVo request! %s\n", HttpUrl+12);
-					Send404(h);
-				}
-			}
-			else
-			{
-				DPRINTF(E_WARN, L_HTTP, "TiVo request with out TiVo support enabled! %s\n",
-					HttpUrl+12);
-				Send404(h);
-			}
-		}
-		#endif
-		else if(strncmp(HttpUrl, "/Resized/", 9) == 0)
-		{
-			SendResp_resizedimg(h, HttpUrl+9);
-		}
-		else if(strncmp(HttpUrl, "/icons/", 7) == 0)
-		{
-			SendResp_icon(h, HttpUrl+7);
-		}
-		else if(strncmp(HttpUrl, "/Captions/", 10) == 0)
-		{
-			SendResp_caption(h, HttpUrl+10);
-		}
-		else if(strncmp(HttpUrl, "/status", 7) == 0)
-		{
-			SendResp_presentation(h);
-		}
-		else if(strcmp(HttpUrl, "/") == 0)
-		{
-			#ifdef READYNAS
-			SendResp_readynas_admin(h);
-			#else
-			SendResp_presentation(h);
-			#endif
-		}
-		else
-		{
-			DPRINTF(E_WARN, L_HTTP, "%s not found, responding ERROR 404\n", HttpUrl);
-			Send404(h);
+			if (strncmp(url, http_routes[i].path, http_routes[i].len) != 0)
+				continue;
+			if (http_routes[i].exact && url[http_routes[i].len])
+				continue;
+			http_routes[i].handler(h, url + http_routes[i].len);
+			return;
 		}
-	}
-	else if(strcmp("SUBSCRIBE", HttpCommand) == 0)
-	{
-		h->req_command = ESubscribe;
-		ProcessHTTPSubscribe_upnphttp(h, HttpUrl);
-	}
-	else if(strcmp("UNSUBSCRIBE", HttpCommand) == 0)
-	{
-		h->req_command = EUnSubscribe;
-		ProcessHTTPUnSubscribe_upnphttp(h, HttpUrl);
-	}
-	else
-	{
-		DPRINTF(E_WARN, L_HTTP, "Unsupported HTTP Command %s\n", HttpCommand);
+		DPRINTF(E_WARN, L_HTTP, "%s not found, responding ERROR 404\n", url);
+		Send404(h);
+		break;
+	case ESubscribe:
+		ProcessHTTPSubscribe_upnphttp(h, url);
+		break;
+	case EUnSubscribe:
+		ProcessHTTPUnSubscribe_upnphttp(h, url);
+		break;
+	default:
+		url = h->req_buf + strspn(h->req_buf, "\r\n");
+		DPRINTF(E_WARN, L_HTTP, "Unsupported HTTP Command %.*s\n",
+			(int)strcspn(url, " \r\n"), url);
 		Send501(h);
 	}
 }
@@ -1034,14 +1466,14 @@ ProcessHttpQuery_upnphttp(struct upnphttp * h)
 void
 Process_upnphttp(struct upnphttp * h)
 {
-	char buf[2048];
 	int n;
 	if(!h)
 		return;
 	switch(h->state)
 	{
 	case 0:
-		n = recv(h->socket, buf, 2048, 0);
+		n = recv(h->socket, h->req_buf + h->req_buflen,
+		         h->req_bufsize - h->req_buflen - 1, 0);
 		if(n<0)
 		{
 			DPRINTF(E_ERROR, L_HTTP, "recv (state0): %s\n", strerror(errno));
@@ -1054,40 +1486,28 @@ Process_upnphttp(struct upnphttp * h)
 		}
 		else
 		{
-			int new_req_buflen;
-			const char * endheaders;
-			/* if 1st arg of realloc() is null,
-			 * realloc behaves the same as malloc() */
-			new_req_buflen = n + h->req_buflen + 1;
-			if (new_req_buflen >= 1024 * 1024)
-			{
-				DPRINTF(E_ERROR, L_HTTP, "Receive headers too large (received %d bytes)\n", new_req_buflen);
-				h->state = 100;
-				break;
-			}
-			h->req_buf = (char *)realloc(h->req_buf, new_req_buflen);
-			if (!h->req_buf)
-			{
-				DPRINTF(E_ERROR, L_HTTP, "Receive headers: %s\n", strerror(errno));
-				h->state = 100;
-				break;
-			}
-			memcpy(h->req_buf + h->req_buflen, buf, n);
 			h->req_buflen += n;
 			h->req_buf[h->req_buflen] = '\0';
-			/* search for the string "\r\n\r\n" */
-			endheaders = strstr(h->req_buf, "\r\n\r\n");
-			if(endheaders)
-			{
-				h->req_contentoff = endheaders - h->req_buf + 4;
-				h->req_contentlen = h->req_buflen - h->req_contentoff;
+			if (ParseHttpRequest(h))
 				ProcessHttpQuery_upnphttp(h);
+			else if (h->req_buflen >= h->req_bufsize - 1)
+			{
+				DPRINTF(E_ERROR, L_HTTP, "Receive headers too large (received %d bytes)\n", h->req_buflen);
+				h->state = 100;
 			}
 		}
 		break;
 	case 1:
 	case 2:
-		n = recv(h->socket, buf, sizeof(buf), 0);
+		/* chunked bodies have no known length, so keep doubling the buffer */
+		if (h->req_buflen >= h->req_bufsize - 1 &&
+		    grow_request(h, h->req_bufsize * 2) != 0)
+		{
+			h->state = 100;
+			break;
+		}
+		n = recv(h->socket, h->req_buf + h->req_buflen,
+		         h->req_bufsize - h->req_buflen - 1, 0);
 		if(n < 0)
 		{
 			DPRINTF(E_ERROR, L_HTTP, "recv (state%d): %s\n", h->state, strerror(errno));
@@ -1100,30 +1520,12 @@ Process_upnphttp(struct upnphttp * h)
 		}
 		else
 		{
-			buf[sizeof(buf)-1] = '\0';
-			/*fwrite(buf, 1, n, stdout);*/	/* debug */
-			h->req_buf = (char *)realloc(h->req_buf, n + h->req_buflen);
-			if (!h->req_buf)
-			{
-				DPRINTF(E_ERROR, L_HTTP, "Receive request body: %s\n", strerror(errno));
-				h->state = 100;
-				break;
-			}
-			memcpy(h->req_buf + h->req_buflen, buf, n);
 			h->req_buflen += n;
-			if((h->req_buflen - h->req_contentoff) >= h->req_contentlen)
-			{
-				/* Need the struct to point to the realloc'd memory locations */
-				if( h->state == 1 )
-				{
-					ParseHttpHeaders(h);
-					ProcessHTTPPOST_upnphttp(h);
-				}
-				else if( h->state == 2 )
-				{
-					ProcessHttpQuery_upnphttp(h);
-				}
-			}
+			h->req_buf[h->req_buflen] = '\0';
+			if( h->state == 1 )
+				ProcessHTTPPOST_upnphttp(h);
+			else
+				ProcessHttpQuery_upnphttp(h);
 		}
 		break;
 	default:
@@ -1160,7 +1562,9 @@ BuildHeader_upnphttp(struct upnphttp * h, int respcode,
 	res.off = 0;
 	strcatf(&res, httpresphead, "HTTP/1.1",
 	              respcode, respmsg,
-	              (h->respflags&FLAG_HTML)?"text/html":"text/xml; charset=\"utf-8\"",
+	              (h->respflags&FLAG_HTML)?"text/html":
+	              (h->respflags&FLAG_JSON)?"application/json":
+	              (h->respflags&FLAG_PLAINTEXT)?"text/plain; version=0.0.4":"text/xml; charset=\"utf-8\"",
 							 bodylen);
 	/* Additional headers */
 	if(h->respflags & FLAG_TIMEOUT) {
@@ -1250,23 +1654,189 @@ send_data(struct upnphttp * h, char * header, size_t size, int flags)
 	return 1;
 }
 
+/* Streams are paced by a userspace token bucket when the kernel can't do it.
+ * The bucket holds at most one second worth of data (or one chunk), so a
+ * stream can only get ahead of its rate by that much. */
+struct pacer {
+	off_t ceiling;		/* item bitrate times stream_burst, 0 for none */
+	uint32_t client;
+	int slot;		/* our entry in the shared stream table */
+	int kernel;		/* SO_MAX_PACING_RATE is doing the work */
+	off_t rate;		/* bytes/sec, 0 while unpaced */
+	off_t chunk;		/* most to send between two waits */
+	off_t depth;
+	off_t tokens;
+	struct timeval last;
+	time_t checked;
+};
+
+/* Work out how fast a stream should be sent, in bytes per second.
+ * The item bitrate (from DETAILS, already in bytes/sec) times the configured
+ * burst multiplier gives the per-stream ceiling, and max_stream_bandwidth is
+ * split evenly between the clients that are streaming right now, then between
+ * that client's streams. Returns 0 if the stream should not be paced at all. */
+static off_t
+stream_rate(struct pacer *p)
+{
+	off_t rate = p->ceiling, share;
+	int nclients, nstreams;
+
+	if( runtime_vars.max_bandwidth <= 0 )
+		return rate;
+
+	nclients = metrics_stream_share(p->client, &nstreams);
+	/* Count ourselves if the table was full */
+	if( p->slot < 0 )
+	{
+		if( !nstreams )
+			nclients++;
+		nstreams++;
+	}
+
+	share = (off_t)runtime_vars.max_bandwidth * 1000 / 8 / nclients / nstreams;
+	if( !rate || share < rate )
+		rate = share;
+
+	return rate;
+}
+
+/* Returns non-zero if the kernel took over pacing for this socket. */
+static int
+set_pacing_rate(int s, off_t rate)
+{
+#ifdef SO_MAX_PACING_RATE
+	unsigned int val = (rate > UINT_MAX) ? UINT_MAX : (unsigned int)rate;
+
+	if( setsockopt(s, SOL_SOCKET, SO_MAX_PACING_RATE, &val, sizeof(val)) == 0 )
+		return 1;
+	DPRINTF(E_DEBUG, L_HTTP, "setsockopt(SO_MAX_PACING_RATE): %s\n", strerror(errno));
+#endif
+	return 0;
+}
+
+/* Pick up this stream's current share of the bandwidth. Called once a
+ * second while sending, since other streams come and go. */
+static void
+pacer_update(struct upnphttp *h, struct pacer *p)
+{
+	off_t rate;
+
+	p->checked = time(NULL);
+	rate = stream_rate(p);
+	if( rate == p->rate )
+		return;
+	DPRINTF(E_DEBUG, L_HTTP, "Pacing stream at %lld bytes/sec\n", (long long)rate);
+	p->rate = rate;
+	p->kernel = rate > 0 && set_pacing_rate(h->socket, rate);
+	if( !rate )
+	{
+		p->chunk = MAX_BUFFER_SIZE;
+		return;
+	}
+	if( p->kernel )
+	{
+		/* Come back once a second to look at our share again */
+		p->chunk = rate;
+		return;
+	}
+
+	/* Send ~100ms worth of data at a time, so sleeps stay short */
+	p->chunk = rate / 10;
+	if( p->chunk < 4096 )
+		p->chunk = 4096;
+	p->depth = (rate > p->chunk) ? rate : p->chunk;
+	if( p->tokens > p->depth )
+		p->tokens = p->depth;
+}
+
+static void
+pacer_start(struct upnphttp *h, struct pacer *p, int bitrate)
+{
+	memset(p, 0, sizeof(*p));
+	if( runtime_vars.stream_burst > 0 && bitrate > 0 )
+		p->ceiling = (off_t)bitrate * runtime_vars.stream_burst;
+	p->client = h->clientaddr.s_addr;
+	p->slot = metrics_stream_begin(p->client);
+	p->chunk = MAX_BUFFER_SIZE;
+	gettimeofday(&p->last, NULL);
+	pacer_update(h, p);
+	p->tokens = p->depth;
+}
+
+static void
+pacer_stop(struct pacer *p)
+{
+	metrics_stream_end(p->slot);
+}
+
+/* Block until the bucket is no longer in debt. */
+static void
+pacer_wait(struct upnphttp *h, struct pacer *p)
+{
+	struct timeval now;
+	long long usecs;
+
+	if( time(NULL) != p->checked )
+		pacer_update(h, p);
+	if( !p->rate || p->kernel )
+		return;
+
+	gettimeofday(&now, NULL);
+	usecs = (now.tv_sec - p->last.tv_sec) * 1000000LL + (now.tv_usec - p->last.tv_usec);
+	p->last = now;
+	if( usecs > 0 )
+		p->tokens += (off_t)(usecs * p->rate / 1000000);
+	if( p->tokens > p->depth )
+		p->tokens = p->depth;
+	if( p->tokens < 0 )
+	{
+		struct timespec sleep_time;
+
+		usecs = -p->tokens * 1000000LL / p->rate;
+		sleep_time.tv_sec = usecs / 1000000;
+		sleep_time.tv_nsec = (usecs % 1000000) * 1000;
+		nanosleep(&sleep_time, NULL);
+		gettimeofday(&p->last, NULL);
+		p->tokens = 0;
+	}
+}
+
+/* Charge the bucket with what actually went out. */
+static inline void
+pacer_charge(struct pacer *p, off_t sent)
+{
+	if( p && sent > 0 )
+		p->tokens -= sent;
+}
+
 static void
-send_file(struct upnphttp * h, int sendfd, off_t offset, off_t end_offset)
+send_file(struct upnphttp * h, int sendfd, off_t offset, off_t end_offset, struct pacer *pacer)
 {
 	off_t send_size;
 	off_t ret;
 	char *buf = NULL;
+	int ctype = h->req_client ? h->req_client->type->type : 0;
 #if HAVE_SENDFILE
 	int try_sendfile = 1;
 #endif
 
 	while( offset <= end_offset )
 	{
+		if( pacer )
+			pacer_wait(h, pacer);
 #if HAVE_SENDFILE
 		if( try_sendfile )
 		{
 			send_size = ( ((end_offset - offset) < MAX_BUFFER_SIZE) ? (end_offset - offset + 1) : MAX_BUFFER_SIZE);
+			if( pacer && send_size > pacer->chunk )
+				send_size = pacer->chunk;
 			ret = sys_sendfile(h->socket, sendfd, &offset, send_size);
+			if( ret > 0 )
+			{
+				metrics_add(M_SENDFILE_BYTES, ret);
+				metrics_stream(ctype, ret);
+				pacer_charge(pacer, ret);
+			}
 			if( ret == -1 )
 			{
 				DPRINTF(E_DEBUG, L_HTTP, "sendfile error :: error no. %d [%s]\n", errno, strerror(errno));
@@ -1287,6 +1857,8 @@ send_file(struct upnphttp * h, int sendfd, off_t offset, off_t end_offset)
 		if( !buf )
 			buf = malloc(MIN_BUFFER_SIZE);
 		send_size = (((end_offset - offset) < MIN_BUFFER_SIZE) ? (end_offset - offset + 1) : MIN_BUFFER_SIZE);
+		if( pacer && send_size > pacer->chunk )
+			send_size = pacer->chunk;
 		lseek(sendfd, offset, SEEK_SET);
 		ret = read(sendfd, buf, send_size);
 		if( ret == -1 ) {
@@ -1304,9 +1876,49 @@ send_file(struct upnphttp * h, int sendfd, off_t offset, off_t end_offset)
 			else
 				break;
 		}
+		metrics_add(M_READ_BYTES, ret);
+		metrics_stream(ctype, ret);
+		pacer_charge(pacer, ret);
+		offset += ret;
+	}
+	free(buf);
+}
+
+/* Serve as much of the requested range as possible out of the shared
+ * head/tail block cache, and return the offset to continue from. */
+static off_t
+send_cached_blocks(struct upnphttp *h, int64_t id, int sendfd, const struct stat *st,
+                   off_t offset, off_t end_offset)
+{
+	char *buf;
+	off_t len, ret;
+
+	len = end_offset - offset + 1;
+	if( len > BLOCK_CACHE_HEAD )
+		len = BLOCK_CACHE_HEAD;
+	buf = malloc(len);
+	if( !buf )
+		return offset;
+	while( offset <= end_offset )
+	{
+		len = end_offset - offset + 1;
+		if( len > BLOCK_CACHE_HEAD )
+			len = BLOCK_CACHE_HEAD;
+		ret = blockcache_read(id, sendfd, st, offset, len, buf);
+		if( ret <= 0 )
+			break;
+		if( send_data(h, buf, ret, (offset + ret <= end_offset) ? MSG_MORE : 0) != 0 )
+		{
+			offset = end_offset + 1;
+			break;
+		}
+		metrics_add(M_BLOCKCACHE_BYTES, ret);
+		metrics_stream(h->req_client ? h->req_client->type->type : 0, ret);
 		offset += ret;
 	}
 	free(buf);
+
+	return offset;
 }
 
 static void
@@ -1434,7 +2046,7 @@ SendResp_albumArt(struct upnphttp * h, char * object)
 	if( send_data(h, str.data, str.off, MSG_MORE) == 0 )
 	{
 		if( h->req_command != EHead )
-			send_file(h, fd, 0, size-1);
+			send_file(h, fd, 0, size-1, NULL);
 	}
 	close(fd);
 	CloseSocket_upnphttp(h);
@@ -1480,7 +2092,7 @@ SendResp_caption(struct upnphttp * h, char * object)
 	if( send_data(h, str.data, str.off, MSG_MORE) == 0 )
 	{
 		if( h->req_command != EHead )
-			send_file(h, fd, 0, size-1);
+			send_file(h, fd, 0, size-1, NULL);
 	}
 	close(fd);
 	CloseSocket_upnphttp(h);
@@ -1551,6 +2163,35 @@ SendResp_thumbnail(struct upnphttp * h, char * object)
 	CloseSocket_upnphttp(h);
 }
 
+/* Where image_resize_jpeg_stream() output goes: chunks to the client
+ * and/or a new resized cache file */
+struct resized_sink {
+	struct upnphttp *h;
+	int fd;
+	int fd_error;
+};
+
+static int
+write_resized_data(void *arg, const unsigned char *data, int len)
+{
+	struct resized_sink *sink = arg;
+	char buf[16];
+	int n;
+
+	if( sink->fd >= 0 && !sink->fd_error && write(sink->fd, data, len) != len )
+		sink->fd_error = 1;
+	if( sink->h )
+	{
+		n = sprintf(buf, "%x\r\n", len);
+		if( send_data(sink->h, buf, n, MSG_MORE) != 0 ||
+		    send_data(sink->h, (char *)data, len, MSG_MORE) != 0 ||
+		    send_data(sink->h, "\r\n", 2, MSG_MORE) != 0 )
+			return -1;
+	}
+
+	return 0;
+}
+
 static void
 SendResp_resizedimg(struct upnphttp * h, char * object)
 {
@@ -1567,6 +2208,10 @@ SendResp_resizedimg(struct upnphttp * h, char * object)
 	char *resolution = NULL;
 	char *key, *val;
 	char *saveptr, *item = NULL;
+	char cache_path[PATH_MAX];
+	int cache_fd = -1;
+	off_t cache_size = 0;
+	time_t mtime = 0;
 	int rotate;
 	int pixw = 0, pixh = 0;
 	long long id;
@@ -1576,7 +2221,7 @@ SendResp_resizedimg(struct upnphttp * h, char * object)
 	const char *tmode;
 
 	id = strtoll(object, &saveptr, 10);
-	snprintf(buf, sizeof(buf), "SELECT PATH, RESOLUTION, ROTATION from DETAILS where ID = '%lld'", (long long)id);
+	snprintf(buf, sizeof(buf), "SELECT PATH, RESOLUTION, ROTATION, TIMESTAMP from DETAILS where ID = '%lld'", (long long)id);
 	ret = sql_get_table(db, buf, &result, &rows, NULL);
 	if( ret != SQLITE_OK )
 	{
@@ -1585,9 +2230,10 @@ SendResp_resizedimg(struct upnphttp * h, char * object)
 	}
 	if( rows )
 	{
-		file_path = result[3];
-		resolution = result[4];
-		rotate = result[5] ? atoi(result[5]) : 0;
+		file_path = result[4];
+		resolution = result[5];
+		rotate = result[6] ? atoi(result[6]) : 0;
+		mtime = result[7] ? strtoll(result[7], NULL, 10) : 0;
 	}
 	if( !file_path || !resolution || (access(file_path, F_OK) != 0) )
 	{
@@ -1705,6 +2351,30 @@ SendResp_resizedimg(struct upnphttp * h, char * object)
 	else if( srcw>>2 >= dstw && srch>>2 >= dsth )
 		scale = 2;
 
+	if( resize_cache_path(cache_path, sizeof(cache_path), id, mtime, dstw, dsth, rotate) == 0 )
+	{
+		cache_fd = resize_cache_open(cache_path, &cache_size);
+		metrics_add(cache_fd >= 0 ? M_RESIZE_HIT : M_RESIZE_MISS, 1);
+	}
+	else
+		cache_path[0] = '\0';
+
+	/* HTTP/1.0 clients need a Content-Length, so stream the rendition into
+	 * the cache first and serve it from there. */
+	if( cache_fd < 0 && cache_path[0] && rotate == ROTATE_NONE &&
+	    strcmp(h->HttpVer, "HTTP/1.0") == 0 )
+	{
+		struct resized_sink sink = { NULL, -1, 0 };
+
+		sink.fd = resize_cache_create(cache_path);
+		if( sink.fd >= 0 )
+		{
+			ret = image_resize_jpeg_stream(file_path, scale, dstw, dsth, write_resized_data, &sink);
+			resize_cache_commit(cache_path, sink.fd, ret == 0 && !sink.fd_error);
+			cache_fd = resize_cache_open(cache_path, &cache_size);
+		}
+	}
+
 	INIT_STR(str, header);
 
 #if USE_FORK
@@ -1717,6 +2387,16 @@ SendResp_resizedimg(struct upnphttp * h, char * object)
 	strcatf(&str, "contentFeatures.dlna.org: %sDLNA.ORG_CI=1;DLNA.ORG_FLAGS=%08X%024X\r\n",
 	              dlna_pn, dlna_flags, 0);
 
+	if( cache_fd >= 0 )
+	{
+		DPRINTF(E_DEBUG, L_HTTP, "Serving cached rendition %s\n", cache_path);
+		strcatf(&str, "Content-Length: %jd\r\n\r\n", (intmax_t)cache_size);
+		if( (send_data(h, str.data, str.off, MSG_MORE) == 0) && (h->req_command != EHead) )
+			send_file(h, cache_fd, 0, cache_size-1, NULL);
+		close(cache_fd);
+		goto resized_done;
+	}
+
 	if( strcmp(h->HttpVer, "HTTP/1.0") == 0 )
 	{
 		chunked = 0;
@@ -1745,7 +2425,24 @@ SendResp_resizedimg(struct upnphttp * h, char * object)
 
 	if( (send_data(h, str.data, str.off, 0) == 0) && (h->req_command != EHead) )
 	{
-		if( chunked )
+		if( chunked && rotate == ROTATE_NONE )
+		{
+			/* Encode scanline by scanline straight to the socket */
+			struct resized_sink sink = { h, -1, 0 };
+
+			if( cache_path[0] )
+				sink.fd = resize_cache_create(cache_path);
+			ret = image_resize_jpeg_stream(file_path, scale, dstw, dsth, write_resized_data, &sink);
+			if( sink.fd >= 0 )
+				resize_cache_commit(cache_path, sink.fd, ret == 0 && !sink.fd_error);
+			/* The headers are gone already, so the only way to tell the client
+			 * the image is incomplete is to close without the last chunk */
+			if( ret != 0 )
+				DPRINTF(E_WARN, L_HTTP, "Unable to stream resized image %s!\n", file_path);
+			else
+				send_data(h, "0\r\n\r\n", 5, 0);
+		}
+		else if( chunked )
 		{
 			imsrc = image_new_from_jpeg(file_path, 1, NULL, 0, scale, rotate);
 			if( !imsrc )
@@ -1767,6 +2464,9 @@ SendResp_resizedimg(struct upnphttp * h, char * object)
 			send_data(h, (char *)data, size, 0);
 		}
 	}
+	if( data && cache_path[0] )
+		resize_cache_store(cache_path, data, size);
+resized_done:
 	DPRINTF(E_INFO, L_HTTP, "Done serving %s\n", file_path);
 	if( imsrc )
 		image_free(imsrc);
@@ -1792,6 +2492,7 @@ SendResp_dlnafile(struct upnphttp *h, char *object)
 	off_t total, offset, size;
 	int64_t id;
 	int sendfh;
+	struct stat st;
 	uint32_t dlna_flags = DLNA_FLAG_DLNA_V1_5|DLNA_FLAG_HTTP_STALLING|DLNA_FLAG_TM_B;
 	uint32_t cflags = h->req_client ? h->req_client->type->flags : 0;
 	const char *tmode;
@@ -1801,6 +2502,7 @@ SendResp_dlnafile(struct upnphttp *h, char *object)
 	                char path[PATH_MAX];
 	                char mime[32];
 	                char dlna[96];
+	                int bitrate;
 	              } last_file = { 0, 0 };
 #if USE_FORK
 	pid_t newpid = 0;
@@ -1823,9 +2525,12 @@ SendResp_dlnafile(struct upnphttp *h, char *object)
 			return;
 		}
 	}
-	if( id != last_file.id || ctype != last_file.client )
+	if( id == last_file.id && ctype == last_file.client )
+		metrics_add(M_DETAILS_HIT, 1);
+	else
 	{
-		snprintf(buf, sizeof(buf), "SELECT PATH, MIME, DLNA_PN from DETAILS where ID = '%lld'", (long long)id);
+		metrics_add(M_DETAILS_MISS, 1);
+		snprintf(buf, sizeof(buf), "SELECT PATH, MIME, DLNA_PN, BITRATE from DETAILS where ID = '%lld'", (long long)id);
 		ret = sql_get_table(db, buf, &result, &rows, NULL);
 		if( (ret != SQLITE_OK) )
 		{
@@ -1833,7 +2538,7 @@ SendResp_dlnafile(struct upnphttp *h, char *object)
 			Send500(h);
 			return;
 		}
-		if( !rows || !result[3] || !result[4] )
+		if( !rows || !result[4] || !result[5] )
 		{
 			DPRINTF(E_WARN, L_HTTP, "%s not found, responding ERROR 404\n", object);
 			sqlite3_free_table(result);
@@ -1843,10 +2548,10 @@ SendResp_dlnafile(struct upnphttp *h, char *object)
 		/* Cache the result */
 		last_file.id = id;
 		last_file.client = ctype;
-		strncpy(last_file.path, result[3], sizeof(last_file.path)-1);
-		if( result[4] )
+		strncpy(last_file.path, result[4], sizeof(last_file.path)-1);
+		if( result[5] )
 		{
-			strncpy(last_file.mime, result[4], sizeof(last_file.mime)-1);
+			strncpy(last_file.mime, result[5], sizeof(last_file.mime)-1);
 			/* From what I read, Samsung TV's expect a [wrong] MIME type of x-mkv. */
 			if( cflags & FLAG_SAMSUNG )
 			{
@@ -1866,10 +2571,11 @@ SendResp_dlnafile(struct upnphttp *h, char *object)
 					strcpy(last_file.mime+6, "divx");
 			}
 		}
-		if( result[5] )
-			snprintf(last_file.dlna, sizeof(last_file.dlna), "DLNA.ORG_PN=%s;", result[5]);
+		if( result[6] )
+			snprintf(last_file.dlna, sizeof(last_file.dlna), "DLNA.ORG_PN=%s;", result[6]);
 		else
 			last_file.dlna[0] = '\0';
+		last_file.bitrate = result[7] ? atoi(result[7]) : 0;
 		sqlite3_free_table(result);
 	}
 #if USE_FORK
@@ -1920,8 +2626,14 @@ SendResp_dlnafile(struct upnphttp *h, char *object)
 		Send404(h);
 		goto error;
 	}
-	size = lseek(sendfh, 0, SEEK_END);
-	lseek(sendfh, 0, SEEK_SET);
+	if( fstat(sendfh, &st) != 0 )
+	{
+		DPRINTF(E_ERROR, L_HTTP, "Error stat'ing %s\n", last_file.path);
+		Send404(h);
+		close(sendfh);
+		goto error;
+	}
+	size = st.st_size;
 
 	INIT_STR(str, header);
 
@@ -1997,8 +2709,18 @@ SendResp_dlnafile(struct upnphttp *h, char *object)
 	//DEBUG DPRINTF(E_DEBUG, L_HTTP, "RESPONSE: %s\n", str.data);
 	if( send_data(h, str.data, str.off, MSG_MORE) == 0 )
 	{
-		if( h->req_command != EHead )
-			send_file(h, sendfh, offset, h->req_RangeEnd);
+		/* Images are interactive transfers, so only cache and pace a/v streams */
+		if( h->req_command != EHead && *last_file.mime == 'i' )
+			send_file(h, sendfh, offset, h->req_RangeEnd, NULL);
+		else if( h->req_command != EHead )
+		{
+			struct pacer pacer;
+
+			pacer_start(h, &pacer, last_file.bitrate);
+			offset = send_cached_blocks(h, id, sendfh, &st, offset, h->req_RangeEnd);
+			send_file(h, sendfh, offset, h->req_RangeEnd, &pacer);
+			pacer_stop(&pacer);
+		}
 	}
 	close(sendfh);
 
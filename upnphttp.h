@@ -54,6 +54,7 @@
 
 #include "minidlnatypes.h"
 #include "config.h"
+#include "arena.h"
 
 /* server: HTTP header returned in all HTTP responses : */
 #define MINIDLNA_SERVER_STRING	OS_VERSION " DLNADOC/1.50 UPnP/1.0 " SERVER_NAME "/" MINIDLNA_VERSION
@@ -74,18 +75,29 @@ enum httpCommands {
 	EUnSubscribe
 };
 
+/* Requests are received into a buffer inside the connection, which is only
+ * replaced by a heap buffer for large POST bodies or chunked uploads. */
+#define UPNPHTTP_BUFSIZE	8192
+#define UPNPHTTP_MAXREQ		(1024 * 1024)
+
 struct upnphttp {
 	int socket;
 	struct in_addr clientaddr;	/* client address */
 	int iface;
 	int state;
-	char HttpVer[16];
+	const char * HttpVer;
 	/* request */
 	char * req_buf;
 	int req_buflen;
+	int req_bufsize;
+	int req_scanoff;	/* where to resume looking for a line end */
+	int req_lineoff;	/* start of the line being received */
+	int req_hdroff;		/* start of the headers, after the request line */
 	int req_contentlen;
 	int req_contentoff;     /* header length */
 	enum httpCommands req_command;
+	char * req_url;
+	int req_clientidx;	/* client type detected from the headers */
 	struct client_cache_s * req_client;
 	const char * req_soapAction;
 	int req_soapActionLen;
@@ -96,10 +108,13 @@ struct upnphttp {
 	int req_Timeout;
 	const char * req_SID;		/* For UNSUBSCRIBE */
 	int req_SIDLen;
+	const char * req_Authorization;	/* For the control interface */
+	int req_AuthorizationLen;
 	off_t req_RangeStart;
 	off_t req_RangeEnd;
 	long int req_chunklen;
 	uint32_t reqflags;
+	struct arena arena;	/* scratch memory for handling the request */
 	/* response */
 	char * res_buf;
 	int res_buflen;
@@ -108,6 +123,7 @@ struct upnphttp {
 	/*int res_contentlen;*/
 	/*int res_contentoff;*/		/* header length */
 	LIST_ENTRY(upnphttp) entries;
+	char req_fixed[UPNPHTTP_BUFSIZE];
 };
 
 #define FLAG_TIMEOUT            0x00000001
@@ -115,6 +131,7 @@ struct upnphttp {
 #define FLAG_RANGE              0x00000004
 #define FLAG_HOST               0x00000008
 #define FLAG_LANGUAGE           0x00000010
+#define FLAG_PLAINTEXT          0x00000020
 
 #define FLAG_INVALID_REQ        0x00000040
 #define FLAG_HTML               0x00000080
@@ -127,6 +144,7 @@ struct upnphttp {
 #define FLAG_XFERINTERACTIVE    0x00002000
 #define FLAG_XFERBACKGROUND     0x00004000
 #define FLAG_CAPTION            0x00008000
+#define FLAG_JSON               0x00010000
 
 #ifndef MSG_MORE
 #define MSG_MORE 0
@@ -31,8 +31,17 @@
 #include <stdio.h>
 
 #include "upnpreplyparse.h"
+#include "arena.h"
 #include "minixml.h"
 
+static struct NameValue *
+NewNameValue(struct NameValueParserData * data, int l)
+{
+    if(data->arena)
+        return arena_alloc(data->arena, sizeof(struct NameValue)+l+1);
+    return malloc(sizeof(struct NameValue)+l+1);
+}
+
 static void
 NameValueParserStartElt(void * d, const char * name, int l)
 {
@@ -46,7 +55,9 @@ NameValueParserStartElt(void * d, const char * name, int l)
     if(!data->head.lh_first)
     {
         struct NameValue * nv;
-        nv = malloc(sizeof(struct NameValue)+l+1);
+        nv = NewNameValue(data, l);
+        if(!nv)
+            return;
         strcpy(nv->name, "rootElement");
         memcpy(nv->value, name, l);
         nv->value[l] = '\0';
@@ -61,7 +72,9 @@ NameValueParserGetData(void * d, const char * datas, int l)
     struct NameValue * nv;
     if(l>1975)
         l = 1975;
-    nv = malloc(sizeof(struct NameValue)+l+1);
+    nv = NewNameValue(data, l);
+    if(!nv)
+        return;
     strncpy(nv->name, data->curelt, 64);
     nv->name[63] = '\0';
     memcpy(nv->value, datas, l);
@@ -72,9 +85,18 @@ NameValueParserGetData(void * d, const char * datas, int l)
 void
 ParseNameValue(const char * buffer, int bufsize,
                     struct NameValueParserData * data, uint32_t flags)
+{
+    ParseNameValueArena(buffer, bufsize, data, flags, NULL);
+}
+
+void
+ParseNameValueArena(const char * buffer, int bufsize,
+                    struct NameValueParserData * data, uint32_t flags,
+                    struct arena * arena)
 {
     struct xmlparser parser;
     LIST_INIT(&(data->head));
+    data->arena = arena;
     /* init xmlparser object */
     parser.xmlstart = buffer;
     parser.xmlsize = bufsize;
@@ -91,6 +113,11 @@ void
 ClearNameValueList(struct NameValueParserData * pdata)
 {
     struct NameValue * nv;
+    if(pdata->arena)
+    {
+        LIST_INIT(&(pdata->head));
+        return;
+    }
     while((nv = pdata->head.lh_first) != NULL)
     {
         LIST_REMOVE(nv, entries);
@@ -42,9 +42,12 @@ struct NameValue {
     char value[];
 };
 
+struct arena;
+
 struct NameValueParserData {
     LIST_HEAD(listhead, NameValue) head;
     char curelt[64];
+    struct arena * arena;
 };
 
 #define XML_STORE_EMPTY_FL  0x01
@@ -54,6 +57,14 @@ void
 ParseNameValue(const char * buffer, int bufsize,
                struct NameValueParserData * data, uint32_t flags);
 
+/* ParseNameValueArena()
+ * same, but the list is allocated from the arena, so there is nothing
+ * for ClearNameValueList() to free */
+void
+ParseNameValueArena(const char * buffer, int bufsize,
+                    struct NameValueParserData * data, uint32_t flags,
+                    struct arena * arena);
+
 /* ClearNameValueList() */
 void
 ClearNameValueList(struct NameValueParserData * pdata);
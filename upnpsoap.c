@@ -70,6 +70,8 @@
 #include "getifaddr.h"
 #include "scanner.h"
 #include "sql.h"
+#include "metrics.h"
+#include "arena.h"
 #include "log.h"
 
 #ifdef __sparc__ /* Sorting takes too long on slow processors with very large containers */
@@ -194,7 +196,7 @@ IsAuthorizedValidated(struct upnphttp * h, const char * action)
 	struct NameValueParserData data;
 	const char * id;
 
-	ParseNameValue(h->req_buf + h->req_contentoff, h->req_contentlen, &data, XML_STORE_EMPTY_FL);
+	ParseNameValueArena(h->req_buf + h->req_contentoff, h->req_contentlen, &data, XML_STORE_EMPTY_FL, &h->arena);
 	id = GetValueFromNameValueList(&data, "DeviceID");
 	if(id)
 	{
@@ -243,11 +245,10 @@ GetProtocolInfo(struct upnphttp * h, const char * action)
 	char * body;
 	int bodylen;
 
-	bodylen = asprintf(&body, resp,
+	bodylen = arena_printf(&h->arena, &body, resp,
 		action, "urn:schemas-upnp-org:service:ConnectionManager:1",
 		action);	
 	BuildSendAndCloseSoapResp(h, body, bodylen);
-	free(body);
 }
 
 static void
@@ -344,7 +345,7 @@ GetCurrentConnectionInfo(struct upnphttp * h, const char * action)
 	int id;
 	char *endptr = NULL;
 
-	ParseNameValue(h->req_buf + h->req_contentoff, h->req_contentlen, &data, XML_STORE_EMPTY_FL);
+	ParseNameValueArena(h->req_buf + h->req_contentoff, h->req_contentlen, &data, XML_STORE_EMPTY_FL, &h->arena);
 	id_str = GetValueFromNameValueList(&data, "ConnectionID");
 	DPRINTF(E_INFO, L_HTTP, "GetCurrentConnectionInfo(%s)\n", id_str);
 	if(id_str)
@@ -565,7 +566,7 @@ set_filter_flags(char *filter, struct upnphttp *h)
 }
 
 static char *
-parse_sort_criteria(char *sortCriteria, int *error)
+parse_sort_criteria(struct arena *arena, char *sortCriteria, int *error)
 {
 	char *order = NULL;
 	char *item, *saveptr;
@@ -574,13 +575,15 @@ parse_sort_criteria(char *sortCriteria, int *error)
 	*error = 0;
 
 	if( force_sort_criteria )
-		sortCriteria = strdup(force_sort_criteria);
+		sortCriteria = arena_strdup(arena, force_sort_criteria);
 	if( !sortCriteria )
 		return NULL;
 
 	if( (item = strtok_r(sortCriteria, ",", &saveptr)) )
 	{
-		order = malloc(4096);
+		order = arena_alloc(arena, 4096);
+		if( !order )
+			return NULL;
 		str.data = order;
 		str.size = 4096;
 		str.off = 0;
@@ -646,19 +649,11 @@ parse_sort_criteria(char *sortCriteria, int *error)
 		item = strtok_r(NULL, ",", &saveptr);
 	}
 	if( i <= 0 )
-	{
-		free(order);
-		if( force_sort_criteria )
-			free(sortCriteria);
 		return NULL;
-	}
 	/* Add a "tiebreaker" sort order */
 	if( !title_sorted )
 		strcatf(&str, ", TITLE ASC");
 
-	if( force_sort_criteria )
-		free(sortCriteria);
-
 	return order;
 }
 
@@ -790,9 +785,11 @@ callback(void *args, int argc, char **argv, char **azColName)
 		if( (str->size+DEFAULT_RESP_SIZE) <= MAX_RESPONSE_SIZE )
 		{
 #endif
-			str->data = realloc(str->data, (str->size+DEFAULT_RESP_SIZE));
-			if( str->data )
+			char *data = arena_realloc(passed_args->arena, str->data, str->size,
+			                           str->size+DEFAULT_RESP_SIZE);
+			if( data )
 			{
+				str->data = data;
 				str->size += DEFAULT_RESP_SIZE;
 				DPRINTF(E_DEBUG, L_HTTP, "UPnP SOAP response enlarged to %lu. [%d results so far]\n",
 					(unsigned long)str->size, passed_args->returned);
@@ -871,11 +868,9 @@ callback(void *args, int argc, char **argv, char **azColName)
 			/* LG hack: subtitles won't get used unless dc:title contains a dot. */
 			else if( passed_args->client == ELGDevice && (passed_args->flags & FLAG_HAS_CAPTIONS) )
 			{
-				ret = asprintf(&alt_title, "%s.", title);
+				ret = arena_printf(passed_args->arena, &alt_title, "%s.", title);
 				if( ret > 0 )
 					title = alt_title;
-				else
-					alt_title = NULL;
 			}
 			/* Asus OPlay reboots with titles longer than 23 characters with some file types. */
 			else if( passed_args->client == EAsusOPlay && (passed_args->flags & FLAG_HAS_CAPTIONS) )
@@ -1070,7 +1065,6 @@ callback(void *args, int argc, char **argv, char **azColName)
 							                   "&lt;/sec:CaptionInfoEx&gt;",
 							                   lan_addr[passed_args->iface].str, runtime_vars.port, detailID);
 					}
-					free(alt_title);
 					break;
 				}
 			}
@@ -1187,6 +1181,7 @@ BrowseContentDirectory(struct upnphttp * h, const char * action)
 	struct Response args;
 	struct string_s str;
 	int totalMatches = 0;
+	unsigned int containerUpdateID;
 	int ret;
 	const char *ObjectID, *BrowseFlag;
 	char *Filter, *SortCriteria;
@@ -1202,7 +1197,7 @@ BrowseContentDirectory(struct upnphttp * h, const char * action)
 	memset(&args, 0, sizeof(args));
 	memset(&str, 0, sizeof(str));
 
-	ParseNameValue(h->req_buf + h->req_contentoff, h->req_contentlen, &data, 0);
+	ParseNameValueArena(h->req_buf + h->req_contentoff, h->req_contentlen, &data, 0, &h->arena);
 
 	ObjectID = GetValueFromNameValueList(&data, "ObjectID");
 	Filter = GetValueFromNameValueList(&data, "Filter");
@@ -1236,7 +1231,12 @@ BrowseContentDirectory(struct upnphttp * h, const char * action)
 		goto browse_error;
 	}
 
-	str.data = malloc(DEFAULT_RESP_SIZE);
+	str.data = arena_alloc(&h->arena, DEFAULT_RESP_SIZE);
+	if( !str.data )
+	{
+		Send500(h);
+		goto browse_error;
+	}
 	str.size = DEFAULT_RESP_SIZE;
 	str.off = sprintf(str.data, "%s", resp0);
 	/* See if we need to include DLNA namespace reference */
@@ -1253,6 +1253,7 @@ BrowseContentDirectory(struct upnphttp * h, const char * action)
 	args.client = h->req_client ? h->req_client->type->type : 0;
 	args.flags = h->req_client ? h->req_client->type->flags : 0;
 	args.str = &str;
+	args.arena = &h->arena;
 	DPRINTF(E_DEBUG, L_HTTP, "Browsing ContentDirectory:\n"
 	                         " * ObjectID: %s\n"
 	                         " * Count: %d\n"
@@ -1300,7 +1301,7 @@ BrowseContentDirectory(struct upnphttp * h, const char * action)
 			if (magic->where)
 				strncpyt(where, magic->where, sizeof(where));
 			if (magic->orderby && !GETFLAG(DLNA_STRICT_MASK))
-				orderBy = strdup(magic->orderby);
+				orderBy = arena_strdup(&h->arena, magic->orderby);
 			if (magic->max_count > 0)
 			{
 				int limit = MAX(magic->max_count - StartingIndex, 0);
@@ -1312,6 +1313,8 @@ BrowseContentDirectory(struct upnphttp * h, const char * action)
 		}
 		if (!where[0])
 			sqlite3_snprintf(sizeof(where), where, "PARENT_ID = '%q'", ObjectID);
+		/* have a deferred scan read this container's metadata next */
+		scanner_hint(ObjectID);
 
 		if (!totalMatches)
 			totalMatches = get_child_count(ObjectID, magic);
@@ -1319,30 +1322,29 @@ BrowseContentDirectory(struct upnphttp * h, const char * action)
 		if (SortCriteria && !orderBy)
 		{
 			__SORT_LIMIT
-			orderBy = parse_sort_criteria(SortCriteria, &ret);
+			orderBy = parse_sort_criteria(&h->arena, SortCriteria, &ret);
 		}
 		else if (!orderBy)
 		{
 			if( strncmp(ObjectID, MUSIC_PLIST_ID, strlen(MUSIC_PLIST_ID)) == 0 )
 			{
 				if( strcmp(ObjectID, MUSIC_PLIST_ID) == 0 )
-					ret = xasprintf(&orderBy, "order by d.TITLE");
+					ret = arena_printf(&h->arena, &orderBy, "order by d.TITLE");
 				else
-					ret = xasprintf(&orderBy, "order by length(OBJECT_ID), OBJECT_ID");
+					ret = arena_printf(&h->arena, &orderBy, "order by length(OBJECT_ID), OBJECT_ID");
 			}
 			else if( args.flags & FLAG_FORCE_SORT )
 			{
 				__SORT_LIMIT
-				ret = xasprintf(&orderBy, "order by o.CLASS, d.DISC, d.TRACK, d.TITLE");
+				ret = arena_printf(&h->arena, &orderBy, "order by o.CLASS, d.DISC, d.TRACK, d.TITLE");
 			}
 			/* LG TV ordering bug */
 			else if( args.client == ELGDevice )
-				ret = xasprintf(&orderBy, "order by o.CLASS, d.TITLE");
+				ret = arena_printf(&h->arena, &orderBy, "order by o.CLASS, d.TITLE");
 			else
-				orderBy = parse_sort_criteria(SortCriteria, &ret);
+				orderBy = parse_sort_criteria(&h->arena, SortCriteria, &ret);
 			if( ret == -1 )
 			{
-				free(orderBy);
 				orderBy = NULL;
 				ret = 0;
 			}
@@ -1379,17 +1381,22 @@ BrowseContentDirectory(struct upnphttp * h, const char * action)
 			goto browse_error;
 		}
 	}
+	/* the root's UpdateID is SystemUpdateID; every other container has its
+	 * own, so control points only refresh what changed */
+	if( strcmp(ObjectID, "0") == 0 )
+		containerUpdateID = updateID;
+	else
+		containerUpdateID = sql_get_int64_field(db, "SELECT UPDATE_ID from CONTAINER_UPDATES"
+		                                            " where OBJECT_ID = '%q'", ObjectID);
 	ret = strcatf(&str, "&lt;/DIDL-Lite&gt;</Result>\n"
 	                    "<NumberReturned>%u</NumberReturned>\n"
 	                    "<TotalMatches>%u</TotalMatches>\n"
 	                    "<UpdateID>%u</UpdateID>"
 	                    "</u:BrowseResponse>",
-	                    args.returned, totalMatches, updateID);
+	                    args.returned, totalMatches, containerUpdateID);
 	BuildSendAndCloseSoapResp(h, str.data, str.off);
 browse_error:
 	ClearNameValueList(&data);
-	free(orderBy);
-	free(str.data);
 }
 
 static inline void
@@ -1405,7 +1412,7 @@ charcat(struct string_s *str, char c)
 }
 
 static inline char *
-parse_search_criteria(const char *str, char *sep)
+parse_search_criteria(struct arena *arena, const char *str, char *sep)
 {
 	struct string_s criteria;
 	int len;
@@ -1413,10 +1420,12 @@ parse_search_criteria(const char *str, char *sep)
 	const char *s;
 
 	if (!str)
-		return strdup("1 = 1");
+		return arena_strdup(arena, "1 = 1");
 
 	len = strlen(str) + 32;
-	criteria.data = malloc(len);
+	criteria.data = arena_alloc(arena, len);
+	if (!criteria.data)
+		return NULL;
 	criteria.size = len;
 	criteria.off = 0;
 
@@ -1690,7 +1699,7 @@ SearchContentDirectory(struct upnphttp * h, const char * action)
 	memset(&args, 0, sizeof(args));
 	memset(&str, 0, sizeof(str));
 
-	ParseNameValue(h->req_buf + h->req_contentoff, h->req_contentlen, &data, 0);
+	ParseNameValueArena(h->req_buf + h->req_contentoff, h->req_contentlen, &data, 0, &h->arena);
 
 	ContainerID = GetValueFromNameValueList(&data, "ContainerID");
 	Filter = GetValueFromNameValueList(&data, "Filter");
@@ -1712,7 +1721,12 @@ SearchContentDirectory(struct upnphttp * h, const char * action)
 		}
 	}
 
-	str.data = malloc(DEFAULT_RESP_SIZE);
+	str.data = arena_alloc(&h->arena, DEFAULT_RESP_SIZE);
+	if( !str.data )
+	{
+		Send500(h);
+		goto search_error;
+	}
 	str.size = DEFAULT_RESP_SIZE;
 	str.off = sprintf(str.data, "%s", resp0);
 	/* See if we need to include DLNA namespace reference */
@@ -1729,6 +1743,7 @@ SearchContentDirectory(struct upnphttp * h, const char * action)
 	args.client = h->req_client ? h->req_client->type->type : 0;
 	args.flags = h->req_client ? h->req_client->type->flags : 0;
 	args.str = &str;
+	args.arena = &h->arena;
 	DPRINTF(E_DEBUG, L_HTTP, "Searching ContentDirectory:\n"
 	                         " * ObjectID: %s\n"
 	                         " * Count: %d\n"
@@ -1750,7 +1765,12 @@ SearchContentDirectory(struct upnphttp * h, const char * action)
 	    GETFLAG(DLNA_STRICT_MASK) )
 		groupBy[0] = '\0';
 
-	where = parse_search_criteria(SearchCriteria, sep);
+	where = parse_search_criteria(&h->arena, SearchCriteria, sep);
+	if( !where )
+	{
+		Send500(h);
+		goto search_error;
+	}
 	DPRINTF(E_DEBUG, L_HTTP, "Translated SearchCriteria: %s\n", where);
 
 	totalMatches = sql_get_int_field(db, "SELECT (select count(distinct DETAIL_ID)"
@@ -1777,7 +1797,7 @@ SearchContentDirectory(struct upnphttp * h, const char * action)
 	}
 	ret = 0;
 	__SORT_LIMIT
-	orderBy = parse_sort_criteria(SortCriteria, &ret);
+	orderBy = parse_sort_criteria(&h->arena, SortCriteria, &ret);
 	/* If it's a DLNA client, return an error for bad sort criteria */
 	if( ret < 0 && ((args.flags & FLAG_DLNA) || GETFLAG(DLNA_STRICT_MASK)) )
 	{
@@ -1813,9 +1833,6 @@ SearchContentDirectory(struct upnphttp * h, const char * action)
 	BuildSendAndCloseSoapResp(h, str.data, str.off);
 search_error:
 	ClearNameValueList(&data);
-	free(orderBy);
-	free(where);
-	free(str.data);
 }
 
 /*
@@ -1839,7 +1856,7 @@ QueryStateVariable(struct upnphttp * h, const char * action)
 	struct NameValueParserData data;
 	const char * var_name;
 
-	ParseNameValue(h->req_buf + h->req_contentoff, h->req_contentlen, &data, 0);
+	ParseNameValueArena(h->req_buf + h->req_contentoff, h->req_contentlen, &data, 0, &h->arena);
 	/*var_name = GetValueFromNameValueList(&data, "QueryStateVariable"); */
 	/*var_name = GetValueFromNameValueListIgnoreNS(&data, "varName");*/
 	var_name = GetValueFromNameValueList(&data, "varName");
@@ -1921,7 +1938,7 @@ SamsungSetBookmark(struct upnphttp * h, const char * action)
 	struct NameValueParserData data;
 	char *ObjectID, *PosSecond;
 
-	ParseNameValue(h->req_buf + h->req_contentoff, h->req_contentlen, &data, 0);
+	ParseNameValueArena(h->req_buf + h->req_contentoff, h->req_contentlen, &data, 0, &h->arena);
 	ObjectID = GetValueFromNameValueList(&data, "ObjectID");
 	PosSecond = GetValueFromNameValueList(&data, "PosSecond");
 	if( ObjectID && PosSecond )
@@ -1988,7 +2005,9 @@ ExecuteSoapAction(struct upnphttp * h, const char * action, int n)
 			len = strlen(soapMethods[i].methodName);
 			if(strncmp(p, soapMethods[i].methodName, len) == 0)
 			{
+				unsigned long long start = monotonic_us();
 				soapMethods[i].methodImpl(h, soapMethods[i].methodName);
+				metrics_soap(i, monotonic_us() - start);
 				return;
 			}
 			i++;
@@ -2000,3 +2019,11 @@ ExecuteSoapAction(struct upnphttp * h, const char * action, int n)
 	SoapError(h, 401, "Invalid Action");
 }
 
+const char *
+SoapMethodName(int i)
+{
+	if(i < 0 || i >= sizeof(soapMethods)/sizeof(soapMethods[0]))
+		return NULL;
+	return soapMethods[i].methodName;
+}
+
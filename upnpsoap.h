@@ -43,6 +43,7 @@ struct Response
 	uint32_t filter;
 	uint32_t flags;
 	enum client_types client;
+	struct arena *arena;
 };
 
 /* ExecuteSoapAction():
@@ -50,5 +51,10 @@ struct Response
 void
 ExecuteSoapAction(struct upnphttp *, const char *, int);
 
+/* SoapMethodName():
+ * name of the i'th supported Soap Action, or NULL past the end of the list */
+const char *
+SoapMethodName(int i);
+
 #endif
 
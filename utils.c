@@ -306,6 +306,77 @@ DJBHash(uint8_t *data, int len)
 	return hash;
 }
 
+static inline uint64_t
+rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t
+fmix64(uint64_t k)
+{
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdULL;
+	k ^= k >> 33;
+	k *= 0xc4ceb9fe1a85ec53ULL;
+	k ^= k >> 33;
+
+	return k;
+}
+
+/* MurmurHash3_x64_128 by Austin Appleby, placed in the public domain */
+void
+hash128(const uint8_t *data, size_t len, uint64_t out[2])
+{
+	const uint64_t c1 = 0x87c37b91114253d5ULL;
+	const uint64_t c2 = 0x4cf5ad432745937fULL;
+	uint64_t h1 = 0, h2 = 0, k1, k2;
+	size_t i, nblocks = len / 16;
+	const uint8_t *tail;
+
+	for (i = 0; i < nblocks; i++)
+	{
+		memcpy(&k1, data + i * 16, 8);
+		memcpy(&k2, data + i * 16 + 8, 8);
+
+		k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+		h1 = rotl64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+		k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+		h2 = rotl64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+	}
+
+	tail = data + nblocks * 16;
+	k1 = k2 = 0;
+	switch (len & 15)
+	{
+	case 15: k2 ^= (uint64_t)tail[14] << 48;
+	case 14: k2 ^= (uint64_t)tail[13] << 40;
+	case 13: k2 ^= (uint64_t)tail[12] << 32;
+	case 12: k2 ^= (uint64_t)tail[11] << 24;
+	case 11: k2 ^= (uint64_t)tail[10] << 16;
+	case 10: k2 ^= (uint64_t)tail[9] << 8;
+	case 9:  k2 ^= (uint64_t)tail[8];
+		k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+	case 8:  k1 ^= (uint64_t)tail[7] << 56;
+	case 7:  k1 ^= (uint64_t)tail[6] << 48;
+	case 6:  k1 ^= (uint64_t)tail[5] << 40;
+	case 5:  k1 ^= (uint64_t)tail[4] << 32;
+	case 4:  k1 ^= (uint64_t)tail[3] << 24;
+	case 3:  k1 ^= (uint64_t)tail[2] << 16;
+	case 2:  k1 ^= (uint64_t)tail[1] << 8;
+	case 1:  k1 ^= (uint64_t)tail[0];
+		k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+	}
+
+	h1 ^= len; h2 ^= len;
+	h1 += h2; h2 += h1;
+	h1 = fmix64(h1); h2 = fmix64(h2);
+	h1 += h2; h2 += h1;
+
+	out[0] = h1;
+	out[1] = h2;
+}
+
 const char *
 mime_to_ext(const char * mime)
 {
@@ -442,19 +513,46 @@ is_album_art(const char * name)
 	return (album_art_name ? 1 : 0);
 }
 
+/* only the file type is needed, so skip anything that may need a round
+ * trip to a network filesystem's server */
+static int
+mode_at(int dirfd, const char *name, int flags, mode_t *mode)
+{
+#ifdef HAVE_STATX
+	struct statx stx;
+
+	if( statx(dirfd, name, flags|AT_STATX_DONT_SYNC, STATX_TYPE, &stx) != 0 )
+		return -1;
+	*mode = stx.stx_mode;
+#else
+	struct stat st;
+
+	if( fstatat(dirfd, name, &st, flags) != 0 )
+		return -1;
+	*mode = st.st_mode;
+#endif
+	return 0;
+}
+
 int
 resolve_unknown_type(const char * path, media_types dir_type)
 {
-	struct stat entry;
+	return resolve_unknown_type_at(AT_FDCWD, path, path, dir_type);
+}
+
+int
+resolve_unknown_type_at(int dirfd, const char *name, const char *path, media_types dir_type)
+{
+	mode_t mode;
 	unsigned char type = TYPE_UNKNOWN;
 	char str_buf[PATH_MAX];
 	ssize_t len;
 
-	if( lstat(path, &entry) == 0 )
+	if( mode_at(dirfd, name, AT_SYMLINK_NOFOLLOW, &mode) == 0 )
 	{
-		if( S_ISLNK(entry.st_mode) )
+		if( S_ISLNK(mode) )
 		{
-			if( (len = readlink(path, str_buf, PATH_MAX-1)) > 0 )
+			if( (len = readlinkat(dirfd, name, str_buf, PATH_MAX-1)) > 0 )
 			{
 				str_buf[len] = '\0';
 				//DEBUG DPRINTF(E_DEBUG, L_GENERAL, "Checking for recursive symbolic link: %s (%s)\n", path, str_buf);
@@ -464,14 +562,15 @@ resolve_unknown_type(const char * path, media_types dir_type)
 					return type;
 				}
 			}
-			stat(path, &entry);
+			if( mode_at(dirfd, name, 0, &mode) != 0 )
+				return type;
 		}
 
-		if( S_ISDIR(entry.st_mode) )
+		if( S_ISDIR(mode) )
 		{
 			type = TYPE_DIR;
 		}
-		else if( S_ISREG(entry.st_mode) )
+		else if( S_ISREG(mode) )
 		{
 			switch( dir_type )
 			{
@@ -90,10 +90,15 @@ int is_playlist(const char * file);
 int is_caption(const char * file);
 int is_album_art(const char * name);
 int resolve_unknown_type(const char * path, media_types dir_type);
+int resolve_unknown_type_at(int dirfd, const char *name, const char *path, media_types dir_type);
 const char *mime_to_ext(const char * mime);
 
 /* Others */
 int make_dir(char * path, mode_t mode);
 unsigned int DJBHash(uint8_t *data, int len);
+/* hash128()
+ * 128-bit MurmurHash3 (x64 variant) of data, for keying content; fast, but
+ * not meant to stand up to deliberately colliding inputs */
+void hash128(const uint8_t *data, size_t len, uint64_t out[2]);
 
 #endif